@@ -7,6 +7,14 @@ wget http://downloads.sourceforge.net/project/iperf/iperf-2.0.5.tar.gz
 tar -zxf ${IPERF_VER}.tar.gz
 cd ${IPERF_VER}
 #patch -p1 < $PA3_DIR/patches/iperf-Option-priority-allows-user-to-set-SO_PRIORITY.patch
+# Not yet checked against the released sources, skipped unless it applies
+# exactly (see pfabric.py --remaining-prio)
+if patch --dry-run -p1 < $PA3_DIR/patches/iperf-2.0.5-remaining-size-priority.patch > /dev/null
+then
+    patch -p1 < $PA3_DIR/patches/iperf-2.0.5-remaining-size-priority.patch
+else
+    echo "iperf-2.0.5-remaining-size-priority.patch does not apply, iperf is built without -Y"
+fi
 cd src
 patch -p1 < $PA3_DIR/patches/iperf-2.0.5-wait-syn.patch
 cd ..
@@ -15,3 +15,5 @@ cd ..
 cd src/kernel
 make
 cd ../../
+
+make -C src/flowgen
@@ -7,6 +7,8 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 #include "utils.h"
 #include "tc_util.h"
 #include "tc_common.h"
@@ -17,19 +19,165 @@
 #define TRACE(x)
 #endif
 
+/* Should correspond to the priority sources in sch_pfab.h */
+enum {
+	PFAB_PRIO_TOS,
+	PFAB_PRIO_DSCP,
+	PFAB_PRIO_SKB_PRIORITY,
+	PFAB_PRIO_MARK,
+	PFAB_PRIO_PCP,
+	__PFAB_PRIO_MAX
+};
+
+static const char *prio_source_names[__PFAB_PRIO_MAX] = {
+	[PFAB_PRIO_TOS]				= "tos",
+	[PFAB_PRIO_DSCP]			= "dscp",
+	[PFAB_PRIO_SKB_PRIORITY]	= "priority",
+	[PFAB_PRIO_MARK]			= "mark",
+	[PFAB_PRIO_PCP]				= "pcp",
+};
+
+/* Should correspond to the scheduling modes in sch_pfab.h */
+enum {
+	PFAB_MODE_BANDS,
+	PFAB_MODE_HEAP,
+	__PFAB_MODE_MAX
+};
+
+static const char *mode_names[__PFAB_MODE_MAX] = {
+	[PFAB_MODE_BANDS]	= "bands",
+	[PFAB_MODE_HEAP]	= "heap",
+};
+
+/* Should correspond to the mark backlogs in sch_pfab.h */
+enum {
+	PFAB_MARK_TOTAL,
+	PFAB_MARK_PRIO,
+	__PFAB_MARK_MAX
+};
+
+static const char *mark_by_names[__PFAB_MARK_MAX] = {
+	[PFAB_MARK_TOTAL]	= "total",
+	[PFAB_MARK_PRIO]	= "prio",
+};
+
 struct tc_pfabric_qopt {
 	__u32 limit;
 	int disable_dequeue;
+	__u32 bands;
+	__u32 prio_source;
+	__u32 prio_shift;
+	__u32 mode;
+	__u32 flows;
+	__u32 limit_bytes;
+	__u32 shared_limit;
+	__u32 mark_threshold;
+	__u32 mark_threshold_bytes;
+	__u32 mark_by;
+	__u32 rate;
+	__u32 burst;
+	__u32 batch;		/* Removed, always 0 */
+	__u32 events;
+	__u32 present;
+};
+
+/* Should correspond to the present bits in sch_pfab.h */
+enum {
+	TC_PFABRIC_OPT_LIMIT			= 1 << 0,
+	TC_PFABRIC_OPT_DISABLE_DEQUEUE		= 1 << 1,
+	TC_PFABRIC_OPT_BANDS			= 1 << 2,
+	TC_PFABRIC_OPT_PRIO_SOURCE		= 1 << 3,
+	TC_PFABRIC_OPT_PRIO_SHIFT		= 1 << 4,
+	TC_PFABRIC_OPT_MODE			= 1 << 5,
+	TC_PFABRIC_OPT_FLOWS			= 1 << 6,
+	TC_PFABRIC_OPT_LIMIT_BYTES		= 1 << 7,
+	TC_PFABRIC_OPT_SHARED_LIMIT		= 1 << 8,
+	TC_PFABRIC_OPT_MARK_THRESHOLD		= 1 << 9,
+	TC_PFABRIC_OPT_MARK_THRESHOLD_BYTES	= 1 << 10,
+	TC_PFABRIC_OPT_MARK_BY			= 1 << 11,
+	TC_PFABRIC_OPT_RATE			= 1 << 12,
+	TC_PFABRIC_OPT_BURST			= 1 << 13,
+	TC_PFABRIC_OPT_BATCH			= 1 << 14,
+	TC_PFABRIC_OPT_EVENTS			= 1 << 15,
+};
+
+/* Should correspond to the extended statistics in sch_pfab.h */
+#define TC_PFABRIC_XSTATS_BANDS (64)
+#define TC_PFABRIC_SOJOURN_BUCKETS (16)
+#define TC_PFABRIC_SOJOURN_GROUPS (16)
+
+struct tc_pfabric_band_xstats {
+	__u32 enqueues;
+	__u32 drops;
+	__u32 evictions;
+	__u32 backlog;
+};
+
+struct tc_pfabric_xstats {
+	__u32 enqueues;
+	__u32 drops;
+	__u32 evictions;
+	__u32 non_ip;
+	__u32 illegal_prio;
+	__u32 marks;
+	__u32 flows;
+	__u32 flow_evictions;
+	__u32 flow_overflows;
+	__u32 sojourn[TC_PFABRIC_SOJOURN_BUCKETS];
+	__u32 sojourn_shift;
+	__u32 sojourn_groups;
+	__u32 band_sojourn[TC_PFABRIC_SOJOURN_GROUPS][TC_PFABRIC_SOJOURN_BUCKETS];
+	__u32 bands;
+	__u32 band_shift;
+	__u32 entries;
+	struct tc_pfabric_band_xstats band[TC_PFABRIC_XSTATS_BANDS];
 };
 
 #define DEFAULT_PACKET_BUFFER_LIMIT (150)
+/* Same bound as the kernel: the square of the word size */
+#define MAX_BANDS (8 * sizeof(long) * 8 * sizeof(long))
+#define MAX_FLOWS (65536)
+#define DEFAULT_MTU (1600)
 
 static void explain(void)
 {
 	fprintf(stderr,
 "Usage: ... pfabric [ limit PACKETS ] \n"
+"					[ limit_bytes BYTES ] \n"
+"					[ shared_limit PACKETS ] \n"
+"					[ bands NUMBER ] \n"
+"					[ prio_from tos | dscp | priority | mark | pcp ] \n"
+"					[ prio_shift BITS ] \n"
+"					[ mode bands | heap ] \n"
+"					[ flows NUMBER ] \n"
+"					[ mark_threshold PACKETS ] \n"
+"					[ mark_threshold_bytes BYTES ] \n"
+"					[ mark_by total | prio ] \n"
+"					[ rate RATE [ burst BYTES ] ] \n"
+"					[ events NUMBER ] \n"
 "					[ disable_dequeue ] \n"
 "					[ enable_dequeue ] \n"
+"\n"
+"The band of a packet is its prio_from value shifted right by prio_shift.\n"
+"tos and dscp are read from the innermost IPv4 or IPv6 header, through\n"
+"IP-in-IP, GRE and VXLAN tunnels, pcp from the 802.1Q tag.\n"
+"In heap mode packets are scheduled by the shifted value itself.\n"
+"With flows (a power of 2) the earliest packet of the flow owning the\n"
+"highest priority packet is sent first (bands mode only). Up to that many\n"
+"flows are tracked, idle ones are reclaimed for new flows.\n"
+"With limit_bytes the buffer is also bounded in bytes, lowest priority\n"
+"packets are dropped until an arriving packet fits.\n"
+"With mark_threshold(_bytes) ECT packets are CE marked when the backlog,\n"
+"or with mark_by prio the backlog of higher or equal priority (bands\n"
+"mode only), exceeds the threshold.\n"
+"With rate the qdisc paces its dequeues at RATE, sending up to burst\n"
+"bytes back to back after an idle period (default rate/HZ + 1600).\n"
+"RATE is kept in 32 bits of bytes per second, so at most 4GBps (34gbit).\n"
+"With events, up to that many drops and evictions per second are reported\n"
+"to tc monitor pfabric.\n"
+"With shared_limit all the pfabric qdiscs of the device that set it, e.g.\n"
+"one per TX queue under mq, share a buffer of that many packets.\n"
+"mode, flows and shared_limit can only be set when adding the qdisc.\n"
 );
 }
 
@@ -42,26 +190,157 @@ static int pfabric_parse_opt(struct qdisc_util *qu, int argc,
 							 char** argv, struct nlmsghdr* n)
 {
 	struct rtattr* tail = NULL;
-	struct tc_pfabric_qopt opt = 
+	/* Only the options given are marked present, so that qdisc change
+	   keeps the others. The limit is still sent for kernels that
+	   predate present. */
+	struct tc_pfabric_qopt opt =
 		{ .limit = DEFAULT_PACKET_BUFFER_LIMIT, .disable_dequeue = 0 };
+	int i;
 	
 	TRACE( printf("pfabric_parse_opt called\n") );	
 	
 	for ( ; argc > 0; --argc, ++ argv ) {
-		if (matches(*argv, "limit") == 0) {
+		if (strcmp(*argv, "limit_bytes") == 0) {
+			NEXT_ARG();
+			if (get_size(&opt.limit_bytes, *argv)) {
+				explain1("limit_bytes");
+				return -1;
+			}
+			opt.present |= TC_PFABRIC_OPT_LIMIT_BYTES;
+		}
+		else if (strcmp(*argv, "shared_limit") == 0) {
+			NEXT_ARG();
+			if (get_u32(&opt.shared_limit, *argv, 0)) {
+				explain1("shared_limit");
+				return -1;
+			}
+			opt.present |= TC_PFABRIC_OPT_SHARED_LIMIT;
+		}
+		else if (strcmp(*argv, "mark_threshold") == 0) {
+			NEXT_ARG();
+			if (get_u32(&opt.mark_threshold, *argv, 0)) {
+				explain1("mark_threshold");
+				return -1;
+			}
+			opt.present |= TC_PFABRIC_OPT_MARK_THRESHOLD;
+		}
+		else if (strcmp(*argv, "mark_threshold_bytes") == 0) {
+			NEXT_ARG();
+			if (get_size(&opt.mark_threshold_bytes, *argv)) {
+				explain1("mark_threshold_bytes");
+				return -1;
+			}
+			opt.present |= TC_PFABRIC_OPT_MARK_THRESHOLD_BYTES;
+		}
+		else if (strcmp(*argv, "mark_by") == 0) {
+			NEXT_ARG();
+			for (i = 0; i < __PFAB_MARK_MAX; i++) {
+				if (strcmp(*argv, mark_by_names[i]) == 0) {
+					break;
+				}
+			}
+			if (i == __PFAB_MARK_MAX) {
+				explain1("mark_by");
+				return -1;
+			}
+			opt.mark_by = i;
+			opt.present |= TC_PFABRIC_OPT_MARK_BY;
+		}
+		else if (strcmp(*argv, "rate") == 0) {
+			NEXT_ARG();
+			if (get_rate(&opt.rate, *argv)) {
+				explain1("rate");
+				return -1;
+			}
+			opt.present |= TC_PFABRIC_OPT_RATE;
+		}
+		else if (strcmp(*argv, "events") == 0) {
+			NEXT_ARG();
+			if (get_u32(&opt.events, *argv, 0)) {
+				explain1("events");
+				return -1;
+			}
+			opt.present |= TC_PFABRIC_OPT_EVENTS;
+		}
+		else if (strcmp(*argv, "burst") == 0) {
+			NEXT_ARG();
+			if (get_size(&opt.burst, *argv)) {
+				explain1("burst");
+				return -1;
+			}
+			opt.present |= TC_PFABRIC_OPT_BURST;
+		}
+		else if (matches(*argv, "limit") == 0) {
 			NEXT_ARG();
 			if (get_size(&opt.limit, *argv)) {
 				explain1("limit");
 				return -1;
 			}
+			opt.present |= TC_PFABRIC_OPT_LIMIT;
 		}
-		else if (matches(*argv, "disable_dequeue") == 0) {
+		else if (matches(*argv, "bands") == 0) {
+			NEXT_ARG();
+			if (get_u32(&opt.bands, *argv, 0) ||
+				opt.bands == 0 || opt.bands > MAX_BANDS) {
+				explain1("bands");
+				fprintf(stderr, "bands must be 1 to %u on this architecture\n",
+						(unsigned) MAX_BANDS);
+				return -1;
+			}
+			opt.present |= TC_PFABRIC_OPT_BANDS;
+		}
+		else if (matches(*argv, "prio_from") == 0) {
+			NEXT_ARG();
+			for (i = 0; i < __PFAB_PRIO_MAX; i++) {
+				if (strcmp(*argv, prio_source_names[i]) == 0) {
+					break;
+				}
+			}
+			if (i == __PFAB_PRIO_MAX) {
+				explain1("prio_from");
+				return -1;
+			}
+			opt.prio_source = i;
+			opt.present |= TC_PFABRIC_OPT_PRIO_SOURCE;
+		}
+		else if (matches(*argv, "prio_shift") == 0) {
+			NEXT_ARG();
+			if (get_u32(&opt.prio_shift, *argv, 0) || opt.prio_shift > 31) {
+				explain1("prio_shift");
+				return -1;
+			}
+			opt.present |= TC_PFABRIC_OPT_PRIO_SHIFT;
+		}
+		else if (matches(*argv, "mode") == 0) {
 			NEXT_ARG();
+			for (i = 0; i < __PFAB_MODE_MAX; i++) {
+				if (strcmp(*argv, mode_names[i]) == 0) {
+					break;
+				}
+			}
+			if (i == __PFAB_MODE_MAX) {
+				explain1("mode");
+				return -1;
+			}
+			opt.mode = i;
+			opt.present |= TC_PFABRIC_OPT_MODE;
+		}
+		else if (matches(*argv, "flows") == 0) {
+			NEXT_ARG();
+			if (get_u32(&opt.flows, *argv, 0) || opt.flows > MAX_FLOWS ||
+				(opt.flows & (opt.flows - 1))) {
+				explain1("flows");
+				return -1;
+			}
+			opt.present |= TC_PFABRIC_OPT_FLOWS;
+		}
+		else if (matches(*argv, "disable_dequeue") == 0) {
 			opt.disable_dequeue = 1;
+			opt.present |= TC_PFABRIC_OPT_DISABLE_DEQUEUE;
 		}
 		else if (matches(*argv, "enable_dequeue") == 0) {
-			NEXT_ARG();
 			opt.disable_dequeue = 0;
+			opt.present |= TC_PFABRIC_OPT_DISABLE_DEQUEUE;
 		}
 		else {
 			fprintf(stderr, "What is \"%s\"?\n", *argv);
@@ -69,6 +348,12 @@ static int pfabric_parse_opt(struct qdisc_util *qu, int argc,
 			return -1;
 		}
 	}
+
+	/* Enough for the packets sent in a timer tick, like htb */
+	if (opt.rate && 0 == opt.burst) {
+		opt.burst = opt.rate / get_hz() + DEFAULT_MTU;
+		opt.present |= TC_PFABRIC_OPT_BURST;
+	}
 		
 	if (addattr_l(n, 1024, TCA_OPTIONS, &opt, sizeof(opt)) < 0) {
 		fprintf(stderr, "q_pfabric: addattr_l failed\n");
@@ -83,26 +368,186 @@ static int pfabric_parse_opt(struct qdisc_util *qu, int argc,
 static int pfabric_print_opt(struct qdisc_util *qu, FILE* f, struct rtattr* opt)
 {
 	struct tc_pfabric_qopt qopt;
-	int len = RTA_PAYLOAD(opt) - sizeof(qopt);
+	int len;
+	SPRINT_BUF(b1);
 	
 	TRACE( fprintf(stderr, "pfabric_print_opt called\n") );
 	
 	if (NULL == opt) {
 		return 0;
 	}
-	if (len < 0) {
+
+	/* Older kernel modules only report limit and disable_dequeue */
+	len = RTA_PAYLOAD(opt);
+	if (len < offsetof(struct tc_pfabric_qopt, bands)) {
 		fprintf(stderr, "options size error\n");
 		return -1;
 	}
 
-	memcpy(&qopt, RTA_DATA(opt), sizeof(qopt));
-	fprintf(f, "limit %d", qopt.limit);
-	fprintf(f, "disable_dequeue %d", qopt.disable_dequeue);
+	memset(&qopt, 0, sizeof(qopt));
+	memcpy(&qopt, RTA_DATA(opt), len < sizeof(qopt) ? len : sizeof(qopt));
+	fprintf(f, "limit %u ", qopt.limit);
+	if (len > offsetof(struct tc_pfabric_qopt, limit_bytes) &&
+		qopt.limit_bytes) {
+		fprintf(f, "limit_bytes %u ", qopt.limit_bytes);
+	}
+	if (len > offsetof(struct tc_pfabric_qopt, shared_limit) &&
+		qopt.shared_limit) {
+		fprintf(f, "shared_limit %u ", qopt.shared_limit);
+	}
+	fprintf(f, "disable_dequeue %d ", qopt.disable_dequeue);
+	if (len > offsetof(struct tc_pfabric_qopt, bands)) {
+		fprintf(f, "bands %u ", qopt.bands);
+		if (qopt.prio_source < __PFAB_PRIO_MAX) {
+			fprintf(f, "prio_from %s ", prio_source_names[qopt.prio_source]);
+		}
+		fprintf(f, "prio_shift %u ", qopt.prio_shift);
+	}
+	if (len > offsetof(struct tc_pfabric_qopt, mode) &&
+		qopt.mode < __PFAB_MODE_MAX) {
+		fprintf(f, "mode %s ", mode_names[qopt.mode]);
+	}
+	if (len > offsetof(struct tc_pfabric_qopt, flows) && qopt.flows) {
+		fprintf(f, "flows %u ", qopt.flows);
+	}
+	if (len > offsetof(struct tc_pfabric_qopt, mark_by) &&
+		(qopt.mark_threshold || qopt.mark_threshold_bytes)) {
+		if (qopt.mark_threshold) {
+			fprintf(f, "mark_threshold %u ", qopt.mark_threshold);
+		}
+		if (qopt.mark_threshold_bytes) {
+			fprintf(f, "mark_threshold_bytes %u ", qopt.mark_threshold_bytes);
+		}
+		if (qopt.mark_by < __PFAB_MARK_MAX) {
+			fprintf(f, "mark_by %s ", mark_by_names[qopt.mark_by]);
+		}
+	}
+	if (len > offsetof(struct tc_pfabric_qopt, burst) && qopt.rate) {
+		fprintf(f, "rate %s ", sprint_rate(qopt.rate, b1));
+		fprintf(f, "burst %s ", sprint_size(qopt.burst, b1));
+	}
+	if (len > offsetof(struct tc_pfabric_qopt, events) && qopt.events) {
+		fprintf(f, "events %u ", qopt.events);
+	}
+	return 0;
+}
+
+static int pfabric_sojourn_empty(const __u32 *counts)
+{
+	int i;
+
+	for (i = 0; i < TC_PFABRIC_SOJOURN_BUCKETS; i++) {
+		if (counts[i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Prints the non-empty buckets of a sojourn time histogram. Bucket i
+   counts sojourns below 2^i us (2^(i+10) ns), the last one the others. */
+static void pfabric_print_sojourn(FILE *f, const __u32 *counts)
+{
+	int i;
+
+	fprintf(f, " sojourn");
+	for (i = 0; i < TC_PFABRIC_SOJOURN_BUCKETS; i++) {
+		if (0 == counts[i]) {
+			continue;
+		}
+
+		if (i < TC_PFABRIC_SOJOURN_BUCKETS - 1) {
+			fprintf(f, " <%uus %u", 1U << i, counts[i]);
+		}
+		else {
+			fprintf(f, " >=%uus %u", 1U << (i - 1), counts[i]);
+		}
+	}
+}
+
+static int pfabric_print_xstats(struct qdisc_util *qu, FILE *f,
+								struct rtattr *xstats)
+{
+	struct tc_pfabric_xstats st;
+	struct tc_pfabric_band_xstats *band = NULL;
+	int len;
+	int i;
+
+	if (NULL == xstats) {
+		return 0;
+	}
+
+	/* Band entries are only sent for the bands in use */
+	len = RTA_PAYLOAD(xstats);
+	if (len < offsetof(struct tc_pfabric_xstats, band)) {
+		return -1;
+	}
+
+	memset(&st, 0, sizeof(st));
+	memcpy(&st, RTA_DATA(xstats), len < sizeof(st) ? len : sizeof(st));
+	fprintf(f, "  enqueued %u dropped %u evicted %u non_ip %u illegal_prio %u "
+			"marked %u",
+			st.enqueues, st.drops, st.evictions, st.non_ip, st.illegal_prio,
+			st.marks);
+	if (st.flows || st.flow_evictions || st.flow_overflows) {
+		fprintf(f, "\n  flows %u flow_evicted %u flow_overflows %u",
+				st.flows, st.flow_evictions, st.flow_overflows);
+	}
+
+	if (!pfabric_sojourn_empty(st.sojourn)) {
+		fprintf(f, "\n ");
+		pfabric_print_sojourn(f, st.sojourn);
+	}
+
+	if (st.sojourn_groups > TC_PFABRIC_SOJOURN_GROUPS) {
+		return -1;
+	}
+
+	for (i = 0; i < st.sojourn_groups; i++) {
+		if (pfabric_sojourn_empty(st.band_sojourn[i])) {
+			continue;
+		}
+
+		if (st.sojourn_shift) {
+			fprintf(f, "\n  bands %u-%u:", i << st.sojourn_shift,
+					((i + 1) << st.sojourn_shift) - 1);
+		}
+		else {
+			fprintf(f, "\n  band %u:", i);
+		}
+		pfabric_print_sojourn(f, st.band_sojourn[i]);
+	}
+
+	if (st.entries > TC_PFABRIC_XSTATS_BANDS ||
+		len < offsetof(struct tc_pfabric_xstats, band) +
+			  st.entries * sizeof(st.band[0])) {
+		return -1;
+	}
+
+	for (i = 0; i < st.entries; i++) {
+		band = &st.band[i];
+		if (0 == band->enqueues && 0 == band->backlog) {
+			continue;
+		}
+
+		if (st.band_shift) {
+			fprintf(f, "\n  bands %u-%u:", i << st.band_shift,
+					((i + 1) << st.band_shift) - 1);
+		}
+		else {
+			fprintf(f, "\n  band %u:", i);
+		}
+		fprintf(f, " enqueued %u dropped %u evicted %u backlog %ub",
+				band->enqueues, band->drops, band->evictions, band->backlog);
+	}
+
 	return 0;
 }
 
 struct qdisc_util pfabric_qdisc_util = {
-	.id			= "pfabric",
-	.parse_qopt	= pfabric_parse_opt,
-	.print_qopt	= pfabric_print_opt,
+	.id				= "pfabric",
+	.parse_qopt		= pfabric_parse_opt,
+	.print_qopt		= pfabric_print_opt,
+	.print_xstats	= pfabric_print_xstats,
 };
@@ -20,17 +20,77 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <time.h>
+#include <linux/genetlink.h>
+#include <linux/if_ether.h>
 #include "rt_names.h"
 #include "utils.h"
+#include "libgenl.h"
 #include "tc_util.h"
 #include "tc_common.h"
 
+#ifndef SOL_NETLINK
+#define SOL_NETLINK 270
+#endif
+
+/* Should correspond to the events in pfab_events.h */
+#define PFAB_GENL_NAME "pfabric"
+#define PFAB_GENL_MCGRP "events"
+
+enum {
+	PFAB_CMD_UNSPEC,
+	PFAB_CMD_EVENTS,
+	__PFAB_CMD_MAX
+};
+
+enum {
+	PFAB_ATTR_UNSPEC,
+	PFAB_ATTR_QDISC,
+	PFAB_ATTR_EVENTS,
+	__PFAB_ATTR_MAX
+};
+#define PFAB_ATTR_MAX (__PFAB_ATTR_MAX - 1)
+
+enum {
+	PFAB_EVENT_DROP,
+	PFAB_EVENT_EVICT,
+	__PFAB_EVENT_MAX
+};
+
+static const char *pfab_event_names[__PFAB_EVENT_MAX] = {
+	[PFAB_EVENT_DROP]	= "drop",
+	[PFAB_EVENT_EVICT]	= "evict",
+};
+
+struct pfab_event_qdisc {
+	__u32 ifindex;
+	__u32 handle;
+	__u32 lost;
+};
+
+struct pfab_event {
+	__u64 tstamp;
+	__u32 saddr[4];
+	__u32 daddr[4];
+	__u16 sport;
+	__u16 dport;
+	__u16 l3proto;
+	__u8 protocol;
+	__u8 type;
+	__u32 prio;
+	__u32 len;
+	__u32 qlen;
+	__u32 backlog;
+};
+
+static int pfab_family = -1;
+
 
 static void usage(void) __attribute__((noreturn));
 
 static void usage(void)
 {
-	fprintf(stderr, "Usage: tc monitor\n");
+	fprintf(stderr, "Usage: tc monitor [ file FILE ]\n");
+	fprintf(stderr, "       tc monitor pfabric\n");
 	exit(-1);
 }
 
@@ -65,6 +125,156 @@ static int accept_tcmsg(const struct sockaddr_nl *who,
 	return 0;
 }
 
+static void print_pfab_event(FILE *fp, const struct pfab_event_qdisc *qdisc,
+			     const struct pfab_event *event)
+{
+	int af = event->l3proto == htons(ETH_P_IPV6) ? AF_INET6 : AF_INET;
+	int len = af == AF_INET6 ? 16 : 4;
+	char handle[16];
+	char abuf[256];
+
+	fprintf(fp, "dev %s handle %s: ", ll_index_to_name(qdisc->ifindex),
+		sprint_qdisc_handle(qdisc->handle, handle));
+	if (event->type < __PFAB_EVENT_MAX)
+		fprintf(fp, "%s ", pfab_event_names[event->type]);
+	else
+		fprintf(fp, "event %u ", event->type);
+	if (event->l3proto) {
+		fprintf(fp, "%s:%u > ",
+			format_host(af, len, event->saddr, abuf, sizeof(abuf)),
+			ntohs(event->sport));
+		fprintf(fp, "%s:%u proto %u ",
+			format_host(af, len, event->daddr, abuf, sizeof(abuf)),
+			ntohs(event->dport), event->protocol);
+	}
+	fprintf(fp, "prio %u len %u qlen %u backlog %u\n",
+		event->prio, event->len, event->qlen, event->backlog);
+}
+
+static int accept_pfab_event(const struct sockaddr_nl *who,
+			     struct nlmsghdr *n, void *arg)
+{
+	FILE *fp = (FILE*)arg;
+	struct genlmsghdr *ghdr = NLMSG_DATA(n);
+	struct rtattr *tb[PFAB_ATTR_MAX + 1];
+	struct pfab_event_qdisc *qdisc;
+	struct pfab_event *event;
+	char handle[16];
+	int len = n->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	int count;
+	int i;
+
+	if (n->nlmsg_type != pfab_family || len < 0 ||
+	    ghdr->cmd != PFAB_CMD_EVENTS)
+		return 0;
+
+	parse_rtattr(tb, PFAB_ATTR_MAX,
+		     (struct rtattr *)((char *)ghdr + GENL_HDRLEN), len);
+	if (tb[PFAB_ATTR_QDISC] == NULL ||
+	    RTA_PAYLOAD(tb[PFAB_ATTR_QDISC]) < sizeof(*qdisc)) {
+		fprintf(stderr, "Missing pfabric qdisc TLV\n");
+		return 0;
+	}
+
+	qdisc = RTA_DATA(tb[PFAB_ATTR_QDISC]);
+	if (tb[PFAB_ATTR_EVENTS]) {
+		event = RTA_DATA(tb[PFAB_ATTR_EVENTS]);
+		count = RTA_PAYLOAD(tb[PFAB_ATTR_EVENTS]) / sizeof(*event);
+		for (i = 0; i < count; i++)
+			print_pfab_event(fp, qdisc, &event[i]);
+	}
+	if (qdisc->lost) {
+		fprintf(fp, "dev %s handle %s: lost %u\n",
+			ll_index_to_name(qdisc->ifindex),
+			sprint_qdisc_handle(qdisc->handle, handle),
+			qdisc->lost);
+	}
+	fflush(fp);
+	return 0;
+}
+
+/* Resolves the pfabric family, and returns the id of its events group */
+static int pfab_resolve_group(struct rtnl_handle *grth)
+{
+	GENL_REQUEST(req, 1024, GENL_ID_CTRL, 0, 0, CTRL_CMD_GETFAMILY,
+		     NLM_F_REQUEST);
+	struct rtattr *tb[CTRL_ATTR_MAX + 1];
+	struct rtattr *grp[CTRL_ATTR_MCAST_GRP_MAX + 1];
+	struct rtattr *rta;
+	int len;
+
+	addattr_l(&req.n, sizeof(req), CTRL_ATTR_FAMILY_NAME,
+		  PFAB_GENL_NAME, strlen(PFAB_GENL_NAME) + 1);
+
+	if (rtnl_talk(grth, &req.n, 0, 0, &req.n) < 0) {
+		fprintf(stderr, "Cannot find the pfabric family, "
+			"is the module loaded?\n");
+		return -1;
+	}
+
+	len = req.n.nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	if (len < 0)
+		return -1;
+
+	parse_rtattr(tb, CTRL_ATTR_MAX,
+		     (struct rtattr *)((char *)NLMSG_DATA(&req.n) + GENL_HDRLEN),
+		     len);
+	if (tb[CTRL_ATTR_FAMILY_ID] == NULL ||
+	    tb[CTRL_ATTR_MCAST_GROUPS] == NULL) {
+		fprintf(stderr, "Missing pfabric family TLVs\n");
+		return -1;
+	}
+	pfab_family = rta_getattr_u16(tb[CTRL_ATTR_FAMILY_ID]);
+
+	/* The groups are nested, one per index */
+	rta = RTA_DATA(tb[CTRL_ATTR_MCAST_GROUPS]);
+	len = RTA_PAYLOAD(tb[CTRL_ATTR_MCAST_GROUPS]);
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		parse_rtattr_nested(grp, CTRL_ATTR_MCAST_GRP_MAX, rta);
+		if (grp[CTRL_ATTR_MCAST_GRP_NAME] && grp[CTRL_ATTR_MCAST_GRP_ID] &&
+		    strcmp(rta_getattr_str(grp[CTRL_ATTR_MCAST_GRP_NAME]),
+			   PFAB_GENL_MCGRP) == 0)
+			return rta_getattr_u32(grp[CTRL_ATTR_MCAST_GRP_ID]);
+	}
+
+	fprintf(stderr, "Missing pfabric events group\n");
+	return -1;
+}
+
+static int do_pfabric_monitor(void)
+{
+	struct rtnl_handle rth;
+	struct rtnl_handle grth;
+	int group;
+
+	if (rtnl_open_byproto(&grth, 0, NETLINK_GENERIC) < 0)
+		exit(1);
+
+	group = pfab_resolve_group(&grth);
+	if (group < 0)
+		exit(1);
+
+	if (setsockopt(grth.fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+		       &group, sizeof(group)) < 0) {
+		perror("Cannot join the pfabric events group");
+		exit(1);
+	}
+
+	/* Only to name the devices */
+	if (rtnl_open(&rth, 0) < 0)
+		exit(1);
+	ll_init_map(&rth);
+	rtnl_close(&rth);
+
+	if (rtnl_listen(&grth, accept_pfab_event, (void*)stdout) < 0) {
+		rtnl_close(&grth);
+		exit(2);
+	}
+
+	rtnl_close(&grth);
+	exit(0);
+}
+
 int do_tcmonitor(int argc, char **argv)
 {
 	struct rtnl_handle rth;
@@ -75,6 +285,8 @@ int do_tcmonitor(int argc, char **argv)
 		if (matches(*argv, "file") == 0) {
 			NEXT_ARG();
 			file = *argv;
+		} else if (strcmp(*argv, "pfabric") == 0) {
+			return do_pfabric_monitor();
 		} else {
 			if (matches(*argv, "help") == 0) {
 				usage();
@@ -20,6 +20,7 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
 
 #include "utils.h"
 #include "tc_util.h"
@@ -152,19 +153,24 @@ int get_rate(unsigned *rate, const char *str)
 	if (p == str)
 		return -1;
 
-	if (*p == '\0') {
-		*rate = bps / 8.;	/* assume bits/sec */
-		return 0;
-	}
-
-	for (s = suffixes; s->name; ++s) {
-		if (strcasecmp(s->name, p) == 0) {
-			*rate = (bps * s->scale) / 8.;
-			return 0;
+	/* assume bits/sec without a suffix */
+	if (*p != '\0') {
+		for (s = suffixes; s->name; ++s) {
+			if (strcasecmp(s->name, p) == 0)
+				break;
 		}
+		if (!s->name)
+			return -1;
+		bps *= s->scale;
 	}
 
-	return -1;
+	/* The kernel keeps rates in 32 bits of bytes per second */
+	bps /= 8.;
+	if (bps < 0 || bps > UINT_MAX)
+		return -1;
+
+	*rate = bps;
+	return 0;
 }
 
 void print_rate(char *buf, int len, __u32 rate)
@@ -30,6 +30,14 @@ pfabric_ko=src/kernel/${pfabric_ko_name}.ko
 pythondir=src/python
 evaluation_script=eval_utils.py
 output_plot=evaluation
+cpus=`nproc`
+cores_per_run=`expr $n_nodes`
+
+# With fewer cores than nodes, one run at a time on all of them
+if [ $cpus -lt $cores_per_run ]
+then
+    cores_per_run=$cpus
+fi
 
 # Inject pFabric kernel module
 module_loaded=`lsmod | grep $pfabric_ko_name | wc -l`
@@ -38,17 +46,17 @@ then
     insmod $pfabric_ko
 fi
 
-for n_flows in 1 2 3 4 8 10 12 15 20; do #24 28 32 36 40; do
-	
-	python $pythondir/pfabric.py --bw $bw \
-		                     --dir $rootdir \
-		                     --nflows $n_flows \
-		                     -n $n_nodes \
-			             --iperf $iperf \
-			             --maxq $max_q_default \
-                                     --maxq_pfab $max_q_pfabric \
-                                     --nruns $n_runs
-done
+# Loads and tests run concurrently, each on cores_per_run of the cpus
+python $pythondir/run_parallel.py --nflows 1 2 3 4 8 10 12 15 20 \
+	                          --cpus $cpus \
+	                          --cores-per-run $cores_per_run \
+	                          --bw $bw \
+	                          --dir $rootdir \
+	                          -n $n_nodes \
+	                          --iperf $iperf \
+	                          --maxq $max_q_default \
+	                          --maxq_pfab $max_q_pfabric \
+	                          --nruns $n_runs
 
 rmmod $pfabric_ko_name
 
@@ -0,0 +1,1000 @@
+/*
+ * Multiplexed flow generator.
+ *
+ * Replaces one iperf process per flow: a single client process opens all
+ * its flows to a flowgen server as non-blocking sockets driven by one
+ * epoll loop, and logs the start and finish time of every flow in
+ * nanoseconds (see flowgen.h). A flow is finished when the server has
+ * read all of it and closed the connection.
+ *
+ * Flow sizes are either given as a list, flow i taking the size
+ * i modulo the list length, or drawn from an empirical CDF file of
+ * "size_bytes cumulative_probability" lines.
+ *
+ * Every socket carries the remaining size of its flow as its priority,
+ * as the pFabric transport does: band = ilog2(remaining >> prio_shift) + 1
+ * (0 below 2^prio_shift bytes, at most bands - 1), set as the DSCP bits
+ * of the TOS (TOS = band << 2, to be read with prio_from tos prio_shift 2
+ * or as the band itself with bands >= 4 * the flowgen bands) and as
+ * SO_PRIORITY. The options are set again only when the band changes, so
+ * most writes cost no extra system call. The remaining size is the one
+ * left to write to the socket, which the socket buffer sends later.
+ *
+ * With --transport pfabric the flows are sent over UDP by the minimal
+ * pFabric rate control instead of TCP, as pfab_sim does: a flow starts at
+ * line rate with a window of about one BDP, the server ACKs every packet,
+ * and the packets not ACKed within a fixed timeout (about 3 RTTs) are sent
+ * again while the window drops to one packet and grows by one per ACK back
+ * to its initial size. After --probe-after timeouts without any ACK the
+ * flow only sends a header sized probe per timeout until one is ACKed.
+ * The remaining size of a flow is then the part not ACKed yet, and a flow
+ * is finished when all its packets are ACKed.
+ *
+ * usage: flowgen --server [--port P]
+ *        flowgen --client HOST --flows N (--sizes S[,S...] | --cdf FILE)
+ *                --output FILE [options], see flowgen --help
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "flowgen.h"
+
+#define FLOWGEN_PORT "5001"
+#define FLOWGEN_BUF_LEN (65536)
+#define FLOWGEN_MAX_EVENTS (256)
+#define FLOWGEN_MAX_BANDS (64)	/* Bands fitting the DSCP bits */
+#define FLOWGEN_MAX_CDF_POINTS (1024)
+#define FLOWGEN_LISTEN_BACKLOG (1024)
+#define FLOWGEN_UDP_PAYLOAD (1400)	/* Data bytes of a pfabric transport packet */
+#define FLOWGEN_PROBE_SEQ (0xffffffffU)
+
+enum {
+	FG_CONNECTING,
+	FG_SENDING,
+	FG_DRAINING,		/* Sent, waiting for the server to close */
+	FG_DONE,
+};
+
+/* pfabric transport packet states */
+enum {
+	FG_PKT_UNSENT,		/* Never sent or timed out */
+	FG_PKT_INFLIGHT,
+	FG_PKT_ACKED,
+};
+
+/* pfabric transport header flags */
+#define FG_UDP_ACK (1)
+#define FG_UDP_PROBE (2)
+
+/* Header of the pfabric transport packets, in network byte order. ACKs
+   and probes are the header alone. */
+struct fg_udp_hdr {
+	uint32_t flow;
+	uint32_t seq;
+	uint32_t flags;
+};
+
+struct fg_flow {
+	int fd;
+	int state;
+	int band;		//Priority set on the socket, -1 for none.
+	uint32_t id;		//Index of the flow.
+	uint64_t size;
+	uint64_t sent;		//TCP: bytes written, pfabric: bytes ACKed.
+	uint64_t start_ns;
+	uint64_t finish_ns;
+
+	/* pfabric transport */
+	uint8_t *packet;	//FG_PKT_* state of every packet.
+	uint32_t packets;
+	uint32_t next_seq;	//First packet never sent.
+	uint32_t lost_seq;	//No timed out packet below it.
+	uint32_t acked;
+	uint32_t inflight;
+	uint32_t window;	//Packets, up to the configured window.
+	uint32_t timeouts;	//Consecutive, without any ACK.
+	uint64_t timeout_ns;	//Last counted timeout.
+	uint64_t probe_ns;	//Send time of the outstanding probe, 0 for none.
+	int probing;
+};
+
+/* A sent packet or probe, expiring one timeout after it was sent */
+struct fg_sent {
+	struct fg_flow *flow;
+	uint32_t seq;
+	uint64_t time_ns;
+};
+
+/* Packets sent, in send order, which with a fixed timeout is also the
+   order in which they expire, so a single timer serves all the flows */
+struct fg_sent_ring {
+	struct fg_sent *sent;
+	uint32_t capacity;
+	uint32_t head;
+	uint32_t count;
+};
+
+struct fg_config {
+	const char *host;	//Client mode when set.
+	const char *port;
+	const char *output;
+	const char *cdf_path;
+	uint64_t *sizes;
+	uint32_t nsizes;
+	uint32_t flows;
+	uint32_t concurrency;	//Flows open at once, 0 for all.
+	uint32_t prio_shift;
+	uint32_t bands;
+	uint64_t seed;
+	int udp;		//pfabric transport.
+	uint32_t window;	//pfabric transport initial window, packets.
+	uint64_t rto_ns;
+	uint32_t probe_after;	//Timeouts before probing.
+};
+
+struct fg_cdf {
+	uint32_t points;
+	double size[FLOWGEN_MAX_CDF_POINTS];
+	double prob[FLOWGEN_MAX_CDF_POINTS];
+};
+
+static struct fg_config config;
+static struct fg_cdf cdf;
+static char fg_buf[FLOWGEN_BUF_LEN];
+static int fg_epoll = -1;
+static int fg_timer = -1;
+static struct fg_sent_ring fg_ring;
+static uint64_t fg_rng;
+static uint32_t fg_done;		//Flows completed or failed.
+static uint32_t fg_failed;
+
+static void fg_fatal(const char *msg)
+{
+	fprintf(stderr, "flowgen: %s: %s\n", msg, strerror(errno));
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t fg_rand(void)
+{
+	fg_rng ^= fg_rng >> 12;
+	fg_rng ^= fg_rng << 25;
+	fg_rng ^= fg_rng >> 27;
+	return fg_rng * 2685821657736338717ULL;
+}
+
+/* Uniform in [0, 1) */
+static double fg_uniform(void)
+{
+	return (fg_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void fg_read_cdf(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[256];
+	unsigned int lineno = 0;
+	double size, prob;
+
+	if (NULL == f) {
+		fg_fatal(path);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if ('#' == line[0] || 2 != sscanf(line, "%lf %lf", &size, &prob)) {
+			continue;
+		}
+
+		if (cdf.points == FLOWGEN_MAX_CDF_POINTS || size < 0 || prob < 0 ||
+			prob > 1 || (cdf.points && (size < cdf.size[cdf.points - 1] ||
+										prob < cdf.prob[cdf.points - 1]))) {
+			fprintf(stderr, "%s:%u: invalid CDF point\n", path, lineno);
+			exit(1);
+		}
+
+		cdf.size[cdf.points] = size;
+		cdf.prob[cdf.points] = prob;
+		cdf.points++;
+	}
+
+	fclose(f);
+	if (cdf.points < 2 || cdf.prob[cdf.points - 1] < 1) {
+		fprintf(stderr, "%s: the CDF must end at probability 1\n", path);
+		exit(1);
+	}
+}
+
+/* Flow size in bytes, interpolated between the points of the CDF */
+static uint64_t fg_cdf_sample(void)
+{
+	double u = fg_uniform();
+	double size;
+	uint32_t i = 1;
+
+	while (i < cdf.points - 1 && cdf.prob[i] <= u) {
+		i++;
+	}
+
+	size = cdf.size[i - 1];
+	if (cdf.prob[i] > cdf.prob[i - 1]) {
+		size += (u - cdf.prob[i - 1]) / (cdf.prob[i] - cdf.prob[i - 1]) *
+			(cdf.size[i] - cdf.size[i - 1]);
+	}
+
+	return (uint64_t) size;
+}
+
+/* Server */
+
+/* ACKs every pfabric transport packet, and probe, with its header */
+static void fg_serve_udp(int fd)
+{
+	struct sockaddr_storage from;
+	struct fg_udp_hdr *hdr = (struct fg_udp_hdr *) fg_buf;
+	socklen_t fromlen;
+	ssize_t len;
+
+	for (;;) {
+		fromlen = sizeof(from);
+		len = recvfrom(fd, fg_buf, sizeof(fg_buf), 0,
+					   (struct sockaddr *) &from, &fromlen);
+		if (len < 0) {
+			return;
+		}
+		if (len < (ssize_t) sizeof(*hdr) || (ntohl(hdr->flags) & FG_UDP_ACK)) {
+			continue;
+		}
+
+		hdr->flags = htonl(ntohl(hdr->flags) | FG_UDP_ACK);
+		sendto(fd, hdr, sizeof(*hdr), 0, (struct sockaddr *) &from, fromlen);
+	}
+}
+
+static void fg_serve(void)
+{
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM,
+							  .ai_flags = AI_PASSIVE };
+	struct epoll_event ev, events[FLOWGEN_MAX_EVENTS];
+	struct addrinfo *addr = NULL;
+	int fd, listen_fd, udp_fd, one = 1;
+	int i, n;
+	ssize_t len;
+
+	if (getaddrinfo(NULL, config.port, &hints, &addr) != 0) {
+		fprintf(stderr, "flowgen: invalid port %s\n", config.port);
+		exit(1);
+	}
+
+	listen_fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (listen_fd < 0 ||
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+		bind(listen_fd, addr->ai_addr, addr->ai_addrlen) < 0 ||
+		listen(listen_fd, FLOWGEN_LISTEN_BACKLOG) < 0) {
+		fg_fatal("listen");
+	}
+
+	/* The pfabric transport port is the same port number over UDP */
+	udp_fd = socket(addr->ai_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (udp_fd < 0 || bind(udp_fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+		fg_fatal("bind");
+	}
+	freeaddrinfo(addr);
+
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd;
+	if (epoll_ctl(fg_epoll, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+		fg_fatal("epoll_ctl");
+	}
+	ev.data.fd = udp_fd;
+	if (epoll_ctl(fg_epoll, EPOLL_CTL_ADD, udp_fd, &ev) < 0) {
+		fg_fatal("epoll_ctl");
+	}
+
+	/* Reads every connection to its end and closes it, which tells the
+	   client its flow is complete. */
+	for (;;) {
+		n = epoll_wait(fg_epoll, events, FLOWGEN_MAX_EVENTS, -1);
+		if (n < 0 && errno != EINTR) {
+			fg_fatal("epoll_wait");
+		}
+
+		for (i = 0; i < n; i++) {
+			fd = events[i].data.fd;
+			if (fd == listen_fd) {
+				while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+					ev.events = EPOLLIN;
+					ev.data.fd = fd;
+					if (epoll_ctl(fg_epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+						close(fd);
+					}
+				}
+				continue;
+			}
+			if (fd == udp_fd) {
+				fg_serve_udp(fd);
+				continue;
+			}
+
+			while ((len = read(fd, fg_buf, sizeof(fg_buf))) > 0)
+				;
+			if (0 == len || (errno != EAGAIN && errno != EINTR)) {
+				close(fd);
+			}
+		}
+	}
+}
+
+/* Client */
+
+static int fg_band(uint64_t remaining)
+{
+	uint64_t units = remaining >> config.prio_shift;
+	int band = units ? 64 - __builtin_clzll(units) : 0;
+
+	return band < (int) config.bands ? band : (int) config.bands - 1;
+}
+
+static void fg_set_band(struct fg_flow *flow, int band)
+{
+	static int warned;
+	int tos = band << 2;
+
+	/* IP_TOS also resets the socket priority, so it goes first */
+	if ((setsockopt(flow->fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0 ||
+		 setsockopt(flow->fd, SOL_SOCKET, SO_PRIORITY, &band, sizeof(band)) < 0) &&
+		!warned) {
+		fprintf(stderr, "flowgen: setting the priority: %s\n", strerror(errno));
+		warned = 1;
+	}
+
+	flow->band = band;
+}
+
+static void fg_finish(struct fg_flow *flow, int completed)
+{
+	if (flow->fd >= 0) {
+		close(flow->fd);
+		flow->fd = -1;
+	}
+
+	free(flow->packet);
+	flow->packet = NULL;
+
+	flow->finish_ns = completed ? now_ns() : 0;
+	flow->state = FG_DONE;
+	fg_done++;
+	fg_failed += !completed;
+}
+
+/* pfabric transport */
+
+static void fg_arm_timer(uint64_t deadline_ns)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline_ns / 1000000000ULL;
+	its.it_value.tv_nsec = deadline_ns % 1000000000ULL;
+	if (timerfd_settime(fg_timer, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		fg_fatal("timerfd_settime");
+	}
+}
+
+static void fg_ring_push(struct fg_flow *flow, uint32_t seq, uint64_t time_ns)
+{
+	struct fg_sent *sent = NULL;
+	uint32_t capacity, i;
+
+	if (fg_ring.count == fg_ring.capacity) {
+		capacity = fg_ring.capacity ? 2 * fg_ring.capacity : 1024;
+		sent = calloc(capacity, sizeof(*sent));
+		if (NULL == sent) {
+			fg_fatal("calloc");
+		}
+		for (i = 0; i < fg_ring.count; i++) {
+			sent[i] = fg_ring.sent[(fg_ring.head + i) % fg_ring.capacity];
+		}
+		free(fg_ring.sent);
+		fg_ring.sent = sent;
+		fg_ring.capacity = capacity;
+		fg_ring.head = 0;
+	}
+
+	sent = &fg_ring.sent[(fg_ring.head + fg_ring.count) % fg_ring.capacity];
+	sent->flow = flow;
+	sent->seq = seq;
+	sent->time_ns = time_ns;
+	if (1 == ++fg_ring.count) {
+		fg_arm_timer(time_ns + config.rto_ns);
+	}
+}
+
+static uint32_t fg_udp_payload(const struct fg_flow *flow, uint32_t seq)
+{
+	uint64_t offset = (uint64_t) seq * FLOWGEN_UDP_PAYLOAD;
+
+	return flow->size - offset < FLOWGEN_UDP_PAYLOAD ?
+		flow->size - offset : FLOWGEN_UDP_PAYLOAD;
+}
+
+/* Sends a packet, or a probe, and records it to time it out. A packet the
+   socket refuses is lost like one dropped on the way. */
+static int fg_udp_send_packet(struct fg_flow *flow, uint32_t seq)
+{
+	struct fg_udp_hdr *hdr = (struct fg_udp_hdr *) fg_buf;
+	uint64_t time_ns = now_ns();
+	uint32_t len = 0;
+	int band = fg_band(flow->size - flow->sent);
+
+	if (band != flow->band) {
+		fg_set_band(flow, band);
+	}
+
+	hdr->flow = htonl(flow->id);
+	hdr->seq = htonl(seq);
+	hdr->flags = htonl(FLOWGEN_PROBE_SEQ == seq ? FG_UDP_PROBE : 0);
+	if (seq != FLOWGEN_PROBE_SEQ) {
+		len = fg_udp_payload(flow, seq);
+		flow->packet[seq] = FG_PKT_INFLIGHT;
+		flow->inflight++;
+	}
+	else {
+		flow->probe_ns = time_ns;
+	}
+
+	if (send(flow->fd, fg_buf, sizeof(*hdr) + len, 0) < 0 &&
+		errno != EAGAIN && errno != ENOBUFS && errno != EINTR) {
+		return -1;
+	}
+
+	fg_ring_push(flow, seq, time_ns);
+	return 0;
+}
+
+/* Sends timed out packets first, then new ones, as the window allows, or
+   a probe while probing. */
+static void fg_udp_send(struct fg_flow *flow)
+{
+	uint32_t seq;
+
+	if (flow->probing) {
+		if (0 == flow->probe_ns &&
+			fg_udp_send_packet(flow, FLOWGEN_PROBE_SEQ) < 0) {
+			fg_finish(flow, 0);
+		}
+		return;
+	}
+
+	while (flow->inflight < flow->window) {
+		while (flow->lost_seq < flow->next_seq &&
+			   flow->packet[flow->lost_seq] != FG_PKT_UNSENT) {
+			flow->lost_seq++;
+		}
+
+		if (flow->lost_seq < flow->next_seq) {
+			seq = flow->lost_seq;
+		}
+		else if (flow->next_seq < flow->packets) {
+			seq = flow->next_seq++;
+			flow->lost_seq = flow->next_seq;
+		}
+		else {
+			return;
+		}
+
+		if (fg_udp_send_packet(flow, seq) < 0) {
+			fg_finish(flow, 0);
+			return;
+		}
+	}
+}
+
+static void fg_udp_recv(struct fg_flow *flow)
+{
+	struct fg_udp_hdr *hdr = (struct fg_udp_hdr *) fg_buf;
+	uint32_t seq, flags;
+	ssize_t len;
+
+	while ((len = recv(flow->fd, fg_buf, sizeof(fg_buf), 0)) >= 0) {
+		flags = ntohl(hdr->flags);
+		seq = ntohl(hdr->seq);
+		if (len < (ssize_t) sizeof(*hdr) || !(flags & FG_UDP_ACK) ||
+			ntohl(hdr->flow) != flow->id ||
+			(!(flags & FG_UDP_PROBE) && seq >= flow->packets)) {
+			continue;
+		}
+
+		/* Any ACK shows the path is back, so probing stops and the
+		   window starts again from one packet */
+		flow->timeouts = 0;
+		if (flow->probing) {
+			flow->probing = 0;
+			flow->probe_ns = 0;
+			flow->window = 1;
+		}
+
+		if ((flags & FG_UDP_PROBE) || FG_PKT_ACKED == flow->packet[seq]) {
+			continue;
+		}
+
+		if (FG_PKT_INFLIGHT == flow->packet[seq]) {
+			flow->inflight--;
+		}
+		flow->packet[seq] = FG_PKT_ACKED;
+		flow->sent += fg_udp_payload(flow, seq);
+		flow->acked++;
+		if (flow->window < config.window) {
+			flow->window++;
+		}
+	}
+
+	if (errno != EAGAIN && errno != EINTR) {
+		fg_finish(flow, 0);
+	}
+	else if (flow->acked == flow->packets) {
+		fg_finish(flow, 1);
+	}
+	else {
+		fg_udp_send(flow);
+	}
+}
+
+/* Packets sent more than one timeout ago and still not ACKed are lost */
+static void fg_udp_timer(void)
+{
+	struct fg_sent sent;
+	struct fg_flow *flow = NULL;
+	uint64_t expirations, now;
+
+	if (read(fg_timer, &expirations, sizeof(expirations)) < 0 &&
+		errno != EAGAIN) {
+		fg_fatal("read");
+	}
+
+	now = now_ns();
+	while (fg_ring.count) {
+		sent = fg_ring.sent[fg_ring.head];
+		if (sent.time_ns + config.rto_ns > now) {
+			fg_arm_timer(sent.time_ns + config.rto_ns);
+			return;
+		}
+
+		fg_ring.head = (fg_ring.head + 1) % fg_ring.capacity;
+		fg_ring.count--;
+		flow = sent.flow;
+		if (FG_DONE == flow->state) {
+			continue;
+		}
+
+		if (FLOWGEN_PROBE_SEQ == sent.seq) {
+			if (!flow->probing || sent.time_ns != flow->probe_ns) {
+				continue;
+			}
+			flow->probe_ns = 0;
+		}
+		else {
+			if (flow->packet[sent.seq] != FG_PKT_INFLIGHT) {
+				continue;
+			}
+			flow->packet[sent.seq] = FG_PKT_UNSENT;
+			flow->inflight--;
+			if (sent.seq < flow->lost_seq) {
+				flow->lost_seq = sent.seq;
+			}
+			flow->window = 1;
+
+			/* The packets of a window sent before the last timeout
+			   time out together, and count as one timeout */
+			if (sent.time_ns < flow->timeout_ns) {
+				fg_udp_send(flow);
+				continue;
+			}
+		}
+
+		flow->timeout_ns = now;
+		if (++flow->timeouts >= config.probe_after) {
+			flow->probing = 1;
+		}
+		fg_udp_send(flow);
+	}
+}
+
+static void fg_start(struct fg_flow *flow, const struct addrinfo *addr)
+{
+	struct epoll_event ev;
+
+	flow->start_ns = now_ns();
+	flow->fd = socket(addr->ai_family, (config.udp ? SOCK_DGRAM : SOCK_STREAM) |
+					  SOCK_NONBLOCK, 0);
+	if (flow->fd < 0) {
+		fg_fatal("socket");
+	}
+
+	fg_set_band(flow, fg_band(flow->size));
+	if (connect(flow->fd, addr->ai_addr, addr->ai_addrlen) < 0 &&
+		errno != EINPROGRESS) {
+		fg_finish(flow, 0);
+		return;
+	}
+
+	flow->state = FG_CONNECTING;
+	ev.events = EPOLLOUT;
+	ev.data.ptr = flow;
+	if (config.udp) {
+		/* An empty flow is still one packet, to be ACKed */
+		flow->packets = flow->size ?
+			(flow->size + FLOWGEN_UDP_PAYLOAD - 1) / FLOWGEN_UDP_PAYLOAD : 1;
+		flow->packet = calloc(flow->packets, 1);
+		if (NULL == flow->packet) {
+			fg_fatal("calloc");
+		}
+		flow->window = config.window;
+		flow->state = FG_SENDING;
+		ev.events = EPOLLIN;
+	}
+
+	if (epoll_ctl(fg_epoll, EPOLL_CTL_ADD, flow->fd, &ev) < 0) {
+		fg_fatal("epoll_ctl");
+	}
+
+	if (config.udp) {
+		fg_udp_send(flow);
+	}
+}
+
+/* Writes as much of the flow as the socket takes */
+static void fg_send(struct fg_flow *flow)
+{
+	struct epoll_event ev;
+	uint64_t remaining;
+	ssize_t len;
+	int band;
+
+	while (flow->sent < flow->size) {
+		remaining = flow->size - flow->sent;
+		band = fg_band(remaining);
+		if (band != flow->band) {
+			fg_set_band(flow, band);
+		}
+
+		len = send(flow->fd, fg_buf, remaining < sizeof(fg_buf) ?
+				   remaining : sizeof(fg_buf), MSG_NOSIGNAL);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				fg_finish(flow, 0);
+			}
+			return;
+		}
+
+		flow->sent += len;
+	}
+
+	/* The server closes the connection once it has read the whole flow */
+	shutdown(flow->fd, SHUT_WR);
+	flow->state = FG_DRAINING;
+	ev.events = EPOLLIN;
+	ev.data.ptr = flow;
+	if (epoll_ctl(fg_epoll, EPOLL_CTL_MOD, flow->fd, &ev) < 0) {
+		fg_fatal("epoll_ctl");
+	}
+}
+
+static void fg_handle(struct fg_flow *flow, uint32_t events)
+{
+	socklen_t optlen = sizeof(int);
+	ssize_t len;
+	int err = 0;
+
+	if (config.udp) {
+		/* A flow may fail while sending, before its events are handled */
+		if (flow->state != FG_DONE) {
+			fg_udp_recv(flow);
+		}
+		return;
+	}
+
+	switch (flow->state) {
+	case FG_CONNECTING:
+		if (getsockopt(flow->fd, SOL_SOCKET, SO_ERROR, &err, &optlen) < 0 || err) {
+			fg_finish(flow, 0);
+			return;
+		}
+		flow->state = FG_SENDING;
+		/* Fall through */
+	case FG_SENDING:
+		fg_send(flow);
+		return;
+	case FG_DRAINING:
+		while ((len = read(flow->fd, fg_buf, sizeof(fg_buf))) > 0)
+			;
+		if (0 == len) {
+			fg_finish(flow, 1);
+		}
+		else if (errno != EAGAIN && errno != EINTR) {
+			fg_finish(flow, 0);
+		}
+		return;
+	}
+}
+
+static void fg_write_log(const struct fg_flow *flows)
+{
+	struct flowgen_log_header header = { .version = FLOWGEN_LOG_VERSION };
+	struct flowgen_record record;
+	FILE *f = fopen(config.output, "wb");
+	uint32_t i;
+
+	if (NULL == f) {
+		fg_fatal(config.output);
+	}
+
+	memcpy(header.magic, FLOWGEN_LOG_MAGIC, sizeof(header.magic));
+	fwrite(&header, sizeof(header), 1, f);
+	for (i = 0; i < config.flows; i++) {
+		memset(&record, 0, sizeof(record));
+		record.flow = i;
+		record.flags = flows[i].finish_ns ? FLOWGEN_COMPLETED : 0;
+		record.size = flows[i].size;
+		record.start_ns = flows[i].start_ns;
+		record.finish_ns = flows[i].finish_ns;
+		fwrite(&record, sizeof(record), 1, f);
+	}
+
+	if (fclose(f) != 0) {
+		fg_fatal(config.output);
+	}
+}
+
+static void fg_run_client(void)
+{
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+	struct epoll_event ev, events[FLOWGEN_MAX_EVENTS];
+	struct fg_flow *flows = calloc(config.flows, sizeof(*flows));
+	struct addrinfo *addr = NULL;
+	uint32_t next = 0, i;
+	int n, j, rc;
+
+	if (NULL == flows) {
+		fg_fatal("calloc");
+	}
+
+	rc = getaddrinfo(config.host, config.port, &hints, &addr);
+	if (rc != 0) {
+		fprintf(stderr, "flowgen: %s: %s\n", config.host, gai_strerror(rc));
+		exit(1);
+	}
+
+	if (config.udp) {
+		/* The timeouts of all the flows, see fg_udp_timer() */
+		fg_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (fg_timer < 0 || epoll_ctl(fg_epoll, EPOLL_CTL_ADD, fg_timer, &ev) < 0) {
+			fg_fatal("timerfd");
+		}
+	}
+
+	for (i = 0; i < config.flows; i++) {
+		flows[i].fd = -1;
+		flows[i].band = -1;
+		flows[i].id = i;
+		flows[i].size = config.nsizes ? config.sizes[i % config.nsizes] :
+			fg_cdf_sample();
+	}
+
+	while (fg_done < config.flows) {
+		/* Opens flows up to the concurrency, in order */
+		while (next < config.flows &&
+			   (0 == config.concurrency || next - fg_done < config.concurrency)) {
+			fg_start(&flows[next++], addr);
+		}
+
+		if (fg_done == config.flows) {
+			break;
+		}
+
+		n = epoll_wait(fg_epoll, events, FLOWGEN_MAX_EVENTS, -1);
+		if (n < 0 && errno != EINTR) {
+			fg_fatal("epoll_wait");
+		}
+
+		for (j = 0; j < n; j++) {
+			if (NULL == events[j].data.ptr) {
+				fg_udp_timer();
+				continue;
+			}
+			fg_handle(events[j].data.ptr, events[j].events);
+		}
+	}
+
+	freeaddrinfo(addr);
+	fg_write_log(flows);
+	if (fg_failed) {
+		fprintf(stderr, "flowgen: %u of %u flows failed\n", fg_failed, config.flows);
+	}
+	free(flows);
+	free(fg_ring.sent);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+"usage: %s --server [--port P]\n"
+"       %s --client HOST --flows N (--sizes S[,S...] | --cdf FILE)\n"
+"              --output FILE [options]\n"
+"  --port P            TCP and UDP port (" FLOWGEN_PORT ")\n"
+"  --flows N           number of flows\n"
+"  --sizes S[,S...]    flow sizes in bytes, flow i takes size i mod count\n"
+"  --cdf FILE          draw sizes from \"size_bytes cumulative_prob\" lines\n"
+"  --seed N            random seed of --cdf (1)\n"
+"  --concurrency N     flows open at once (0 = all)\n"
+"  --prio-shift N      remaining bytes of band 0 are below 2^N (10)\n"
+"  --bands N           number of priority bands, up to 64 (16)\n"
+"  --transport T       tcp, or pfabric for the pfabric rate control over\n"
+"                      UDP (tcp)\n"
+"  --window N          pfabric initial window, packets, about a BDP (12)\n"
+"  --rto-us T          pfabric fixed timeout, about 3 RTTs (3000)\n"
+"  --probe-after N     pfabric timeouts without ACK before probing (5)\n"
+"  --output FILE       binary log of the flows, see flowgen.h\n", prog, prog);
+	exit(1);
+}
+
+static uint64_t parse_u64(const char *arg, char **end, const char *prog)
+{
+	unsigned long long v;
+
+	errno = 0;
+	v = strtoull(arg, end, 0);
+	if (*end == arg || errno || '-' == arg[0]) {
+		usage(prog);
+	}
+
+	return v;
+}
+
+static uint32_t parse_u32(const char *arg, const char *prog)
+{
+	char *end = NULL;
+	uint64_t v = parse_u64(arg, &end, prog);
+
+	if (*end || v > 0xffffffffULL) {
+		usage(prog);
+	}
+
+	return v;
+}
+
+static void parse_sizes(const char *arg, const char *prog)
+{
+	const char *p = arg;
+	char *end = NULL;
+
+	config.nsizes = 0;
+	config.sizes = calloc(strlen(arg) / 2 + 1, sizeof(*config.sizes));
+	if (NULL == config.sizes) {
+		fg_fatal("calloc");
+	}
+
+	for (;;) {
+		/* Sizes such as 3.16e6 are accepted, as pfabric.py computes them */
+		config.sizes[config.nsizes++] = (uint64_t) strtod(p, &end);
+		if (end == p || '-' == *p) {
+			usage(prog);
+		}
+		if ('\0' == *end) {
+			break;
+		}
+		if (*end != ',') {
+			usage(prog);
+		}
+		p = end + 1;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "server", no_argument, NULL, 's' },
+		{ "client", required_argument, NULL, 'c' },
+		{ "port", required_argument, NULL, 'p' },
+		{ "flows", required_argument, NULL, 'n' },
+		{ "sizes", required_argument, NULL, 'S' },
+		{ "cdf", required_argument, NULL, 'C' },
+		{ "seed", required_argument, NULL, 'x' },
+		{ "concurrency", required_argument, NULL, 'k' },
+		{ "prio-shift", required_argument, NULL, 'P' },
+		{ "bands", required_argument, NULL, 'b' },
+		{ "transport", required_argument, NULL, 't' },
+		{ "window", required_argument, NULL, 'w' },
+		{ "rto-us", required_argument, NULL, 'r' },
+		{ "probe-after", required_argument, NULL, 'a' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	int server = 0;
+	int opt;
+
+	config.port = FLOWGEN_PORT;
+	config.prio_shift = 10;
+	config.bands = 16;
+	config.seed = 1;
+	config.window = 12;
+	config.rto_ns = 3000000;
+	config.probe_after = 5;
+
+	while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+		switch (opt) {
+		case 's': server = 1; break;
+		case 'c': config.host = optarg; break;
+		case 'p': config.port = optarg; break;
+		case 'n': config.flows = parse_u32(optarg, argv[0]); break;
+		case 'S': parse_sizes(optarg, argv[0]); break;
+		case 'C': config.cdf_path = optarg; break;
+		case 'x': config.seed = parse_u32(optarg, argv[0]); break;
+		case 'k': config.concurrency = parse_u32(optarg, argv[0]); break;
+		case 'P': config.prio_shift = parse_u32(optarg, argv[0]); break;
+		case 'b': config.bands = parse_u32(optarg, argv[0]); break;
+		case 't':
+			if (0 == strcmp(optarg, "pfabric")) {
+				config.udp = 1;
+			}
+			else if (strcmp(optarg, "tcp") != 0) {
+				usage(argv[0]);
+			}
+			break;
+		case 'w': config.window = parse_u32(optarg, argv[0]); break;
+		case 'r': config.rto_ns = parse_u32(optarg, argv[0]) * 1000ULL; break;
+		case 'a': config.probe_after = parse_u32(optarg, argv[0]); break;
+		case 'o': config.output = optarg; break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind < argc || server == (NULL != config.host) ||
+		0 == config.bands || config.bands > FLOWGEN_MAX_BANDS ||
+		config.prio_shift > 63 || 0 == config.window || 0 == config.rto_ns ||
+		0 == config.probe_after ||
+		(!server && (0 == config.flows || NULL == config.output ||
+					 (0 == config.nsizes) == (NULL == config.cdf_path)))) {
+		usage(argv[0]);
+	}
+
+	fg_epoll = epoll_create1(0);
+	if (fg_epoll < 0) {
+		fg_fatal("epoll_create1");
+	}
+
+	if (server) {
+		fg_serve();
+	}
+
+	if (config.cdf_path) {
+		fg_read_cdf(config.cdf_path);
+	}
+	fg_rng = config.seed ? config.seed : 1;
+	fg_run_client();
+	return fg_failed ? 1 : 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * flowgen log format.
+ *
+ * A log is a flowgen_log_header followed by one flowgen_record per flow,
+ * in the byte order of the host that wrote it (little endian on x86).
+ * Timestamps are CLOCK_MONOTONIC nanoseconds, so the logs of the hosts
+ * of one machine (e.g. Mininet hosts) share a time base.
+ */
+
+#ifndef FLOWGEN_H
+#define FLOWGEN_H
+
+#include <stdint.h>
+
+#define FLOWGEN_LOG_MAGIC "PFGL"
+#define FLOWGEN_LOG_VERSION (1)
+
+/* flowgen_record flags */
+#define FLOWGEN_COMPLETED (1)	/* The receiver read the whole flow */
+
+struct flowgen_log_header {
+	char magic[4];
+	uint32_t version;
+};
+
+struct flowgen_record {
+	uint32_t flow;		//Index of the flow on its sender.
+	uint32_t flags;
+	uint64_t size;		//Bytes.
+	uint64_t start_ns;	//Before the connection is opened.
+	uint64_t finish_ns;	//The receiver closed the connection, 0 on failure.
+};
+
+#endif /* FLOWGEN_H */
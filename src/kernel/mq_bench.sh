@@ -0,0 +1,68 @@
+#!/bin/bash
+# Measures TX throughput through pFabric on a dummy device while the
+# number of sending CPUs grows, with a single root qdisc and with one
+# qdisc per TX queue under mq sharing their buffer.
+#
+# usage: sudo ./mq_bench.sh [max CPUs] [seconds per run]
+TC=../../iproute2/tc/tc
+IPERF=${IPERF:-iperf}
+IFC=pfab0
+ADDR=10.99.0.1
+DST=10.99.0.2
+MAX_CPUS=${1:-$(nproc)}
+DURATION=${2:-10}
+LIMIT=150
+
+setup_device() {
+	ip link add $IFC numtxqueues $MAX_CPUS type dummy || exit 1
+	ip addr add $ADDR/24 dev $IFC
+	ip link set $IFC up
+	# Every CPU transmits on its own queue
+	for i in $(seq 0 $(($MAX_CPUS - 1))); do
+		printf "%x" $((1 << $i)) > /sys/class/net/$IFC/queues/tx-$i/xps_cpus
+	done
+}
+
+add_root() {
+	$TC qdisc add dev $IFC root pfabric limit $LIMIT
+}
+
+add_mq() {
+	$TC qdisc add dev $IFC root handle 1: mq
+	for i in $(seq 1 $MAX_CPUS); do
+		$TC qdisc add dev $IFC parent 1:$(printf "%x" $i) \
+			pfabric limit $LIMIT shared_limit $LIMIT
+	done
+}
+
+tx_packets() {
+	cat /sys/class/net/$IFC/statistics/tx_packets
+}
+
+# run <qdisc setup> <CPUs>
+run() {
+	local before after pids=""
+
+	$TC qdisc del dev $IFC root 2> /dev/null
+	$1
+	before=$(tx_packets)
+	for i in $(seq 0 $(($2 - 1))); do
+		taskset -c $i $IPERF -u -c $DST -b 10000M -l 64 -t $DURATION \
+			-S $(($i % 32)) > /dev/null &
+		pids="$pids $!"
+	done
+	wait $pids
+	after=$(tx_packets)
+	printf "%-5s %4d %12d\n" ${1#add_} $2 $((($after - $before) / $DURATION))
+}
+
+lsmod | grep -q pfabric || insmod pfabric.ko || exit 1
+setup_device
+
+printf "%-5s %4s %12s\n" qdisc cpus packets/s
+for cpus in $(seq 1 $MAX_CPUS); do
+	run add_root $cpus
+	run add_mq $cpus
+done
+
+ip link del $IFC
@@ -0,0 +1,326 @@
+/*
+ * Module: pFabric classful queueing discipline.
+ *
+ * Packet classification, see pfab_classify.h.
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/skbuff.h>
+#include <linux/if_ether.h>
+#include <linux/if_vlan.h>
+#include <linux/if_tunnel.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
+#include <net/ipv6.h>
+#include <net/dsfield.h>
+#include "pfab_classify.h"
+#include "pfab_flow.h"
+
+/* VXLAN header, the I flag is set when the VNI is valid */
+struct pfab_vxlan_hdr {
+	__be32 flags;
+	__be32 vni;
+};
+#define PFAB_VXLAN_FLAG_VNI (0x08000000)
+
+/* The header fields read by pfab_parse_gre() */
+struct pfab_gre_hdr {
+	__be16 flags;
+	__be16 protocol;
+};
+
+/* 802.1ad service tags, defined by the kernel since 3.10 */
+#ifndef ETH_P_8021AD
+#define ETH_P_8021AD 0x88A8
+#endif
+
+static inline int pfab_proto_vlan(__be16 proto)
+{
+	return htons(ETH_P_8021Q) == proto || htons(ETH_P_8021AD) == proto;
+}
+
+/* Each parser reads the header at *nhoff and moves *nhoff past it. They
+   return the Ethertype of the next header, or 0 to stop. */
+
+static __be16 pfab_parse_vlan(const struct sk_buff *skb, int *nhoff,
+							  struct pfab_pkt_info *info)
+{
+	const struct vlan_hdr *vlan = NULL;
+	struct vlan_hdr _vlan;
+
+	vlan = skb_header_pointer(skb, *nhoff, sizeof(_vlan), &_vlan);
+	if (NULL == vlan) {
+		return 0;
+	}
+
+	if (!(info->flags & PFAB_PKT_VLAN)) {
+		info->pcp = (ntohs(vlan->h_vlan_TCI) & VLAN_PRIO_MASK) >>
+			VLAN_PRIO_SHIFT;
+		info->flags |= PFAB_PKT_VLAN;
+	}
+
+	*nhoff += sizeof(*vlan);
+	return vlan->h_vlan_encapsulated_proto;
+}
+
+/* The Ethernet header of a bridged tunnel payload */
+static __be16 pfab_parse_eth(const struct sk_buff *skb, int *nhoff)
+{
+	const struct ethhdr *eth = NULL;
+	struct ethhdr _eth;
+
+	eth = skb_header_pointer(skb, *nhoff, sizeof(_eth), &_eth);
+	if (NULL == eth) {
+		return 0;
+	}
+
+	*nhoff += sizeof(*eth);
+	return eth->h_proto;
+}
+
+/* The IP parsers also set *ip_proto, and return 0 only for an invalid
+   header. The key is only replaced once the header is known to be
+   valid, so that a truncated inner header leaves the outer one.
+   Fragments have no ip_proto, as only the first one carries the next
+   headers. */
+static __be16 pfab_parse_ipv4(const struct sk_buff *skb, int *nhoff,
+							  u8 *ip_proto, struct pfab_pkt_info *info,
+							  struct pfab_flow_key *key)
+{
+	const struct iphdr *iph = NULL;
+	struct iphdr _iph;
+
+	iph = skb_header_pointer(skb, *nhoff, sizeof(_iph), &_iph);
+	if (NULL == iph || iph->version != 4 || iph->ihl < 5) {
+		return 0;
+	}
+
+	info->dsfield = iph->tos;
+	info->flags |= PFAB_PKT_IP;
+	*ip_proto = iph->protocol;
+	if (key) {
+		memset(key, 0, sizeof(*key));
+		key->saddr[0] = iph->saddr;
+		key->daddr[0] = iph->daddr;
+		key->l3proto = htons(ETH_P_IP);
+		key->protocol = iph->protocol;
+	}
+
+	if (iph->frag_off & htons(IP_MF | IP_OFFSET)) {
+		*ip_proto = 0;
+	}
+
+	*nhoff += iph->ihl * 4;
+	return htons(ETH_P_IP);
+}
+
+static __be16 pfab_parse_ipv6(const struct sk_buff *skb, int *nhoff,
+							  u8 *ip_proto, struct pfab_pkt_info *info,
+							  struct pfab_flow_key *key)
+{
+	const struct ipv6hdr *ip6h = NULL;
+	struct ipv6hdr _ip6h;
+	const struct ipv6_opt_hdr *opt = NULL;
+	struct ipv6_opt_hdr _opt;
+	u8 nexthdr;
+	int depth;
+
+	ip6h = skb_header_pointer(skb, *nhoff, sizeof(_ip6h), &_ip6h);
+	if (NULL == ip6h || ip6h->version != 6) {
+		return 0;
+	}
+
+	info->dsfield = ipv6_get_dsfield(ip6h);
+	info->flags |= PFAB_PKT_IP;
+	nexthdr = ip6h->nexthdr;
+	if (key) {
+		memset(key, 0, sizeof(*key));
+		memcpy(key->saddr, &ip6h->saddr, sizeof(key->saddr));
+		memcpy(key->daddr, &ip6h->daddr, sizeof(key->daddr));
+		key->l3proto = htons(ETH_P_IPV6);
+		key->protocol = nexthdr;
+	}
+
+	*ip_proto = 0;
+	*nhoff += sizeof(*ip6h);
+	for (depth = 0; depth < PFAB_CLASSIFY_MAX_DEPTH; depth++) {
+		switch (nexthdr) {
+		case NEXTHDR_HOP:
+		case NEXTHDR_ROUTING:
+		case NEXTHDR_DEST:
+			opt = skb_header_pointer(skb, *nhoff, sizeof(_opt), &_opt);
+			if (NULL == opt) {
+				return htons(ETH_P_IPV6);
+			}
+			nexthdr = opt->nexthdr;
+			*nhoff += ipv6_optlen(opt);
+			break;
+		case NEXTHDR_FRAGMENT:
+			return htons(ETH_P_IPV6);
+		default:
+			*ip_proto = nexthdr;
+			if (key) {
+				key->protocol = nexthdr;
+			}
+			return htons(ETH_P_IPV6);
+		}
+	}
+
+	return htons(ETH_P_IPV6);
+}
+
+static __be16 pfab_parse_gre(const struct sk_buff *skb, int *nhoff)
+{
+	const struct pfab_gre_hdr *gre = NULL;
+	struct pfab_gre_hdr _gre;
+
+	gre = skb_header_pointer(skb, *nhoff, sizeof(_gre), &_gre);
+	if (NULL == gre || (gre->flags & (GRE_VERSION | GRE_ROUTING))) {
+		return 0;
+	}
+
+	*nhoff += sizeof(*gre);
+	if (gre->flags & GRE_CSUM) {
+		*nhoff += 4;
+	}
+	if (gre->flags & GRE_KEY) {
+		*nhoff += 4;
+	}
+	if (gre->flags & GRE_SEQ) {
+		*nhoff += 4;
+	}
+
+	if (htons(ETH_P_TEB) == gre->protocol) {
+		return pfab_parse_eth(skb, nhoff);
+	}
+	return gre->protocol;
+}
+
+/* Other traffic may use the VXLAN ports, the I flag must be set too */
+static __be16 pfab_parse_vxlan(const struct sk_buff *skb, int *nhoff)
+{
+	const struct udphdr *udph = NULL;
+	struct udphdr _udph;
+	const struct pfab_vxlan_hdr *vxh = NULL;
+	struct pfab_vxlan_hdr _vxh;
+
+	udph = skb_header_pointer(skb, *nhoff, sizeof(_udph), &_udph);
+	if (NULL == udph || (htons(PFAB_VXLAN_PORT) != udph->dest &&
+						 htons(PFAB_VXLAN_PORT_LINUX) != udph->dest)) {
+		return 0;
+	}
+
+	vxh = skb_header_pointer(skb, *nhoff + sizeof(*udph), sizeof(_vxh),
+							 &_vxh);
+	if (NULL == vxh || !(vxh->flags & htonl(PFAB_VXLAN_FLAG_VNI))) {
+		return 0;
+	}
+
+	*nhoff += sizeof(*udph) + sizeof(*vxh);
+	return pfab_parse_eth(skb, nhoff);
+}
+
+static void pfab_parse_ports(const struct sk_buff *skb, int thoff,
+							 u8 ip_proto, struct pfab_flow_key *key)
+{
+	const __be32 *ports = NULL;
+	__be32 _ports;
+
+	if (IPPROTO_TCP == ip_proto || IPPROTO_UDP == ip_proto) {
+		ports = skb_header_pointer(skb, thoff, sizeof(_ports), &_ports);
+		if (ports) {
+			key->ports = *ports;
+		}
+	}
+}
+
+void pfab_classify(const struct sk_buff *skb, struct pfab_pkt_info *info,
+				   struct pfab_flow_key *key)
+{
+	int nhoff = skb_network_offset(skb);
+	int thoff;
+	int tunnel_thoff = -1;	/* Of a tunnel not yet decapsulated */
+	__be16 proto = skb->protocol;
+	u8 ip_proto = 0;
+	u8 tunnel_proto = 0;
+	int depth;
+
+	info->dsfield = 0;
+	info->pcp = 0;
+	info->flags = 0;
+	if (key) {
+		memset(key, 0, sizeof(*key));
+	}
+
+	/* A tag not yet inserted in the packet */
+	if (vlan_tx_tag_present(skb)) {
+		info->pcp = (vlan_tx_tag_get(skb) & VLAN_PRIO_MASK) >> VLAN_PRIO_SHIFT;
+		info->flags |= PFAB_PKT_VLAN;
+	}
+
+	for (depth = 0; depth < PFAB_CLASSIFY_MAX_DEPTH; depth++) {
+		if (pfab_proto_vlan(proto)) {
+			proto = pfab_parse_vlan(skb, &nhoff, info);
+			continue;
+		}
+
+		if (htons(ETH_P_IP) == proto) {
+			proto = pfab_parse_ipv4(skb, &nhoff, &ip_proto, info, key);
+		}
+		else if (htons(ETH_P_IPV6) == proto) {
+			proto = pfab_parse_ipv6(skb, &nhoff, &ip_proto, info, key);
+		}
+		else {
+			proto = 0;
+		}
+
+		/* Not a valid IP header, the payload of a tunnel may be anything */
+		if (0 == proto) {
+			break;
+		}
+
+		if (tunnel_thoff >= 0) {
+			info->flags |= PFAB_PKT_TUNNEL;
+			tunnel_thoff = -1;
+		}
+
+		/* The transport header or a tunnel */
+		thoff = nhoff;
+		switch (ip_proto) {
+		case IPPROTO_IPIP:
+			proto = htons(ETH_P_IP);
+			break;
+		case IPPROTO_IPV6:
+			proto = htons(ETH_P_IPV6);
+			break;
+		case IPPROTO_GRE:
+			proto = pfab_parse_gre(skb, &nhoff);
+			break;
+		case IPPROTO_UDP:
+			proto = pfab_parse_vxlan(skb, &nhoff);
+			break;
+		default:
+			proto = 0;
+			break;
+		}
+
+		if (0 == proto) {
+			if (key) {
+				pfab_parse_ports(skb, thoff, ip_proto, key);
+			}
+			return;
+		}
+
+		tunnel_thoff = thoff;
+		tunnel_proto = ip_proto;
+	}
+
+	/* The key still holds the outer header of a tunnel that could not be
+	   decapsulated, such as other UDP traffic to a VXLAN port, which is
+	   told apart by its outer ports */
+	if (key && tunnel_thoff >= 0) {
+		pfab_parse_ports(skb, tunnel_thoff, tunnel_proto, key);
+	}
+}
@@ -0,0 +1,45 @@
+/*
+ * Module: pFabric classful queueing discipline.
+ *
+ * Packet classification. The headers of an arriving packet are parsed
+ * once, in the manner of the kernel flow dissector, through 802.1Q tags,
+ * IPv4 and IPv6 (with its extension headers) and IP-in-IP, GRE and VXLAN
+ * tunnels down to the innermost IP header. The fields the priority
+ * sources need are read, and the 5-tuple of the innermost header for
+ * the flow table in the same pass. The fields are kept in the skb
+ * control block, for the priority of queued packets when the mapping
+ * changes; the 5-tuple is too large for it, and is found in the flow
+ * entry of the packet when there is one.
+ */
+
+#ifndef __PFAB_CLASSIFY_H__
+#define __PFAB_CLASSIFY_H__
+
+#include <linux/types.h>
+
+struct sk_buff;
+struct pfab_flow_key;
+
+/* UDP destination ports of VXLAN, the IANA one and the Linux default */
+#define PFAB_VXLAN_PORT (4789)
+#define PFAB_VXLAN_PORT_LINUX (8472)
+
+/* Headers (tags, tunnels, IPv6 extension headers) followed at most */
+#define PFAB_CLASSIFY_MAX_DEPTH (8)
+
+/* Flags of struct pfab_pkt_info */
+#define PFAB_PKT_IP (1 << 0)		/* dsfield is valid */
+#define PFAB_PKT_VLAN (1 << 1)		/* pcp is valid */
+#define PFAB_PKT_TUNNEL (1 << 2)	/* Encapsulated in a tunnel */
+
+struct pfab_pkt_info {
+	u8 dsfield;	//TOS or traffic class of the innermost IP header.
+	u8 pcp;		//Priority code point of the outermost 802.1Q tag.
+	u8 flags;
+};
+
+/* Fills info, and key unless NULL. Non-IP packets have the zero key. */
+void pfab_classify(const struct sk_buff *skb, struct pfab_pkt_info *info,
+				   struct pfab_flow_key *key);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * Module: pFabric classful queueing discipline.
+ *
+ * Drop and eviction events, see pfab_events.h.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/skbuff.h>
+#include <linux/ktime.h>
+#include <linux/jiffies.h>
+#include <linux/timer.h>
+#include <linux/netdevice.h>
+#include <net/genetlink.h>
+#include <net/pkt_sched.h>
+#include "pfab_events.h"
+#include "pfab_classify.h"
+#include "pfab_flow.h"
+
+static struct genl_family pfab_genl_family = {
+	.id = GENL_ID_GENERATE,
+	.name = PFAB_GENL_NAME,
+	.version = PFAB_GENL_VERSION,
+	.maxattr = PFAB_ATTR_MAX,
+};
+
+/* The id is assigned when the group is registered */
+static struct genl_multicast_group pfab_genl_mcgrp = {
+	.name = PFAB_GENL_MCGRP,
+};
+
+int pfab_events_register(void)
+{
+	int retval;
+
+	retval = genl_register_family(&pfab_genl_family);
+	if (retval < 0) {
+		return retval;
+	}
+
+	retval = genl_register_mc_group(&pfab_genl_family, &pfab_genl_mcgrp);
+	if (retval < 0) {
+		genl_unregister_family(&pfab_genl_family);
+	}
+
+	return retval;
+}
+
+/* Also unregisters the group */
+void pfab_events_unregister(void)
+{
+	genl_unregister_family(&pfab_genl_family);
+}
+
+/* Returns 0, or a negative error if the events were not sent. Having no
+   listener is not an error. */
+static int pfab_events_send(struct pfab_events *events)
+{
+	struct pfab_event_qdisc qdisc;
+	struct sk_buff *skb = NULL;
+	void *hdr = NULL;
+	int len = events->count * sizeof(events->batch[0]);
+	int retval;
+
+	skb = genlmsg_new(nla_total_size(sizeof(qdisc)) + nla_total_size(len),
+					  GFP_ATOMIC);
+	if (NULL == skb) {
+		return -ENOMEM;
+	}
+
+	hdr = genlmsg_put(skb, 0, 0, &pfab_genl_family, 0, PFAB_CMD_EVENTS);
+	if (NULL == hdr) {
+		nlmsg_free(skb);
+		return -EMSGSIZE;
+	}
+
+	qdisc.ifindex = qdisc_dev(events->sch)->ifindex;
+	qdisc.handle = events->sch->handle;
+	qdisc.lost = events->lost;
+	if (nla_put(skb, PFAB_ATTR_QDISC, sizeof(qdisc), &qdisc) ||
+		nla_put(skb, PFAB_ATTR_EVENTS, len, events->batch)) {
+		nlmsg_free(skb);
+		return -EMSGSIZE;
+	}
+
+	genlmsg_end(skb, hdr);
+	retval = genlmsg_multicast(skb, 0, pfab_genl_mcgrp.id, GFP_ATOMIC);
+	return -ESRCH == retval ? 0 : retval;
+}
+
+void pfab_events_flush(struct pfab_events *events)
+{
+	if (0 == events->count && 0 == events->lost) {
+		return;
+	}
+
+	/* Events that could not be sent are reported as lost */
+	if (pfab_events_send(events) < 0) {
+		events->lost += events->count;
+	}
+	else {
+		events->lost = 0;
+	}
+
+	events->count = 0;
+}
+
+static void pfab_events_timer(unsigned long arg)
+{
+	struct pfab_events *events = (struct pfab_events *) arg;
+	spinlock_t *root_lock = qdisc_root_sleeping_lock(events->sch);
+
+	spin_lock(root_lock);
+	pfab_events_flush(events);
+	spin_unlock(root_lock);
+}
+
+void pfab_events_init(struct pfab_events *events, struct Qdisc *sch)
+{
+	memset(events, 0, sizeof(*events));
+	events->sch = sch;
+	setup_timer(&events->timer, pfab_events_timer, (unsigned long) events);
+}
+
+void pfab_events_destroy(struct pfab_events *events)
+{
+	del_timer_sync(&events->timer);
+	pfab_events_flush(events);
+}
+
+void __pfab_events_record(struct pfab_events *events, int type,
+						  const struct sk_buff *skb,
+						  const struct pfab_flow_key *key, u32 prio)
+{
+	struct pfab_event *event = NULL;
+	struct pfab_pkt_info info;
+	struct pfab_flow_key parsed;
+	u64 now = ktime_to_ns(ktime_get());
+
+	if (now - events->window_start >= NSEC_PER_SEC) {
+		events->window_start = now;
+		events->window_count = 0;
+	}
+
+	if (events->window_count >= events->rate) {
+		events->lost++;
+	}
+	else {
+		events->window_count++;
+
+		if (NULL == key) {
+			pfab_classify(skb, &info, &parsed);
+			key = &parsed;
+		}
+
+		event = &events->batch[events->count++];
+		event->tstamp = now;
+		memcpy(event->saddr, key->saddr, sizeof(event->saddr));
+		memcpy(event->daddr, key->daddr, sizeof(event->daddr));
+		event->sport = ((const __be16 *) &key->ports)[0];
+		event->dport = ((const __be16 *) &key->ports)[1];
+		event->l3proto = key->l3proto;
+		event->protocol = key->protocol;
+		event->type = type;
+		event->prio = prio;
+		event->len = qdisc_pkt_len(skb);
+		event->qlen = events->sch->q.qlen;
+		event->backlog = events->sch->qstats.backlog;
+	}
+
+	if (PFAB_EVENTS_BATCH == events->count) {
+		pfab_events_flush(events);
+	}
+	else if (!timer_pending(&events->timer)) {
+		mod_timer(&events->timer,
+				  jiffies + msecs_to_jiffies(PFAB_EVENTS_FLUSH_MS));
+	}
+}
@@ -0,0 +1,120 @@
+/*
+ * Module: pFabric classful queueing discipline.
+ *
+ * Drop and eviction events, multicast on the "events" group of the
+ * "pfabric" generic netlink family, where tc monitor pfabric prints them.
+ * Each event carries the 5-tuple of the packet, read by pfab_classify(),
+ * its band and the queue depth, so that flow completion time regressions
+ * can be traced to the flows that lost packets without a capture.
+ *
+ * Events are batched per qdisc: a message holds up to PFAB_EVENTS_BATCH
+ * of them and is sent when the batch is full, or PFAB_EVENTS_FLUSH_MS
+ * after it was started. A qdisc reports at most its rate of events per
+ * second, the others are only counted and the count is sent with the
+ * next message, so that a burst of drops at line rate costs a few
+ * messages.
+ */
+
+#ifndef __PFAB_EVENTS_H__
+#define __PFAB_EVENTS_H__
+
+#include <linux/types.h>
+#include <linux/timer.h>
+
+struct sk_buff;
+struct Qdisc;
+struct pfab_flow_key;
+
+#define PFAB_GENL_NAME "pfabric"
+#define PFAB_GENL_VERSION (1)
+#define PFAB_GENL_MCGRP "events"
+
+enum {
+	PFAB_CMD_UNSPEC,
+	PFAB_CMD_EVENTS,	/* Sent to the group, never received */
+	__PFAB_CMD_MAX
+};
+
+enum {
+	PFAB_ATTR_UNSPEC,
+	PFAB_ATTR_QDISC,	/* struct pfab_event_qdisc */
+	PFAB_ATTR_EVENTS,	/* Array of struct pfab_event */
+	__PFAB_ATTR_MAX
+};
+#define PFAB_ATTR_MAX (__PFAB_ATTR_MAX - 1)
+
+/* Type of an event */
+enum {
+	PFAB_EVENT_DROP,	/* An arriving packet was not admitted */
+	PFAB_EVENT_EVICT,	/* A queued packet was pushed out */
+	__PFAB_EVENT_MAX
+};
+
+/* Fields ordering should correspond to that in tc */
+struct pfab_event_qdisc {
+	__u32 ifindex;
+	__u32 handle;
+	__u32 lost;		/* Events over the rate since the last message */
+};
+
+struct pfab_event {
+	__u64 tstamp;		/* ns */
+	__be32 saddr[4];	/* IPv4 addresses take the first word */
+	__be32 daddr[4];
+	__be16 sport;
+	__be16 dport;
+	__be16 l3proto;		/* 0 if not an IP packet */
+	__u8 protocol;
+	__u8 type;		/* PFAB_EVENT_* */
+	__u32 prio;		/* Band, or the priority value in heap mode */
+	__u32 len;		/* Bytes */
+	__u32 qlen;		/* Packets queued, counting an evicted one */
+	__u32 backlog;		/* Bytes */
+};
+
+#define PFAB_EVENTS_BATCH (16)
+#define PFAB_EVENTS_FLUSH_MS (100)
+
+/* Accessed under the qdisc lock, the flush timer takes it too. */
+struct pfab_events {
+	struct Qdisc *sch;
+	u32 rate;			//Events per second, 0 if disabled.
+	u64 window_start;		//Start of the current second, ns.
+	u32 window_count;		//Events reported in it.
+	u32 lost;
+	u32 count;			//Events in the batch.
+	struct timer_list timer;	//Sends the batch, if pending.
+	struct pfab_event batch[PFAB_EVENTS_BATCH];
+};
+
+/* The generic netlink family, registered with the qdisc. */
+int pfab_events_register(void);
+void pfab_events_unregister(void);
+
+void pfab_events_init(struct pfab_events *events, struct Qdisc *sch);
+
+/* Sends the pending events. Called under the qdisc lock. */
+void pfab_events_flush(struct pfab_events *events);
+
+/* Sends the pending events and stops the timer. Called without the
+   qdisc lock, as the timer may be waiting for it. */
+void pfab_events_destroy(struct pfab_events *events);
+
+void __pfab_events_record(struct pfab_events *events, int type,
+						  const struct sk_buff *skb,
+						  const struct pfab_flow_key *key, u32 prio);
+
+/* Reports a packet dropped or evicted, before it is freed. key is the
+   5-tuple of the packet if the caller has it, NULL to parse the packet
+   again. Called under the qdisc lock. */
+static inline void pfab_events_record(struct pfab_events *events, int type,
+									  const struct sk_buff *skb,
+									  const struct pfab_flow_key *key,
+									  u32 prio)
+{
+	if (unlikely(events->rate)) {
+		__pfab_events_record(events, type, skb, key, prio);
+	}
+}
+
+#endif
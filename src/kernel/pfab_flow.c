@@ -0,0 +1,286 @@
+/*
+ * Module: pFabric classful queueing discipline.
+ *
+ * Flow table of the flow ordered dequeue.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include "pfab_flow.h"
+
+/* The cache is shared by the instances, created by the first one and
+   destroyed with the last one, under RTNL like the groups. */
+static struct kmem_cache *pfab_flow_cache;
+static int pfab_flow_cache_users;
+static DEFINE_MUTEX(pfab_flow_cache_mutex);
+
+static int pfab_flow_cache_get(void)
+{
+	int retval = 0;
+
+	mutex_lock(&pfab_flow_cache_mutex);
+	if (0 == pfab_flow_cache_users) {
+		pfab_flow_cache = kmem_cache_create("pfabric_flow",
+											sizeof(struct pfab_flow), 0,
+											SLAB_HWCACHE_ALIGN, NULL);
+		if (NULL == pfab_flow_cache) {
+			retval = -ENOMEM;
+		}
+	}
+
+	if (0 == retval) {
+		pfab_flow_cache_users++;
+	}
+	mutex_unlock(&pfab_flow_cache_mutex);
+
+	return retval;
+}
+
+static void pfab_flow_cache_put(void)
+{
+	mutex_lock(&pfab_flow_cache_mutex);
+	if (0 == --pfab_flow_cache_users) {
+		kmem_cache_destroy(pfab_flow_cache);
+		pfab_flow_cache = NULL;
+	}
+	mutex_unlock(&pfab_flow_cache_mutex);
+}
+
+static inline u32 pfab_flow_hash(const struct pfab_flow_table *table,
+								 const struct pfab_flow_key *key)
+{
+	BUILD_BUG_ON(sizeof(*key) % sizeof(u32));
+	return jhash2((const u32 *) key, sizeof(*key) / sizeof(u32),
+				  table->perturbation);
+}
+
+static inline int pfab_flow_key_equal(const struct pfab_flow_key *a,
+									  const struct pfab_flow_key *b)
+{
+	return 0 == memcmp(a, b, sizeof(*a));
+}
+
+static void pfab_flow_init_entry(struct pfab_flow *flow)
+{
+	flow->head = PFAB_FLOW_NO_LINK;
+	flow->tail = PFAB_FLOW_NO_LINK;
+	flow->qlen = 0;
+	INIT_LIST_HEAD(&flow->list);
+}
+
+/* Chains the links from first on in front of the free list. */
+static void pfab_flow_free_links_from(struct pfab_flow_table *table, u32 first)
+{
+	u32 i;
+
+	for (i = first; i < table->link_capacity; i++) {
+		table->links[i].skb = NULL;
+		table->links[i].next = i + 1 < table->link_capacity ?
+			i + 1 : table->free_link;
+	}
+
+	if (first < table->link_capacity) {
+		table->free_link = first;
+	}
+}
+
+/* Puts every entry and every link in the free lists. */
+static void pfab_flow_free_all(struct pfab_flow_table *table)
+{
+	struct pfab_flow *flow = NULL;
+	u32 i;
+
+	INIT_LIST_HEAD(&table->idle);
+	INIT_LIST_HEAD(&table->free);
+	for (i = 0; i < table->capacity; i++) {
+		flow = table->entries[i];
+		pfab_flow_init_entry(flow);
+		flow->index = i;
+		list_add_tail(&flow->list, &table->free);
+	}
+
+	memset(table->slots, 0, (table->slot_mask + 1) * sizeof(*table->slots));
+	table->count = 0;
+	pfab_flow_init_entry(&table->overflow);
+	table->overflow.index = table->capacity;
+
+	table->free_link = PFAB_FLOW_NO_LINK;
+	pfab_flow_free_links_from(table, 0);
+}
+
+struct pfab_flow_link *pfab_flow_alloc_links(u32 capacity)
+{
+	return kcalloc(capacity, sizeof(struct pfab_flow_link), GFP_KERNEL);
+}
+
+void pfab_flow_free_links(struct pfab_flow_link *links)
+{
+	kfree(links);
+}
+
+struct pfab_flow_link *pfab_flow_replace_links(struct pfab_flow_table *table,
+		struct pfab_flow_link *links, u32 capacity)
+{
+	struct pfab_flow_link *old = table->links;
+	u32 first = table->link_capacity;
+
+	BUG_ON(capacity < first);
+
+	if (first) {
+		memcpy(links, old, first * sizeof(*links));
+	}
+
+	table->links = links;
+	table->link_capacity = capacity;
+	pfab_flow_free_links_from(table, first);
+	return old;
+}
+
+int pfab_flow_table_init(struct pfab_flow_table *table, u32 capacity,
+						 u32 packets)
+{
+	u32 i;
+
+	memset(table, 0, sizeof(*table));
+	if (0 == packets) {
+		return -EINVAL;
+	}
+
+	if (pfab_flow_cache_get() < 0) {
+		return -ENOMEM;
+	}
+
+	table->entries = kcalloc(capacity, sizeof(*table->entries), GFP_KERNEL);
+	if (NULL == table->entries) {
+		pfab_flow_cache_put();
+		return -ENOMEM;
+	}
+
+	table->slots = kcalloc(2 * capacity, sizeof(*table->slots), GFP_KERNEL);
+	table->links = pfab_flow_alloc_links(packets);
+	if (NULL == table->slots || NULL == table->links) {
+		goto fail;
+	}
+	table->link_capacity = packets;
+
+	for (i = 0; i < capacity; i++) {
+		table->entries[i] = kmem_cache_alloc(pfab_flow_cache, GFP_KERNEL);
+		if (NULL == table->entries[i]) {
+			goto fail;
+		}
+		table->capacity++;
+	}
+
+	table->slot_mask = 2 * capacity - 1;
+	table->perturbation = net_random();
+	pfab_flow_free_all(table);
+	return 0;
+
+fail:
+	pfab_flow_table_destroy(table);
+	return -ENOMEM;
+}
+
+void pfab_flow_table_destroy(struct pfab_flow_table *table)
+{
+	u32 i;
+
+	if (NULL == table->entries) {
+		/* Never initialized, or already destroyed */
+		return;
+	}
+
+	for (i = 0; i < table->capacity; i++) {
+		kmem_cache_free(pfab_flow_cache, table->entries[i]);
+	}
+
+	kfree(table->entries);
+	kfree(table->slots);
+	pfab_flow_free_links(table->links);
+	memset(table, 0, sizeof(*table));
+	pfab_flow_cache_put();
+}
+
+void pfab_flow_table_reset(struct pfab_flow_table *table)
+{
+	if (table->entries) {
+		pfab_flow_free_all(table);
+	}
+}
+
+/* Removes an idle flow from the table. The following entries of its probe
+   sequence are shifted back, so that lookups never need tombstones. */
+static void pfab_flow_unlink(struct pfab_flow_table *table,
+							 struct pfab_flow *flow)
+{
+	u32 mask = table->slot_mask;
+	u32 i = flow->hash & mask;
+	u32 j;
+	u32 home;
+
+	while (table->slots[i] != flow) {
+		i = (i + 1) & mask;
+	}
+
+	/* Moves into hole i every later entry whose home slot is not in the
+	   cyclic range (i, j], i.e. that probed past i. */
+	for (j = (i + 1) & mask; table->slots[j]; j = (j + 1) & mask) {
+		home = table->slots[j]->hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			table->slots[i] = table->slots[j];
+			i = j;
+		}
+	}
+
+	table->slots[i] = NULL;
+	table->count--;
+	list_del(&flow->list);
+	list_add_tail(&flow->list, &table->free);
+}
+
+struct pfab_flow *pfab_flow_get(struct pfab_flow_table *table,
+								const struct pfab_flow_key *key,
+								int *reclaimed)
+{
+	u32 hash = pfab_flow_hash(table, key);
+	u32 mask = table->slot_mask;
+	struct pfab_flow *flow = NULL;
+	u32 i;
+
+	*reclaimed = 0;
+	for (i = hash & mask; (flow = table->slots[i]) != NULL; i = (i + 1) & mask) {
+		if (flow->hash == hash && pfab_flow_key_equal(&flow->key, key)) {
+			return flow;
+		}
+	}
+
+	if (table->count == table->capacity) {
+		if (list_empty(&table->idle)) {
+			return &table->overflow;
+		}
+
+		pfab_flow_unlink(table, list_first_entry(&table->idle,
+												 struct pfab_flow, list));
+		*reclaimed = 1;
+
+		/* The removal may have shifted entries into the probe sequence */
+		i = hash & mask;
+		while (table->slots[i]) {
+			i = (i + 1) & mask;
+		}
+	}
+
+	flow = list_first_entry(&table->free, struct pfab_flow, list);
+	list_del(&flow->list);
+	pfab_flow_init_entry(flow);
+	flow->hash = hash;
+	flow->key = *key;
+	table->slots[i] = flow;
+	table->count++;
+	return flow;
+}
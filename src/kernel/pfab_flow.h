@@ -0,0 +1,186 @@
+/*
+ * Module: pFabric classful queueing discipline.
+ *
+ * Flow table of the flow ordered dequeue. Every flow with packets in the
+ * buffer has its own entry, keyed by its 5-tuple, so that flows are never
+ * merged by a hash collision. Entries come from a kmem_cache shared by all
+ * the instances and are allocated when the qdisc is set up, so that the
+ * fast path never allocates. The table is open addressed with linear
+ * probing and holds at most half as many entries as slots.
+ *
+ * Flows whose packets all left the buffer keep their entry until it is
+ * needed for a new flow, least recently active first. A new flow which
+ * finds every entry busy shares the overflow entry with the other such
+ * flows.
+ *
+ * The packets of a flow are doubly linked through an array of links, one
+ * per packet the buffer can hold, so that any of them is removed in
+ * constant time. The skb control block has no room for two pointers on
+ * 64 bit, a packet only keeps the index of its link.
+ */
+
+#ifndef __PFAB_FLOW_H__
+#define __PFAB_FLOW_H__
+
+#include <linux/types.h>
+#include <linux/list.h>
+
+struct sk_buff;
+
+/* Set by pfab_classify(), from the innermost IP header. IPv4 addresses
+   take the first word. */
+struct pfab_flow_key {
+	__be32 saddr[4];
+	__be32 daddr[4];
+	__be32 ports;		//Both ports, 0 if unknown.
+	__be16 l3proto;		//ETH_P_IP or ETH_P_IPV6, 0 if not IP.
+	u16 protocol;
+};
+
+/* No link, ends the lists */
+#define PFAB_FLOW_NO_LINK (~0U)
+
+struct pfab_flow_link {
+	struct sk_buff *skb;
+	u32 prev;
+	u32 next;		//Also links the free links.
+};
+
+struct pfab_flow {
+	u32 head;		//Links of the packets of the flow in the
+	u32 tail;		//buffer, in arrival order.
+	u32 qlen;
+	u32 hash;
+	u32 index;		//In entries, capacity for the overflow entry.
+	struct pfab_flow_key key;
+	struct list_head list;	//Entry in the idle list while qlen is 0 and
+							//the flow is in the table, in the free list
+							//while it is not.
+};
+
+struct pfab_flow_table {
+	struct pfab_flow **entries;	//Array of capacity entries, from the cache.
+	struct pfab_flow **slots;	//Array of 2 * capacity slots.
+	u32 slot_mask;
+	u32 capacity;			//Entries, half the slots.
+	u32 count;			//Entries in the table.
+	u32 perturbation;		//Hash seed.
+	struct list_head idle;		//Least recently active first.
+	struct list_head free;
+	struct pfab_flow overflow;	//Not in the table.
+	struct pfab_flow_link *links;	//Array of link_capacity links.
+	u32 link_capacity;
+	u32 free_link;			//First free link.
+};
+
+/* Allocates a table of capacity entries (a power of 2), and links for
+   up to packets packets. */
+int pfab_flow_table_init(struct pfab_flow_table *table, u32 capacity,
+						 u32 packets);
+
+/* Releases the entries. The buffer must be empty. */
+void pfab_flow_table_destroy(struct pfab_flow_table *table);
+
+/* Empties the table, once the buffer was emptied. */
+void pfab_flow_table_reset(struct pfab_flow_table *table);
+
+/* Allocates room for capacity links. Returns NULL on failure. */
+struct pfab_flow_link *pfab_flow_alloc_links(u32 capacity);
+void pfab_flow_free_links(struct pfab_flow_link *links);
+
+/* Moves the links to a larger array. Returns the old array to be freed by
+   the caller. */
+struct pfab_flow_link *pfab_flow_replace_links(struct pfab_flow_table *table,
+		struct pfab_flow_link *links, u32 capacity);
+
+/* Returns the entry of a flow, adding it if needed. Sets reclaimed when
+   the entry of an idle flow was taken for it. Returns the overflow entry
+   if the table is full of flows with packets in the buffer. */
+struct pfab_flow *pfab_flow_get(struct pfab_flow_table *table,
+								const struct pfab_flow_key *key,
+								int *reclaimed);
+
+/* Packets refer to their flow by index, which fits in the skb control
+   block where a pointer would not. */
+static inline struct pfab_flow *pfab_flow_at(struct pfab_flow_table *table,
+											 u32 index)
+{
+	return index < table->capacity ?
+		table->entries[index] : &table->overflow;
+}
+
+/* Packets are linked to their flow by the caller, which tells the table
+   when a flow gets its first packet and when it has none left. */
+static inline void pfab_flow_busy(struct pfab_flow_table *table,
+								  struct pfab_flow *flow)
+{
+	if (flow != &table->overflow) {
+		list_del_init(&flow->list);
+	}
+}
+
+static inline void pfab_flow_idle(struct pfab_flow_table *table,
+								  struct pfab_flow *flow)
+{
+	if (flow != &table->overflow) {
+		list_add_tail(&flow->list, &table->idle);
+	}
+}
+
+/* Appends a packet to the list of its flow. Returns the index of its link,
+   there is always a free one for a packet the buffer can hold. */
+static inline u32 pfab_flow_append(struct pfab_flow_table *table,
+								   struct pfab_flow *flow, struct sk_buff *skb)
+{
+	u32 index = table->free_link;
+	struct pfab_flow_link *link = &table->links[index];
+
+	table->free_link = link->next;
+	link->skb = skb;
+	link->prev = flow->tail;
+	link->next = PFAB_FLOW_NO_LINK;
+	if (PFAB_FLOW_NO_LINK == flow->tail) {
+		flow->head = index;
+	}
+	else {
+		table->links[flow->tail].next = index;
+	}
+	flow->tail = index;
+
+	return index;
+}
+
+/* Unlinks a packet, wherever it is in the list of its flow. */
+static inline void pfab_flow_unlink_packet(struct pfab_flow_table *table,
+										   struct pfab_flow *flow, u32 index)
+{
+	struct pfab_flow_link *link = &table->links[index];
+
+	if (PFAB_FLOW_NO_LINK == link->prev) {
+		flow->head = link->next;
+	}
+	else {
+		table->links[link->prev].next = link->next;
+	}
+
+	if (PFAB_FLOW_NO_LINK == link->next) {
+		flow->tail = link->prev;
+	}
+	else {
+		table->links[link->next].prev = link->prev;
+	}
+
+	link->skb = NULL;
+	link->next = table->free_link;
+	table->free_link = index;
+}
+
+/* Returns the earliest packet of the flow in the buffer, NULL if none. */
+static inline struct sk_buff *pfab_flow_first(struct pfab_flow_table *table,
+											  struct pfab_flow *flow)
+{
+	return PFAB_FLOW_NO_LINK == flow->head ?
+		NULL : table->links[flow->head].skb;
+}
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Module: pFabric classful queueing discipline.
+ *
+ * Buffer shared by the pFabric instances of a device.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/bitops.h>
+#include <linux/netdevice.h>
+#include "pfab_group.h"
+
+/* Groups are created and destroyed with the qdiscs, under RTNL, but the
+   list has its own lock like the stats instances list. */
+static LIST_HEAD(pfab_groups);
+static DEFINE_MUTEX(pfab_groups_mutex);
+
+static struct pfab_group *pfab_group_find(struct net_device *dev)
+{
+	struct pfab_group *group = NULL;
+
+	list_for_each_entry(group, &pfab_groups, list) {
+		if (group->dev == dev) {
+			return group;
+		}
+	}
+
+	return NULL;
+}
+
+int pfab_group_join(struct net_device *dev, u32 mode, u32 limit,
+					struct pfab_group **group)
+{
+	struct pfab_group *g = NULL;
+	int slot;
+
+	mutex_lock(&pfab_groups_mutex);
+
+	g = pfab_group_find(dev);
+	if (NULL == g) {
+		g = kzalloc(sizeof(*g), GFP_KERNEL);
+		if (NULL == g) {
+			slot = -ENOMEM;
+			goto out;
+		}
+
+		g->dev = dev;
+		g->mode = mode;
+		list_add(&g->list, &pfab_groups);
+	}
+
+	if (g->mode != mode) {
+		pr_err("All shared pFabric instances of %s must use the same mode\n",
+			   dev->name);
+		slot = -EINVAL;
+		goto out_free;
+	}
+
+	if (~0UL == g->used) {
+		pr_err("At most %d pFabric instances can share a buffer\n",
+			   PFAB_GROUP_SLOTS);
+		slot = -ENOSPC;
+		goto out_free;
+	}
+
+	/* The last member to join sets the shared limit */
+	slot = ffz(g->used);
+	memset(&g->slots[slot], 0, sizeof(g->slots[slot]));
+	g->used |= 1UL << slot;
+	g->limit = limit;
+	g->refcnt++;
+	*group = g;
+	goto out;
+
+out_free:
+	if (0 == g->refcnt) {
+		list_del(&g->list);
+		kfree(g);
+	}
+out:
+	mutex_unlock(&pfab_groups_mutex);
+	return slot;
+}
+
+void pfab_group_leave(struct pfab_group *group, int slot)
+{
+	mutex_lock(&pfab_groups_mutex);
+
+	group->used &= ~(1UL << slot);
+	pfab_group_publish(group, slot, 0, 0);
+	if (0 == --group->refcnt) {
+		list_del(&group->list);
+		kfree(group);
+	}
+
+	mutex_unlock(&pfab_groups_mutex);
+}
+
+u32 pfab_group_qlen(const struct pfab_group *group)
+{
+	unsigned long used = ACCESS_ONCE(group->used);
+	u32 qlen = 0;
+	int slot;
+
+	for_each_set_bit(slot, &used, PFAB_GROUP_SLOTS) {
+		qlen += ACCESS_ONCE(group->slots[slot].qlen);
+	}
+
+	return qlen;
+}
+
+int pfab_group_lowest(const struct pfab_group *group, u32 *lowest)
+{
+	unsigned long used = ACCESS_ONCE(group->used);
+	const struct pfab_group_slot *s = NULL;
+	int found = -1;
+	u32 value;
+	int slot;
+
+	for_each_set_bit(slot, &used, PFAB_GROUP_SLOTS) {
+		s = &group->slots[slot];
+		if (0 == ACCESS_ONCE(s->qlen)) {
+			continue;
+		}
+
+		value = ACCESS_ONCE(s->lowest);
+		if (found < 0 || value > *lowest) {
+			*lowest = value;
+			found = 0;
+		}
+	}
+
+	return found;
+}
@@ -0,0 +1,62 @@
+/*
+ * Module: pFabric classful queueing discipline.
+ *
+ * Buffer shared by the pFabric instances of a device, typically one per
+ * TX queue under mq. Every member keeps its own lock and queues, and
+ * publishes its queue length and lowest priority in a slot of the group.
+ * Other members read the slots without locking, so the shared limit and
+ * the lowest priority in the shared buffer are estimates, which is enough
+ * to keep admission and eviction approximately global.
+ */
+
+#ifndef __PFAB_GROUP_H__
+#define __PFAB_GROUP_H__
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/cache.h>
+#include <linux/compiler.h>
+
+#define PFAB_GROUP_SLOTS (BITS_PER_LONG)
+
+struct net_device;
+
+struct pfab_group_slot {
+	u32 qlen;
+	u32 lowest;		//Lowest priority (largest value) queued, if qlen.
+} ____cacheline_aligned_in_smp;
+
+struct pfab_group {
+	struct list_head list;		//Entry in the list of groups.
+	struct net_device *dev;
+	u32 mode;			//Members must use the same scheduling mode.
+	u32 limit;			//Packets in all the members together.
+	int refcnt;
+	unsigned long used;		//Slots held by members.
+	struct pfab_group_slot slots[PFAB_GROUP_SLOTS];
+};
+
+/* Joins the group of dev, creating it if needed, and takes a slot.
+   Returns the slot or a negative error. */
+int pfab_group_join(struct net_device *dev, u32 mode, u32 limit,
+					struct pfab_group **group);
+void pfab_group_leave(struct pfab_group *group, int slot);
+
+/* Packets queued in all the members. */
+u32 pfab_group_qlen(const struct pfab_group *group);
+
+/* Sets *lowest to the lowest priority queued in any member. Returns 0
+   if some member has packets, -1 otherwise. */
+int pfab_group_lowest(const struct pfab_group *group, u32 *lowest);
+
+/* Called by the owner of the slot, under its qdisc lock. */
+static inline void pfab_group_publish(struct pfab_group *group, int slot,
+									  u32 qlen, u32 lowest)
+{
+	struct pfab_group_slot *s = &group->slots[slot];
+
+	ACCESS_ONCE(s->lowest) = lowest;
+	ACCESS_ONCE(s->qlen) = qlen;
+}
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ * Module: pFabric classful queueing discipline.
+ *
+ * Min-max heap: even levels (starting with the root) hold entries that
+ * are smaller than all their descendants, odd levels hold entries that
+ * are larger than all their descendants. See Atkinson et al., "Min-max
+ * heaps and generalized priority queues", CACM 1986.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include "pfab_heap.h"
+
+#define PARENT(i) (((i) - 1) / 2)
+#define FIRST_CHILD(i) (2 * (i) + 1)
+
+static inline int is_min_level(u32 i)
+{
+	return !(ilog2(i + 1) & 1);
+}
+
+/* Entry a should be sent before entry b. */
+static inline int entry_less(const struct pfab_heap_entry *a,
+							 const struct pfab_heap_entry *b)
+{
+	if (a->key != b->key) {
+		return a->key < b->key;
+	}
+
+	return (s32) (a->seq - b->seq) < 0;
+}
+
+/* Compares for the min levels when min is set, for the max levels otherwise. */
+static inline int entry_before(const struct pfab_heap_entry *a,
+							   const struct pfab_heap_entry *b, int min)
+{
+	return min ? entry_less(a, b) : entry_less(b, a);
+}
+
+static inline void entry_swap(struct pfab_heap *heap, u32 i, u32 j)
+{
+	struct pfab_heap_entry tmp = heap->entries[i];
+
+	heap->entries[i] = heap->entries[j];
+	heap->entries[j] = tmp;
+}
+
+static void bubble_up_grandparents(struct pfab_heap *heap, u32 i, int min)
+{
+	u32 grandparent;
+
+	while (i > 2) {
+		grandparent = PARENT(PARENT(i));
+		if (!entry_before(&heap->entries[i], &heap->entries[grandparent], min)) {
+			break;
+		}
+
+		entry_swap(heap, i, grandparent);
+		i = grandparent;
+	}
+}
+
+static void bubble_up(struct pfab_heap *heap, u32 i)
+{
+	int min;
+	u32 parent;
+
+	if (0 == i) {
+		return;
+	}
+
+	min = is_min_level(i);
+	parent = PARENT(i);
+	if (entry_before(&heap->entries[parent], &heap->entries[i], min)) {
+		/* Belongs on the parent's levels */
+		entry_swap(heap, i, parent);
+		bubble_up_grandparents(heap, parent, !min);
+	}
+	else {
+		bubble_up_grandparents(heap, i, min);
+	}
+}
+
+static void trickle_down(struct pfab_heap *heap, u32 i)
+{
+	int min = is_min_level(i);
+	u32 child, last, m, j;
+
+	for (;;) {
+		child = FIRST_CHILD(i);
+		if (child >= heap->size) {
+			return;
+		}
+
+		/* Find the best among the children and grandchildren */
+		m = child;
+		if (child + 1 < heap->size &&
+			entry_before(&heap->entries[child + 1], &heap->entries[m], min)) {
+			m = child + 1;
+		}
+
+		last = min_t(u32, FIRST_CHILD(child + 1) + 1, heap->size - 1);
+		for (j = FIRST_CHILD(child); j <= last && j < heap->size; j++) {
+			if (entry_before(&heap->entries[j], &heap->entries[m], min)) {
+				m = j;
+			}
+		}
+
+		if (!entry_before(&heap->entries[m], &heap->entries[i], min)) {
+			return;
+		}
+
+		entry_swap(heap, i, m);
+		if (m <= child + 1) {
+			/* A child, nothing below it can be out of order */
+			return;
+		}
+
+		/* A grandchild, it may now be out of order with its parent */
+		if (entry_before(&heap->entries[PARENT(m)], &heap->entries[m], min)) {
+			entry_swap(heap, m, PARENT(m));
+		}
+
+		i = m;
+	}
+}
+
+/* Removes entry i by moving the last entry into its place. */
+static struct sk_buff *heap_remove(struct pfab_heap *heap, u32 i)
+{
+	struct sk_buff *skb = heap->entries[i].skb;
+
+	heap->size--;
+	if (i < heap->size) {
+		heap->entries[i] = heap->entries[heap->size];
+		trickle_down(heap, i);
+	}
+
+	return skb;
+}
+
+struct pfab_heap_entry *pfab_heap_alloc_entries(u32 capacity)
+{
+	return kcalloc(capacity, sizeof(struct pfab_heap_entry), GFP_KERNEL);
+}
+
+void pfab_heap_free_entries(struct pfab_heap_entry *entries)
+{
+	kfree(entries);
+}
+
+struct pfab_heap_entry *pfab_heap_replace_entries(struct pfab_heap *heap,
+		struct pfab_heap_entry *entries, u32 capacity)
+{
+	struct pfab_heap_entry *old = heap->entries;
+
+	BUG_ON(capacity < heap->size);
+
+	if (heap->size) {
+		memcpy(entries, old, heap->size * sizeof(*entries));
+	}
+
+	heap->entries = entries;
+	heap->capacity = capacity;
+	return old;
+}
+
+void pfab_heap_push(struct pfab_heap *heap, u32 key, struct sk_buff *skb)
+{
+	struct pfab_heap_entry *entry = NULL;
+
+	BUG_ON(heap->size >= heap->capacity);
+
+	entry = &heap->entries[heap->size];
+	entry->key = key;
+	entry->seq = heap->next_seq++;
+	entry->skb = skb;
+
+	bubble_up(heap, heap->size++);
+}
+
+/* Inserting the entries one at a time in place: bubble_up only looks at
+   the entries before the one it moves. */
+void pfab_heap_rebuild(struct pfab_heap *heap)
+{
+	u32 i;
+
+	for (i = 1; i < heap->size; i++) {
+		bubble_up(heap, i);
+	}
+}
+
+u32 pfab_heap_max_index(const struct pfab_heap *heap)
+{
+	BUG_ON(0 == heap->size);
+
+	/* The largest entry is the root or one of its children */
+	if (heap->size == 1) {
+		return 0;
+	}
+
+	if (heap->size == 2 ||
+		entry_less(&heap->entries[2], &heap->entries[1])) {
+		return 1;
+	}
+
+	return 2;
+}
+
+struct sk_buff *pfab_heap_pop_min(struct pfab_heap *heap)
+{
+	if (0 == heap->size) {
+		return NULL;
+	}
+
+	return heap_remove(heap, 0);
+}
+
+struct sk_buff *pfab_heap_pop_max(struct pfab_heap *heap)
+{
+	if (0 == heap->size) {
+		return NULL;
+	}
+
+	return heap_remove(heap, pfab_heap_max_index(heap));
+}
@@ -0,0 +1,72 @@
+/*
+ * Module: pFabric classful queueing discipline.
+ *
+ * Min-max heap of packets keyed by an unbounded 32 bit priority, used by
+ * the heap scheduling mode. Both the packet with the smallest key (next
+ * to send) and the one with the largest key (next to evict) are found in
+ * O(1) and removed in O(log n). Packets with equal keys are ordered by
+ * arrival.
+ */
+
+#ifndef __PFAB_HEAP_H__
+#define __PFAB_HEAP_H__
+
+#include <linux/types.h>
+
+struct sk_buff;
+
+struct pfab_heap_entry {
+	u32 key;
+	u32 seq;		//Arrival order, breaks ties between equal keys.
+	struct sk_buff *skb;
+};
+
+struct pfab_heap {
+	u32 size;
+	u32 capacity;
+	u32 next_seq;
+	struct pfab_heap_entry *entries;
+};
+
+/* Allocates room for capacity entries. Returns NULL on failure. */
+struct pfab_heap_entry *pfab_heap_alloc_entries(u32 capacity);
+void pfab_heap_free_entries(struct pfab_heap_entry *entries);
+
+/* Moves the heap to a new entries array which must be able to hold all
+   the current entries. Returns the old array to be freed by the caller. */
+struct pfab_heap_entry *pfab_heap_replace_entries(struct pfab_heap *heap,
+		struct pfab_heap_entry *entries, u32 capacity);
+
+/* Restores the heap order after the keys of the entries were changed in
+   place, keeping the arrival order of equal keys. */
+void pfab_heap_rebuild(struct pfab_heap *heap);
+
+/* Inserts a packet. The caller must make sure size < capacity. */
+void pfab_heap_push(struct pfab_heap *heap, u32 key, struct sk_buff *skb);
+
+/* Removes and returns the packet with the smallest key, or NULL. */
+struct sk_buff *pfab_heap_pop_min(struct pfab_heap *heap);
+
+/* Removes and returns the packet with the largest key, or NULL. */
+struct sk_buff *pfab_heap_pop_max(struct pfab_heap *heap);
+
+static inline int pfab_heap_empty(const struct pfab_heap *heap)
+{
+	return 0 == heap->size;
+}
+
+static inline struct sk_buff *pfab_heap_peek_min(const struct pfab_heap *heap)
+{
+	return heap->size ? heap->entries[0].skb : NULL;
+}
+
+/* Returns the index of the entry with the largest key. The heap must not
+   be empty. */
+u32 pfab_heap_max_index(const struct pfab_heap *heap);
+
+static inline u32 pfab_heap_max_key(const struct pfab_heap *heap)
+{
+	return heap->entries[pfab_heap_max_index(heap)].key;
+}
+
+#endif
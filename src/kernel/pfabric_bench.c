@@ -0,0 +1,434 @@
+/*
+ * Module: pFabric classful queueing discipline.
+ *
+ * In-module benchmark, built with make BENCH=1. Reports the cost of
+ * enqueue and dequeue through the qdisc for several band counts, and of
+ * the band lookup alone against the linear scan it replaced.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/if_ether.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <net/netlink.h>
+#include "sch_pfab.h"
+
+#define NET_DEVICE_NAME "lo"
+
+#define BENCH_PACKETS (1024)
+#define BENCH_ROUNDS (200)
+
+static const int bench_band_counts[] = { 32, 256, 4096 };
+
+/* Cheap LCG so that the measured loop is not dominated by the RNG. */
+static inline u32 bench_rand(u32 *seed)
+{
+	*seed = *seed * 1664525 + 1013904223;
+	return *seed >> 8;
+}
+
+struct bench_qdisc_ctx {
+	struct Qdisc *sch;
+	int nbands;
+	u32 seed;
+	struct sk_buff *skbs[BENCH_PACKETS];
+};
+
+/* An IPv4 packet whose mark is the priority, as in pfabric_tests.c */
+static struct sk_buff *bench_alloc_skb(u32 mark)
+{
+	struct sk_buff *skb = alloc_skb(ETH_HLEN + sizeof(struct iphdr),
+									GFP_KERNEL);
+	struct iphdr *ip_header = NULL;
+
+	if (NULL == skb) {
+		return NULL;
+	}
+
+	skb_reset_mac_header(skb);
+	memset(skb_put(skb, ETH_HLEN), 0, ETH_HLEN);
+
+	skb_set_network_header(skb, ETH_HLEN);
+	skb->protocol = htons(ETH_P_IP);
+	ip_header = (struct iphdr *) skb_put(skb, sizeof(struct iphdr));
+	memset(ip_header, 0, sizeof(struct iphdr));
+	ip_header->version = 4;
+	ip_header->ihl = sizeof(struct iphdr) / 4;
+	ip_header->saddr = htonl(0x0a000002);
+	ip_header->daddr = htonl(0x0a000001);
+
+	skb->mark = mark;
+	qdisc_skb_cb(skb)->pkt_len = skb->len;
+	return skb;
+}
+
+/* Packets are built before the timed loops, since the ones that are
+   dropped or evicted are freed by the qdisc. */
+static int bench_fill(struct bench_qdisc_ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < BENCH_PACKETS; i++) {
+		ctx->skbs[i] = bench_alloc_skb(bench_rand(&ctx->seed) % ctx->nbands);
+		if (NULL == ctx->skbs[i]) {
+			pr_err("Failed allocating skb\n");
+			while (i-- > 0) {
+				kfree_skb(ctx->skbs[i]);
+			}
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static u64 bench_qdisc_enqueue(struct bench_qdisc_ctx *ctx)
+{
+	ktime_t start;
+	int i;
+
+	start = ktime_get();
+	for (i = 0; i < BENCH_PACKETS; i++) {
+		pfab_qdisc_ops.enqueue(ctx->skbs[i], ctx->sch);
+	}
+
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+static u64 bench_qdisc_dequeue(struct bench_qdisc_ctx *ctx, int *count)
+{
+	ktime_t start;
+	struct sk_buff *skb = NULL;
+	int i = 0;
+
+	start = ktime_get();
+	while ((skb = pfab_qdisc_ops.dequeue(ctx->sch)) != NULL) {
+		ctx->skbs[i++] = skb;
+	}
+
+	*count = i;
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+/* Sets the options through the change operation, as tc qdisc change. */
+static int bench_change(struct Qdisc *sch, int nbands, u32 limit)
+{
+	struct {
+		struct nlattr nla;
+		tc_pfabric_qopt_t qopt;
+	} opt;
+
+	memset(&opt, 0, sizeof(opt));
+	opt.nla.nla_len = nla_attr_size(sizeof(opt.qopt));
+	opt.nla.nla_type = TCA_OPTIONS;
+	opt.qopt.limit = limit;
+	opt.qopt.bands = nbands;
+	opt.qopt.prio_source = PFAB_PRIO_MARK;
+	opt.qopt.present = TC_PFABRIC_OPT_LIMIT | TC_PFABRIC_OPT_BANDS |
+		TC_PFABRIC_OPT_PRIO_SOURCE;
+
+	return pfab_qdisc_ops.change(sch, &opt.nla);
+}
+
+/* Enqueues and drains BENCH_PACKETS packets of uniformly spread
+   priorities per round. With a limit below BENCH_PACKETS most enqueues
+   drop or evict a packet. */
+static int bench_qdisc_run(struct bench_qdisc_ctx *ctx, u32 limit)
+{
+	u64 enqueue_ns = 0;
+	u64 dequeue_ns = 0;
+	u64 dequeued = 0;
+	int round, count, i, retval;
+
+	retval = bench_change(ctx->sch, ctx->nbands, limit);
+	if (retval < 0) {
+		pr_err("Failed configuring %d bands\n", ctx->nbands);
+		return retval;
+	}
+
+	ctx->seed = 1;
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		retval = bench_fill(ctx);
+		if (retval < 0) {
+			return retval;
+		}
+
+		enqueue_ns += bench_qdisc_enqueue(ctx);
+		dequeue_ns += bench_qdisc_dequeue(ctx, &count);
+		dequeued += count;
+		for (i = 0; i < count; i++) {
+			kfree_skb(ctx->skbs[i]);
+		}
+		cond_resched();
+	}
+
+	pr_info("pfabric bench qdisc    bands=%-5d limit=%-5u enqueue %llu ns/op, dequeue %llu ns/op\n",
+			ctx->nbands, limit,
+			div64_u64(enqueue_ns, (u64) BENCH_PACKETS * BENCH_ROUNDS),
+			div64_u64(dequeue_ns, dequeued ? dequeued : 1));
+	return 0;
+}
+
+static int bench_qdisc(void)
+{
+	struct bench_qdisc_ctx *ctx = NULL;
+	struct net_device *netdev = NULL;
+	struct netdev_queue *netdev_queue = NULL;
+	int retval = 0;
+	int i;
+
+	netdev = dev_get_by_name(&init_net, NET_DEVICE_NAME);
+	if (NULL == netdev) {
+		pr_err("Failed getting network device\n");
+		return -ENODEV;
+	}
+
+	netdev_queue = netdev_get_tx_queue(netdev, 0);
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (NULL == ctx) {
+		retval = -ENOMEM;
+		goto bench_put;
+	}
+
+	/* Not attached to the device, so only the benchmark uses it */
+	ctx->sch = qdisc_create_dflt(netdev_queue, &pfab_qdisc_ops, 0);
+	if (NULL == ctx->sch) {
+		pr_err("Failed allocating qdisc\n");
+		retval = -ENOMEM;
+		goto bench_free;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(bench_band_counts); i++) {
+		ctx->nbands = bench_band_counts[i];
+		if (ctx->nbands > MAX_BANDS) {
+			pr_info("Skipping %d bands, at most %d are supported\n",
+					ctx->nbands, MAX_BANDS);
+			continue;
+		}
+
+		/* Room for every packet, then for a quarter of them */
+		retval = bench_qdisc_run(ctx, BENCH_PACKETS);
+		if (retval < 0) {
+			break;
+		}
+
+		retval = bench_qdisc_run(ctx, BENCH_PACKETS / 4);
+		if (retval < 0) {
+			break;
+		}
+	}
+
+	qdisc_destroy(ctx->sch);
+bench_free:
+	kfree(ctx);
+bench_put:
+	dev_put(netdev);
+	return retval;
+}
+
+typedef int (*band_search_t)(const struct pfab_bitmap *bm, int nbands);
+
+/* Band search through the bit-scan index used by the qdisc. */
+static int bitscan_first(const struct pfab_bitmap *bm, int nbands)
+{
+	return pfab_bitmap_first(bm);
+}
+
+static int bitscan_last(const struct pfab_bitmap *bm, int nbands)
+{
+	return pfab_bitmap_last(bm);
+}
+
+/* Reference band search that walks every bit, as pFabric used to do.
+   Kept here only to show the gain. */
+static int linear_first(const struct pfab_bitmap *bm, int nbands)
+{
+	int band;
+
+	for (band = 0; band < nbands; band++) {
+		if (test_bit(band, bm->words)) {
+			return band;
+		}
+	}
+
+	return -1;
+}
+
+static int linear_last(const struct pfab_bitmap *bm, int nbands)
+{
+	int band;
+
+	for (band = nbands - 1; band >= 0; band--) {
+		if (test_bit(band, bm->words)) {
+			return band;
+		}
+	}
+
+	return -1;
+}
+
+struct bench_lookup_ctx {
+	int nbands;
+	struct pfab_bitmap bitmap;
+	struct sk_buff_head *queues;
+	struct sk_buff *skbs[BENCH_PACKETS];
+	u32 seed;
+	int sink;
+};
+
+/* Mirrors the band handling of pfab_enqueue under a full buffer:
+   look up the lowest priority band, then append to the packet's band. */
+static u64 bench_lookup_enqueue(struct bench_lookup_ctx *ctx,
+								band_search_t search_last)
+{
+	ktime_t start;
+	int i, band;
+
+	start = ktime_get();
+	for (i = 0; i < BENCH_PACKETS; i++) {
+		band = bench_rand(&ctx->seed) % ctx->nbands;
+		/* The drop decision is not acted upon to keep the amount of
+		   work per round fixed. */
+		ctx->sink += search_last(&ctx->bitmap, ctx->nbands);
+		__skb_queue_tail(ctx->queues + band, ctx->skbs[i]);
+		pfab_bitmap_set(&ctx->bitmap, band);
+	}
+
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+/* Mirrors pfab_dequeue: pop the head of the highest priority band. */
+static u64 bench_lookup_dequeue(struct bench_lookup_ctx *ctx,
+								band_search_t search_first)
+{
+	ktime_t start;
+	int i, band;
+	struct sk_buff_head *list = NULL;
+
+	start = ktime_get();
+	for (i = 0; i < BENCH_PACKETS; i++) {
+		band = search_first(&ctx->bitmap, ctx->nbands);
+		list = ctx->queues + band;
+		ctx->skbs[i] = __skb_dequeue(list);
+		if (skb_queue_empty(list)) {
+			pfab_bitmap_clear(&ctx->bitmap, band);
+		}
+	}
+
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+static void bench_lookup_run(struct bench_lookup_ctx *ctx, const char *name,
+							 band_search_t search_first,
+							 band_search_t search_last)
+{
+	u64 enqueue_ns = 0;
+	u64 dequeue_ns = 0;
+	u64 ops = (u64) BENCH_PACKETS * BENCH_ROUNDS;
+	int round;
+
+	ctx->seed = 1;
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		enqueue_ns += bench_lookup_enqueue(ctx, search_last);
+		dequeue_ns += bench_lookup_dequeue(ctx, search_first);
+		cond_resched();
+	}
+
+	pr_info("pfabric bench %-8s bands=%-5d enqueue %llu ns/op, dequeue %llu ns/op\n",
+			name, ctx->nbands, div64_u64(enqueue_ns, ops),
+			div64_u64(dequeue_ns, ops));
+}
+
+static int bench_lookup_bands(struct bench_lookup_ctx *ctx, int nbands)
+{
+	int i;
+
+	if (nbands > MAX_BANDS) {
+		return 0;
+	}
+
+	ctx->queues = kmalloc(nbands * sizeof(*ctx->queues), GFP_KERNEL);
+	if (NULL == ctx->queues) {
+		pr_err("Failed allocating %d bands\n", nbands);
+		return -ENOMEM;
+	}
+
+	ctx->bitmap.summary = 0;
+	ctx->bitmap.words = kcalloc(BITS_TO_LONGS(nbands), sizeof(unsigned long),
+								GFP_KERNEL);
+	if (NULL == ctx->bitmap.words) {
+		kfree(ctx->queues);
+		return -ENOMEM;
+	}
+
+	ctx->nbands = nbands;
+	for (i = 0; i < nbands; i++) {
+		__skb_queue_head_init(ctx->queues + i);
+	}
+
+	bench_lookup_run(ctx, "bitscan", bitscan_first, bitscan_last);
+	bench_lookup_run(ctx, "linear", linear_first, linear_last);
+
+	kfree(ctx->bitmap.words);
+	kfree(ctx->queues);
+	return 0;
+}
+
+/* The band lookup alone, on a private bitmap and set of queues, both
+   with the bit-scan index and with the linear scan. */
+static int bench_lookup(void)
+{
+	struct bench_lookup_ctx *ctx = NULL;
+	int retval = 0;
+	int i;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (NULL == ctx) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < BENCH_PACKETS; i++) {
+		ctx->skbs[i] = alloc_skb(0, GFP_KERNEL);
+		if (NULL == ctx->skbs[i]) {
+			pr_err("Failed allocating skb\n");
+			retval = -ENOMEM;
+			goto bench_free;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(bench_band_counts); i++) {
+		retval = bench_lookup_bands(ctx, bench_band_counts[i]);
+		if (retval < 0) {
+			break;
+		}
+	}
+
+bench_free:
+	for (i = 0; i < BENCH_PACKETS; i++) {
+		if (ctx->skbs[i]) {
+			kfree_skb(ctx->skbs[i]);
+		}
+	}
+	kfree(ctx);
+	return retval;
+}
+
+int run_bench( void )
+{
+	int retval;
+
+	pr_info("Running pFabric benchmark...\n");
+
+	retval = bench_qdisc();
+	if (0 == retval) {
+		retval = bench_lookup();
+	}
+
+	pr_info("pFabric benchmark completed with status %d\n", retval);
+	return retval;
+} /* end of run_bench */
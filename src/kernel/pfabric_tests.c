@@ -1,5 +1,9 @@
 #include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/if_vlan.h>
+#include <linux/udp.h>
 #include "sch_pfab.h"
+#include "stats.h"
 
 #define NET_DEVICE_NAME "lo"
 
@@ -17,10 +21,13 @@ static struct Qdisc* sch = NULL;
 
 #define ETH_HEADER_LEN (14)
 #define IP_HEADER_LEN (20)
+#define IPV6_HEADER_LEN (40)
 
-static struct sk_buff* alloc_ip_skb(__u8 priority)
+static struct sk_buff* alloc_flow_skb(__u8 priority, __be32 saddr)
 {
-	struct sk_buff* skb = alloc_skb(ETH_HEADER_LEN + IP_HEADER_LEN, GFP_KERNEL);
+	/* Room for an inner header, see alloc_tunnel_skb() */
+	struct sk_buff* skb = alloc_skb(ETH_HEADER_LEN + IP_HEADER_LEN +
+									IPV6_HEADER_LEN, GFP_KERNEL);
 	struct iphdr* ip_header = NULL;
 
 	if (NULL == skb) {
@@ -28,27 +35,81 @@ static struct sk_buff* alloc_ip_skb(__u8 priority)
 		return NULL;
 	}
 	
-	skb->mac_header = (sk_buff_data_t) skb_put(skb, ETH_HEADER_LEN);
-	if (NULL == skb->mac_header) {
-		pr_err("Failed putting MAC header data in skb\n");
-		kfree_skb(skb);
-		return NULL;
-	}
+	skb_reset_mac_header(skb);
+	memset(skb_put(skb, ETH_HEADER_LEN), 0, ETH_HEADER_LEN);
 
+	skb_set_network_header(skb, ETH_HEADER_LEN);
+	skb->protocol = htons(ETH_P_IP);
 	ip_header = (struct iphdr*) skb_put(skb, IP_HEADER_LEN);
-	if (NULL == ip_header) {
-		pr_err("IP header is NULL\n");
-		kfree_skb(skb);
-		return NULL;
-	}
-	skb->network_header = (sk_buff_data_t) ip_header;
+	memset(ip_header, 0, IP_HEADER_LEN);
 
 	ip_header->version = 4; /* IPv4 packet */
-	ip_header->tos = priority;						
+	ip_header->ihl = IP_HEADER_LEN / 4;
+	ip_header->tos = priority;
+	ip_header->saddr = saddr;
+	ip_header->daddr = htonl(0x0a000001);
+
+	/* Normally set by the stack before the qdisc is called */
+	qdisc_skb_cb(skb)->pkt_len = skb->len;
 	pr_debug("Allocated skb. Length %d\n", qdisc_pkt_len(skb));
 	return skb;
 }
 
+static struct sk_buff* alloc_ip_skb(__u8 priority)
+{
+	return alloc_flow_skb(priority, htonl(0x0a000002));
+}
+
+#define ALLOC_FLOW_SKB(skb, priority, saddr) do {	\
+	skb = alloc_flow_skb(priority, saddr);		\
+	if (NULL == skb) {					\
+		return -1;						\
+	}									\
+} while (0)
+
+/* An IPv4 packet carrying an IPv4 or IPv6 one, whose TOS or traffic
+   class is the priority. The outer TOS tells the packets apart. */
+static struct sk_buff* alloc_tunnel_skb(__u8 outer_tos, __u8 priority,
+										int ipv6)
+{
+	struct sk_buff* skb = alloc_ip_skb(outer_tos);
+	struct iphdr* ip_header = NULL;
+	struct ipv6hdr* ipv6_header = NULL;
+
+	if (NULL == skb) {
+		return NULL;
+	}
+
+	if (ipv6) {
+		ip_hdr(skb)->protocol = IPPROTO_IPV6;
+		ipv6_header = (struct ipv6hdr*) skb_put(skb, IPV6_HEADER_LEN);
+		memset(ipv6_header, 0, IPV6_HEADER_LEN);
+		ipv6_header->version = 6;
+		ipv6_header->priority = priority >> 4;
+		ipv6_header->flow_lbl[0] = priority << 4;
+		ipv6_header->nexthdr = IPPROTO_TCP;
+	}
+	else {
+		ip_hdr(skb)->protocol = IPPROTO_IPIP;
+		ip_header = (struct iphdr*) skb_put(skb, IP_HEADER_LEN);
+		memset(ip_header, 0, IP_HEADER_LEN);
+		ip_header->version = 4;
+		ip_header->ihl = IP_HEADER_LEN / 4;
+		ip_header->tos = priority;
+		ip_header->protocol = IPPROTO_TCP;
+	}
+
+	qdisc_skb_cb(skb)->pkt_len = skb->len;
+	return skb;
+}
+
+#define ALLOC_TUNNEL_SKB(skb, outer_tos, priority, ipv6) do {	\
+	skb = alloc_tunnel_skb(outer_tos, priority, ipv6);		\
+	if (NULL == skb) {					\
+		return -1;						\
+	}									\
+} while (0)
+
 static void disable_dequeue( int status )
 {
 	pfab_sched_data_t* pfab_data = qdisc_priv(sch);
@@ -63,6 +124,53 @@ static void set_limit( __u32 limit )
 	pr_info("Limit set to %u\n", limit);
 }
 
+/* Re-creates a qdisc with the given options, for options that can only
+   be set when the qdisc is added. */
+static int reinit_qdisc( struct Qdisc* q, tc_pfabric_qopt_t* qopt )
+{
+	struct {
+		struct nlattr nla;
+		tc_pfabric_qopt_t qopt;
+	} opt;
+
+	opt.nla.nla_len = nla_attr_size(sizeof(*qopt));
+	opt.nla.nla_type = TCA_OPTIONS;
+	opt.qopt = *qopt;
+
+	/* Callers that fill the whole structure set all the options */
+	if (0 == opt.qopt.present) {
+		opt.qopt.present = TC_PFABRIC_OPT_ALL;
+	}
+
+	pfab_qdisc_ops.destroy(q);
+	return pfab_qdisc_ops.init(q, &opt.nla);
+}
+
+/* Changes the options of the live qdisc, as tc qdisc change does. */
+static int change( tc_pfabric_qopt_t* qopt )
+{
+	struct {
+		struct nlattr nla;
+		tc_pfabric_qopt_t qopt;
+	} opt;
+
+	opt.nla.nla_len = nla_attr_size(sizeof(*qopt));
+	opt.nla.nla_type = TCA_OPTIONS;
+	opt.qopt = *qopt;
+
+	/* Callers that fill the whole structure set all the options */
+	if (0 == opt.qopt.present) {
+		opt.qopt.present = TC_PFABRIC_OPT_ALL;
+	}
+
+	return pfab_qdisc_ops.change(sch, &opt.nla);
+}
+
+static int reinit( tc_pfabric_qopt_t* qopt )
+{
+	return reinit_qdisc(sch, qopt);
+}
+
 int setup( void )
 {
 	struct net_device* netdev = NULL;
@@ -140,6 +248,9 @@ int drop_test( void )
 {
 	int retval;
 	struct sk_buff* skb = NULL;
+	pfab_sched_data_t* pfab_data = qdisc_priv(sch);
+	struct pfab_stat_data stats;
+	struct pfab_band_stats band_stats;
 
 	pr_info("drop_test\n");
 
@@ -190,9 +301,777 @@ int drop_test( void )
 
 	kfree_skb(skb);
 
+	/* Priority 2 was refused on arrival, priorities 0 and 1 were evicted */
+	pfab_stats_read(pfab_data, &stats);
+	if (1 != stats.drops || 2 != stats.evictions) {
+		pr_err("Expected 1 drop and 2 evictions but got %u and %u\n",
+			   stats.drops, stats.evictions);
+		return -3;
+	}
+
+	pfab_stats_read_band(pfab_data, 2, &band_stats);
+	if (1 != band_stats.drops || 0 != band_stats.evictions) {
+		pr_err("Band 2: expected 1 drop but got %u drops and %u evictions\n",
+			   band_stats.drops, band_stats.evictions);
+		return -4;
+	}
+
+	if (0 != pfab_data->band_backlog[0]) {
+		pr_err("Band 0 backlog expected to be empty\n");
+		return -5;
+	}
+
 	return 0;
 } /* end of drop_test */
 
+int priority_order_test( void )
+{
+	static const __u8 priorities[] = { 7, 31, 0, 12, 7, 1 };
+	struct sk_buff* skb = NULL;
+	int retval;
+	int i;
+	int last = -1;
+
+	pr_info("priority_order_test\n");
+
+	set_limit(DEFAULT_LIMIT);
+	disable_dequeue(0);
+
+	for (i = 0; i < ARRAY_SIZE(priorities); i++) {
+		ALLOC_SKB(skb, priorities[i]);
+		retval = pfab_qdisc_ops.enqueue(skb, sch);
+		if (NET_XMIT_SUCCESS != retval) {
+			pr_err("Expected %d but got %d\n", NET_XMIT_SUCCESS, retval);
+			return -EINVAL;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(priorities); i++) {
+		skb = pfab_qdisc_ops.dequeue(sch);
+		if (NULL == skb) {
+			pr_err("Failed dequeuing packet %d\n", i);
+			return -2;
+		}
+
+		if (ip_hdr(skb)->tos < last) {
+			pr_err("Dequeued priority %u after %d\n", ip_hdr(skb)->tos, last);
+			kfree_skb(skb);
+			return -3;
+		}
+
+		last = ip_hdr(skb)->tos;
+		kfree_skb(skb);
+	}
+
+	if (NULL != pfab_qdisc_ops.dequeue(sch)) {
+		pr_err("Queue expected to be empty\n");
+		return -4;
+	}
+
+	return 0;
+} /* end of priority_order_test */
+
+/* Dequeues packets and checks their TOS against the expected order. */
+static int expect_order( const __u8* expected, int count )
+{
+	struct sk_buff* skb = NULL;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		skb = pfab_qdisc_ops.dequeue(sch);
+		if (NULL == skb) {
+			pr_err("Failed dequeuing packet %d\n", i);
+			return -2;
+		}
+
+		if (ip_hdr(skb)->tos != expected[i]) {
+			pr_err("Packet %d: expected priority %u but got %u\n",
+				   i, expected[i], ip_hdr(skb)->tos);
+			kfree_skb(skb);
+			return -3;
+		}
+
+		kfree_skb(skb);
+	}
+
+	if (NULL != pfab_qdisc_ops.dequeue(sch)) {
+		pr_err("Queue expected to be empty\n");
+		return -4;
+	}
+
+	return 0;
+}
+
+int heap_order_test( void )
+{
+	static const __u8 expected[] = { 1, 3, 3, 200 };
+	tc_pfabric_qopt_t qopt = { .limit = 4, .mode = PFAB_MODE_HEAP };
+	struct sk_buff* skb = NULL;
+	int retval;
+
+	pr_info("heap_order_test\n");
+
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed switching to heap mode (%d)\n", retval);
+		return retval;
+	}
+
+	/* Priorities beyond the bands are kept as is in heap mode */
+	ALLOC_SKB(skb, 200);
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_SKB(skb, 3);
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_SKB(skb, 250);
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_SKB(skb, 1);
+	pfab_qdisc_ops.enqueue(skb, sch);
+
+	/* The buffer is full, this one evicts 250 */
+	ALLOC_SKB(skb, 3);
+	retval = pfab_qdisc_ops.enqueue(skb, sch);
+	if (NET_XMIT_CN != retval) {
+		pr_err("Expected %d but got %d\n", NET_XMIT_CN, retval);
+		return -EINVAL;
+	}
+
+	return expect_order(expected, ARRAY_SIZE(expected));
+} /* end of heap_order_test */
+
+int flow_order_test( void )
+{
+	/* Flow A sends 20 then 2, flow B sends 5. The highest priority
+	   packet is A's 2, so A's earliest packet is sent first. */
+	static const __u8 expected[] = { 20, 2, 5 };
+	tc_pfabric_qopt_t qopt = { .limit = DEFAULT_LIMIT, .flows = 64 };
+	struct sk_buff* skb = NULL;
+	int retval;
+
+	pr_info("flow_order_test\n");
+
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed enabling flow ordering (%d)\n", retval);
+		return retval;
+	}
+
+	ALLOC_FLOW_SKB(skb, 20, htonl(0x0a000002));
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_FLOW_SKB(skb, 2, htonl(0x0a000002));
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_FLOW_SKB(skb, 5, htonl(0x0a000003));
+	pfab_qdisc_ops.enqueue(skb, sch);
+
+	return expect_order(expected, ARRAY_SIZE(expected));
+} /* end of flow_order_test */
+
+int flow_table_test( void )
+{
+	/* With room for two flows, C takes the entry of A, which went idle
+	   first, and D finds both entries busy and shares the overflow one. */
+	static const __u8 expected[] = { 1, 5, 30 };
+	tc_pfabric_qopt_t qopt = { .limit = DEFAULT_LIMIT, .flows = 2 };
+	pfab_sched_data_t* pfab_data = NULL;
+	struct pfab_stat_data stats;
+	struct sk_buff* skb = NULL;
+	int retval;
+
+	pr_info("flow_table_test\n");
+
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed enabling flow ordering (%d)\n", retval);
+		return retval;
+	}
+
+	pfab_data = qdisc_priv(sch);
+	ALLOC_FLOW_SKB(skb, 10, htonl(0x0a00000a));
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_FLOW_SKB(skb, 20, htonl(0x0a00000b));
+	pfab_qdisc_ops.enqueue(skb, sch);
+	kfree_skb(pfab_qdisc_ops.dequeue(sch));
+	kfree_skb(pfab_qdisc_ops.dequeue(sch));
+
+	ALLOC_FLOW_SKB(skb, 5, htonl(0x0a00000c));
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_FLOW_SKB(skb, 30, htonl(0x0a00000b));
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_FLOW_SKB(skb, 1, htonl(0x0a00000d));
+	pfab_qdisc_ops.enqueue(skb, sch);
+
+	pfab_stats_read(pfab_data, &stats);
+	if (2 != pfab_data->flow_table.count || 1 != stats.flow_evictions ||
+		1 != stats.flow_overflows) {
+		pr_err("Expected 2 flows, 1 eviction and 1 overflow but got "
+			   "%u, %u and %u\n", pfab_data->flow_table.count,
+			   stats.flow_evictions, stats.flow_overflows);
+		return -1;
+	}
+
+	return expect_order(expected, ARRAY_SIZE(expected));
+} /* end of flow_table_test */
+
+int byte_limit_test( void )
+{
+	static const __u8 expected[] = { 1, 5, 6 };
+	const __u32 packet_len = ETH_HEADER_LEN + IP_HEADER_LEN;
+	tc_pfabric_qopt_t qopt = { .limit = DEFAULT_LIMIT,
+							   .limit_bytes = 3 * packet_len };
+	struct sk_buff* skb = NULL;
+	int retval;
+
+	pr_info("byte_limit_test\n");
+
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed setting a byte limit (%d)\n", retval);
+		return retval;
+	}
+
+	ALLOC_SKB(skb, 5);
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_SKB(skb, 6);
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_SKB(skb, 7);
+	pfab_qdisc_ops.enqueue(skb, sch);
+
+	/* The buffer is full in bytes, this one evicts 7 */
+	ALLOC_SKB(skb, 1);
+	retval = pfab_qdisc_ops.enqueue(skb, sch);
+	if (NET_XMIT_CN != retval) {
+		pr_err("Expected %d but got %d\n", NET_XMIT_CN, retval);
+		return -EINVAL;
+	}
+
+	/* Lower priority than everything in the buffer */
+	ALLOC_SKB(skb, 9);
+	retval = pfab_qdisc_ops.enqueue(skb, sch);
+	if (NET_XMIT_DROP != retval) {
+		pr_err("Expected %d but got %d\n", NET_XMIT_DROP, retval);
+		return -EINVAL;
+	}
+
+	if (sch->qstats.backlog != qopt.limit_bytes) {
+		pr_err("Expected backlog %u but got %u\n",
+			   qopt.limit_bytes, sch->qstats.backlog);
+		return -5;
+	}
+
+	retval = expect_order(expected, ARRAY_SIZE(expected));
+	if (retval < 0) {
+		return retval;
+	}
+
+	if (0 != sch->qstats.backlog) {
+		pr_err("Backlog expected to be empty but is %u\n", sch->qstats.backlog);
+		return -6;
+	}
+
+	return 0;
+} /* end of byte_limit_test */
+
+int shared_buffer_test( void )
+{
+	static const __u8 expected[] = { 1 };
+	tc_pfabric_qopt_t qopt = { .limit = DEFAULT_LIMIT, .shared_limit = 2 };
+	struct Qdisc* other = NULL;
+	struct sk_buff* skb = NULL;
+	int retval;
+
+	pr_info("shared_buffer_test\n");
+
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed sharing the buffer (%d)\n", retval);
+		return retval;
+	}
+
+	/* A second instance on the same device, as for another TX queue */
+	other = qdisc_create_dflt(sch->dev_queue, &pfab_qdisc_ops, 0);
+	if (NULL == other) {
+		pr_err("Failed allocating qdisc\n");
+		return -1;
+	}
+
+	retval = reinit_qdisc(other, &qopt);
+	if (retval < 0) {
+		pr_err("Failed sharing the buffer (%d)\n", retval);
+		goto shared_teardown;
+	}
+
+	ALLOC_SKB(skb, 5);
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_SKB(skb, 6);
+	pfab_qdisc_ops.enqueue(skb, other);
+
+	/* The shared buffer is full and 6 is queued in the other instance */
+	ALLOC_SKB(skb, 7);
+	retval = pfab_qdisc_ops.enqueue(skb, sch);
+	if (NET_XMIT_DROP != retval) {
+		pr_err("Expected %d but got %d\n", NET_XMIT_DROP, retval);
+		retval = -2;
+		goto shared_teardown;
+	}
+
+	/* Admitted, and makes room by evicting the local 5 */
+	ALLOC_SKB(skb, 1);
+	retval = pfab_qdisc_ops.enqueue(skb, sch);
+	if (NET_XMIT_CN != retval) {
+		pr_err("Expected %d but got %d\n", NET_XMIT_CN, retval);
+		retval = -3;
+		goto shared_teardown;
+	}
+
+	if (1 != other->q.qlen) {
+		pr_err("Expected 1 packet in the other instance, got %u\n",
+			   other->q.qlen);
+		retval = -4;
+		goto shared_teardown;
+	}
+
+	retval = expect_order(expected, ARRAY_SIZE(expected));
+
+shared_teardown:
+	qdisc_destroy(other);
+	return retval;
+} /* end of shared_buffer_test */
+
+int live_change_test( void )
+{
+	static const __u8 expected[] = { 1, 5 };
+	tc_pfabric_qopt_t qopt = { .limit = 4, .bands = 32 };
+	pfab_sched_data_t* pfab_data = qdisc_priv(sch);
+	struct sk_buff* skb = NULL;
+	int retval;
+
+	pr_info("live_change_test\n");
+
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed re-creating the qdisc (%d)\n", retval);
+		return retval;
+	}
+
+	ALLOC_SKB(skb, 20);
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_SKB(skb, 1);
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_SKB(skb, 5);
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_SKB(skb, 9);
+	pfab_qdisc_ops.enqueue(skb, sch);
+
+	/* 9 and 20 now share the last band, and are evicted to fit the new
+	   limit. The other packets stay in the buffer. */
+	qopt.limit = 2;
+	qopt.bands = 8;
+	retval = change(&qopt);
+	if (retval < 0) {
+		pr_err("Failed changing the qdisc (%d)\n", retval);
+		return retval;
+	}
+
+	if (8 != pfab_data->bands || 2 != sch->q.qlen) {
+		pr_err("Expected 8 bands and 2 packets, got %u bands and %u packets\n",
+			   pfab_data->bands, sch->q.qlen);
+		return -5;
+	}
+
+	return expect_order(expected, ARRAY_SIZE(expected));
+} /* end of live_change_test */
+
+int partial_change_test( void )
+{
+	tc_pfabric_qopt_t qopt = { .limit = 4, .limit_bytes = 6000,
+							   .mode = PFAB_MODE_HEAP, .mark_threshold = 3 };
+	pfab_sched_data_t* pfab_data = qdisc_priv(sch);
+	int retval;
+
+	pr_info("partial_change_test\n");
+
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed re-creating the qdisc (%d)\n", retval);
+		return retval;
+	}
+
+	/* As tc qdisc change limit 8: the mode, which can not change on the
+	   fly, and the other options are kept */
+	memset(&qopt, 0, sizeof(qopt));
+	qopt.limit = 8;
+	qopt.present = TC_PFABRIC_OPT_LIMIT;
+	retval = change(&qopt);
+	if (retval < 0) {
+		pr_err("Failed changing the limit alone (%d)\n", retval);
+		return retval;
+	}
+
+	if (8 != pfab_data->limit || 6000 != pfab_data->limit_bytes ||
+		PFAB_MODE_HEAP != pfab_data->mode || 3 != pfab_data->mark_threshold) {
+		pr_err("Expected limit 8, limit_bytes 6000, heap mode and mark "
+			   "threshold 3, got %u, %u, %u and %u\n", pfab_data->limit,
+			   pfab_data->limit_bytes, pfab_data->mode,
+			   pfab_data->mark_threshold);
+		return -5;
+	}
+
+	return 0;
+} /* end of partial_change_test */
+
+int remap_priority_test( void )
+{
+	/* Both packets arrive in the last of 32 bands, and are moved to
+	   bands 40 and 35 by the change, by their skb->priority */
+	static const __u8 expected[] = { 2, 1 };
+	tc_pfabric_qopt_t qopt = { .limit = DEFAULT_LIMIT, .bands = 32,
+							   .prio_source = PFAB_PRIO_SKB_PRIORITY };
+	struct sk_buff* skb = NULL;
+	int retval;
+
+	pr_info("remap_priority_test\n");
+
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed re-creating the qdisc (%d)\n", retval);
+		return retval;
+	}
+
+	ALLOC_SKB(skb, 1);
+	skb->priority = 40;
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_SKB(skb, 2);
+	skb->priority = 35;
+	pfab_qdisc_ops.enqueue(skb, sch);
+
+	qopt.bands = 64;
+	retval = change(&qopt);
+	if (retval < 0) {
+		pr_err("Failed changing the qdisc (%d)\n", retval);
+		return retval;
+	}
+
+	/* The band is not written over the packet's priority */
+	skb = pfab_qdisc_ops.peek(sch);
+	if (NULL == skb || 35 != skb->priority) {
+		pr_err("Expected skb->priority 35 to be kept\n");
+		return -5;
+	}
+
+	return expect_order(expected, ARRAY_SIZE(expected));
+} /* end of remap_priority_test */
+
+int mark_test( void )
+{
+	/* The band is the TOS without its ECN bits. The third packet of band 5
+	   exceeds the threshold and is marked CE; the packets of band 1 only
+	   count the band 1 backlog, and the last one is not ECT. */
+	static const __u8 expected[] = { 6, 6, 4, 22, 22, 23 };
+	static const __u8 sent[] = { 22, 22, 22, 6, 6, 4 };
+	tc_pfabric_qopt_t qopt = { .limit = DEFAULT_LIMIT, .prio_shift = 2,
+							   .mark_threshold = 2,
+							   .mark_by = PFAB_MARK_PRIO };
+	pfab_sched_data_t* pfab_data = NULL;
+	struct pfab_stat_data stats;
+	struct sk_buff* skb = NULL;
+	int retval;
+	int i;
+
+	pr_info("mark_test\n");
+
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed enabling marking (%d)\n", retval);
+		return retval;
+	}
+
+	pfab_data = qdisc_priv(sch);
+	for (i = 0; i < ARRAY_SIZE(sent); i++) {
+		ALLOC_SKB(skb, sent[i]);
+		retval = pfab_qdisc_ops.enqueue(skb, sch);
+		if (NET_XMIT_SUCCESS != retval) {
+			pr_err("Expected %d but got %d\n", NET_XMIT_SUCCESS, retval);
+			return -EINVAL;
+		}
+	}
+
+	pfab_stats_read(pfab_data, &stats);
+	if (1 != stats.marks) {
+		pr_err("Expected 1 mark but got %u\n", stats.marks);
+		return -1;
+	}
+
+	return expect_order(expected, ARRAY_SIZE(expected));
+} /* end of mark_test */
+
+int rate_test( void )
+{
+	/* At one packet per second, the first packet leaves at once and the
+	   next ones wait for the watchdog until the rate is lifted */
+	static const __u8 expected[] = { 2, 3 };
+	tc_pfabric_qopt_t qopt = { .limit = DEFAULT_LIMIT,
+							   .rate = ETH_HEADER_LEN + IP_HEADER_LEN };
+	struct sk_buff* skb = NULL;
+	int retval;
+
+	pr_info("rate_test\n");
+
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed setting the rate (%d)\n", retval);
+		return retval;
+	}
+
+	ALLOC_SKB(skb, 3);
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_SKB(skb, 1);
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_SKB(skb, 2);
+	pfab_qdisc_ops.enqueue(skb, sch);
+
+	skb = pfab_qdisc_ops.dequeue(sch);
+	if (NULL == skb || 1 != ip_hdr(skb)->tos) {
+		pr_err("Expected priority 1 to be sent at once\n");
+		kfree_skb(skb);
+		return -1;
+	}
+	kfree_skb(skb);
+
+	skb = pfab_qdisc_ops.dequeue(sch);
+	if (NULL != skb || 2 != sch->q.qlen || 0 == sch->qstats.overlimits) {
+		pr_err("Expected the next packets to be held\n");
+		kfree_skb(skb);
+		return -2;
+	}
+
+	/* A parent that peeks first must not see them either */
+	if (NULL != pfab_qdisc_ops.peek(sch)) {
+		pr_err("Expected no packet to peek while the rate holds them\n");
+		return -3;
+	}
+
+	qopt.rate = 0;
+	retval = change(&qopt);
+	if (retval < 0) {
+		pr_err("Failed lifting the rate (%d)\n", retval);
+		return retval;
+	}
+
+	return expect_order(expected, ARRAY_SIZE(expected));
+} /* end of rate_test */
+
+int batch_test( void )
+{
+	/* The batch option was removed, a tc that sends it is refused and
+	   the qdisc keeps its packets */
+	static const __u8 expected[] = { 1, 5 };
+	tc_pfabric_qopt_t qopt = { .limit = DEFAULT_LIMIT };
+	struct sk_buff* skb = NULL;
+	int retval;
+
+	pr_info("batch_test\n");
+
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed resetting the qdisc (%d)\n", retval);
+		return retval;
+	}
+
+	ALLOC_SKB(skb, 5);
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_SKB(skb, 1);
+	pfab_qdisc_ops.enqueue(skb, sch);
+
+	qopt.batch = 65536;
+	retval = change(&qopt);
+	if (-EINVAL != retval) {
+		pr_err("Expected batch to be refused but got %d\n", retval);
+		return -EINVAL;
+	}
+
+	return expect_order(expected, ARRAY_SIZE(expected));
+} /* end of batch_test */
+
+/* UDP and VXLAN headers, then half an Ethernet header */
+#define VXLAN_TRUNCATED_LEN (8 + 8 + ETH_ALEN)
+#define VXLAN_ETH_LEN (8 + 8 + ETH_HEADER_LEN)
+
+int tunnel_test( void )
+{
+	/* The inner header sets the priority, IPv4 or IPv6 */
+	static const __u8 expected[] = { 2, 3, 1 };
+	static const int vxlan_len[] = { VXLAN_TRUNCATED_LEN, VXLAN_ETH_LEN,
+									 VXLAN_ETH_LEN };
+	static const __u8 vxlan_flags[] = { 0x08, 0, 0x08 };
+	tc_pfabric_qopt_t qopt = { .limit = DEFAULT_LIMIT };
+	struct sk_buff* skb = NULL;
+	struct udphdr* udp_header = NULL;
+	struct ethhdr* inner_eth = NULL;
+	struct pfab_pkt_info info;
+	struct pfab_flow_key key;
+	int retval;
+	int i;
+
+	pr_info("tunnel_test\n");
+
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed resetting the qdisc (%d)\n", retval);
+		return retval;
+	}
+
+	ALLOC_TUNNEL_SKB(skb, 1, 30, 0);
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_TUNNEL_SKB(skb, 2, 10, 1);
+	pfab_qdisc_ops.enqueue(skb, sch);
+	ALLOC_TUNNEL_SKB(skb, 3, 20, 0);
+	pfab_qdisc_ops.enqueue(skb, sch);
+
+	retval = expect_order(expected, ARRAY_SIZE(expected));
+	if (retval < 0) {
+		return retval;
+	}
+
+	/* A VXLAN packet cut short in the inner Ethernet header, UDP
+	   traffic to the VXLAN port without the VXLAN I flag, and a VXLAN
+	   packet without the inner IP header its Ethernet header announces
+	   keep the outer ports rather than bytes of the payload read as
+	   ports */
+	for (i = 0; i < ARRAY_SIZE(vxlan_len); i++) {
+		ALLOC_SKB(skb, 0);
+		ip_hdr(skb)->protocol = IPPROTO_UDP;
+		udp_header = (struct udphdr*) skb_put(skb, vxlan_len[i]);
+		memset(udp_header, 0, vxlan_len[i]);
+		memset(udp_header + 1, vxlan_flags[i], 1);
+		if (VXLAN_ETH_LEN == vxlan_len[i]) {
+			inner_eth = (struct ethhdr*) ((__u8*) udp_header + 8 + 8);
+			inner_eth->h_proto = htons(ETH_P_IP);
+		}
+		udp_header->source = htons(1000);
+		udp_header->dest = htons(PFAB_VXLAN_PORT);
+		pfab_classify(skb, &info, &key);
+		kfree_skb(skb);
+		if (((const __be16 *) &key.ports)[0] != htons(1000) ||
+			((const __be16 *) &key.ports)[1] != htons(PFAB_VXLAN_PORT) ||
+			htons(ETH_P_IP) != key.l3proto ||
+			(info.flags & PFAB_PKT_TUNNEL)) {
+			pr_err("Expected the outer header and ports, got ports %08x\n",
+				   ntohl(key.ports));
+			return -5 - i;
+		}
+	}
+
+	return 0;
+} /* end of tunnel_test */
+
+int pcp_test( void )
+{
+	/* Untagged packets take the highest priority, as non-IP ones do
+	   with the IP sources */
+	static const __u8 expected[] = { 2, 4, 3, 1 };
+	static const __u8 pcp[] = { 5, 0, 3 };
+	tc_pfabric_qopt_t qopt = { .limit = DEFAULT_LIMIT,
+							   .prio_source = PFAB_PRIO_PCP };
+	struct sk_buff* skb = NULL;
+	int retval;
+	int i;
+
+	pr_info("pcp_test\n");
+
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed taking the priority from the tag (%d)\n", retval);
+		return retval;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(pcp); i++) {
+		ALLOC_SKB(skb, i + 1);
+		skb->vlan_tci = VLAN_TAG_PRESENT | (pcp[i] << VLAN_PRIO_SHIFT);
+		pfab_qdisc_ops.enqueue(skb, sch);
+	}
+	ALLOC_SKB(skb, 4);
+	pfab_qdisc_ops.enqueue(skb, sch);
+
+	return expect_order(expected, ARRAY_SIZE(expected));
+} /* end of pcp_test */
+
+int events_test( void )
+{
+	/* Priority 3 is dropped on arrival, then 2 is evicted by 0. Both
+	   are reported in the pending batch, with the addresses of the
+	   arriving packet and of the flow entry of the queued one. */
+	static const __u8 expected[] = { 0, 1 };
+	static const __u8 sent[] = { 1, 2, 3, 0 };
+	tc_pfabric_qopt_t qopt = { .limit = 2, .events = 100, .flows = 16 };
+	pfab_sched_data_t* pfab_data = NULL;
+	struct pfab_event* event = NULL;
+	struct sk_buff* skb = NULL;
+	int retval;
+	int i;
+
+	pr_info("events_test\n");
+
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed enabling events (%d)\n", retval);
+		return retval;
+	}
+
+	pfab_data = qdisc_priv(sch);
+	for (i = 0; i < ARRAY_SIZE(sent); i++) {
+		ALLOC_FLOW_SKB(skb, sent[i], htonl(0x0a000010 + sent[i]));
+		pfab_qdisc_ops.enqueue(skb, sch);
+	}
+
+	if (2 != pfab_data->events.count) {
+		pr_err("Expected 2 events but got %u\n", pfab_data->events.count);
+		return -1;
+	}
+
+	event = &pfab_data->events.batch[0];
+	if (PFAB_EVENT_DROP != event->type || 3 != event->prio ||
+		2 != event->qlen || htonl(0x0a000013) != event->saddr[0]) {
+		pr_err("Unexpected drop event: type %u, prio %u, qlen %u\n",
+			   event->type, event->prio, event->qlen);
+		return -2;
+	}
+
+	event = &pfab_data->events.batch[1];
+	if (PFAB_EVENT_EVICT != event->type || 2 != event->prio ||
+		3 != event->qlen || htonl(0x0a000012) != event->saddr[0]) {
+		pr_err("Unexpected eviction event: type %u, prio %u, qlen %u\n",
+			   event->type, event->prio, event->qlen);
+		return -3;
+	}
+
+	return expect_order(expected, ARRAY_SIZE(expected));
+} /* end of events_test */
+
+int failed_init_test( void )
+{
+	tc_pfabric_qopt_t qopt = { .limit = 4, .bands = MAX_BANDS + 1 };
+	int retval;
+
+	pr_info("failed_init_test\n");
+
+	retval = reinit(&qopt);
+	if (retval >= 0) {
+		pr_err("Expected %d bands to be rejected\n", (int) MAX_BANDS + 1);
+		return -EINVAL;
+	}
+
+	/* As qdisc_destroy() does after qdisc_create_dflt() failed */
+	pfab_qdisc_ops.reset(sch);
+
+	qopt.bands = 8;
+	retval = reinit(&qopt);
+	if (retval < 0) {
+		pr_err("Failed re-creating the qdisc (%d)\n", retval);
+		return retval;
+	}
+
+	return 0;
+} /* end of failed_init_test */
+
 int run_tests( void )
 {
 	int retval;
@@ -214,6 +1093,102 @@ int run_tests( void )
 	retval = drop_test();
 	if (retval < 0) {
 		pr_err("drop_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = priority_order_test();
+	if (retval < 0) {
+		pr_err("priority_order_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = heap_order_test();
+	if (retval < 0) {
+		pr_err("heap_order_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = flow_order_test();
+	if (retval < 0) {
+		pr_err("flow_order_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = flow_table_test();
+	if (retval < 0) {
+		pr_err("flow_table_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = byte_limit_test();
+	if (retval < 0) {
+		pr_err("byte_limit_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = shared_buffer_test();
+	if (retval < 0) {
+		pr_err("shared_buffer_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = live_change_test();
+	if (retval < 0) {
+		pr_err("live_change_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = partial_change_test();
+	if (retval < 0) {
+		pr_err("partial_change_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = remap_priority_test();
+	if (retval < 0) {
+		pr_err("remap_priority_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = mark_test();
+	if (retval < 0) {
+		pr_err("mark_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = rate_test();
+	if (retval < 0) {
+		pr_err("rate_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = batch_test();
+	if (retval < 0) {
+		pr_err("batch_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = tunnel_test();
+	if (retval < 0) {
+		pr_err("tunnel_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = pcp_test();
+	if (retval < 0) {
+		pr_err("pcp_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = events_test();
+	if (retval < 0) {
+		pr_err("events_test failed (%d)\n", retval);
+		goto tests_teardown;
+	}
+
+	retval = failed_init_test();
+	if (retval < 0) {
+		pr_err("failed_init_test failed (%d)\n", retval);
 	}
 
 tests_teardown:
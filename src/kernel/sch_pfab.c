@@ -13,130 +13,540 @@
 #include <linux/errno.h>
 #include <linux/skbuff.h>
 #include <net/netlink.h> 
-#include <linux/ip.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <net/inet_ecn.h>
 #include "sch_pfab.h"
 #include "stats.h"
+#include "pfab_group.h"
+#include "pfab_classify.h"
+#include "pfab_events.h"
 
 
-#define BAND_TO_BIT_AND_BMAP(band, bit, b_map) do {		\
-	bit = band % BANDS_IN_BITMAP;						\
-	b_map = band / BANDS_IN_BITMAP;			 			\
-} while (0)
-
-#ifdef PFABRIC_TESTS
+/* The qdisc functions are also called by the tests, the benchmark and
+   the userspace build (see user/). */
+#if defined(PFABRIC_TESTS) || defined(PFABRIC_BENCH) || defined(PFABRIC_USER)
 #define STATIC
-extern int run_tests( void );
 #else
 #define STATIC static
 #endif
 
+#ifdef PFABRIC_TESTS
+extern int run_tests( void );
+#endif
+
 /* Function Prototypes. */
 static unsigned int pfab_drop(struct Qdisc *sch);
 
-/* TODO: In the future we will need a list of these. */
-struct pfab_stat_data pfab_stats;
-
 static inline struct sk_buff_head*
 band2list(pfab_sched_data_t* pfab, int band)
 {
 	return pfab->queues + band;
 }
 
+/* Tells whether adding packets and bytes to the buffer would exceed
+   either the packet or the byte limit. */
+static inline int pfab_exceeds_limit(pfab_sched_data_t *pfab_data,
+									 struct Qdisc *sch,
+									 u32 packets, u32 bytes)
+{
+	if (skb_queue_len(&sch->q) + packets > pfab_data->limit) {
+		return 1;
+	}
+
+	return pfab_data->limit_bytes &&
+		sch->qstats.backlog + bytes > pfab_data->limit_bytes;
+}
+
+/* Tells whether the buffer shared with the other instances of the device
+   is full, without this instance's last changes. Always false when the
+   buffer is not shared. */
+static inline int pfab_shared_full(pfab_sched_data_t *pfab_data)
+{
+	return pfab_data->group &&
+		pfab_group_qlen(pfab_data->group) >= pfab_data->group->limit;
+}
+
+/* Tells whether some other instance sharing the buffer holds a packet
+   of priority value lower or equal to prio. */
+static inline int pfab_shared_lower(pfab_sched_data_t *pfab_data, u32 prio)
+{
+	u32 lowest;
+
+	return 0 == pfab_group_lowest(pfab_data->group, &lowest) &&
+		lowest <= prio;
+}
+
 /* Returns the highest priority band that is not empty, given pfab schedule data. */
-//TODO: Optimize.
-static int bitmap_high_prio(pfab_sched_data_t *pfab_data) 
+static inline int bitmap_high_prio(pfab_sched_data_t *pfab_data) 
 {
-	int i, j;
-	u32 mask = 1;
-	int high_prio = -1;
-	
-	BUG_ON(!pfab_data);
+	int high_prio;
 
-	for (i = 0; i < BITMAP_SIZE; i++) {
-		if (0 == pfab_data->bitmap[i]) {
-			continue;
-		}
-		
-		for (j = 0; j < BANDS_IN_BITMAP; j++) {
-			if (pfab_data->bitmap[i] & (mask << j)) {
-				high_prio = i * BANDS_IN_BITMAP + j; /* i * 32 + j */
-				TRACE( printk("Highest enqueued priority: %d\n", high_prio) );
-				return high_prio;
-			}
-		}
-	}	
+	BUG_ON(!pfab_data);
 
-	return -1;
+	high_prio = pfab_bitmap_first(&pfab_data->bitmap);
+	TRACE( printk("Highest enqueued priority: %d\n", high_prio) );
+	return high_prio;
 } 
 
 /* Returns the lowest priority band that is not empty, given pfab schedule data. */
-//TODO: Optimize.
-static int bitmap_low_prio(pfab_sched_data_t *pfab_data) 
+static inline int bitmap_low_prio(pfab_sched_data_t *pfab_data) 
 {
-	int i, j;
-	u32 mask = 1;
-	int low_prio = -1;
+	int low_prio;
 
 	BUG_ON(!pfab_data);
-	
-	for (i = BITMAP_SIZE - 1; i >= 0; i--) {
-		if (0 == pfab_data->bitmap[i]) {
-			continue;
-		}
-		
-		for (j = BANDS_IN_BITMAP - 1; j >= 0; j--) {
-			if (pfab_data->bitmap[i] & (mask << j)) {
-				low_prio = i * BANDS_IN_BITMAP + j; /* i * 32 + j */
-				TRACE( printk("Lowest enqueued priority: %d\n", low_prio) );
-				return low_prio;
-			}
-		}
-	}
-	
-	return -1;
+
+	low_prio = pfab_bitmap_last(&pfab_data->bitmap);
+	TRACE( printk("Lowest enqueued priority: %d\n", low_prio) );
+	return low_prio;
 } 
 
 /* Updates the bitmap that stores which queues are currently occupied, when a 
    packet was added to a band. */
 static inline void bitmap_add_band(pfab_sched_data_t *pfab_data, int band)
 {
-	int bit, b_map;
-
-	BAND_TO_BIT_AND_BMAP(band, bit, b_map);
-	pfab_data->bitmap[b_map] |= (1 << bit);
-	pfab_stats.bitmap[b_map] = pfab_data->bitmap[b_map];
+	pfab_bitmap_set(&pfab_data->bitmap, band);
 }
 
 /* Updates the bitmap that stores which queues are currently occupied, when 
    the last packet is removed from a band. */
 static inline void bitmap_remove_band(pfab_sched_data_t *pfab_data, u32 band)
 {
-	int bit, b_map;
+	pfab_bitmap_clear(&pfab_data->bitmap, band);
+}
 
-	BAND_TO_BIT_AND_BMAP(band, bit, b_map);
-	pfab_data->bitmap[b_map] &= ~(1 << bit);
-	pfab_stats.bitmap[b_map] = pfab_data->bitmap[b_map];
+/* Counts a packet of len bytes queued in band, per band and per bitmap
+   word. The word counts let pfab_mark() sum the higher priority bands a
+   word at a time. */
+static inline void pfab_band_add(pfab_sched_data_t *pfab_data, u32 band,
+								 unsigned int len)
+{
+	pfab_data->band_backlog[band] += len;
+	pfab_data->word_qlen[BIT_WORD(band)]++;
+	pfab_data->word_backlog[BIT_WORD(band)] += len;
 }
 
-#define ETH_HEADER_LEN (14)
-#define IP_HEADER_LEN (20)
+/* Undoes pfab_band_add() for a packet removed from band. */
+static inline void pfab_band_sub(pfab_sched_data_t *pfab_data, u32 band,
+								 unsigned int len)
+{
+	pfab_data->band_backlog[band] -= len;
+	pfab_data->word_qlen[BIT_WORD(band)]--;
+	pfab_data->word_backlog[BIT_WORD(band)] -= len;
+}
 
-static inline int get_skb_priority(struct sk_buff* skb)
+/* Extracts the raw priority value selected by prio_source, from the
+   fields pfab_classify() found in the packet. Returns -1 if the packet
+   lacks the header the value is taken from. */
+static inline int get_skb_priority(pfab_sched_data_t *pfab_data,
+								   struct sk_buff* skb,
+								   const struct pfab_pkt_info *info, u32 *prio)
 {
-	if (skb->len < (ETH_HEADER_LEN + IP_HEADER_LEN)) {
-		pr_debug("skb length is: %d\n", skb->len);
+	switch (pfab_data->prio_source) {
+	case PFAB_PRIO_SKB_PRIORITY:
+		*prio = skb->priority;
+		return 0;
+	case PFAB_PRIO_MARK:
+		*prio = skb->mark;
+		return 0;
+	case PFAB_PRIO_PCP:
+		if (!(info->flags & PFAB_PKT_VLAN)) {
+			return -1; /* untagged */
+		}
+		*prio = info->pcp;
+		return 0;
+	default:
+		break;
+	}
+
+	if (!(info->flags & PFAB_PKT_IP)) {
 		return -1; /* not an IP packet */
 	}
 
-	return ip_hdr(skb)->tos;
+	*prio = info->dsfield;
+	if (PFAB_PRIO_DSCP == pfab_data->prio_source) {
+		*prio >>= 2;
+	}
+
+	return 0;
 }
 
-STATIC int pfab_enqueue(struct sk_buff *skb, struct Qdisc *sch) 
+static inline u32 prio_to_key(pfab_sched_data_t *pfab_data, u32 prio)
 {
-	int band;
+	return (pfab_data->prio_shift < 32) ? prio >> pfab_data->prio_shift : 0;
+}
+
+/* Returns the priority value of a packet shifted by prio_shift. */
+static inline u32 get_skb_key(pfab_sched_data_t *pfab_data,
+							  struct sk_buff* skb,
+							  const struct pfab_pkt_info *info)
+{
+	u32 prio;
+
+	if (unlikely(get_skb_priority(pfab_data, skb, info, &prio) < 0)) {
+		TRACE( pr_debug("No priority field in packet\n") );
+		PFAB_STATS_INC(pfab_data, non_ip_packet_counter);
+		return 0; /* let all other types through */
+	}
+
+	return prio_to_key(pfab_data, prio);
+}
+
+/* Same as get_skb_key for a packet already in the buffer, which was
+   counted in the statistics when it arrived, from the fields kept when
+   it was parsed. */
+static inline u32 get_queued_skb_key(pfab_sched_data_t *pfab_data,
+									 struct sk_buff* skb)
+{
+	u32 prio;
+
+	if (get_skb_priority(pfab_data, skb, &pfab_skb_cb(skb)->info, &prio) < 0) {
+		return 0;
+	}
+
+	return prio_to_key(pfab_data, prio);
+}
+
+/* Maps a packet to its band according to the qdisc's priority mapping. */
+static inline int get_skb_band(pfab_sched_data_t *pfab_data,
+							   struct sk_buff* skb,
+							   const struct pfab_pkt_info *info)
+{
+	u32 band = get_skb_key(pfab_data, skb, info);
+
+	if (unlikely(band >= pfab_data->bands)) {
+		TRACE( pr_debug("Priority %u beyond last band\n", band) );
+		PFAB_STATS_INC(pfab_data, illegal_prio_occurance);
+		band = pfab_data->bands - 1;
+	}
+
+	return band;
+}
+
+/* Appends a packet to the list of its flow. */
+static inline void pfab_flow_add(pfab_sched_data_t *pfab_data,
+								 struct sk_buff *skb,
+								 const struct pfab_flow_key *key)
+{
+	struct pfab_flow_table *table = &pfab_data->flow_table;
+	struct pfab_skb_cb *cb = pfab_skb_cb(skb);
+	struct pfab_flow *flow = NULL;
+	int reclaimed;
+
+	flow = pfab_flow_get(table, key, &reclaimed);
+	if ( unlikely(reclaimed) ) {
+		PFAB_STATS_INC(pfab_data, flow_evictions);
+	}
+	else if ( unlikely(flow == &table->overflow) ) {
+		PFAB_STATS_INC(pfab_data, flow_overflows);
+	}
+
+	cb->flow = flow->index;
+	cb->flow_link = pfab_flow_append(table, flow, skb);
+
+	if (0 == flow->qlen++) {
+		pfab_flow_busy(table, flow);
+	}
+}
+
+/* Removes a packet from the list of its flow, in constant time: dequeue
+   takes the head of the flow, but an eviction may take any packet. */
+static inline void pfab_flow_remove(pfab_sched_data_t *pfab_data,
+									struct sk_buff *skb)
+{
+	struct pfab_skb_cb *cb = pfab_skb_cb(skb);
+	struct pfab_flow *flow = pfab_flow_at(&pfab_data->flow_table, cb->flow);
+
+	pfab_flow_unlink_packet(&pfab_data->flow_table, flow, cb->flow_link);
+	if (0 == --flow->qlen) {
+		pfab_flow_idle(&pfab_data->flow_table, flow);
+	}
+}
+
+/* Returns the 5-tuple of a queued packet as kept by its flow entry, or
+   NULL if it has none: without a flow table, or in the overflow entry
+   that flows share when the table is full. */
+static inline const struct pfab_flow_key *
+pfab_queued_flow_key(pfab_sched_data_t *pfab_data, struct sk_buff *skb)
+{
+	u32 index = pfab_skb_cb(skb)->flow;
+
+	if (0 == pfab_data->flows || index >= pfab_data->flow_table.capacity) {
+		return NULL;
+	}
+
+	return &pfab_flow_at(&pfab_data->flow_table, index)->key;
+}
+
+/* Returns the packet dequeue sends given the highest priority packet:
+   the earliest packet of the same flow. */
+static inline struct sk_buff *pfab_flow_head(pfab_sched_data_t *pfab_data,
+											 struct sk_buff *best)
+{
+	struct pfab_flow_table *table = &pfab_data->flow_table;
+
+	return pfab_flow_first(table, pfab_flow_at(table, pfab_skb_cb(best)->flow));
+}
+
+/* Dequeue with flow ordering. The earliest packet of the flow may sit in
+   any band, so it is unlinked from the middle of its band queue. */
+static struct sk_buff *pfab_flow_dequeue(struct Qdisc *sch,
+										 struct sk_buff *best)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct sk_buff *skb = pfab_flow_head(pfab_data, best);
+	int band = pfab_skb_cb(skb)->band;
+	struct sk_buff_head *list = band2list(pfab_data, band);
+
+	pfab_flow_remove(pfab_data, skb);
+	__skb_unlink(skb, list);
+	pfab_band_sub(pfab_data, band, qdisc_pkt_len(skb));
+	if (skb_queue_empty(list)) {
+		bitmap_remove_band(pfab_data, band);
+	}
+
+	sch->q.qlen--;
+	sch->qstats.backlog -= qdisc_pkt_len(skb);
+	qdisc_bstats_update(sch, skb);
+	return skb;
+}
+
+/* CE marks a packet that was just queued, if it is ECT and the backlog
+   (with PFAB_MARK_PRIO, of its band and the higher priority ones)
+   exceeds a mark threshold. band is -1 in heap mode. With PFAB_MARK_PRIO
+   the bitmap words before the band's are summed from their counts, so
+   at most two words of set bits are walked whatever the number of
+   bands. */
+static void pfab_mark(pfab_sched_data_t *pfab_data, struct Qdisc *sch,
+					  struct sk_buff *skb, int band)
+{
+	u32 qlen = sch->q.qlen;
+	u32 backlog = sch->qstats.backlog;
+	unsigned long words, bits;
+	int word, first, b;
+
+	if (PFAB_MARK_PRIO == pfab_data->mark_by && band >= 0) {
+		qlen = 0;
+		backlog = 0;
+		word = BIT_WORD(band);
+		first = word * BITS_PER_LONG;
+		words = pfab_data->bitmap.summary & (BIT_MASK(word) - 1);
+		while (words) {
+			b = __ffs(words);
+			words &= words - 1;
+			qlen += pfab_data->word_qlen[b];
+			backlog += pfab_data->word_backlog[b];
+		}
+
+		bits = pfab_data->bitmap.words[word] &
+			(BIT_MASK(band) | (BIT_MASK(band) - 1));
+		while (bits) {
+			b = first + __ffs(bits);
+			bits &= bits - 1;
+			qlen += skb_queue_len(band2list(pfab_data, b));
+			backlog += pfab_data->band_backlog[b];
+		}
+	}
+
+	if ((pfab_data->mark_threshold && qlen > pfab_data->mark_threshold) ||
+		(pfab_data->mark_threshold_bytes &&
+		 backlog > pfab_data->mark_threshold_bytes)) {
+		if (INET_ECN_set_ce(skb)) {
+			PFAB_STATS_INC(pfab_data, marks);
+		}
+	}
+}
+
+static inline int pfab_marking(pfab_sched_data_t *pfab_data)
+{
+	return pfab_data->mark_threshold || pfab_data->mark_threshold_bytes;
+}
+
+/* Drops the packet with the largest key in heap mode. */
+static unsigned int pfab_heap_drop(struct Qdisc *sch)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct sk_buff *skb = NULL;
+	unsigned int len;
+	u32 key;
+
+	if (pfab_heap_empty(&pfab_data->heap)) {
+		pr_alert("no packet to drop\n");
+		return 0;
+	}
+
+	key = pfab_heap_max_key(&pfab_data->heap);
+	skb = pfab_heap_pop_max(&pfab_data->heap);
+	pfab_events_record(&pfab_data->events, PFAB_EVENT_EVICT, skb, NULL, key);
+	len = qdisc_pkt_len(skb);
+	sch->qstats.backlog -= len;
+	kfree_skb(skb);
+	sch->q.qlen--;
+	sch->qstats.drops++;
+	pfab_stats_evicted(pfab_data, -1);
+	return len;
+}
+
+/* Returns NET_XMIT_CN once an arrival evicted packets. The parents do
+   not count a packet enqueued with NET_XMIT_CN, which makes up for one
+   eviction; their qlen is lowered by the others. */
+static inline int pfab_congested(struct Qdisc *sch, unsigned int evicted)
+{
+	if (evicted > 1) {
+		qdisc_tree_decrease_qlen(sch, evicted - 1);
+	}
+
+	return NET_XMIT_CN;
+}
+
+/* Enqueue in heap mode: same admission and eviction rules as the band
+   mode, applied to the full priority value of each packet. */
+static int pfab_heap_enqueue(struct sk_buff *skb, struct Qdisc *sch,
+							 const struct pfab_pkt_info *info,
+							 const struct pfab_flow_key *flow_key)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct pfab_heap *heap = &pfab_data->heap;
+	u32 key = get_skb_key(pfab_data, skb, info);
+	int shared_full = pfab_shared_full(pfab_data);
+	unsigned int evicted = 0;
+
+	if ( unlikely(pfab_exceeds_limit(pfab_data, sch, 1, qdisc_pkt_len(skb))) ) {
+		if ( pfab_heap_empty(heap) || pfab_heap_max_key(heap) <= key ) {
+			pfab_events_record(&pfab_data->events, PFAB_EVENT_DROP, skb,
+							   flow_key, key);
+			pfab_stats_dropped(pfab_data, -1);
+			return qdisc_drop(skb, sch);
+		}
+	}
+	else if ( unlikely(shared_full) && pfab_shared_lower(pfab_data, key) ) {
+		pfab_events_record(&pfab_data->events, PFAB_EVENT_DROP, skb,
+						   flow_key, key);
+		pfab_stats_dropped(pfab_data, -1);
+		return qdisc_drop(skb, sch);
+	}
+
+	pfab_heap_push(heap, key, skb);
+	sch->q.qlen++;
+	sch->qstats.backlog += qdisc_pkt_len(skb);
+	pfab_stats_enqueued(pfab_data, skb, -1);
+	if (pfab_marking(pfab_data)) {
+		pfab_mark(pfab_data, sch, skb, -1);
+	}
+
+	if ( unlikely(pfab_exceeds_limit(pfab_data, sch, 0, 0)) ) {
+		while (pfab_exceeds_limit(pfab_data, sch, 0, 0) && sch->q.qlen) {
+			pfab_heap_drop(sch);
+			evicted++;
+		}
+		return pfab_congested(sch, evicted);
+	}
+
+	/* Make room in the shared buffer if this instance holds a lower
+	   priority packet, otherwise the lowest one is in another instance
+	   and will be evicted by its own arrivals. */
+	if ( unlikely(shared_full) && pfab_heap_max_key(heap) > key ) {
+		pfab_heap_drop(sch);
+		return NET_XMIT_CN;
+	}
+
+	return NET_XMIT_SUCCESS;
+}
+
+static struct sk_buff *pfab_heap_dequeue(struct Qdisc *sch)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct sk_buff *skb = NULL;
+
+	skb = pfab_heap_pop_min(&pfab_data->heap);
+	if (NULL == skb) {
+		return NULL;
+	}
+
+	sch->q.qlen--;
+	sch->qstats.backlog -= qdisc_pkt_len(skb);
+	qdisc_bstats_update(sch, skb);
+	return skb;
+}
+
+static void pfab_heap_purge(struct Qdisc *sch)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct sk_buff *skb = NULL;
+
+	while ((skb = pfab_heap_pop_min(&pfab_data->heap)) != NULL) {
+		kfree_skb(skb);
+	}
+}
+
+/* Makes sure the flow lists can link limit packets plus the one that is
+   linked before an eviction. */
+static int pfab_flow_reserve(struct Qdisc *sch, u32 limit)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct pfab_flow_link *links = NULL;
+	u32 capacity = limit + 1;
+
+	if (unlikely(0 == capacity)) {
+		return -EINVAL;
+	}
+
+	if (capacity <= pfab_data->flow_table.link_capacity) {
+		return 0;
+	}
+
+	links = pfab_flow_alloc_links(capacity);
+	if (NULL == links) {
+		return -ENOMEM;
+	}
+
+	sch_tree_lock(sch);
+	links = pfab_flow_replace_links(&pfab_data->flow_table, links, capacity);
+	sch_tree_unlock(sch);
+
+	pfab_flow_free_links(links);
+	return 0;
+}
+
+/* Makes sure the heap can hold limit packets plus the one that is
+   inserted before an eviction. */
+static int pfab_heap_reserve(struct Qdisc *sch, u32 limit)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct pfab_heap_entry *entries = NULL;
+	u32 capacity = limit + 1;
+
+	if (unlikely(0 == capacity)) {
+		return -EINVAL;
+	}
+
+	if (capacity <= pfab_data->heap.capacity) {
+		return 0;
+	}
+
+	entries = pfab_heap_alloc_entries(capacity);
+	if (NULL == entries) {
+		return -ENOMEM;
+	}
+
+	sch_tree_lock(sch);
+	entries = pfab_heap_replace_entries(&pfab_data->heap, entries, capacity);
+	sch_tree_unlock(sch);
+
+	pfab_heap_free_entries(entries);
+	return 0;
+}
+
+static int __pfab_enqueue(struct sk_buff *skb, struct Qdisc *sch,
+						  const struct pfab_pkt_info *info,
+						  const struct pfab_flow_key *key)
+{
+	int band, low;
 	pfab_sched_data_t *pfab_data = NULL;
 	struct sk_buff_head *list = NULL;
 	int len;
+	int shared_full;
+	unsigned int evicted = 0;
 
 	TRACE( pr_debug("pfab_enqueue called\n") );
 	BUG_ON(!skb);
@@ -145,68 +555,121 @@ STATIC int pfab_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 	pfab_data = qdisc_priv(sch);
 	BUG_ON(!pfab_data);
 
-	band = get_skb_priority(skb);
-	if (unlikely(band < 0)) {
-		TRACE( pr_debug("Not an IP packet\n") );
-		band = 0; /* let all other types through */
-		++pfab_stats.non_ip_packet_counter;
+	if (PFAB_MODE_HEAP == pfab_data->mode) {
+		return pfab_heap_enqueue(skb, sch, info, key);
 	}
 
-	/* Packet seems to be ok, set its priority according to TOS */
-	skb->priority = band;
+	band = get_skb_band(pfab_data, skb, info);
+	pfab_skb_cb(skb)->band = band;
 
-	if (unlikely(skb->priority >= NUM_BANDS || skb->priority < 0)) {
-		pr_warning("Illegal packet priority (%d). Discarding...\n",
-				   skb->priority);
-		++pfab_stats.illegal_prio_occurance;
-		return qdisc_drop(skb, sch);
-	}
-
-	++pfab_stats.per_band_packet_counter[skb->priority];
-
-	TRACE( pr_debug("Enqueuing packet with priority %d\n", skb->priority) );
+	TRACE( pr_debug("Enqueuing packet in band %d\n", band) );
 	TRACE( pr_debug("Queue length = %u, limit = %u\n", 
 					skb_queue_len(&sch->q), pfab_data->limit) );
 	
-	if ( unlikely(skb_queue_len(&sch->q) >= pfab_data->limit) ) {
+	shared_full = pfab_shared_full(pfab_data);
+	if ( unlikely(pfab_exceeds_limit(pfab_data, sch, 1, qdisc_pkt_len(skb))) ) {
 		TRACE( pr_debug("pFabric buffer is full\n") );
-		band = bitmap_low_prio(pfab_data);
-		if ((0 <= band) && (band <= skb->priority))  {
-			pr_debug("Packet has lower priority (%d) than any other "
-					 "in buffer (%d). Dropping...\n", 
-					 skb->priority, band);
+		low = bitmap_low_prio(pfab_data);
+		if ((0 <= low) && (low <= band))  {
+			pfab_events_record(&pfab_data->events, PFAB_EVENT_DROP, skb,
+							   key, band);
+			pfab_stats_dropped(pfab_data, band);
 			return qdisc_drop(skb, sch);
 		}
 	}
+	else if ( unlikely(shared_full) &&
+			  pfab_shared_lower(pfab_data, band) ) {
+		pfab_events_record(&pfab_data->events, PFAB_EVENT_DROP, skb, key,
+						   band);
+		pfab_stats_dropped(pfab_data, band);
+		return qdisc_drop(skb, sch);
+	}
 
 	/* Enqueue the packet. */
-	band = skb->priority;
 	bitmap_add_band(pfab_data, band);
 	sch->q.qlen++;
-	pfab_stats.tc_stats.bytes += skb->len;
-	pfab_stats.tc_stats.packets++;
+	pfab_band_add(pfab_data, band, qdisc_pkt_len(skb));
+	pfab_stats_enqueued(pfab_data, skb, band);
 
 	list = band2list(pfab_data, band);
 	__qdisc_enqueue_tail(skb, sch, list);
+	if (pfab_data->flows) {
+		pfab_flow_add(pfab_data, skb, key);
+	}
+	if (pfab_marking(pfab_data)) {
+		pfab_mark(pfab_data, sch, skb, band);
+	}
 
 	TRACE(pr_debug("New queue len: %u\n", skb_queue_len(&sch->q)));
 
-	/* Drop a packet if we have exceeded buffer limit. */
-	if ( unlikely(skb_queue_len(&sch->q) > pfab_data->limit) ) {
-		pr_debug("Buffer is full. Dropping packet...\n");
-		len = pfab_drop(sch);
-		if ( unlikely(len < 0) ) {
-			pr_alert("ERROR: Failed dropping a packet from an overflown queue\n");
-		}
-		else {
-			return NET_XMIT_CN;
-		}
-	}	
+	/* Drop the lowest priority packets until the buffer is within its
+	   limits again. A large packet may push out several small ones. */
+	if ( unlikely(pfab_exceeds_limit(pfab_data, sch, 0, 0)) ) {
+		do {
+			len = pfab_drop(sch);
+			if ( unlikely(len < 0) ) {
+				pr_alert("ERROR: Failed dropping a packet from an overflown queue\n");
+				return NET_XMIT_SUCCESS;
+			}
+			evicted++;
+		} while (pfab_exceeds_limit(pfab_data, sch, 0, 0));
+
+		return pfab_congested(sch, evicted);
+	}
+
+	/* Same as in heap mode, evict locally only if it makes room for a
+	   higher priority packet. */
+	if ( unlikely(shared_full) && bitmap_low_prio(pfab_data) > band ) {
+		pfab_drop(sch);
+		return NET_XMIT_CN;
+	}
 
 	return NET_XMIT_SUCCESS;
 }
 
-STATIC struct sk_buff *pfab_dequeue(struct Qdisc *sch) 
+/* Lowest priority value queued, as published to the shared buffer. */
+static inline u32 pfab_lowest_prio(pfab_sched_data_t *pfab_data)
+{
+	int band;
+
+	if (PFAB_MODE_HEAP == pfab_data->mode) {
+		return pfab_heap_empty(&pfab_data->heap) ?
+			0 : pfab_heap_max_key(&pfab_data->heap);
+	}
+
+	band = bitmap_low_prio(pfab_data);
+	return band < 0 ? 0 : band;
+}
+
+static inline void pfab_shared_update(struct Qdisc *sch)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+
+	if (pfab_data->group) {
+		pfab_group_publish(pfab_data->group, pfab_data->group_slot,
+						   sch->q.qlen, pfab_lowest_prio(pfab_data));
+	}
+}
+
+STATIC int pfab_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct pfab_pkt_info info;
+	struct pfab_flow_key key;
+	int retval;
+
+	/* The headers are parsed only here, the key only if it is needed */
+	pfab_classify(skb, &info,
+				  pfab_data->flows || pfab_data->events.rate ? &key : NULL);
+	pfab_skb_cb(skb)->info = info;
+	pfab_skb_cb(skb)->enqueue_time = pfab_sojourn_now();
+	retval = __pfab_enqueue(skb, sch, &info, &key);
+
+	pfab_shared_update(sch);
+	return retval;
+}
+
+static struct sk_buff *__pfab_dequeue(struct Qdisc *sch) 
 {
 	pfab_sched_data_t *pfab_data = NULL;
 	int band;
@@ -223,8 +686,12 @@ STATIC struct sk_buff *pfab_dequeue(struct Qdisc *sch)
 		return NULL;
 	}
 
+	if (PFAB_MODE_HEAP == pfab_data->mode) {
+		return pfab_heap_dequeue(sch);
+	}
+
 	band = bitmap_high_prio(pfab_data);
-	BUG_ON(band >= NUM_BANDS);
+	BUG_ON(band >= (int) pfab_data->bands);
 
 	/*TRACE( printk("Highest priority band is %d\n", band) );*/
 
@@ -234,20 +701,120 @@ STATIC struct sk_buff *pfab_dequeue(struct Qdisc *sch)
 		return NULL;
 	}
 
-	/* If there are queued packets, dequeue. */
-	list = band2list(pfab_data, band);
-	skb = __qdisc_dequeue_head(sch, list);
-	if ( unlikely(NULL == skb) ) {
-		pr_warning("ERROR: an skb is expected in band %d\n", band);
-		return NULL;
+	/* If there are queued packets, dequeue. */
+	list = band2list(pfab_data, band);
+	if (pfab_data->flows) {
+		return pfab_flow_dequeue(sch, skb_peek(list));
+	}
+
+	skb = __qdisc_dequeue_head(sch, list);
+	if ( unlikely(NULL == skb) ) {
+		pr_warning("ERROR: an skb is expected in band %d\n", band);
+		return NULL;
+	}
+
+	pfab_band_sub(pfab_data, band, qdisc_pkt_len(skb));
+	sch->q.qlen--;
+	if (skb_queue_empty(list)) {
+		/*TRACE( printk("Band %d empty, removing from bitmap...\n", band) );*/
+		bitmap_remove_band(pfab_data, band);
+	}
+
+	return skb;
+}
+
+/* Precomputes the time to send a byte as a multiplier and a shift, as
+   psched_ratecfg does for tc rates, so that pacing needs no division. */
+static void pfab_rate_set(pfab_sched_data_t *pfab_data, u32 rate, u32 burst)
+{
+	u64 factor = NSEC_PER_SEC;
+
+	pfab_data->rate = rate;
+	pfab_data->burst = burst;
+	pfab_data->rate_mult = 1;
+	pfab_data->rate_shift = 0;
+	pfab_data->burst_ns = 0;
+	if (0 == rate) {
+		return;
+	}
+
+	for (;;) {
+		pfab_data->rate_mult = div64_u64(factor, rate);
+		if ((pfab_data->rate_mult & (1U << 31)) || (factor & (1ULL << 63))) {
+			break;
+		}
+		factor <<= 1;
+		pfab_data->rate_shift++;
+	}
+
+	pfab_data->burst_ns = div64_u64((u64) burst * NSEC_PER_SEC, rate);
+}
+
+static inline u64 pfab_rate_l2t(pfab_sched_data_t *pfab_data, unsigned int len)
+{
+	return ((u64) len * pfab_data->rate_mult) >> pfab_data->rate_shift;
+}
+
+/* The watchdog counts in psched ticks of 64 ns. The time is rounded up,
+   so that the watchdog does not dequeue before the packet may leave. */
+static inline void pfab_watchdog_schedule(struct qdisc_watchdog *wd, u64 t)
+{
+	qdisc_watchdog_schedule(wd, PSCHED_NS2TICKS(t + PSCHED_TICKS2NS(1) - 1));
+}
+
+/* Returns whether a packet may be sent at now. If not, the watchdog
+   dequeues again once it may. */
+static inline int pfab_rate_ready(struct Qdisc *sch, u64 now)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+
+	if (now >= pfab_data->t_next) {
+		return 1;
+	}
+
+	if (sch->q.qlen) {
+		sch->qstats.overlimits++;
+		pfab_watchdog_schedule(&pfab_data->watchdog, pfab_data->t_next);
+	}
+	return 0;
+}
+
+/* Moves the departure time of the next packet by the time to send the
+   one that leaves. The credit of an idle link is capped at burst. */
+static inline void pfab_rate_charge(pfab_sched_data_t *pfab_data, u64 now,
+									unsigned int len)
+{
+	if (now > pfab_data->burst_ns &&
+		pfab_data->t_next < now - pfab_data->burst_ns) {
+		pfab_data->t_next = now - pfab_data->burst_ns;
 	}
 
-	sch->q.qlen--;
-	if (skb_queue_empty(list)) {
-		/*TRACE( printk("Band %d empty, removing from bitmap...\n", band) );*/
-		bitmap_remove_band(pfab_data, band);
+	pfab_data->t_next += pfab_rate_l2t(pfab_data, len);
+}
+
+STATIC struct sk_buff *pfab_dequeue(struct Qdisc *sch)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct sk_buff *skb = NULL;
+	u64 now = 0;
+
+	if (pfab_data->rate) {
+		now = ktime_to_ns(ktime_get());
+		if (!pfab_rate_ready(sch, now)) {
+			return NULL;
+		}
 	}
 
+	skb = __pfab_dequeue(sch);
+	if (skb) {
+		if (pfab_data->rate) {
+			pfab_rate_charge(pfab_data, now, qdisc_pkt_len(skb));
+		}
+		pfab_stats_departed(pfab_data, skb,
+							PFAB_MODE_HEAP == pfab_data->mode ?
+							-1 : pfab_skb_cb(skb)->band);
+		pfab_shared_update(sch);
+	}
 	return skb;
 }
 
@@ -258,14 +825,28 @@ STATIC struct sk_buff *pfab_peek(struct Qdisc *sch)
 	int band;
 
 	pfab_data = qdisc_priv(sch);
-	band = bitmap_high_prio(pfab_data);
 
+	/* A packet that dequeue would hold back is not shown to the parent */
+	if (pfab_data->rate &&
+		!pfab_rate_ready(sch, ktime_to_ns(ktime_get()))) {
+		return NULL;
+	}
+
+	if (PFAB_MODE_HEAP == pfab_data->mode) {
+		return pfab_heap_peek_min(&pfab_data->heap);
+	}
+
+	band = bitmap_high_prio(pfab_data);
 	if ( band < 0 ) {
 		return NULL;
 	}
 
 	/* If there is a packet... */
 	list = band2list(pfab_data, band);
+	if (pfab_data->flows) {
+		return pfab_flow_head(pfab_data, skb_peek(list));
+	}
+
 	return skb_peek(list);
 }
 
@@ -281,6 +862,10 @@ STATIC unsigned int pfab_drop(struct Qdisc *sch)
 	BUG_ON(!sch);
 
 	pfab_data = qdisc_priv(sch);
+	if (PFAB_MODE_HEAP == pfab_data->mode) {
+		return pfab_heap_drop(sch);
+	}
+
 	band = bitmap_low_prio(pfab_data);
 	if (band < 0) {
 		pr_alert("low priority band not found\n");
@@ -290,17 +875,299 @@ STATIC unsigned int pfab_drop(struct Qdisc *sch)
 	TRACE(pr_debug("Found low priority packets in band %u\n", band));
 	
 	list = band2list(pfab_data, band);
+	pfab_events_record(&pfab_data->events, PFAB_EVENT_EVICT, skb_peek(list),
+					   pfab_queued_flow_key(pfab_data, skb_peek(list)), band);
+	if (pfab_data->flows) {
+		pfab_flow_remove(pfab_data, skb_peek(list));
+	}
+
 	len = __qdisc_queue_drop_head(sch, list);
+	pfab_band_sub(pfab_data, band, len);
+	if (skb_queue_empty(list)) {
+		bitmap_remove_band(pfab_data, band);
+	}
 	sch->q.qlen--;
 	sch->qstats.drops++;
-	pfab_stats.tc_stats.drops++;
+	pfab_stats_evicted(pfab_data, band);
 	return len;
 }
 
+/* The arrays sized by the number of bands, allocated together so that
+   the number of bands can be changed on a live qdisc. */
+struct pfab_band_arrays {
+	struct sk_buff_head *queues;
+	u32 *band_backlog;
+	unsigned long *words;		//Band bitmap.
+};
+
+static void pfab_free_band_arrays(struct pfab_band_arrays *arrays)
+{
+	kfree(arrays->words);
+	arrays->words = NULL;
+	kfree(arrays->band_backlog);
+	arrays->band_backlog = NULL;
+	kfree(arrays->queues);
+	arrays->queues = NULL;
+}
+
+static int pfab_alloc_band_arrays(struct pfab_band_arrays *arrays, u32 bands)
+{
+	u32 i;
+
+	arrays->queues = kcalloc(bands, sizeof(*arrays->queues), GFP_KERNEL);
+	arrays->band_backlog = kcalloc(bands, sizeof(*arrays->band_backlog),
+								   GFP_KERNEL);
+	arrays->words = kcalloc(BITS_TO_LONGS(bands), sizeof(unsigned long),
+							GFP_KERNEL);
+	if (NULL == arrays->queues || NULL == arrays->band_backlog ||
+		NULL == arrays->words) {
+		pfab_free_band_arrays(arrays);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < bands; i++) {
+		skb_queue_head_init(&arrays->queues[i]);
+	}
+
+	return 0;
+}
+
+/* Exchanges the band arrays of the qdisc with arrays. */
+static void pfab_swap_band_arrays(pfab_sched_data_t *pfab_data,
+								  struct pfab_band_arrays *arrays)
+{
+	swap(pfab_data->queues, arrays->queues);
+	swap(pfab_data->band_backlog, arrays->band_backlog);
+	swap(pfab_data->bitmap.words, arrays->words);
+}
+
+/* Moves every packet out of the bands, highest priority band first, to
+   be queued again by pfab_requeue() after the priority mapping changed.
+   The flow lists are left as they are. */
+static void pfab_unqueue_all(struct Qdisc *sch, struct sk_buff_head *packets)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct sk_buff_head *list = NULL;
+	struct sk_buff *skb = NULL;
+	int band;
+
+	while ((band = bitmap_high_prio(pfab_data)) >= 0) {
+		list = band2list(pfab_data, band);
+		while ((skb = __skb_dequeue(list)) != NULL) {
+			__skb_queue_tail(packets, skb);
+		}
+
+		pfab_data->band_backlog[band] = 0;
+		bitmap_remove_band(pfab_data, band);
+	}
+
+	memset(pfab_data->word_qlen, 0, sizeof(pfab_data->word_qlen));
+	memset(pfab_data->word_backlog, 0, sizeof(pfab_data->word_backlog));
+}
+
+/* Queues the packets taken out by pfab_unqueue_all() in their band under
+   the current mapping. Packets moved to the same band keep their order. */
+static void pfab_requeue(struct Qdisc *sch, struct sk_buff_head *packets)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct sk_buff *skb = NULL;
+	u32 band;
+
+	while ((skb = __skb_dequeue(packets)) != NULL) {
+		band = min(get_queued_skb_key(pfab_data, skb), pfab_data->bands - 1);
+		pfab_skb_cb(skb)->band = band;
+		__skb_queue_tail(band2list(pfab_data, band), skb);
+		pfab_band_add(pfab_data, band, qdisc_pkt_len(skb));
+		bitmap_add_band(pfab_data, band);
+	}
+}
+
+/* Recomputes the heap keys of the queued packets after the priority
+   mapping changed. */
+static void pfab_heap_rekey(struct Qdisc *sch)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct pfab_heap *heap = &pfab_data->heap;
+	u32 i;
+
+	for (i = 0; i < heap->size; i++) {
+		heap->entries[i].key = get_queued_skb_key(pfab_data,
+												  heap->entries[i].skb);
+	}
+
+	pfab_heap_rebuild(heap);
+}
+
+/* Evicts the lowest priority packets until the buffer is within its
+   limits, after they were lowered. */
+static void pfab_trim(struct Qdisc *sch)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	unsigned int evicted = 0;
+
+	while (sch->q.qlen && pfab_exceeds_limit(pfab_data, sch, 0, 0)) {
+		pfab_drop(sch);
+		evicted++;
+	}
+
+	if (evicted) {
+		qdisc_tree_decrease_qlen(sch, evicted);
+	}
+}
+
+/* Sets the options sent with their present bit */
+static void pfab_merge_opt(tc_pfabric_qopt_t *qopt,
+						   const tc_pfabric_qopt_t *sent)
+{
+	u32 present = sent->present;
+
+	if (present & TC_PFABRIC_OPT_LIMIT) {
+		qopt->limit = sent->limit;
+	}
+	if (present & TC_PFABRIC_OPT_DISABLE_DEQUEUE) {
+		qopt->disable_dequeue = sent->disable_dequeue;
+	}
+	if (present & TC_PFABRIC_OPT_BANDS) {
+		qopt->bands = sent->bands;
+	}
+	if (present & TC_PFABRIC_OPT_PRIO_SOURCE) {
+		qopt->prio_source = sent->prio_source;
+	}
+	if (present & TC_PFABRIC_OPT_PRIO_SHIFT) {
+		qopt->prio_shift = sent->prio_shift;
+	}
+	if (present & TC_PFABRIC_OPT_MODE) {
+		qopt->mode = sent->mode;
+	}
+	if (present & TC_PFABRIC_OPT_FLOWS) {
+		qopt->flows = sent->flows;
+	}
+	if (present & TC_PFABRIC_OPT_LIMIT_BYTES) {
+		qopt->limit_bytes = sent->limit_bytes;
+	}
+	if (present & TC_PFABRIC_OPT_SHARED_LIMIT) {
+		qopt->shared_limit = sent->shared_limit;
+	}
+	if (present & TC_PFABRIC_OPT_MARK_THRESHOLD) {
+		qopt->mark_threshold = sent->mark_threshold;
+	}
+	if (present & TC_PFABRIC_OPT_MARK_THRESHOLD_BYTES) {
+		qopt->mark_threshold_bytes = sent->mark_threshold_bytes;
+	}
+	if (present & TC_PFABRIC_OPT_MARK_BY) {
+		qopt->mark_by = sent->mark_by;
+	}
+	if (present & TC_PFABRIC_OPT_RATE) {
+		qopt->rate = sent->rate;
+	}
+	if (present & TC_PFABRIC_OPT_BURST) {
+		qopt->burst = sent->burst;
+	}
+	if (present & TC_PFABRIC_OPT_BATCH) {
+		qopt->batch = sent->batch;
+	}
+	if (present & TC_PFABRIC_OPT_EVENTS) {
+		qopt->events = sent->events;
+	}
+}
+
+/* Copies the options sent by tc into qopt. Options that are not sent,
+   or not marked present, keep their current values. */
+static int pfab_parse_opt(pfab_sched_data_t* pfab_data, struct nlattr *opt,
+						  tc_pfabric_qopt_t* qopt)
+{
+	tc_pfabric_qopt_t sent;
+	int len = nla_len(opt);
+
+	if ( len < TC_PFABRIC_QOPT_V1_SIZE ) {
+		return -EINVAL;
+	}
+
+	qopt->limit = pfab_data->limit;
+	qopt->disable_dequeue = pfab_data->disable_dequeue;
+	qopt->bands = pfab_data->bands;
+	qopt->prio_source = pfab_data->prio_source;
+	qopt->prio_shift = pfab_data->prio_shift;
+	qopt->mode = pfab_data->mode;
+	qopt->flows = pfab_data->flows;
+	qopt->limit_bytes = pfab_data->limit_bytes;
+	qopt->shared_limit = pfab_data->shared_limit;
+	qopt->mark_threshold = pfab_data->mark_threshold;
+	qopt->mark_threshold_bytes = pfab_data->mark_threshold_bytes;
+	qopt->mark_by = pfab_data->mark_by;
+	qopt->rate = pfab_data->rate;
+	qopt->burst = pfab_data->burst;
+	qopt->batch = 0;
+	qopt->events = pfab_data->events.rate;
+	if (len < sizeof(*qopt)) {
+		memcpy(qopt, nla_data(opt), min_t(int, len, TC_PFABRIC_QOPT_V2_SIZE));
+	}
+	else {
+		memcpy(&sent, nla_data(opt), sizeof(sent));
+		pfab_merge_opt(qopt, &sent);
+	}
+
+	/* Zero bands means the current (or default) number of bands */
+	if (0 == qopt->bands) {
+		qopt->bands = pfab_data->bands;
+	}
+
+	if (qopt->bands > MAX_BANDS) {
+		pr_err("At most %d bands are supported\n", (int) MAX_BANDS);
+		return -EINVAL;
+	}
+
+	if (qopt->prio_source >= __PFAB_PRIO_MAX) {
+		pr_err("Unknown priority source %u\n", qopt->prio_source);
+		return -EINVAL;
+	}
+
+	if (qopt->mode >= __PFAB_MODE_MAX) {
+		pr_err("Unknown scheduling mode %u\n", qopt->mode);
+		return -EINVAL;
+	}
+
+	if (qopt->flows > MAX_FLOWS || (qopt->flows & (qopt->flows - 1))) {
+		pr_err("Number of flows must be a power of 2 up to %d\n", MAX_FLOWS);
+		return -EINVAL;
+	}
+
+	if (qopt->flows && PFAB_MODE_HEAP == qopt->mode) {
+		pr_err("Flow ordering is not supported in heap mode\n");
+		return -EINVAL;
+	}
+
+	if (qopt->mark_by >= __PFAB_MARK_MAX) {
+		pr_err("Unknown mark backlog %u\n", qopt->mark_by);
+		return -EINVAL;
+	}
+
+	if (PFAB_MARK_PRIO == qopt->mark_by && PFAB_MODE_HEAP == qopt->mode) {
+		pr_err("Marking by priority is not supported in heap mode\n");
+		return -EINVAL;
+	}
+
+	if (qopt->batch) {
+		pr_err("The batch option is no longer supported\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Applies new options atomically under the qdisc lock, without flushing
+   the buffer. A new number of bands or priority mapping moves the queued
+   packets to their new bands (or heap keys), and lower limits evict the
+   lowest priority packets. */
 STATIC int pfab_change(struct Qdisc* sch, struct nlattr *opt)
 {
 	pfab_sched_data_t* pfab_data = NULL;
-	tc_pfabric_qopt_t* qopt = NULL;
+	tc_pfabric_qopt_t qopt;
+	struct pfab_band_arrays arrays = { NULL, NULL, NULL };
+	struct pfab_cpu_stats __percpu *cpu_stats = NULL;
+	struct sk_buff_head packets;
+	int live, remap, reshape;
+	int retval;
 	BUG_ON(!sch);
 	
 	TRACE( printk("pfab_change called\n") );
@@ -310,27 +1177,181 @@ STATIC int pfab_change(struct Qdisc* sch, struct nlattr *opt)
 		return -EINVAL;
 	}
 	
-	if ( nla_len(opt) < sizeof(*qopt) ) {
+	pfab_data = qdisc_priv(sch);
+	retval = pfab_parse_opt(pfab_data, opt, &qopt);
+	if (retval < 0) {
+		return retval;
+	}
+
+	/* The band arrays are allocated by pfab_init, after the first call */
+	live = NULL != pfab_data->queues;
+
+	if (live && qopt.mode != pfab_data->mode) {
+		pr_err("Scheduling mode can only be set when adding the qdisc\n");
 		return -EINVAL;
 	}
-	
-	pfab_data = qdisc_priv(sch);
-	qopt = nla_data(opt);
-
-	pr_info("Setting limit=%d, disable_dequeue=%d\n",
-			qopt->limit, qopt->disable_dequeue);
-	pfab_data->limit = qopt->limit;
-	pfab_stats.limit = qopt->limit;
-	pfab_data->disable_dequeue = qopt->disable_dequeue;
-	pfab_stats.disable_dequeue = qopt->disable_dequeue;
-	
+
+	if (live && qopt.flows != pfab_data->flows) {
+		pr_err("Number of flows can only be set when adding the qdisc\n");
+		return -EINVAL;
+	}
+
+	if (live && qopt.shared_limit != pfab_data->shared_limit) {
+		pr_err("Shared limit can only be set when adding the qdisc\n");
+		return -EINVAL;
+	}
+
+	if (PFAB_MODE_HEAP == qopt.mode) {
+		retval = pfab_heap_reserve(sch, qopt.limit);
+		if (retval < 0) {
+			pr_err("Failed allocating heap for %u packets\n", qopt.limit);
+			return retval;
+		}
+	}
+
+	/* The flow table itself is allocated by pfab_init, with the links */
+	if (live && pfab_data->flows) {
+		retval = pfab_flow_reserve(sch, qopt.limit);
+		if (retval < 0) {
+			pr_err("Failed allocating flow links for %u packets\n",
+				   qopt.limit);
+			return retval;
+		}
+	}
+
+	/* Everything that may fail is allocated before taking the lock */
+	if (live && qopt.bands != pfab_data->bands) {
+		retval = pfab_alloc_band_arrays(&arrays, qopt.bands);
+		if (0 == retval) {
+			cpu_stats = pfab_stats_alloc_bands(qopt.bands);
+			if (NULL == cpu_stats) {
+				pfab_free_band_arrays(&arrays);
+				retval = -ENOMEM;
+			}
+		}
+
+		if (retval < 0) {
+			pr_err("Failed allocating %u bands\n", qopt.bands);
+			return retval;
+		}
+	}
+
+	remap = live && (qopt.bands != pfab_data->bands ||
+					 qopt.prio_source != pfab_data->prio_source ||
+					 qopt.prio_shift != pfab_data->prio_shift);
+	reshape = live && (qopt.rate != pfab_data->rate ||
+					   qopt.burst != pfab_data->burst);
+
+	pr_debug("Setting limit=%d, limit_bytes=%u, shared_limit=%u, "
+			 "disable_dequeue=%d, bands=%u, prio_source=%u, prio_shift=%u, "
+			 "mode=%u, flows=%u, mark_threshold=%u, mark_threshold_bytes=%u, "
+			 "mark_by=%u, rate=%u, burst=%u, events=%u\n",
+			 qopt.limit, qopt.limit_bytes, qopt.shared_limit,
+			 qopt.disable_dequeue, qopt.bands, qopt.prio_source,
+			 qopt.prio_shift, qopt.mode, qopt.flows, qopt.mark_threshold,
+			 qopt.mark_threshold_bytes, qopt.mark_by, qopt.rate, qopt.burst,
+			 qopt.events);
+
+	__skb_queue_head_init(&packets);
+	sch_tree_lock(sch);
+	if (remap && PFAB_MODE_BANDS == pfab_data->mode) {
+		pfab_unqueue_all(sch, &packets);
+	}
+
+	/* arrays and cpu_stats are left with the old ones, to be freed */
+	if (cpu_stats) {
+		pfab_swap_band_arrays(pfab_data, &arrays);
+		cpu_stats = pfab_stats_replace(pfab_data, cpu_stats, qopt.bands);
+	}
+
+	pfab_data->limit = qopt.limit;
+	pfab_data->limit_bytes = qopt.limit_bytes;
+	pfab_data->shared_limit = qopt.shared_limit;
+	pfab_data->disable_dequeue = qopt.disable_dequeue;
+	pfab_data->bands = qopt.bands;
+	pfab_data->sojourn_shift = pfab_bands_shift(qopt.bands,
+												TC_PFABRIC_SOJOURN_GROUPS);
+	pfab_data->prio_source = qopt.prio_source;
+	pfab_data->prio_shift = qopt.prio_shift;
+	pfab_data->mode = qopt.mode;
+	pfab_data->flows = qopt.flows;
+	pfab_data->mark_threshold = qopt.mark_threshold;
+	pfab_data->mark_threshold_bytes = qopt.mark_threshold_bytes;
+	pfab_data->mark_by = qopt.mark_by;
+	pfab_rate_set(pfab_data, qopt.rate, qopt.burst);
+
+	/* Events recorded before they were disabled are still sent */
+	if (0 == qopt.events) {
+		pfab_events_flush(&pfab_data->events);
+	}
+	pfab_data->events.rate = qopt.events;
+
+	if (remap && PFAB_MODE_BANDS == pfab_data->mode) {
+		pfab_requeue(sch, &packets);
+	}
+	else if (remap) {
+		pfab_heap_rekey(sch);
+	}
+
+	if (live) {
+		pfab_trim(sch);
+		pfab_shared_update(sch);
+	}
+
+	/* The pending departure was computed at the old rate, the watchdog
+	   is moved to now for the queued packets to be paced at the new one */
+	if (reshape) {
+		pfab_data->t_next = 0;
+		if (sch->q.qlen) {
+			pfab_watchdog_schedule(&pfab_data->watchdog,
+								   ktime_to_ns(ktime_get()));
+		}
+	}
+	sch_tree_unlock(sch);
+
+	pfab_free_band_arrays(&arrays);
+	free_percpu(cpu_stats);
+
+	return 0;
+}
+
+/* Allocates the band queues and the bitmap according to the number of bands. */
+static int pfab_alloc_bands(pfab_sched_data_t *pfab_data)
+{
+	struct pfab_band_arrays arrays;
+
+	if (pfab_alloc_band_arrays(&arrays, pfab_data->bands) < 0) {
+		return -ENOMEM;
+	}
+
+	if (pfab_data->flows &&
+		pfab_flow_table_init(&pfab_data->flow_table, pfab_data->flows,
+							 pfab_data->limit + 1) < 0) {
+		pfab_free_band_arrays(&arrays);
+		return -ENOMEM;
+	}
+
+	pfab_swap_band_arrays(pfab_data, &arrays);
+	pfab_data->bitmap.summary = 0;
 	return 0;
 }
 
+static void pfab_free_bands(pfab_sched_data_t *pfab_data)
+{
+	pfab_flow_table_destroy(&pfab_data->flow_table);
+	kfree(pfab_data->bitmap.words);
+	pfab_data->bitmap.words = NULL;
+	kfree(pfab_data->band_backlog);
+	pfab_data->band_backlog = NULL;
+	kfree(pfab_data->queues);
+	pfab_data->queues = NULL;
+	pfab_heap_free_entries(pfab_data->heap.entries);
+	memset(&pfab_data->heap, 0, sizeof(pfab_data->heap));
+}
+
 STATIC int pfab_init(struct Qdisc *sch, struct nlattr *opt) 
 {
 	pfab_sched_data_t *pfab_data = NULL;
-	int i;
 	int retval;
 	struct net_device* netdev = NULL;
   
@@ -344,35 +1365,81 @@ STATIC int pfab_init(struct Qdisc *sch, struct nlattr *opt)
 	netdev = qdisc_dev(sch);
 	BUG_ON(!netdev);
 	
-	/* Initialize priority queues. */
-	for (i = 0; i < NUM_BANDS; i++) {
-		skb_queue_head_init(band2list(pfab_data, i));
-	}
-	
-	/* Initialize bitmap. */
-	memset(pfab_data->bitmap, 0, sizeof(pfab_data->bitmap));
-		
-	memset(&pfab_stats, 0, sizeof(pfab_stats));
-
 	pfab_data->limit = DEFAULT_LIMIT;
+	pfab_data->limit_bytes = 0;
+	pfab_data->shared_limit = 0;
+	pfab_data->mark_threshold = 0;
+	pfab_data->mark_threshold_bytes = 0;
+	pfab_data->mark_by = PFAB_MARK_TOTAL;
+	pfab_rate_set(pfab_data, 0, 0);
+	pfab_data->t_next = 0;
+	qdisc_watchdog_init(&pfab_data->watchdog, sch);
+	pfab_events_init(&pfab_data->events, sch);
+	pfab_data->group = NULL;
 	pfab_data->disable_dequeue = 0;
-	
-	/* Initialize statistics for proc file. */
-	pfab_stats.limit = DEFAULT_LIMIT;
-	pfab_stats.disable_dequeue = 0;
+	pfab_data->bands = DEFAULT_BANDS;
+	pfab_data->sojourn_shift = pfab_bands_shift(DEFAULT_BANDS,
+												TC_PFABRIC_SOJOURN_GROUPS);
+	pfab_data->prio_source = PFAB_PRIO_TOS;
+	pfab_data->prio_shift = 0;
+	pfab_data->mode = PFAB_MODE_BANDS;
+	pfab_data->queues = NULL;
+	pfab_data->band_backlog = NULL;
+	pfab_data->bitmap.words = NULL;
+	pfab_data->flows = 0;
+	memset(&pfab_data->flow_table, 0, sizeof(pfab_data->flow_table));
+	pfab_data->cpu_stats = NULL;
+	memset(&pfab_data->heap, 0, sizeof(pfab_data->heap));
 
 	retval = opt ? pfab_change(sch, opt) : 0;
 	if (retval < 0) {
 		pr_err("pfab_change failed\n");
-		return retval;
+		goto init_failed;
 	}
 
-	BUG_ON(!netdev->name);
-	retval = pfab_stats_init(netdev->name);
+	/* Initialize priority queues and bitmap. */
+	retval = pfab_alloc_bands(pfab_data);
+	if (retval < 0) {
+		pr_err("Failed allocating %u bands\n", pfab_data->bands);
+		goto init_failed;
+	}
+
+	retval = pfab_stats_alloc(pfab_data);
+	if (retval < 0) {
+		pr_err("Failed allocating statistics for pFabric\n");
+		goto init_failed;
+	}
+
+	retval = pfab_stats_init(sch);
 	if (retval < 0) {
 		pr_err("Failed initializing statistics for pFabric\n");
+		goto stats_init_failed;
+	}
+
+	if (pfab_data->shared_limit) {
+		retval = pfab_group_join(netdev, pfab_data->mode,
+								 pfab_data->shared_limit, &pfab_data->group);
+		if (retval < 0) {
+			pr_err("Failed sharing the buffer of %s\n", netdev->name);
+			goto group_join_failed;
+		}
+
+		pfab_data->group_slot = retval;
 	}
 
+	return 0;
+
+	/* qdisc_create() does not call ->destroy when ->init fails, everything
+	   pfab_change and the steps above set up is released here.
+	   qdisc_create_dflt() calls ->reset and ->destroy anyway, both find
+	   no queues and return. */
+group_join_failed:
+	pfab_stats_exit(sch);
+stats_init_failed:
+	pfab_stats_free(pfab_data);
+init_failed:
+	pfab_events_destroy(&pfab_data->events);
+	pfab_free_bands(pfab_data);
 	return retval;
 }
 
@@ -386,19 +1453,35 @@ STATIC void pfab_reset(struct Qdisc *sch)
 	BUG_ON(!sch);
 	
 	pfab_data = qdisc_priv(sch);
+	if (NULL == pfab_data->queues) {
+		/* pfab_init failed, nothing to reset */
+		return;
+	}
 
-	for (prio = 0; prio < NUM_BANDS; prio++) {
+	for (prio = 0; prio < pfab_data->bands; prio++) {
 		__qdisc_reset_queue(sch, band2list(pfab_data, prio));
 	}
 
+	pfab_heap_purge(sch);
+
+	pfab_flow_table_reset(&pfab_data->flow_table);
+
+	pfab_data->bitmap.summary = 0;
+	memset(pfab_data->bitmap.words, 0,
+		   BITS_TO_LONGS(pfab_data->bands) * sizeof(unsigned long));
+	memset(pfab_data->band_backlog, 0,
+		   pfab_data->bands * sizeof(*pfab_data->band_backlog));
+	memset(pfab_data->word_qlen, 0, sizeof(pfab_data->word_qlen));
+	memset(pfab_data->word_backlog, 0, sizeof(pfab_data->word_backlog));
+
 	sch->qstats.backlog = 0;
 	sch->q.qlen = 0;
+	pfab_shared_update(sch);
 
-	memset(&pfab_stats, 0, sizeof(pfab_stats));
+	qdisc_watchdog_cancel(&pfab_data->watchdog);
+	pfab_data->t_next = 0;
 
-	/* Initialize statistics for proc file. */
-	pfab_stats.limit = DEFAULT_LIMIT;
-	pfab_stats.disable_dequeue = 0;
+	pfab_stats_clear(pfab_data);
 }
 
 STATIC void pfab_destroy(struct Qdisc *sch) 
@@ -414,14 +1497,28 @@ STATIC void pfab_destroy(struct Qdisc *sch)
 	BUG_ON(!netdev);
 	BUG_ON(!netdev->name);
 	
-	for (prio = 0; prio < NUM_BANDS; prio++) {
+	qdisc_watchdog_cancel(&pfab_data->watchdog);
+	pfab_events_destroy(&pfab_data->events);
+
+	if (NULL == pfab_data->queues) {
+		/* pfab_init failed, nothing else to clean up */
+		return;
+	}
+
+	for (prio = 0; prio < pfab_data->bands; prio++) {
 		skb_queue_purge(band2list(pfab_data, prio));
 	}
 
-	pfab_stats_exit(netdev->name);
+	pfab_heap_purge(sch);
+	if (pfab_data->group) {
+		pfab_group_leave(pfab_data->group, pfab_data->group_slot);
+		pfab_data->group = NULL;
+	}
+	pfab_stats_exit(sch);
+	pfab_stats_free(pfab_data);
+	pfab_free_bands(pfab_data);
 }
 
-#ifdef CONFIG_RTLENTLINK
 STATIC int pfab_dump(struct Qdisc* sch, struct sk_buff* skb)
 {
 	pfab_sched_data_t* pfab_data = NULL;
@@ -433,8 +1530,24 @@ STATIC int pfab_dump(struct Qdisc* sch, struct sk_buff* skb)
 	BUG_ON(!sch);
 	pfab_data = qdisc_priv(sch);
 	
+	/* Every byte of qopt is copied to userspace */
+	memset(&qopt, 0, sizeof(qopt));
+	qopt.present = TC_PFABRIC_OPT_ALL;
 	qopt.limit = pfab_data->limit;
 	qopt.disable_dequeue = pfab_data->disable_dequeue;
+	qopt.bands = pfab_data->bands;
+	qopt.prio_source = pfab_data->prio_source;
+	qopt.prio_shift = pfab_data->prio_shift;
+	qopt.mode = pfab_data->mode;
+	qopt.flows = pfab_data->flows;
+	qopt.limit_bytes = pfab_data->limit_bytes;
+	qopt.shared_limit = pfab_data->shared_limit;
+	qopt.mark_threshold = pfab_data->mark_threshold;
+	qopt.mark_threshold_bytes = pfab_data->mark_threshold_bytes;
+	qopt.mark_by = pfab_data->mark_by;
+	qopt.rate = pfab_data->rate;
+	qopt.burst = pfab_data->burst;
+	qopt.events = pfab_data->events.rate;
 	if ( nla_put(skb, TCA_OPTIONS, sizeof(qopt), &qopt) ) {
 		pr_err("nla_put failed\n");
 		goto dump_error;
@@ -446,7 +1559,71 @@ dump_error:
 	nlmsg_trim(skb, nla);
 	return -1;
 }
-#endif
+
+/* Reports the counters as TCA_XSTATS. With many bands, adjacent bands
+   are summed so that the message size stays bounded. */
+STATIC int pfab_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct tc_pfabric_xstats *st = NULL;
+	struct pfab_stat_data stats;
+	struct pfab_band_stats band_stats;
+	struct tc_pfabric_band_xstats *entry = NULL;
+	u32 shift = 0;
+	u32 group;
+	int band;
+	int retval;
+
+	TRACE( printk("pfab_dump_stats called\n") );
+
+	st = kzalloc(sizeof(*st), GFP_ATOMIC);
+	if (NULL == st) {
+		return -1;
+	}
+
+	pfab_stats_read(pfab_data, &stats);
+	st->enqueues = stats.packets;
+	st->drops = stats.drops;
+	st->evictions = stats.evictions;
+	st->non_ip = stats.non_ip_packet_counter;
+	st->illegal_prio = stats.illegal_prio_occurance;
+	st->marks = stats.marks;
+	st->flows = pfab_data->flow_table.count;
+	st->flow_evictions = stats.flow_evictions;
+	st->flow_overflows = stats.flow_overflows;
+	memcpy(st->sojourn, stats.sojourn, sizeof(st->sojourn));
+	st->bands = pfab_data->bands;
+
+	/* Per band counters are not kept in heap mode */
+	if (PFAB_MODE_BANDS == pfab_data->mode) {
+		shift = pfab_bands_shift(pfab_data->bands, TC_PFABRIC_XSTATS_BANDS);
+
+		for (band = 0; band < pfab_data->bands; band++) {
+			pfab_stats_read_band(pfab_data, band, &band_stats);
+			entry = &st->band[band >> shift];
+			entry->enqueues += band_stats.packets;
+			entry->drops += band_stats.drops;
+			entry->evictions += band_stats.evictions;
+			entry->backlog += pfab_data->band_backlog[band];
+		}
+
+		st->entries = ((pfab_data->bands - 1) >> shift) + 1;
+
+		st->sojourn_shift = pfab_data->sojourn_shift;
+		st->sojourn_groups = ((pfab_data->bands - 1) >>
+							  pfab_data->sojourn_shift) + 1;
+		for (group = 0; group < st->sojourn_groups; group++) {
+			pfab_stats_read_sojourn(pfab_data, group, st->band_sojourn[group]);
+		}
+	}
+	st->band_shift = shift;
+
+	retval = gnet_stats_copy_app(d, st,
+								 offsetof(struct tc_pfabric_xstats, band) +
+								 st->entries * sizeof(st->band[0]));
+	kfree(st);
+	return retval;
+}
 
 STATIC struct Qdisc_ops pfab_qdisc_ops __read_mostly = {
 	.next		=	NULL,
@@ -461,9 +1638,8 @@ STATIC struct Qdisc_ops pfab_qdisc_ops __read_mostly = {
 	.destroy	=	pfab_destroy,
 	.owner		=	THIS_MODULE,
 
-#ifdef CONFIG_RTLENTLINK
 	.dump		=	pfab_dump,
-#endif
+	.dump_stats	=	pfab_dump_stats,
 };
 
 static int __init pfab_module_init(void)
@@ -471,20 +1647,37 @@ static int __init pfab_module_init(void)
 	int retval;
 	pr_info("Initializing pFabric...\n");
 
+	retval = pfab_events_register();
+	if (retval < 0) {
+		pr_err("Failed registering pFabric events family\n");
+		return retval;
+	}
+
 #ifdef PFABRIC_TESTS
 	retval = run_tests();
 	if (retval < 0) {
 		pr_err("pFabric tests failed\n");
 	}
 
+	pfab_events_unregister();
 	return -1;
 #endif
 
+#ifdef PFABRIC_BENCH
+	retval = run_bench();
+	if (retval < 0) {
+		pr_err("pFabric benchmark failed\n");
+	}
+
+	pfab_events_unregister();
+	return -1;
+#endif
 
 	pr_info("Registering qdisc...\n");
 	retval = register_qdisc(&pfab_qdisc_ops);
 	if (retval < 0) {
 		pr_err("Failed registering pFabric qdisc\n");
+		pfab_events_unregister();
 		return retval;
 	}
 
@@ -495,6 +1688,7 @@ static void __exit pfab_module_exit(void)
 {
 	pr_info("Unregistering qdisc...\n");
 	unregister_qdisc(&pfab_qdisc_ops);
+	pfab_events_unregister();
 }
 
 module_init(pfab_module_init);
@@ -9,14 +9,29 @@
 #define __SCH_PFAB_H__
 
 #include <linux/list.h>
+#include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
 #include <net/pkt_sched.h>
+#include "pfab_heap.h"
+#include "pfab_flow.h"
+#include "pfab_classify.h"
+#include "pfab_events.h"
 
-//TODO: make these options.
-#define BITS_IN_BYTE (8)
-#define BANDS_IN_BITMAP (sizeof(u32) * BITS_IN_BYTE)
+struct pfab_group;
 
-#define NUM_BANDS (32)
-#define BITMAP_SIZE (NUM_BANDS / BANDS_IN_BITMAP)
+/* Default number of bands, used when tc does not specify one */
+#define DEFAULT_BANDS (32)
+
+/* The band bitmap is a two level structure: one summary word in which
+   bit i is set iff word i of the bitmap is non-zero. Both levels are
+   searched with a single bit-scan, so the number of bands is bounded
+   by the square of the word size (1024 on 32 bit, 4096 on 64 bit). */
+#define MAX_BANDS (BITS_PER_LONG * BITS_PER_LONG)
+#define MAX_BITMAP_SIZE BITS_TO_LONGS(MAX_BANDS)
+
+/* Maximal number of tracked flows for flow ordered dequeue */
+#define MAX_FLOWS (65536)
 
 /* Default packet buffer size */
 #define DEFAULT_LIMIT (150)
@@ -30,14 +45,71 @@
 /* This should correspond to the identifier used by tc */
 #define QDISC_ID "pfabric"
 
+struct pfab_bitmap {
+	unsigned long summary;	//Bit i set iff words[i] != 0.
+	unsigned long *words;	//Bit per occupied band.
+};
+
+/* Packet field from which the band is derived */
+enum {
+	PFAB_PRIO_TOS,		/* IPv4 TOS byte or IPv6 traffic class */
+	PFAB_PRIO_DSCP,		/* DSCP, i.e. TOS without the ECN bits */
+	PFAB_PRIO_SKB_PRIORITY,	/* skb->priority, e.g. set by SO_PRIORITY */
+	PFAB_PRIO_MARK,		/* skb->mark, e.g. set by iptables */
+	PFAB_PRIO_PCP,		/* 802.1Q priority code point */
+	__PFAB_PRIO_MAX
+};
+
+/* Scheduling engine */
+enum {
+	PFAB_MODE_BANDS,	/* FIFO per band, priority quantized to bands */
+	PFAB_MODE_HEAP,		/* Per packet min-max heap on the full priority */
+	__PFAB_MODE_MAX
+};
+
+/* Backlog compared with the ECN mark thresholds */
+enum {
+	PFAB_MARK_TOTAL,	/* The whole buffer */
+	PFAB_MARK_PRIO,		/* Bands of higher or equal priority */
+	__PFAB_MARK_MAX
+};
+
+/* Sojourn time histograms, counting packets as they are dequeued.
+   Bucket 0 counts sojourns below 1 us (2^10 ns), bucket i those in
+   [2^(i+9), 2^(i+10)) ns and the last bucket all the longer ones. */
+#define TC_PFABRIC_SOJOURN_BUCKETS (16)
+#define PFAB_SOJOURN_MIN_SHIFT (10)
+
+/* Per band histograms are kept for at most this many groups of adjacent
+   bands, so that they fit in a netlink message. */
+#define TC_PFABRIC_SOJOURN_GROUPS (16)
+
+/* Statistics counters of a qdisc instance. The fast path updates a per
+   CPU copy, readers add up the copies (see stats.c). */
 struct pfab_stat_data {
-	u32 limit; 			//Limit of the queue size.
-	int disable_dequeue;
-	u32 bitmap[BITMAP_SIZE];	//Bitmap indicating occupied queues.
-	struct tc_stats tc_stats;
-	u32 per_band_packet_counter[NUM_BANDS];
+	u64 bytes;			//Enqueued bytes.
+	u32 packets;			//Enqueued packets.
+	u32 drops;			//Arriving packets that were not admitted.
+	u32 evictions;			//Packets evicted from the buffer.
 	u32 non_ip_packet_counter;
-	u32 illegal_prio_occurance;
+	u32 illegal_prio_occurance;	//Priorities beyond the last band.
+	u32 marks;			//Packets CE marked.
+	u32 flow_evictions;		//Idle flows reclaimed for new flows.
+	u32 flow_overflows;		//Packets of flows that found the table full.
+	u32 sojourn[TC_PFABRIC_SOJOURN_BUCKETS];	//All the bands.
+};
+
+struct pfab_band_stats {
+	u32 packets;
+	u32 drops;
+	u32 evictions;
+};
+
+struct pfab_cpu_stats {
+	struct pfab_stat_data data;
+	struct u64_stats_sync syncp;	//Protects data.bytes on 32 bit.
+	u32 band_sojourn[TC_PFABRIC_SOJOURN_GROUPS][TC_PFABRIC_SOJOURN_BUCKETS];
+	struct pfab_band_stats band[0];	//Array of bands entries.
 };
 
 /* Fields ordering should correspond to that in tc in order for
@@ -52,20 +124,257 @@ struct tc_pfabric_qopt {
 	   pFabric's packet buffer.
 	 */
 	int	disable_dequeue;
+
+	/* Number of bands, between 1 and MAX_BANDS */
+	__u32 bands;
+
+	/* Packet field to take the priority from (PFAB_PRIO_*) */
+	__u32 prio_source;
+
+	/* The band is the priority value shifted right by prio_shift.
+	   Values beyond the last band are placed in the last band. */
+	__u32 prio_shift;
+
+	/* Scheduling engine (PFAB_MODE_*). In heap mode the shifted
+	   priority value is used as is and bands is ignored. */
+	__u32 mode;
+
+	/* Number of tracked flows (a power of 2), 0 to disable. When enabled
+	   dequeue sends the earliest packet of the flow that owns the highest
+	   priority packet, which avoids reordering within a flow. Only
+	   supported in bands mode. */
+	__u32 flows;
+
+	/* Buffer size in bytes, 0 for no byte limit. Both limits apply
+	   when set. */
+	__u32 limit_bytes;
+
+	/* Packets in all the pFabric instances of the device that set it,
+	   0 to disable. Used with one instance per TX queue under mq, so
+	   that admission and eviction consider the lowest priority packet
+	   of the whole device. */
+	__u32 shared_limit;
+
+	/* ECN marking, 0 to disable: an arriving ECT packet is CE marked if
+	   the backlog, counting the packet, exceeds either threshold.
+	   Packets are still only dropped or evicted when the buffer is
+	   full. */
+	__u32 mark_threshold;		/* Packets */
+	__u32 mark_threshold_bytes;
+
+	/* Backlog compared with the thresholds (PFAB_MARK_*). Marking by
+	   priority, only the packets a packet would wait for count, so low
+	   priority backlog does not slow down high priority flows. Only
+	   supported in bands mode. */
+	__u32 mark_by;
+
+	/* Shaping, 0 to disable: dequeue paces the packets at rate bytes
+	   per second, so that the qdisc is the bottleneck by itself rather
+	   than under an HTB class. After an idle period up to burst bytes
+	   are sent back to back. */
+	__u32 rate;
+	__u32 burst;		/* Bytes */
+
+	/* Must be 0. Was a dequeue budget in bytes, removed as it did not
+	   make dequeue faster; kept for the layout of the next fields. */
+	__u32 batch;
+
+	/* Drop and eviction events per second, sent to the events group of
+	   the pfabric generic netlink family (see pfab_events.h), 0 to
+	   disable. */
+	__u32 events;
+
+	/* Options set by this message (TC_PFABRIC_OPT_*), the others keep
+	   their current values, or the defaults when the qdisc is added.
+	   Older versions of tc do not send it and set every option they
+	   send. */
+	__u32 present;
+};
+
+/* Bits of tc_pfabric_qopt.present, in the order of the fields */
+enum {
+	TC_PFABRIC_OPT_LIMIT			= 1 << 0,
+	TC_PFABRIC_OPT_DISABLE_DEQUEUE		= 1 << 1,
+	TC_PFABRIC_OPT_BANDS			= 1 << 2,
+	TC_PFABRIC_OPT_PRIO_SOURCE		= 1 << 3,
+	TC_PFABRIC_OPT_PRIO_SHIFT		= 1 << 4,
+	TC_PFABRIC_OPT_MODE			= 1 << 5,
+	TC_PFABRIC_OPT_FLOWS			= 1 << 6,
+	TC_PFABRIC_OPT_LIMIT_BYTES		= 1 << 7,
+	TC_PFABRIC_OPT_SHARED_LIMIT		= 1 << 8,
+	TC_PFABRIC_OPT_MARK_THRESHOLD		= 1 << 9,
+	TC_PFABRIC_OPT_MARK_THRESHOLD_BYTES	= 1 << 10,
+	TC_PFABRIC_OPT_MARK_BY			= 1 << 11,
+	TC_PFABRIC_OPT_RATE			= 1 << 12,
+	TC_PFABRIC_OPT_BURST			= 1 << 13,
+	TC_PFABRIC_OPT_BATCH			= 1 << 14,
+	TC_PFABRIC_OPT_EVENTS			= 1 << 15,
+	TC_PFABRIC_OPT_ALL			= (1 << 16) - 1
+};
+
+/* Extended statistics, reported through TCA_XSTATS. Fields ordering
+should correspond to that in tc. */
+#define TC_PFABRIC_XSTATS_BANDS (64)
+
+struct tc_pfabric_band_xstats {
+	__u32 enqueues;
+	__u32 drops;		/* Arriving packets that were not admitted */
+	__u32 evictions;	/* Packets pushed out by higher priority ones */
+	__u32 backlog;		/* Bytes */
+};
+
+struct tc_pfabric_xstats {
+	__u32 enqueues;
+	__u32 drops;
+	__u32 evictions;
+	__u32 non_ip;
+	__u32 illegal_prio;
+	__u32 marks;		/* ECT packets CE marked */
+	__u32 flows;		/* Flows in the flow table */
+	__u32 flow_evictions;	/* Idle flows reclaimed for new flows */
+	__u32 flow_overflows;	/* Packets that found the flow table full */
+	__u32 sojourn[TC_PFABRIC_SOJOURN_BUCKETS];	/* All the bands */
+	/* Histogram i covers bands [i << sojourn_shift,
+	   (i + 1) << sojourn_shift), sojourn_groups are sent (0 in heap
+	   mode). */
+	__u32 sojourn_shift;
+	__u32 sojourn_groups;
+	__u32 band_sojourn[TC_PFABRIC_SOJOURN_GROUPS][TC_PFABRIC_SOJOURN_BUCKETS];
+	__u32 bands;
+	/* Entry i covers bands [i << band_shift, (i + 1) << band_shift),
+	   so that at most TC_PFABRIC_XSTATS_BANDS entries are sent. */
+	__u32 band_shift;
+	__u32 entries;
+	struct tc_pfabric_band_xstats band[TC_PFABRIC_XSTATS_BANDS];
 };
 
+/* Size of the options sent by versions of tc that predate the band
+   configuration, which are still accepted. */
+#define TC_PFABRIC_QOPT_V1_SIZE (offsetof(struct tc_pfabric_qopt, bands))
+
+/* Size of the options sent by versions of tc that predate present */
+#define TC_PFABRIC_QOPT_V2_SIZE (offsetof(struct tc_pfabric_qopt, present))
+
 typedef struct tc_pfabric_qopt tc_pfabric_qopt_t;
 
-extern struct pfab_stat_data pfab_stats;
+/* Suffix of the proc file names, the device name possibly followed by
+   the qdisc handle */
+#define PFAB_PROC_SUFFIX_LEN (IFNAMSIZ + 12)
+
+/* Per packet state, kept in the qdisc private part of the skb control
+   block, which is only 20 bytes. skb->priority is left as it arrived. */
+struct pfab_skb_cb {
+	u32 flow_link;			//See pfab_flow_append().
+	u32 enqueue_time;		//See pfab_sojourn_now().
+	u32 band:12;			//Band in bands mode.
+	u32 flow:20;			//Flow table index, see pfab_flow_at().
+	struct pfab_pkt_info info;	//Parsed at enqueue.
+};
+
+static inline struct pfab_skb_cb *pfab_skb_cb(struct sk_buff *skb)
+{
+	BUILD_BUG_ON(MAX_BANDS > (1 << 12));
+	BUILD_BUG_ON(MAX_FLOWS >= (1 << 20));
+	qdisc_cb_private_validate(skb, sizeof(struct pfab_skb_cb));
+	return (struct pfab_skb_cb *) qdisc_skb_cb(skb)->data;
+}
 
 typedef struct pfab_sched_data {
 	u32 limit; 
-	u32 bitmap[BITMAP_SIZE];
-	struct sk_buff_head queues[NUM_BANDS];
+	u32 limit_bytes;
+	u32 shared_limit;
+	u32 mark_threshold;
+	u32 mark_threshold_bytes;
+	u32 mark_by;
+	u32 rate;			//Bytes per second, 0 if not shaping.
+	u32 burst;
+	u32 rate_mult;			//Sending len bytes takes
+	u32 rate_shift;			//(len * rate_mult) >> rate_shift ns.
+	u64 burst_ns;			//Time to send burst bytes.
+	u64 t_next;			//Earliest departure of the next packet, ns.
+	struct qdisc_watchdog watchdog;	//Dequeues when t_next is reached.
+	struct pfab_events events;
+	struct pfab_group *group;	//Shared buffer, if shared_limit is set.
+	int group_slot;
+	u32 bands;
+	u32 sojourn_shift;		//Bands per sojourn histogram, log2.
+	u32 prio_source;
+	u32 prio_shift;
+	u32 mode;
+	struct pfab_bitmap bitmap;
+	struct sk_buff_head *queues;	//Array of bands entries.
+	u32 *band_backlog;		//Bytes queued in each band.
+	u32 word_qlen[MAX_BITMAP_SIZE];	//Packets queued in each bitmap word.
+	u32 word_backlog[MAX_BITMAP_SIZE];	//Bytes queued in each bitmap word.
+	struct pfab_heap heap;		//Used instead of queues in heap mode.
+	u32 flows;
+	struct pfab_flow_table flow_table;	//Used if flows is set.
+	struct pfab_cpu_stats __percpu *cpu_stats;
+	struct list_head stats_list;	//Entry in the list of proc files.
+	char proc_suffix[PFAB_PROC_SUFFIX_LEN];
 	int disable_dequeue;
 } pfab_sched_data_t;
 
-#ifdef PFABRIC_TESTS
+/* Smallest shift that maps the bands to at most entries groups of
+   adjacent bands. */
+static inline u32 pfab_bands_shift(u32 bands, u32 entries)
+{
+	u32 shift = 0;
+
+	while (((bands - 1) >> shift) >= entries) {
+		shift++;
+	}
+
+	return shift;
+}
+
+/* Marks a band as occupied. */
+static inline void pfab_bitmap_set(struct pfab_bitmap *bm, int band)
+{
+	int word = BIT_WORD(band);
+
+	bm->words[word] |= BIT_MASK(band);
+	bm->summary |= BIT_MASK(word);
+}
+
+/* Marks a band as empty. */
+static inline void pfab_bitmap_clear(struct pfab_bitmap *bm, int band)
+{
+	int word = BIT_WORD(band);
+
+	bm->words[word] &= ~BIT_MASK(band);
+	if (0 == bm->words[word]) {
+		bm->summary &= ~BIT_MASK(word);
+	}
+}
+
+/* Returns the lowest numbered (highest priority) occupied band, or -1. */
+static inline int pfab_bitmap_first(const struct pfab_bitmap *bm)
+{
+	int word;
+
+	if (0 == bm->summary) {
+		return -1;
+	}
+
+	word = __ffs(bm->summary);
+	return word * BITS_PER_LONG + __ffs(bm->words[word]);
+}
+
+/* Returns the highest numbered (lowest priority) occupied band, or -1. */
+static inline int pfab_bitmap_last(const struct pfab_bitmap *bm)
+{
+	int word;
+
+	if (0 == bm->summary) {
+		return -1;
+	}
+
+	word = __fls(bm->summary);
+	return word * BITS_PER_LONG + __fls(bm->words[word]);
+}
+
+#if defined(PFABRIC_TESTS) || defined(PFABRIC_BENCH) || defined(PFABRIC_USER)
 int pfab_enqueue(struct sk_buff *skb, struct Qdisc *sch);
 struct sk_buff *pfab_dequeue(struct Qdisc *sch);
 struct sk_buff *pfab_peek(struct Qdisc *sch);
@@ -74,8 +383,13 @@ int pfab_init(struct Qdisc *sch, struct nlattr *opt);
 void pfab_reset(struct Qdisc *sch);
 void pfab_destroy(struct Qdisc *sch); 
 int pfab_dump(struct Qdisc* sch, struct sk_buff* skb);
+int pfab_dump_stats(struct Qdisc *sch, struct gnet_dump *d);
 
 extern struct Qdisc_ops pfab_qdisc_ops;
 #endif
 
+#ifdef PFABRIC_BENCH
+int run_bench(void);
+#endif
+
 #endif
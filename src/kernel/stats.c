@@ -3,103 +3,273 @@
 #include <linux/proc_fs.h>
 #include <linux/fs.h>
 #include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
 #include "sch_pfab.h"
 #include "stats.h"
 
-static void *pfab_stats_proc_seq_start(struct seq_file *s, loff_t *pos)
+/* All the pFabric instances, used to give each one its own proc files */
+static LIST_HEAD(pfab_stats_instances);
+static DEFINE_MUTEX(pfab_stats_mutex);
+
+struct pfab_cpu_stats __percpu *pfab_stats_alloc_bands(u32 bands)
+{
+	size_t size = sizeof(struct pfab_cpu_stats) +
+		bands * sizeof(struct pfab_band_stats);
+
+	return __alloc_percpu(size, __alignof__(struct pfab_cpu_stats));
+}
+
+int pfab_stats_alloc(pfab_sched_data_t *pfab_data)
+{
+	pfab_data->cpu_stats = pfab_stats_alloc_bands(pfab_data->bands);
+	return pfab_data->cpu_stats ? 0 : -ENOMEM;
+}
+
+/* The counters of the bands beyond the new last band are added to it,
+   where their packets now go, so that the bands still add up to the
+   totals. The sojourn histograms are regrouped the same way, by the
+   first band of each old group. */
+struct pfab_cpu_stats __percpu *pfab_stats_replace(pfab_sched_data_t *pfab_data,
+		struct pfab_cpu_stats __percpu *cpu_stats, u32 bands)
+{
+	struct pfab_cpu_stats __percpu *old = pfab_data->cpu_stats;
+	struct pfab_cpu_stats *from = NULL;
+	struct pfab_cpu_stats *to = NULL;
+	struct pfab_band_stats *band = NULL;
+	u32 shift = pfab_bands_shift(bands, TC_PFABRIC_SOJOURN_GROUPS);
+	u32 group;
+	int cpu;
+	u32 i, j;
+
+	for_each_possible_cpu(cpu) {
+		from = per_cpu_ptr(old, cpu);
+		to = per_cpu_ptr(cpu_stats, cpu);
+		memset(to, 0, sizeof(*to) + bands * sizeof(to->band[0]));
+		to->data = from->data;
+		for (i = 0; i < pfab_data->bands; i++) {
+			band = &to->band[min(i, bands - 1)];
+			band->packets += from->band[i].packets;
+			band->drops += from->band[i].drops;
+			band->evictions += from->band[i].evictions;
+		}
+
+		for (i = 0; (i << pfab_data->sojourn_shift) < pfab_data->bands; i++) {
+			group = min(i << pfab_data->sojourn_shift, bands - 1) >> shift;
+			for (j = 0; j < TC_PFABRIC_SOJOURN_BUCKETS; j++) {
+				to->band_sojourn[group][j] += from->band_sojourn[i][j];
+			}
+		}
+	}
+
+	pfab_data->cpu_stats = cpu_stats;
+	return old;
+}
+
+void pfab_stats_free(pfab_sched_data_t *pfab_data)
+{
+	free_percpu(pfab_data->cpu_stats);
+	pfab_data->cpu_stats = NULL;
+}
+
+void pfab_stats_clear(pfab_sched_data_t *pfab_data)
+{
+	size_t size = sizeof(struct pfab_cpu_stats) +
+		pfab_data->bands * sizeof(struct pfab_band_stats);
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		memset(per_cpu_ptr(pfab_data->cpu_stats, cpu), 0, size);
+	}
+}
+
+void pfab_stats_read(pfab_sched_data_t *pfab_data, struct pfab_stat_data *stats)
 {
-	static unsigned long counter = 0;
-	if (*pos == 0) {
-		return &counter;
+	struct pfab_cpu_stats *cpu_stats = NULL;
+	unsigned int start;
+	u64 bytes;
+	int cpu;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	for_each_possible_cpu(cpu) {
+		cpu_stats = per_cpu_ptr(pfab_data->cpu_stats, cpu);
+		do {
+			start = u64_stats_fetch_begin_bh(&cpu_stats->syncp);
+			bytes = cpu_stats->data.bytes;
+		} while (u64_stats_fetch_retry_bh(&cpu_stats->syncp, start));
+
+		stats->bytes += bytes;
+		stats->packets += cpu_stats->data.packets;
+		stats->drops += cpu_stats->data.drops;
+		stats->evictions += cpu_stats->data.evictions;
+		stats->non_ip_packet_counter += cpu_stats->data.non_ip_packet_counter;
+		stats->illegal_prio_occurance += cpu_stats->data.illegal_prio_occurance;
+		stats->marks += cpu_stats->data.marks;
+		stats->flow_evictions += cpu_stats->data.flow_evictions;
+		stats->flow_overflows += cpu_stats->data.flow_overflows;
+		for (i = 0; i < TC_PFABRIC_SOJOURN_BUCKETS; i++) {
+			stats->sojourn[i] += cpu_stats->data.sojourn[i];
+		}
 	}
-	else {
-		*pos = 0;
-		return NULL;
+}
+
+void pfab_stats_read_sojourn(pfab_sched_data_t *pfab_data, u32 group,
+							 u32 *counts)
+{
+	struct pfab_cpu_stats *cpu_stats = NULL;
+	int cpu;
+	int i;
+
+	memset(counts, 0, TC_PFABRIC_SOJOURN_BUCKETS * sizeof(*counts));
+	for_each_possible_cpu(cpu) {
+		cpu_stats = per_cpu_ptr(pfab_data->cpu_stats, cpu);
+		for (i = 0; i < TC_PFABRIC_SOJOURN_BUCKETS; i++) {
+			counts[i] += cpu_stats->band_sojourn[group][i];
+		}
 	}
 }
 
-static void *pfab_stats_proc_seq_next(struct seq_file *s, void *v, loff_t *pos)
+void pfab_stats_read_band(pfab_sched_data_t *pfab_data, int band,
+						  struct pfab_band_stats *stats)
 {
-	unsigned long *index = (unsigned long *)v;
-	(*index)++;
+	struct pfab_band_stats *cpu_stats = NULL;
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+	for_each_possible_cpu(cpu) {
+		cpu_stats = &per_cpu_ptr(pfab_data->cpu_stats, cpu)->band[band];
+		stats->packets += cpu_stats->packets;
+		stats->drops += cpu_stats->drops;
+		stats->evictions += cpu_stats->evictions;
+	}
+}
 
-	return NULL;
+static void pfab_stats_show_bitmap(struct seq_file *s, pfab_sched_data_t *pfab_data)
+{
+	int i;
+
+	for(i = 0; i < BITS_TO_LONGS(pfab_data->bands); i++) {
+		seq_printf(s, "%0*lx\n", BITS_PER_LONG / 4, pfab_data->bitmap.words[i]);
+	}
 }
 
-static void pfab_stats_proc_seq_stop(struct seq_file *s, void *v)
+static void pfab_stats_show_sojourn(struct seq_file *s, const u32 *counts)
 {
-	/* nothing to do, we use a static value in start() */
+	int i;
+
+	for (i = 0; i < TC_PFABRIC_SOJOURN_BUCKETS; i++) {
+		seq_printf(s, " %u", counts[i]);
+	}
+	seq_printf(s, "\n");
 }
 
 static int pfab_stats_proc_seq_show(struct seq_file *s, void *v)
 {
+	struct Qdisc *sch = s->private;
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct pfab_stat_data stats;
+	struct pfab_band_stats band_stats;
+	u32 counts[TC_PFABRIC_SOJOURN_BUCKETS];
+	u32 groups;
 	int i;
-		
+
 	TRACE( printk("pfab_stats_proc_seq_show called\n") );
 
-	/* TODO: support more than one p_fab context. */
-	seq_printf(s, 
-		   "limit: %u\ndisable_dequeue: %d\ndropped:%u\npackets:%u\nbytes:%llu\n"
-		   "Non-IP packets: %u\nillegal priority occurances: %u\n",
-		   pfab_stats.limit,
-		   pfab_stats.disable_dequeue,
-		   pfab_stats.tc_stats.drops, 
-		   pfab_stats.tc_stats.packets, 
-		   pfab_stats.tc_stats.bytes,
-		   pfab_stats.non_ip_packet_counter,
-		   pfab_stats.illegal_prio_occurance);
+	/* A change of the number of bands replaces the arrays read here */
+	sch_tree_lock(sch);
+	pfab_stats_read(pfab_data, &stats);
+	seq_printf(s,
+		   "limit: %u\nlimit_bytes: %u\nbacklog: %u\ndisable_dequeue: %d\nbands: %u\n"
+		   "dropped:%u\nevicted:%u\npackets:%u\nbytes:%llu\n"
+		   "Non-IP packets: %u\nillegal priority occurances: %u\nmarked:%u\n",
+		   pfab_data->limit,
+		   pfab_data->limit_bytes,
+		   sch->qstats.backlog,
+		   pfab_data->disable_dequeue,
+		   pfab_data->bands,
+		   stats.drops,
+		   stats.evictions,
+		   stats.packets,
+		   stats.bytes,
+		   stats.non_ip_packet_counter,
+		   stats.illegal_prio_occurance,
+		   stats.marks);
+
+	if (pfab_data->mark_threshold || pfab_data->mark_threshold_bytes) {
+		seq_printf(s, "mark_threshold: %u\nmark_threshold_bytes: %u\n"
+				   "mark_by: %s\n",
+				   pfab_data->mark_threshold, pfab_data->mark_threshold_bytes,
+				   PFAB_MARK_PRIO == pfab_data->mark_by ? "prio" : "total");
+	}
 
-	seq_printf(s, "bitmap:\n");
-	for(i = 0; i < BITMAP_SIZE; i++) {
-		seq_printf(s, "%08x\n", pfab_stats.bitmap[i]);
+	if (pfab_data->flows) {
+		seq_printf(s, "flows: %u/%u\nflow evictions: %u\nflow overflows: %u\n",
+				   pfab_data->flow_table.count, pfab_data->flows,
+				   stats.flow_evictions, stats.flow_overflows);
 	}
 
+	seq_printf(s, "bitmap:\n");
+	pfab_stats_show_bitmap(s, pfab_data);
+
 	seq_printf(s, "Packet distribution across bands:\n");
-	for (i = 0; i < NUM_BANDS; ++i) {
-		seq_printf(s, "Band %u: %u\n", i, pfab_stats.per_band_packet_counter[i]);
+	for (i = 0; i < pfab_data->bands; ++i) {
+		pfab_stats_read_band(pfab_data, i, &band_stats);
+		seq_printf(s, "Band %u: %u (dropped %u, evicted %u, backlog %u)\n", i,
+				   band_stats.packets, band_stats.drops, band_stats.evictions,
+				   pfab_data->band_backlog[i]);
+	}
+
+	seq_printf(s, "Sojourn times, packets per bucket "
+			   "(<1us, <2us, <4us, ..., >=%uus):\nAll:",
+			   1U << (TC_PFABRIC_SOJOURN_BUCKETS - 2));
+	pfab_stats_show_sojourn(s, stats.sojourn);
+
+	groups = PFAB_MODE_BANDS == pfab_data->mode ?
+		((pfab_data->bands - 1) >> pfab_data->sojourn_shift) + 1 : 0;
+	for (i = 0; i < groups; i++) {
+		pfab_stats_read_sojourn(pfab_data, i, counts);
+		seq_printf(s, "Bands %u-%u:", i << pfab_data->sojourn_shift,
+				   min(((i + 1) << pfab_data->sojourn_shift) - 1,
+					   pfab_data->bands - 1));
+		pfab_stats_show_sojourn(s, counts);
 	}
 
+	sch_tree_unlock(sch);
 	return 0;
 }
 
 static int pfab_csvstats_proc_seq_show(struct seq_file *s, void *v) {
-	
-	int i;
+
+	struct Qdisc *sch = s->private;
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct pfab_stat_data stats;
 
 	TRACE( printk("pfab_csvstats_proc_seq_show called\n") );
 
-	/* TODO: support more than one p_fab context. */
-	seq_printf(s, 
+	sch_tree_lock(sch);
+	pfab_stats_read(pfab_data, &stats);
+	seq_printf(s,
 		   "limit,\tdropped,\tenqueues,\tdequeues,\tnon-ip packets,\tillegal priority\n"
 		   "%u,\t%u,\t\t%u,\t\t%llu,\t\t%u\t\t%u\n",
-		   pfab_stats.limit, 
-		   pfab_stats.tc_stats.drops, 
-		   pfab_stats.tc_stats.packets, 
-		   pfab_stats.tc_stats.bytes,
-		   pfab_stats.non_ip_packet_counter,
-		   pfab_stats.illegal_prio_occurance);
+		   pfab_data->limit,
+		   stats.drops + stats.evictions,
+		   stats.packets,
+		   stats.bytes,
+		   stats.non_ip_packet_counter,
+		   stats.illegal_prio_occurance);
 
 	seq_printf(s, "bitmap\n");
-	for(i = 0; i < BITMAP_SIZE; i++) {
-		seq_printf(s, "%08x\n", pfab_stats.bitmap[i]);
-	}
+	pfab_stats_show_bitmap(s, pfab_data);
 
+	sch_tree_unlock(sch);
 	return 0;
 }
 
-static struct proc_dir_entry *pfab_stats_proc = NULL;
-
-static struct seq_operations pfab_stats_proc_seq_ops = {
-	.start = pfab_stats_proc_seq_start,
-	.next = pfab_stats_proc_seq_next,
-	.stop = pfab_stats_proc_seq_stop,
-	.show = pfab_stats_proc_seq_show
-};
-
 static int pfab_stats_proc_open(struct inode *inode, struct file *file)
 {
 	TRACE( printk("pfab_stats_proc_open called\n") );
-	return seq_open(file, &pfab_stats_proc_seq_ops);
+	return single_open(file, pfab_stats_proc_seq_show, PDE(inode)->data);
 }
 
 static struct file_operations pfab_stats_proc_file_ops = {
@@ -107,24 +277,15 @@ static struct file_operations pfab_stats_proc_file_ops = {
 	.open = pfab_stats_proc_open,
 	.read = seq_read,
 	.llseek = seq_lseek,
-	.release = seq_release
+	.release = single_release
 };
 
 
 /* For program friendly CSV stats */
-static struct proc_dir_entry *pfab_csvstats_proc;
-
-static struct seq_operations pfab_csvstats_proc_seq_ops = {
-	.start = pfab_stats_proc_seq_start,
-	.next = pfab_stats_proc_seq_next,
-	.stop = pfab_stats_proc_seq_stop,
-	.show = pfab_csvstats_proc_seq_show
-};
-
 static int pfab_csvstats_proc_open(struct inode *inode, struct file *file)
 {
 	TRACE( printk("pfab_csvstats_proc_open called\n") );
-	return seq_open(file, &pfab_csvstats_proc_seq_ops);
+	return single_open(file, pfab_csvstats_proc_seq_show, PDE(inode)->data);
 }
 
 static struct file_operations pfab_csvstats_proc_file_ops = {
@@ -132,51 +293,106 @@ static struct file_operations pfab_csvstats_proc_file_ops = {
 	.open = pfab_csvstats_proc_open,
 	.read = seq_read,
 	.llseek = seq_lseek,
-	.release = seq_release
+	.release = single_release
 };
 
 
-int pfab_stats_init(const char* suffix) {
+static int pfab_stats_suffix_in_use(const char *suffix)
+{
+	pfab_sched_data_t *pfab_data = NULL;
+
+	list_for_each_entry(pfab_data, &pfab_stats_instances, stats_list) {
+		if (0 == strcmp(pfab_data->proc_suffix, suffix)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* The first instance on a device is named after the device, additional
+   ones (e.g. one per TX queue) also get their handle appended. */
+static int pfab_stats_choose_suffix(struct Qdisc *sch)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct net_device *netdev = qdisc_dev(sch);
+	u32 id = sch->handle ? sch->handle : sch->parent;
+
+	snprintf(pfab_data->proc_suffix, PFAB_PROC_SUFFIX_LEN, "%s", netdev->name);
+	if (!pfab_stats_suffix_in_use(pfab_data->proc_suffix)) {
+		return 0;
+	}
+
+	snprintf(pfab_data->proc_suffix, PFAB_PROC_SUFFIX_LEN, "%s_%x:%x",
+			 netdev->name, TC_H_MAJ(id) >> 16, TC_H_MIN(id));
+	if (!pfab_stats_suffix_in_use(pfab_data->proc_suffix)) {
+		return 0;
+	}
+
+	return -EEXIST;
+}
+
+int pfab_stats_init(struct Qdisc *sch) {
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
 	int ret = 0;
 	char proc_name[MAX_PROC_NAME_LEN + 1] = {0};
 
-	TRACE( pr_debug("pfab_stats_init (%s)\n", suffix) );
-	
-	snprintf(proc_name, MAX_PROC_NAME_LEN, PFAB_STATS_PROC_NAME, suffix);
-	pfab_stats_proc = create_proc_entry(proc_name, 0, NULL);
-	if(pfab_stats_proc) {
-		pfab_stats_proc->proc_fops = &pfab_stats_proc_file_ops;
-	} else {
+	mutex_lock(&pfab_stats_mutex);
+
+	ret = pfab_stats_choose_suffix(sch);
+	if (ret < 0) {
+		TRACE( printk("No free proc file name. Failed initializing stats\n") );
+		goto out;
+	}
+
+	TRACE( pr_debug("pfab_stats_init (%s)\n", pfab_data->proc_suffix) );
+
+	snprintf(proc_name, MAX_PROC_NAME_LEN, PFAB_STATS_PROC_NAME,
+			 pfab_data->proc_suffix);
+	if (NULL == proc_create_data(proc_name, 0, NULL,
+								 &pfab_stats_proc_file_ops, sch)) {
 		TRACE( printk("pfab_stats_proc = NULL. Failed initializing stats\n") );
-		ret = 1;
+		ret = -ENOMEM;
 		goto out;
 	}
 
-	snprintf(proc_name, MAX_PROC_NAME_LEN, PFAB_CSVSTATS_PROC_NAME, suffix);
-	pfab_csvstats_proc = create_proc_entry(proc_name, 0, NULL);
-	if(pfab_csvstats_proc) {
-		pfab_csvstats_proc->proc_fops = &pfab_csvstats_proc_file_ops;
-	} else {
+	snprintf(proc_name, MAX_PROC_NAME_LEN, PFAB_CSVSTATS_PROC_NAME,
+			 pfab_data->proc_suffix);
+	if (NULL == proc_create_data(proc_name, 0, NULL,
+								 &pfab_csvstats_proc_file_ops, sch)) {
 		TRACE( printk("pfab_csvstats_proc = NULL. Failed initializing stats\n") );
-		ret = 1;
+		ret = -ENOMEM;
+		snprintf(proc_name, MAX_PROC_NAME_LEN, PFAB_STATS_PROC_NAME,
+				 pfab_data->proc_suffix);
 		remove_proc_entry(proc_name, NULL);
 		goto out;
 	}
 
+	list_add(&pfab_data->stats_list, &pfab_stats_instances);
 	TRACE( printk("Initilized stats\n") );
 
  out:
+	mutex_unlock(&pfab_stats_mutex);
 	return ret;
 }
 
-void pfab_stats_exit(const char* suffix) {
+void pfab_stats_exit(struct Qdisc *sch) {
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
 	char proc_name[MAX_PROC_NAME_LEN + 1] = {0};
 
 	TRACE( printk("pfab_stats_exit called\n") );
 
-	snprintf(proc_name, MAX_PROC_NAME_LEN, PFAB_STATS_PROC_NAME, suffix);
+	mutex_lock(&pfab_stats_mutex);
+
+	snprintf(proc_name, MAX_PROC_NAME_LEN, PFAB_STATS_PROC_NAME,
+			 pfab_data->proc_suffix);
 	remove_proc_entry(proc_name, NULL);
 
-	snprintf(proc_name, MAX_PROC_NAME_LEN, PFAB_CSVSTATS_PROC_NAME, suffix);
+	snprintf(proc_name, MAX_PROC_NAME_LEN, PFAB_CSVSTATS_PROC_NAME,
+			 pfab_data->proc_suffix);
 	remove_proc_entry(proc_name, NULL);
+
+	list_del(&pfab_data->stats_list);
+
+	mutex_unlock(&pfab_stats_mutex);
 }
@@ -1,11 +1,104 @@
+
 #ifndef __STATS_H__
 #define __STATS_H__
 
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include "sch_pfab.h"
+
 #define PFAB_STATS_PROC_NAME "pfabric_stats_%s"
 #define PFAB_CSVSTATS_PROC_NAME "pfabric_stats_csv_%s"
 #define MAX_PROC_NAME_LEN (255)
 
-int pfab_stats_init(const char* suffix);
-void pfab_stats_exit(const char* suffix);
+int pfab_stats_init(struct Qdisc *sch);
+void pfab_stats_exit(struct Qdisc *sch);
+
+int pfab_stats_alloc(pfab_sched_data_t *pfab_data);
+void pfab_stats_free(pfab_sched_data_t *pfab_data);
+
+/* Changing the number of bands: the counters for the new number of bands
+   are allocated first, then swapped in under the qdisc lock by
+   pfab_stats_replace(), which carries the current counts over and returns
+   the old counters, to be released with free_percpu(). */
+struct pfab_cpu_stats __percpu *pfab_stats_alloc_bands(u32 bands);
+struct pfab_cpu_stats __percpu *pfab_stats_replace(pfab_sched_data_t *pfab_data,
+		struct pfab_cpu_stats __percpu *cpu_stats, u32 bands);
+void pfab_stats_clear(pfab_sched_data_t *pfab_data);
+
+/* Add up the per CPU counters */
+void pfab_stats_read(pfab_sched_data_t *pfab_data, struct pfab_stat_data *stats);
+void pfab_stats_read_band(pfab_sched_data_t *pfab_data, int band,
+						  struct pfab_band_stats *stats);
+void pfab_stats_read_sojourn(pfab_sched_data_t *pfab_data, u32 group,
+							 u32 *counts);
+
+/* Fast path updates. Called under the qdisc lock with BH disabled. */
+#define PFAB_STATS_INC(pfab_data, field) \
+	(this_cpu_ptr((pfab_data)->cpu_stats)->data.field++)
+
+static inline void pfab_stats_enqueued(pfab_sched_data_t *pfab_data,
+									   struct sk_buff *skb, int band)
+{
+	struct pfab_cpu_stats *stats = this_cpu_ptr(pfab_data->cpu_stats);
+
+	u64_stats_update_begin(&stats->syncp);
+	stats->data.bytes += skb->len;
+	u64_stats_update_end(&stats->syncp);
+	stats->data.packets++;
+	if (band >= 0) {
+		stats->band[band].packets++;
+	}
+}
+
+/* An arriving packet was not admitted. band is -1 in heap mode. */
+static inline void pfab_stats_dropped(pfab_sched_data_t *pfab_data, int band)
+{
+	struct pfab_cpu_stats *stats = this_cpu_ptr(pfab_data->cpu_stats);
+
+	stats->data.drops++;
+	if (band >= 0) {
+		stats->band[band].drops++;
+	}
+}
+
+/* A packet was pushed out of the buffer. band is -1 in heap mode. */
+static inline void pfab_stats_evicted(pfab_sched_data_t *pfab_data, int band)
+{
+	struct pfab_cpu_stats *stats = this_cpu_ptr(pfab_data->cpu_stats);
+
+	stats->data.evictions++;
+	if (band >= 0) {
+		stats->band[band].evictions++;
+	}
+}
+
+/* Arrival time kept in the control block, in units of the first
+   histogram bucket (2^PFAB_SOJOURN_MIN_SHIFT ns). It wraps after about
+   73 minutes, far beyond any sojourn. */
+static inline u32 pfab_sojourn_now(void)
+{
+	return (u32) (ktime_to_ns(ktime_get()) >> PFAB_SOJOURN_MIN_SHIFT);
+}
+
+/* Histogram bucket of a sojourn time, see TC_PFABRIC_SOJOURN_BUCKETS */
+static inline int pfab_sojourn_bucket(u32 sojourn)
+{
+	return sojourn ?
+		min_t(int, ilog2(sojourn) + 1, TC_PFABRIC_SOJOURN_BUCKETS - 1) : 0;
+}
+
+/* A packet left the buffer. band is -1 in heap mode. */
+static inline void pfab_stats_departed(pfab_sched_data_t *pfab_data,
+									   struct sk_buff *skb, int band)
+{
+	struct pfab_cpu_stats *stats = this_cpu_ptr(pfab_data->cpu_stats);
+	int bucket = pfab_sojourn_bucket(pfab_sojourn_now() -
+									 pfab_skb_cb(skb)->enqueue_time);
+
+	stats->data.sojourn[bucket]++;
+	if (band >= 0) {
+		stats->band_sojourn[band >> pfab_data->sojourn_shift][bucket]++;
+	}
+}
 
 #endif
@@ -0,0 +1,204 @@
+/*
+ * Userspace build of the pFabric scheduler: out of line parts of the
+ * kernel API emulation.
+ */
+
+#include "kernel_user.h"
+
+int pfab_user_verbose = 0;
+
+int printk(const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	if (!pfab_user_verbose) {
+		return 0;
+	}
+
+	va_start(args, fmt);
+	len = vfprintf(stderr, fmt, args);
+	va_end(args);
+	return len;
+}
+
+void pfab_user_bug(const char *file, int line, const char *cond)
+{
+	fprintf(stderr, "BUG at %s:%d: %s\n", file, line, cond);
+	abort();
+}
+
+void *__alloc_percpu(size_t size, size_t align)
+{
+	void *p = NULL;
+
+	if (align < sizeof(void *)) {
+		align = sizeof(void *);
+	}
+
+	if (posix_memalign(&p, align, size ? size : 1)) {
+		return NULL;
+	}
+
+	memset(p, 0, size);
+	return p;
+}
+
+unsigned long volatile jiffies = 0;
+
+ktime_t ktime_get(void)
+{
+	struct timespec ts;
+	ktime_t kt;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	kt.tv64 = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	return kt;
+}
+
+/* xorshift32, deterministic so that runs can be reproduced */
+static u32 random_state = 2463534242U;
+
+u32 net_random(void)
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return random_state;
+}
+
+/* Freed packets are kept for reuse like a slab cache would, so that
+   benchmarks do not measure malloc. Sizes are rounded up to a power of
+   2 with a free list per size. */
+#define SKB_CACHE_MIN_SHIFT (8)
+#define SKB_CACHE_CLASSES (9)
+
+static struct sk_buff *skb_cache[SKB_CACHE_CLASSES];
+
+static int skb_cache_class(unsigned int size)
+{
+	int shift = SKB_CACHE_MIN_SHIFT;
+
+	while ((1U << shift) < size) {
+		shift++;
+	}
+
+	return shift - SKB_CACHE_MIN_SHIFT;
+}
+
+struct sk_buff *alloc_skb(unsigned int size, gfp_t flags)
+{
+	int class = skb_cache_class(size);
+	struct sk_buff *skb = NULL;
+
+	if (class < SKB_CACHE_CLASSES) {
+		size = 1U << (class + SKB_CACHE_MIN_SHIFT);
+		skb = skb_cache[class];
+	}
+
+	if (skb) {
+		skb_cache[class] = skb->next;
+	}
+	else {
+		skb = malloc(sizeof(*skb) + size);
+		if (NULL == skb) {
+			return NULL;
+		}
+	}
+
+	memset(skb, 0, sizeof(*skb));
+	skb->head = skb->data = (unsigned char *) (skb + 1);
+	skb->truesize = size;
+	return skb;
+}
+
+void kfree_skb(struct sk_buff *skb)
+{
+	int class;
+
+	if (NULL == skb) {
+		return;
+	}
+
+	class = skb_cache_class(skb->truesize);
+	if (class >= SKB_CACHE_CLASSES) {
+		free(skb);
+		return;
+	}
+
+	skb->next = skb_cache[class];
+	skb_cache[class] = skb;
+}
+
+int gnet_stats_copy_app(struct gnet_dump *d, void *st, int len)
+{
+	if (len > d->size) {
+		return -1;
+	}
+
+	memcpy(d->buf, st, len);
+	d->len = len;
+	return 0;
+}
+
+int seq_printf(struct seq_file *s, const char *fmt, ...)
+{
+	return 0;
+}
+
+ssize_t seq_read(struct file *file, char *buf, size_t size, loff_t *ppos)
+{
+	return 0;
+}
+
+loff_t seq_lseek(struct file *file, loff_t offset, int whence)
+{
+	return 0;
+}
+
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+				void *data)
+{
+	return 0;
+}
+
+int single_release(struct inode *inode, struct file *file)
+{
+	return 0;
+}
+
+struct proc_dir_entry *PDE(const struct inode *inode)
+{
+	return NULL;
+}
+
+static struct proc_dir_entry proc_entry;
+
+struct proc_dir_entry *proc_create_data(const char *name, int mode,
+		struct proc_dir_entry *parent, const struct file_operations *fops,
+		void *data)
+{
+	return &proc_entry;
+}
+
+void remove_proc_entry(const char *name, struct proc_dir_entry *parent)
+{
+}
+
+unsigned int pfab_user_tree_decrease = 0;
+
+void (*pfab_user_genl_rcv)(const struct sk_buff *skb) = NULL;
+
+int genlmsg_multicast(struct sk_buff *skb, u32 pid, unsigned int group,
+					  gfp_t flags)
+{
+	int retval = -ESRCH;
+
+	if (pfab_user_genl_rcv) {
+		pfab_user_genl_rcv(skb);
+		retval = 0;
+	}
+
+	kfree_skb(skb);
+	return retval;
+}
@@ -0,0 +1,1101 @@
+/*
+ * Userspace build of the pFabric scheduler.
+ *
+ * Just enough of the kernel API for sch_pfab.c and the other parts of the
+ * qdisc to build as a regular userspace library. It is included
+ * before everything else, the kernel headers included by those files are
+ * empty placeholders generated by the Makefile. Single threaded: there is
+ * one CPU and locks do nothing.
+ *
+ * The API is the one of Linux 3.5, the kernel the module is built
+ * against, so that code building here also builds there: do not add
+ * functions or definitions that kernel lacks.
+ */
+
+#ifndef __KERNEL_USER_H__
+#define __KERNEL_USER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Types */
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef long long s64;
+typedef u8 __u8;
+typedef u16 __u16;
+typedef u32 __u32;
+typedef u64 __u64;
+typedef s32 __s32;
+typedef s64 __s64;
+typedef u16 __be16;
+typedef u32 __be32;
+typedef unsigned int gfp_t;
+
+#define __read_mostly
+#define __init
+#define __exit
+#define __percpu
+#define __always_unused __attribute__((unused))
+#define L1_CACHE_BYTES (64)
+#define ____cacheline_aligned_in_smp __attribute__((aligned(L1_CACHE_BYTES)))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define barrier() __asm__ __volatile__("" ::: "memory")
+#define ACCESS_ONCE(x) (*(volatile typeof(x) *)&(x))
+
+#define THIS_MODULE NULL
+#define MODULE_LICENSE(x)
+#define module_init(fn) \
+	static int (*__pfab_user_init)(void) __attribute__((unused)) = fn
+#define module_exit(fn) \
+	static void (*__pfab_user_exit)(void) __attribute__((unused)) = fn
+
+/* Errors */
+
+#define ENOENT 2
+#define ESRCH 3
+#define ENOMEM 12
+#define EBUSY 16
+#define EEXIST 17
+#define EINVAL 22
+#define ENOSPC 28
+#define ERANGE 34
+#define EMSGSIZE 90
+#define EOPNOTSUPP 95
+#define ENOBUFS 105
+
+/* Logging, silent unless pfab_user_verbose is set */
+
+extern int pfab_user_verbose;
+int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+#define pr_err(...) printk(__VA_ARGS__)
+#define pr_alert(...) printk(__VA_ARGS__)
+#define pr_warning(...) printk(__VA_ARGS__)
+#define pr_info(...) printk(__VA_ARGS__)
+#define pr_debug(...) do { if (0) printk(__VA_ARGS__); } while (0)
+
+/* Assertions abort, so that the fuzzer notices them */
+#define BUG_ON(cond) do { if (unlikely(cond)) pfab_user_bug(__FILE__, __LINE__, #cond); } while (0)
+#define BUILD_BUG_ON(cond) ((void) sizeof(char[1 - 2 * !!(cond)]))
+void pfab_user_bug(const char *file, int line, const char *cond)
+	__attribute__((noreturn));
+
+/* Arithmetic */
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) ((t) (a) < (t) (b) ? (t) (a) : (t) (b))
+#define max_t(t, a, b) ((t) (a) > (t) (b) ? (t) (a) : (t) (b))
+#define swap(a, b) \
+	do { __typeof__(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
+#define ilog2(n) ((int) (8 * sizeof(unsigned long long) - 1 - \
+						 __builtin_clzll((unsigned long long) (n))))
+
+static inline u64 div64_u64(u64 dividend, u64 divisor)
+{
+	return dividend / divisor;
+}
+
+/* Byte order, the mock packets are built in network order */
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define htons(x) ((__be16) __builtin_bswap16(x))
+#define htonl(x) ((__be32) __builtin_bswap32(x))
+#else
+#define htons(x) ((__be16) (x))
+#define htonl(x) ((__be32) (x))
+#endif
+#define ntohs(x) htons(x)
+#define ntohl(x) htonl(x)
+
+/* Bit operations */
+
+#define BITS_PER_LONG (8 * (int) sizeof(long))
+#define BIT_WORD(nr) ((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr) (1UL << ((nr) % BITS_PER_LONG))
+#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static inline unsigned long __ffs(unsigned long word)
+{
+	return __builtin_ctzl(word);
+}
+
+static inline unsigned long __fls(unsigned long word)
+{
+	return BITS_PER_LONG - 1 - __builtin_clzl(word);
+}
+
+static inline unsigned long ffz(unsigned long word)
+{
+	return __ffs(~word);
+}
+
+static inline int test_bit(int nr, const unsigned long *addr)
+{
+	return 1UL & (addr[BIT_WORD(nr)] >> (nr % BITS_PER_LONG));
+}
+
+static inline int find_next_bit(const unsigned long *addr, int size,
+								int offset)
+{
+	for ( ; offset < size; offset++) {
+		if (test_bit(offset, addr)) {
+			break;
+		}
+	}
+
+	return offset;
+}
+
+#define for_each_set_bit(bit, addr, size) \
+	for ((bit) = find_next_bit((addr), (size), 0); \
+		 (bit) < (size); \
+		 (bit) = find_next_bit((addr), (size), (bit) + 1))
+
+/* Memory */
+
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 1
+
+void *__alloc_percpu(size_t size, size_t align);
+
+/* Cache line aligned like the kmalloc caches of that size, so that
+   ____cacheline_aligned_in_smp members are aligned. Memory is always
+   zeroed. */
+static inline void *kmalloc(size_t size, gfp_t flags)
+{
+	return __alloc_percpu(size, L1_CACHE_BYTES);
+}
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+	return kmalloc(size, flags);
+}
+
+static inline void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+	if (size && n > SIZE_MAX / size) {
+		return NULL;
+	}
+
+	return kmalloc(n * size, flags);
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *) p);
+}
+
+/* Object caches are plain allocations of the object size. */
+#define SLAB_HWCACHE_ALIGN 0
+
+struct kmem_cache {
+	size_t size;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name,
+		size_t size, size_t align, unsigned long flags, void (*ctor)(void *))
+{
+	struct kmem_cache *cache = malloc(sizeof(*cache));
+
+	if (cache) {
+		cache->size = size;
+	}
+	return cache;
+}
+
+static inline void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	free(cache);
+}
+
+static inline void *kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags)
+{
+	return kmalloc(cache->size, flags);
+}
+
+static inline void kmem_cache_free(struct kmem_cache *cache, void *p)
+{
+	kfree(p);
+}
+
+/* Per CPU data and statistics, with a single CPU */
+
+#define free_percpu(p) free(p)
+#define per_cpu_ptr(p, cpu) ((void) (cpu), (p))
+#define this_cpu_ptr(p) (p)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+
+struct u64_stats_sync {
+};
+
+#define u64_stats_update_begin(syncp) do { } while (0)
+#define u64_stats_update_end(syncp) do { } while (0)
+#define u64_stats_fetch_begin_bh(syncp) ((void) (syncp), 0)
+#define u64_stats_fetch_retry_bh(syncp, start) ((void) (syncp), (start) != 0)
+
+/* Locking */
+
+struct mutex {
+};
+
+#define DEFINE_MUTEX(name) struct mutex name
+#define mutex_lock(m) ((void) (m))
+#define mutex_unlock(m) ((void) (m))
+
+typedef struct {
+} spinlock_t;
+
+#define spin_lock(l) ((void) (l))
+#define spin_unlock(l) ((void) (l))
+
+/* Lists */
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD(name) struct list_head name = { &(name), &(name) }
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list->prev = list;
+}
+
+static inline void list_add(struct list_head *entry, struct list_head *head)
+{
+	entry->next = head->next;
+	entry->prev = head;
+	head->next->prev = entry;
+	head->next = entry;
+}
+
+static inline void list_add_tail(struct list_head *entry,
+								 struct list_head *head)
+{
+	list_add(entry, head->prev);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	entry->next = entry->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+	list_del(entry);
+	INIT_LIST_HEAD(entry);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) \
+	list_entry((ptr)->next, type, member)
+/* The end is found without accessing the head as a member of an entry,
+   which the sanitizers report as misaligned for aligned entry types. */
+#define list_for_each_entry(pos, head, member) \
+	for (pos = list_entry((head)->next, typeof(*pos), member); \
+		 (struct list_head *) ((char *) pos + \
+							   offsetof(typeof(*pos), member)) != (head); \
+		 pos = list_entry(pos->member.next, typeof(*pos), member))
+
+/* Time */
+
+#define NSEC_PER_SEC 1000000000L
+
+typedef struct {
+	s64 tv64;
+} ktime_t;
+
+ktime_t ktime_get(void);
+#define ktime_to_ns(kt) ((kt).tv64)
+
+#define HZ 1000
+extern unsigned long volatile jiffies;
+#define msecs_to_jiffies(m) ((unsigned long) (m) * HZ / 1000)
+
+/* Timers never fire: mod_timer records the expiry, for the callers to run
+   the function. */
+struct timer_list {
+	unsigned long expires;
+	void (*function)(unsigned long);
+	unsigned long data;
+	int pending;
+};
+
+static inline void setup_timer(struct timer_list *timer,
+							   void (*function)(unsigned long),
+							   unsigned long data)
+{
+	timer->function = function;
+	timer->data = data;
+	timer->pending = 0;
+}
+
+static inline int timer_pending(const struct timer_list *timer)
+{
+	return timer->pending;
+}
+
+static inline int mod_timer(struct timer_list *timer, unsigned long expires)
+{
+	int pending = timer->pending;
+
+	timer->expires = expires;
+	timer->pending = 1;
+	return pending;
+}
+
+static inline int del_timer_sync(struct timer_list *timer)
+{
+	int pending = timer->pending;
+
+	timer->pending = 0;
+	return pending;
+}
+
+/* Random numbers and hashing */
+
+u32 net_random(void);
+
+#define __jhash_rot(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
+#define __jhash_final(a, b, c) do {			\
+	c ^= b; c -= __jhash_rot(b, 14);		\
+	a ^= c; a -= __jhash_rot(c, 11);		\
+	b ^= a; b -= __jhash_rot(a, 25);		\
+	c ^= b; c -= __jhash_rot(b, 16);		\
+	a ^= c; a -= __jhash_rot(c, 4);			\
+	b ^= a; b -= __jhash_rot(a, 14);		\
+	c ^= b; c -= __jhash_rot(b, 24);		\
+} while (0)
+
+static inline u32 jhash_3words(u32 a, u32 b, u32 c, u32 initval)
+{
+	a += 0xdeadbeef + (3 << 2) + initval;
+	b += 0xdeadbeef + (3 << 2) + initval;
+	c += 0xdeadbeef + (3 << 2) + initval;
+	__jhash_final(a, b, c);
+	return c;
+}
+
+#define __jhash_mix(a, b, c) do {			\
+	a -= c; a ^= __jhash_rot(c, 4); c += b;	\
+	b -= a; b ^= __jhash_rot(a, 6); a += c;	\
+	c -= b; c ^= __jhash_rot(b, 8); b += a;	\
+	a -= c; a ^= __jhash_rot(c, 16); c += b;	\
+	b -= a; b ^= __jhash_rot(a, 19); a += c;	\
+	c -= b; c ^= __jhash_rot(b, 4); b += a;	\
+} while (0)
+
+static inline u32 jhash2(const u32 *k, u32 length, u32 initval)
+{
+	u32 a, b, c;
+
+	a = b = c = 0xdeadbeef + (length << 2) + initval;
+	while (length > 3) {
+		a += k[0];
+		b += k[1];
+		c += k[2];
+		__jhash_mix(a, b, c);
+		length -= 3;
+		k += 3;
+	}
+
+	switch (length) {
+	case 3: c += k[2];
+	case 2: b += k[1];
+	case 1: a += k[0];
+		__jhash_final(a, b, c);
+	case 0:
+		break;
+	}
+
+	return c;
+}
+
+/* Packets */
+
+#define IFNAMSIZ 16
+#define IPPROTO_IPIP 4
+#define IPPROTO_TCP 6
+#define IPPROTO_UDP 17
+#define IPPROTO_IPV6 41
+#define IPPROTO_GRE 47
+#define IP_MF 0x2000
+#define IP_OFFSET 0x1FFF
+#define ETH_ALEN 6
+#define ETH_P_IP 0x0800
+#define ETH_P_8021Q 0x8100
+#define ETH_P_IPV6 0x86DD
+#define ETH_P_TEB 0x6558
+#define INET_ECN_MASK 3
+
+struct ethhdr {
+	unsigned char h_dest[6];
+	unsigned char h_source[6];
+	__be16 h_proto;
+} __attribute__((packed));
+
+#define VLAN_PRIO_MASK 0xe000
+#define VLAN_PRIO_SHIFT 13
+#define VLAN_TAG_PRESENT 0x1000
+
+struct vlan_hdr {
+	__be16 h_vlan_TCI;
+	__be16 h_vlan_encapsulated_proto;
+};
+
+/* GRE flags, in network order */
+#define GRE_CSUM htons(0x8000)
+#define GRE_ROUTING htons(0x4000)
+#define GRE_KEY htons(0x2000)
+#define GRE_SEQ htons(0x1000)
+#define GRE_VERSION htons(0x0007)
+
+struct iphdr {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	__u8 ihl:4, version:4;
+#else
+	__u8 version:4, ihl:4;
+#endif
+	__u8 tos;
+	__be16 tot_len;
+	__be16 id;
+	__be16 frag_off;
+	__u8 ttl;
+	__u8 protocol;
+	__u16 check;
+	__be32 saddr;
+	__be32 daddr;
+};
+
+#define NEXTHDR_HOP 0
+#define NEXTHDR_ROUTING 43
+#define NEXTHDR_FRAGMENT 44
+#define NEXTHDR_DEST 60
+
+struct in6_addr {
+	__be32 s6_addr32[4];
+};
+
+struct ipv6hdr {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	__u8 priority:4, version:4;
+#else
+	__u8 version:4, priority:4;
+#endif
+	__u8 flow_lbl[3];
+	__be16 payload_len;
+	__u8 nexthdr;
+	__u8 hop_limit;
+	struct in6_addr saddr;
+	struct in6_addr daddr;
+};
+
+struct ipv6_opt_hdr {
+	__u8 nexthdr;
+	__u8 hdrlen;
+};
+
+#define ipv6_optlen(p) (((p)->hdrlen + 1) << 3)
+
+static inline __u8 ipv6_get_dsfield(const struct ipv6hdr *ipv6h)
+{
+	return ntohs(*(const __be16 *) ipv6h) >> 4;
+}
+
+struct udphdr {
+	__be16 source;
+	__be16 dest;
+	__be16 len;
+	__u16 check;
+};
+
+/* Mock sk_buff: a linear buffer and the fields the qdisc looks at. */
+struct sk_buff {
+	struct sk_buff *next, *prev;
+	unsigned int len;
+	__u32 priority;
+	__u32 mark;
+	__be16 protocol;
+	__u16 vlan_tci;			//Tag to insert, if VLAN_TAG_PRESENT.
+	char cb[48] __attribute__((aligned(8)));
+	unsigned char *head;
+	unsigned char *data;
+	unsigned int truesize;		//Size of the data buffer.
+	unsigned int mac_header;
+	unsigned int network_header;
+};
+
+struct sk_buff_head {
+	struct sk_buff *next, *prev;
+	__u32 qlen;
+};
+
+struct sk_buff *alloc_skb(unsigned int size, gfp_t flags);
+void kfree_skb(struct sk_buff *skb);
+
+#define NET_IP_ALIGN (2)
+
+static inline void skb_reserve(struct sk_buff *skb, int len)
+{
+	skb->data += len;
+}
+
+static inline unsigned char *skb_put(struct sk_buff *skb, unsigned int len)
+{
+	unsigned char *tail = skb->data + skb->len;
+
+	skb->len += len;
+	return tail;
+}
+
+static inline unsigned char *skb_tail_pointer(const struct sk_buff *skb)
+{
+	return skb->data + skb->len;
+}
+
+static inline void skb_reset_mac_header(struct sk_buff *skb)
+{
+	skb->mac_header = skb->data - skb->head;
+}
+
+static inline void skb_set_network_header(struct sk_buff *skb, int offset)
+{
+	skb->network_header = skb->data - skb->head + offset;
+}
+
+static inline int skb_network_offset(const struct sk_buff *skb)
+{
+	return skb->head + skb->network_header - skb->data;
+}
+
+static inline struct iphdr *ip_hdr(const struct sk_buff *skb)
+{
+	return (struct iphdr *) (skb->head + skb->network_header);
+}
+
+#define vlan_tx_tag_present(skb) ((skb)->vlan_tci & VLAN_TAG_PRESENT)
+#define vlan_tx_tag_get(skb) ((skb)->vlan_tci & ~VLAN_TAG_PRESENT)
+
+static inline void *skb_header_pointer(const struct sk_buff *skb, int offset,
+									   int len, void *buffer)
+{
+	if (offset < 0 || offset + len > (int) min(skb->len, skb->truesize)) {
+		return NULL;
+	}
+
+	return skb->data + offset;
+}
+
+/* Sets the CE codepoint of an ECT packet, or keeps it, and returns 1.
+   Returns 0 for other packets. The checksum is not maintained. */
+static inline int INET_ECN_set_ce(struct sk_buff *skb)
+{
+	struct iphdr *iph = NULL;
+
+	if (skb->protocol != htons(ETH_P_IP) ||
+		NULL == skb_header_pointer(skb, skb_network_offset(skb),
+								   sizeof(*iph), NULL)) {
+		return 0;
+	}
+
+	iph = ip_hdr(skb);
+	if (0 == (iph->tos & INET_ECN_MASK)) {
+		return 0;
+	}
+
+	iph->tos |= INET_ECN_MASK;
+	return 1;
+}
+
+static inline void __skb_queue_head_init(struct sk_buff_head *list)
+{
+	list->prev = list->next = (struct sk_buff *) list;
+	list->qlen = 0;
+}
+
+#define skb_queue_head_init(list) __skb_queue_head_init(list)
+
+static inline __u32 skb_queue_len(const struct sk_buff_head *list)
+{
+	return list->qlen;
+}
+
+static inline int skb_queue_empty(const struct sk_buff_head *list)
+{
+	return list->next == (const struct sk_buff *) list;
+}
+
+static inline struct sk_buff *skb_peek(const struct sk_buff_head *list)
+{
+	struct sk_buff *skb = list->next;
+
+	return skb == (const struct sk_buff *) list ? NULL : skb;
+}
+
+#define skb_queue_walk(queue, skb) \
+	for (skb = (queue)->next; skb != (struct sk_buff *) (queue); \
+		 skb = skb->next)
+
+static inline void __skb_queue_tail(struct sk_buff_head *list,
+									struct sk_buff *skb)
+{
+	struct sk_buff *prev = list->prev;
+
+	skb->next = (struct sk_buff *) list;
+	skb->prev = prev;
+	prev->next = skb;
+	list->prev = skb;
+	list->qlen++;
+}
+
+static inline void __skb_unlink(struct sk_buff *skb, struct sk_buff_head *list)
+{
+	list->qlen--;
+	skb->next->prev = skb->prev;
+	skb->prev->next = skb->next;
+	skb->next = skb->prev = NULL;
+}
+
+static inline struct sk_buff *__skb_dequeue(struct sk_buff_head *list)
+{
+	struct sk_buff *skb = skb_peek(list);
+
+	if (skb) {
+		__skb_unlink(skb, list);
+	}
+	return skb;
+}
+
+static inline void skb_queue_purge(struct sk_buff_head *list)
+{
+	struct sk_buff *skb = NULL;
+
+	while ((skb = __skb_dequeue(list)) != NULL) {
+		kfree_skb(skb);
+	}
+}
+
+/* Devices and qdiscs */
+
+struct net_device {
+	char name[IFNAMSIZ];
+	int ifindex;
+};
+
+struct netdev_queue {
+	struct net_device *dev;
+};
+
+#define NET_XMIT_SUCCESS 0x00
+#define NET_XMIT_DROP 0x01
+#define NET_XMIT_CN 0x02
+
+#define TC_H_MAJ(h) ((h) & 0xFFFF0000U)
+#define TC_H_MIN(h) ((h) & 0x0000FFFFU)
+#define TCA_OPTIONS 2
+
+struct gnet_stats_basic_packed {
+	__u64 bytes;
+	__u32 packets;
+};
+
+struct gnet_stats_queue {
+	__u32 qlen;
+	__u32 backlog;
+	__u32 drops;
+	__u32 requeues;
+	__u32 overlimits;
+};
+
+/* Receives the TCA_XSTATS payload of dump_stats */
+struct gnet_dump {
+	void *buf;
+	int size;
+	int len;
+};
+
+struct Qdisc;
+struct nlattr;
+
+struct Qdisc_ops {
+	struct Qdisc_ops *next;
+	char id[IFNAMSIZ];
+	int priv_size;
+	int (*enqueue)(struct sk_buff *, struct Qdisc *);
+	struct sk_buff *(*dequeue)(struct Qdisc *);
+	struct sk_buff *(*peek)(struct Qdisc *);
+	unsigned int (*drop)(struct Qdisc *);
+	int (*init)(struct Qdisc *, struct nlattr *);
+	void (*reset)(struct Qdisc *);
+	void (*destroy)(struct Qdisc *);
+	int (*change)(struct Qdisc *, struct nlattr *);
+	int (*dump)(struct Qdisc *, struct sk_buff *);
+	int (*dump_stats)(struct Qdisc *, struct gnet_dump *);
+	void *owner;
+};
+
+struct Qdisc {
+	const struct Qdisc_ops *ops;
+	__u32 handle;
+	__u32 parent;
+	struct netdev_queue *dev_queue;
+	struct sk_buff_head q;
+	struct gnet_stats_basic_packed bstats;
+	struct gnet_stats_queue qstats;
+	long privdata[] __attribute__((aligned(64)));
+};
+
+struct qdisc_skb_cb {
+	unsigned int pkt_len;
+	u16 slave_dev_queue_mapping;
+	u16 _pad;
+	unsigned char data[20];
+};
+
+static inline struct qdisc_skb_cb *qdisc_skb_cb(const struct sk_buff *skb)
+{
+	return (struct qdisc_skb_cb *) skb->cb;
+}
+
+static inline void qdisc_cb_private_validate(const struct sk_buff *skb, int sz)
+{
+	struct qdisc_skb_cb *qcb;
+
+	BUILD_BUG_ON(sizeof(skb->cb) < offsetof(struct qdisc_skb_cb, data) + sz);
+	BUILD_BUG_ON(sizeof(qcb->data) < sz);
+}
+
+static inline void *qdisc_priv(struct Qdisc *sch)
+{
+	return sch->privdata;
+}
+
+static inline struct net_device *qdisc_dev(const struct Qdisc *sch)
+{
+	return sch->dev_queue->dev;
+}
+
+static inline unsigned int qdisc_pkt_len(const struct sk_buff *skb)
+{
+	return qdisc_skb_cb(skb)->pkt_len;
+}
+
+#define sch_tree_lock(sch) do { } while (0)
+#define sch_tree_unlock(sch) do { } while (0)
+
+static inline spinlock_t *qdisc_root_sleeping_lock(const struct Qdisc *sch)
+{
+	static spinlock_t lock;
+
+	return &lock;
+}
+
+typedef u64 psched_time_t;
+
+#define PSCHED_SHIFT 6
+#define PSCHED_TICKS2NS(x) ((s64)(x) << PSCHED_SHIFT)
+#define PSCHED_NS2TICKS(x) ((x) >> PSCHED_SHIFT)
+
+/* There is no timer: the watchdog records when the qdisc asked to be
+   dequeued again, for the callers to check. */
+struct qdisc_watchdog {
+	u64 expires;		//ns, 0 if not scheduled.
+	struct Qdisc *qdisc;
+};
+
+static inline void qdisc_watchdog_init(struct qdisc_watchdog *wd,
+									   struct Qdisc *sch)
+{
+	wd->expires = 0;
+	wd->qdisc = sch;
+}
+
+static inline void qdisc_watchdog_schedule(struct qdisc_watchdog *wd,
+										   psched_time_t expires)
+{
+	wd->expires = PSCHED_TICKS2NS(expires);
+}
+
+static inline void qdisc_watchdog_cancel(struct qdisc_watchdog *wd)
+{
+	wd->expires = 0;
+}
+
+/* Userspace qdiscs have no parent. The packets the parents would take
+   off their qlen are added up, for the fuzzer to follow the qlen a
+   parent sees. */
+extern unsigned int pfab_user_tree_decrease;
+
+static inline void qdisc_tree_decrease_qlen(struct Qdisc *sch, unsigned int n)
+{
+	pfab_user_tree_decrease += n;
+}
+
+static inline void qdisc_bstats_update(struct Qdisc *sch,
+									   const struct sk_buff *skb)
+{
+	sch->bstats.bytes += qdisc_pkt_len(skb);
+	sch->bstats.packets++;
+}
+
+static inline int qdisc_drop(struct sk_buff *skb, struct Qdisc *sch)
+{
+	kfree_skb(skb);
+	sch->qstats.drops++;
+	return NET_XMIT_DROP;
+}
+
+static inline int __qdisc_enqueue_tail(struct sk_buff *skb, struct Qdisc *sch,
+									   struct sk_buff_head *list)
+{
+	__skb_queue_tail(list, skb);
+	sch->qstats.backlog += qdisc_pkt_len(skb);
+	return NET_XMIT_SUCCESS;
+}
+
+static inline struct sk_buff *__qdisc_dequeue_head(struct Qdisc *sch,
+												   struct sk_buff_head *list)
+{
+	struct sk_buff *skb = __skb_dequeue(list);
+
+	if (likely(skb != NULL)) {
+		sch->qstats.backlog -= qdisc_pkt_len(skb);
+		qdisc_bstats_update(sch, skb);
+	}
+	return skb;
+}
+
+static inline unsigned int __qdisc_queue_drop_head(struct Qdisc *sch,
+												   struct sk_buff_head *list)
+{
+	struct sk_buff *skb = __skb_dequeue(list);
+	unsigned int len = 0;
+
+	if (likely(skb != NULL)) {
+		len = qdisc_pkt_len(skb);
+		sch->qstats.backlog -= len;
+		kfree_skb(skb);
+	}
+	return len;
+}
+
+static inline void __qdisc_reset_queue(struct Qdisc *sch,
+									   struct sk_buff_head *list)
+{
+	skb_queue_purge(list);
+}
+
+/* Netlink */
+
+struct nlattr {
+	__u16 nla_len;
+	__u16 nla_type;
+};
+
+#define NLA_HDRLEN ((int) sizeof(struct nlattr))
+
+static inline int nla_attr_size(int payload)
+{
+	return NLA_HDRLEN + payload;
+}
+
+static inline int nla_len(const struct nlattr *nla)
+{
+	return nla->nla_len - NLA_HDRLEN;
+}
+
+static inline void *nla_data(const struct nlattr *nla)
+{
+	return (char *) nla + NLA_HDRLEN;
+}
+
+#define NLA_ALIGNTO 4
+#define NLA_ALIGN(len) (((len) + NLA_ALIGNTO - 1) & ~(NLA_ALIGNTO - 1))
+
+static inline int nla_total_size(int payload)
+{
+	return NLA_ALIGN(nla_attr_size(payload));
+}
+
+static inline int nla_put(struct sk_buff *skb, int type, int len,
+						  const void *data)
+{
+	struct nlattr *nla = NULL;
+
+	if (skb->len + nla_total_size(len) > skb->truesize) {
+		return -EMSGSIZE;
+	}
+
+	nla = (struct nlattr *) skb_put(skb, nla_total_size(len));
+	nla->nla_len = nla_attr_size(len);
+	nla->nla_type = type;
+	memcpy(nla_data(nla), data, len);
+	memset((char *) nla_data(nla) + len, 0, nla_total_size(len) -
+		   nla_attr_size(len));
+	return 0;
+}
+
+static inline int nla_nest_end(struct sk_buff *skb, struct nlattr *start)
+{
+	return skb->len;
+}
+
+static inline void nlmsg_trim(struct sk_buff *skb, const void *mark)
+{
+}
+
+#define nlmsg_free(skb) kfree_skb(skb)
+
+/* Generic netlink: the family is never registered, multicast messages
+   are handed to pfab_user_genl_rcv if set. Messages are built from the
+   start of a linear mock skb. */
+#define GENL_ID_GENERATE 0
+#define GENL_NAMSIZ 16
+
+struct nlmsghdr {
+	__u32 nlmsg_len;
+	__u16 nlmsg_type;
+	__u16 nlmsg_flags;
+	__u32 nlmsg_seq;
+	__u32 nlmsg_pid;
+};
+
+struct genlmsghdr {
+	__u8 cmd;
+	__u8 version;
+	__u16 reserved;
+};
+
+#define GENL_HDRLEN ((int) sizeof(struct genlmsghdr))
+
+struct genl_family {
+	unsigned int id;
+	char name[GENL_NAMSIZ];
+	unsigned int version;
+	unsigned int maxattr;
+};
+
+struct genl_multicast_group {
+	char name[GENL_NAMSIZ];
+	u32 id;
+};
+
+static inline int genl_register_family(struct genl_family *family)
+{
+	return 0;
+}
+
+static inline int genl_register_mc_group(struct genl_family *family,
+										 struct genl_multicast_group *grp)
+{
+	grp->id = 1;
+	return 0;
+}
+
+static inline int genl_unregister_family(struct genl_family *family)
+{
+	return 0;
+}
+
+static inline struct sk_buff *genlmsg_new(int payload, gfp_t flags)
+{
+	return alloc_skb(sizeof(struct nlmsghdr) + GENL_HDRLEN + payload, flags);
+}
+
+static inline void *genlmsg_put(struct sk_buff *skb, u32 pid, u32 seq,
+								struct genl_family *family, int flags, u8 cmd)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *) skb_put(skb, sizeof(*nlh));
+	struct genlmsghdr *hdr = (struct genlmsghdr *) skb_put(skb, GENL_HDRLEN);
+
+	memset(nlh, 0, sizeof(*nlh));
+	nlh->nlmsg_type = family->id;
+	hdr->cmd = cmd;
+	hdr->version = family->version;
+	hdr->reserved = 0;
+	return hdr + 1;
+}
+
+static inline void genlmsg_end(struct sk_buff *skb, void *hdr)
+{
+	((struct nlmsghdr *) skb->data)->nlmsg_len = skb->len;
+}
+
+extern void (*pfab_user_genl_rcv)(const struct sk_buff *skb);
+
+/* Returns -ESRCH, as the kernel does, if there is no listener */
+int genlmsg_multicast(struct sk_buff *skb, u32 pid, unsigned int group,
+					  gfp_t flags);
+
+int gnet_stats_copy_app(struct gnet_dump *d, void *st, int len);
+
+/* proc files, accepted and never shown */
+
+struct inode;
+struct file;
+
+struct seq_file {
+	void *private;
+};
+
+struct proc_dir_entry {
+	void *data;
+};
+
+struct file_operations {
+	void *owner;
+	int (*open)(struct inode *, struct file *);
+	ssize_t (*read)(struct file *, char *, size_t, loff_t *);
+	loff_t (*llseek)(struct file *, loff_t, int);
+	int (*release)(struct inode *, struct file *);
+};
+
+int seq_printf(struct seq_file *s, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+ssize_t seq_read(struct file *file, char *buf, size_t size, loff_t *ppos);
+loff_t seq_lseek(struct file *file, loff_t offset, int whence);
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+				void *data);
+int single_release(struct inode *inode, struct file *file);
+struct proc_dir_entry *PDE(const struct inode *inode);
+struct proc_dir_entry *proc_create_data(const char *name, int mode,
+		struct proc_dir_entry *parent, const struct file_operations *fops,
+		void *data);
+void remove_proc_entry(const char *name, struct proc_dir_entry *parent);
+
+static inline int register_qdisc(struct Qdisc_ops *ops)
+{
+	return 0;
+}
+
+static inline int unregister_qdisc(struct Qdisc_ops *ops)
+{
+	return 0;
+}
+
+#endif
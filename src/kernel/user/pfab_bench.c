@@ -0,0 +1,216 @@
+/*
+ * Userspace benchmark of the pFabric scheduler.
+ *
+ * Reports the enqueue and dequeue rates in Mpps for several scheduling
+ * configurations and priority mixes, both when the buffer never fills
+ * and when it is overloaded (every enqueue drops or evicts a packet).
+ *
+ * usage: pfab_bench [rounds]
+ */
+
+#include <time.h>
+#include "pfab_user.h"
+
+#define BENCH_PACKETS (1024)
+#define BENCH_ROUNDS (2000)
+#define BENCH_PACKET_LEN (1500)
+
+struct bench_config {
+	const char *name;
+	tc_pfabric_qopt_t qopt;
+	u32 tuples;		//Distinct 5-tuples, 0 for one per packet
+};
+
+static const struct bench_config bench_configs[] = {
+	{ "bands=32", { .bands = 32, .prio_source = PFAB_PRIO_MARK } },
+	{ "bands=max", { .bands = MAX_BANDS, .prio_source = PFAB_PRIO_MARK } },
+	{ "mark=prio", { .bands = MAX_BANDS, .prio_source = PFAB_PRIO_MARK,
+					 .mark_threshold = 1, .mark_by = PFAB_MARK_PRIO } },
+	{ "flows", { .bands = 32, .prio_source = PFAB_PRIO_MARK, .flows = 1024 } },
+	{ "flows=4", { .bands = 32, .prio_source = PFAB_PRIO_MARK, .flows = 1024 },
+	  4 },
+	{ "heap", { .prio_source = PFAB_PRIO_MARK, .mode = PFAB_MODE_HEAP } },
+};
+
+typedef u32 (*bench_mix_t)(u32 rand, u32 bands);
+
+/* All packets in the same band */
+static u32 mix_single(u32 rand, u32 bands)
+{
+	return 0;
+}
+
+static u32 mix_uniform(u32 rand, u32 bands)
+{
+	return rand % bands;
+}
+
+/* Most packets belong to the few shortest flows, as in data center
+   traffic: each band is half as likely as the previous one. */
+static u32 mix_skewed(u32 rand, u32 bands)
+{
+	u32 band = __builtin_ctz(rand | (1U << 31));
+
+	return band < bands ? band : bands - 1;
+}
+
+static const struct {
+	const char *name;
+	bench_mix_t fn;
+} bench_mixes[] = {
+	{ "single", mix_single },
+	{ "uniform", mix_uniform },
+	{ "skewed", mix_skewed },
+};
+
+struct bench_ctx {
+	struct Qdisc *sch;
+	u32 bands;		//Range of the generated priorities
+	bench_mix_t mix;
+	u32 tuples;
+	u32 seed;
+	struct sk_buff *skbs[BENCH_PACKETS];
+};
+
+static inline u32 bench_rand(struct bench_ctx *ctx)
+{
+	ctx->seed = ctx->seed * 1664525 + 1013904223;
+	return ctx->seed >> 1;
+}
+
+static inline u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Packets are built before the timed loops */
+static int bench_fill(struct bench_ctx *ctx)
+{
+	struct sk_buff *skb = NULL;
+	u32 tuple;
+	int i;
+
+	for (i = 0; i < BENCH_PACKETS; i++) {
+		tuple = ctx->tuples ? i % ctx->tuples : i;
+		skb = pfab_user_alloc_skb(BENCH_PACKET_LEN, 0,
+								  htonl(0x0a000000 + tuple % 64),
+								  htonl(0x0a000100), htons(tuple % 1000),
+								  htons(5001));
+		if (NULL == skb) {
+			return -ENOMEM;
+		}
+
+		skb->mark = ctx->mix(bench_rand(ctx), ctx->bands);
+		ctx->skbs[i] = skb;
+	}
+
+	return 0;
+}
+
+static u64 bench_enqueue(struct bench_ctx *ctx)
+{
+	u64 start = now_ns();
+	int i;
+
+	for (i = 0; i < BENCH_PACKETS; i++) {
+		pfab_qdisc_ops.enqueue(ctx->skbs[i], ctx->sch);
+	}
+
+	return now_ns() - start;
+}
+
+static u64 bench_dequeue(struct bench_ctx *ctx, int *count)
+{
+	u64 start = now_ns();
+	struct sk_buff *skb = NULL;
+	int i = 0;
+
+	while ((skb = pfab_qdisc_ops.dequeue(ctx->sch)) != NULL) {
+		ctx->skbs[i++] = skb;
+	}
+
+	*count = i;
+	return now_ns() - start;
+}
+
+static double mpps(u64 packets, u64 ns)
+{
+	return ns ? (double) packets * 1000.0 / ns : 0.0;
+}
+
+/* Runs one configuration and mix with the given buffer limit. */
+static int bench_run(const struct bench_config *config, bench_mix_t mix,
+					 u32 limit, int rounds, double *enqueue_mpps,
+					 double *dequeue_mpps)
+{
+	tc_pfabric_qopt_t qopt = config->qopt;
+	struct bench_ctx ctx = { .seed = 1, .mix = mix,
+							 .tuples = config->tuples };
+	u64 enqueue_ns = 0, dequeue_ns = 0, dequeued = 0;
+	int round, count, i;
+
+	qopt.limit = limit;
+	ctx.bands = qopt.bands ? qopt.bands : 1U << 20;
+	ctx.sch = pfab_user_create("bench0", &qopt);
+	if (NULL == ctx.sch) {
+		fprintf(stderr, "Failed creating qdisc %s\n", config->name);
+		return -EINVAL;
+	}
+
+	for (round = 0; round < rounds; round++) {
+		if (bench_fill(&ctx) < 0) {
+			pfab_user_destroy(ctx.sch);
+			return -ENOMEM;
+		}
+
+		enqueue_ns += bench_enqueue(&ctx);
+		dequeue_ns += bench_dequeue(&ctx, &count);
+		dequeued += count;
+		for (i = 0; i < count; i++) {
+			kfree_skb(ctx.skbs[i]);
+		}
+	}
+
+	*enqueue_mpps = mpps((u64) rounds * BENCH_PACKETS, enqueue_ns);
+	*dequeue_mpps = mpps(dequeued, dequeue_ns);
+	pfab_user_destroy(ctx.sch);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : BENCH_ROUNDS;
+	double enqueue_mpps, dequeue_mpps, overload_mpps, drain_mpps;
+	int c, m;
+
+	if (rounds <= 0) {
+		fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%d rounds of %d packets, Mpps\n", rounds, BENCH_PACKETS);
+	printf("%-12s %-8s %10s %10s %10s %10s\n", "config", "mix",
+		   "enqueue", "dequeue", "overload", "drain");
+
+	for (c = 0; c < ARRAY_SIZE(bench_configs); c++) {
+		for (m = 0; m < ARRAY_SIZE(bench_mixes); m++) {
+			/* Room for every packet, then a quarter of them */
+			if (bench_run(&bench_configs[c], bench_mixes[m].fn, BENCH_PACKETS,
+						  rounds, &enqueue_mpps, &dequeue_mpps) < 0 ||
+				bench_run(&bench_configs[c], bench_mixes[m].fn,
+						  BENCH_PACKETS / 4, rounds, &overload_mpps,
+						  &drain_mpps) < 0) {
+				return 1;
+			}
+
+			printf("%-12s %-8s %10.2f %10.2f %10.2f %10.2f\n",
+				   bench_configs[c].name, bench_mixes[m].name,
+				   enqueue_mpps, dequeue_mpps, overload_mpps, drain_mpps);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,741 @@
+/*
+ * Fuzz harness of the pFabric scheduler, for libFuzzer (make fuzz) or
+ * standalone (make check).
+ *
+ * The first bytes of the input select the qdisc options, the rest is a
+ * sequence of operations: enqueue, dequeue, peek, change, reset and
+ * statistics dump. The qdisc state is checked after every operation:
+ * queue length and backlog against the bands (or heap) contents, the
+ * band bitmap, the flow lists, the buffer limits, the dequeue order and
+ * the drop and eviction events.
+ *
+ * Standalone usage: pfab_fuzz_standalone [-runs=N] [input files]
+ */
+
+#include "pfab_user.h"
+#include "stats.h"
+
+#define FUZZ_MAX_INPUT (4096)
+
+#define FUZZ_CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", \
+					__FILE__, __LINE__, #cond); \
+			abort(); \
+		} \
+	} while (0)
+
+struct fuzz_input {
+	const u8 *data;
+	size_t size;
+};
+
+static u8 fuzz_u8(struct fuzz_input *in)
+{
+	u8 byte = 0;
+
+	if (in->size) {
+		byte = *in->data++;
+		in->size--;
+	}
+
+	return byte;
+}
+
+static u16 fuzz_u16(struct fuzz_input *in)
+{
+	u16 low = fuzz_u8(in);
+
+	return low | (fuzz_u8(in) << 8);
+}
+
+struct fuzz_state {
+	struct Qdisc *sch;
+	/* Packets dequeued since the last reset, checked against the
+	   statistics counters */
+	u32 departed;
+	/* Drops and evictions not reported by events, see
+	   fuzz_events_rebase() */
+	u32 events_base;
+	/* Queue length as a parent qdisc counts it: enqueues that returned
+	   NET_XMIT_SUCCESS, less dequeues and qdisc_tree_decrease_qlen() */
+	u32 parent_qlen;
+};
+
+/* Events received, lost ones included */
+static u32 fuzz_events = 0;
+
+static void fuzz_genl_rcv(const struct sk_buff *skb)
+{
+	const struct nlmsghdr *nlh = (const struct nlmsghdr *) skb->data;
+	const struct genlmsghdr *hdr = (const struct genlmsghdr *) (nlh + 1);
+	const struct nlattr *qdisc = (const struct nlattr *) (hdr + 1);
+	const struct nlattr *events = NULL;
+	const struct pfab_event_qdisc *q = nla_data(qdisc);
+	const struct pfab_event *event = NULL;
+	u32 count, i;
+
+	FUZZ_CHECK(nlh->nlmsg_len == skb->len);
+	FUZZ_CHECK(PFAB_CMD_EVENTS == hdr->cmd);
+	FUZZ_CHECK(PFAB_ATTR_QDISC == qdisc->nla_type);
+	FUZZ_CHECK(nla_len(qdisc) == sizeof(*q));
+
+	events = (const struct nlattr *) ((const char *) qdisc +
+									  NLA_ALIGN(qdisc->nla_len));
+	FUZZ_CHECK(PFAB_ATTR_EVENTS == events->nla_type);
+	FUZZ_CHECK(0 == nla_len(events) % sizeof(*event));
+	FUZZ_CHECK((const char *) events + NLA_ALIGN(events->nla_len) ==
+			   (const char *) nlh + nlh->nlmsg_len);
+
+	count = nla_len(events) / sizeof(*event);
+	FUZZ_CHECK(count <= PFAB_EVENTS_BATCH);
+	FUZZ_CHECK(count || q->lost);
+	for (i = 0; i < count; i++) {
+		event = (const struct pfab_event *) nla_data(events) + i;
+		FUZZ_CHECK(event->type < __PFAB_EVENT_MAX);
+		FUZZ_CHECK(PFAB_EVENT_DROP == event->type || event->qlen);
+	}
+
+	fuzz_events += count + q->lost;
+}
+
+/* From now on, every drop and eviction must be reported by an event,
+   sent or pending. */
+static void fuzz_events_rebase(struct fuzz_state *state)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(state->sch);
+	struct pfab_stat_data stats;
+
+	pfab_stats_read(pfab_data, &stats);
+	state->events_base = stats.drops + stats.evictions - fuzz_events -
+		pfab_data->events.count - pfab_data->events.lost;
+}
+
+/* Runs the flush timer of the events, if pending */
+static void fuzz_events_timer(struct fuzz_state *state)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(state->sch);
+	struct timer_list *timer = &pfab_data->events.timer;
+
+	if (del_timer_sync(timer)) {
+		timer->function(timer->data);
+		FUZZ_CHECK(0 == pfab_data->events.count);
+	}
+}
+
+/* Checks that the packet is linked in the list of its flow */
+static void fuzz_check_flow_links(pfab_sched_data_t *pfab_data,
+								  struct sk_buff *skb)
+{
+	struct pfab_skb_cb *cb = pfab_skb_cb(skb);
+	struct pfab_flow *flow = NULL;
+
+	FUZZ_CHECK(cb->flow <= pfab_data->flow_table.capacity);
+	flow = pfab_flow_at(&pfab_data->flow_table, cb->flow);
+	FUZZ_CHECK(flow->qlen);
+
+	FUZZ_CHECK(cb->flow_link < pfab_data->flow_table.link_capacity);
+	FUZZ_CHECK(pfab_data->flow_table.links[cb->flow_link].skb == skb);
+}
+
+/* Counts the packets in the list of a flow. */
+static u32 fuzz_check_flow(struct pfab_flow_table *table,
+						   struct pfab_flow *flow, u32 qlen)
+{
+	struct pfab_flow_link *link = NULL;
+	u32 prev = PFAB_FLOW_NO_LINK;
+	u32 i, flow_qlen = 0;
+
+	for (i = flow->head; i != PFAB_FLOW_NO_LINK; i = link->next) {
+		FUZZ_CHECK(i < table->link_capacity);
+		link = &table->links[i];
+		FUZZ_CHECK(link->skb);
+		FUZZ_CHECK(link->prev == prev);
+		FUZZ_CHECK(pfab_skb_cb(link->skb)->flow == flow->index);
+		FUZZ_CHECK(pfab_skb_cb(link->skb)->flow_link == i);
+		FUZZ_CHECK(++flow_qlen <= qlen);
+		prev = i;
+	}
+
+	FUZZ_CHECK(flow->tail == prev);
+
+	FUZZ_CHECK(flow_qlen == flow->qlen);
+	return flow_qlen;
+}
+
+/* Checks the flow table: every entry is reachable from its home slot,
+   idle entries are the ones without packets, and the flows hold exactly
+   the packets in the buffer. */
+static void fuzz_check_flow_table(pfab_sched_data_t *pfab_data, u32 qlen)
+{
+	struct pfab_flow_table *table = &pfab_data->flow_table;
+	struct pfab_flow *flow = NULL;
+	u32 count = 0, idle = 0, free = 0, flow_qlen = 0;
+	u32 slot, i;
+
+	for (slot = 0; slot <= table->slot_mask; slot++) {
+		flow = table->slots[slot];
+		if (NULL == flow) {
+			continue;
+		}
+
+		for (i = flow->hash & table->slot_mask; i != slot;
+			 i = (i + 1) & table->slot_mask) {
+			FUZZ_CHECK(table->slots[i]);
+		}
+
+		FUZZ_CHECK(!flow->qlen == !list_empty(&flow->list));
+		flow_qlen += fuzz_check_flow(table, flow, qlen);
+		count++;
+	}
+
+	FUZZ_CHECK(count == table->count);
+	FUZZ_CHECK(count <= table->capacity);
+	FUZZ_CHECK(list_empty(&table->overflow.list));
+	FUZZ_CHECK(table->overflow.index == table->capacity);
+	flow_qlen += fuzz_check_flow(table, &table->overflow, qlen);
+	FUZZ_CHECK(flow_qlen == qlen);
+
+	for (i = table->free_link; i != PFAB_FLOW_NO_LINK;
+		 i = table->links[i].next) {
+		FUZZ_CHECK(i < table->link_capacity);
+		FUZZ_CHECK(NULL == table->links[i].skb);
+		FUZZ_CHECK(++free <= table->link_capacity);
+	}
+
+	FUZZ_CHECK(free == table->link_capacity - qlen);
+	free = 0;
+
+	list_for_each_entry(flow, &table->idle, list) {
+		FUZZ_CHECK(0 == flow->qlen);
+		FUZZ_CHECK(++idle <= count);
+	}
+
+	list_for_each_entry(flow, &table->free, list) {
+		FUZZ_CHECK(++free <= table->capacity);
+	}
+
+	FUZZ_CHECK(free == table->capacity - count);
+}
+
+/* Walks the occupied bands, and with full all the bands and flows. */
+static void fuzz_check_bands(struct Qdisc *sch, int full)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct sk_buff *skb = NULL;
+	u32 qlen = 0;
+	u32 backlog, total_backlog = 0;
+	u32 word_qlen[MAX_BITMAP_SIZE] = { 0 };
+	u32 word_backlog[MAX_BITMAP_SIZE] = { 0 };
+	u32 band;
+	int words = BITS_TO_LONGS(pfab_data->bands);
+	int word;
+
+	for (word = 0; word < BITS_PER_LONG; word++) {
+		int set = !!(pfab_data->bitmap.summary & BIT_MASK(word));
+
+		FUZZ_CHECK(set == (word < words && 0 != pfab_data->bitmap.words[word]));
+	}
+
+	for_each_set_bit(band, pfab_data->bitmap.words, pfab_data->bands) {
+		struct sk_buff_head *list = &pfab_data->queues[band];
+
+		FUZZ_CHECK(!skb_queue_empty(list));
+
+		backlog = 0;
+		skb_queue_walk(list, skb) {
+			FUZZ_CHECK(pfab_skb_cb(skb)->band == band);
+			backlog += qdisc_pkt_len(skb);
+			if (pfab_data->flows) {
+				fuzz_check_flow_links(pfab_data, skb);
+			}
+		}
+
+		FUZZ_CHECK(backlog == pfab_data->band_backlog[band]);
+		qlen += skb_queue_len(list);
+		total_backlog += backlog;
+		word_qlen[BIT_WORD(band)] += skb_queue_len(list);
+		word_backlog[BIT_WORD(band)] += backlog;
+	}
+
+	for (word = 0; word < MAX_BITMAP_SIZE; word++) {
+		FUZZ_CHECK(word_qlen[word] == pfab_data->word_qlen[word]);
+		FUZZ_CHECK(word_backlog[word] == pfab_data->word_backlog[word]);
+	}
+
+	/* Packets outside the occupied bands would be missing here */
+	FUZZ_CHECK(qlen == sch->q.qlen);
+	FUZZ_CHECK(total_backlog == sch->qstats.backlog);
+
+	if (!full) {
+		return;
+	}
+
+	for (band = 0; band < pfab_data->bands; band++) {
+		if (skb_queue_empty(&pfab_data->queues[band])) {
+			FUZZ_CHECK(0 == pfab_data->band_backlog[band]);
+		}
+	}
+
+	if (pfab_data->flows) {
+		fuzz_check_flow_table(pfab_data, qlen);
+	}
+}
+
+static void fuzz_check_heap(struct Qdisc *sch)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct pfab_heap *heap = &pfab_data->heap;
+	u32 backlog = 0;
+	u32 i;
+
+	FUZZ_CHECK(heap->size == sch->q.qlen);
+	FUZZ_CHECK(heap->size <= heap->capacity);
+
+	for (i = 0; i < heap->size; i++) {
+		backlog += qdisc_pkt_len(heap->entries[i].skb);
+	}
+
+	FUZZ_CHECK(backlog == sch->qstats.backlog);
+}
+
+/* Checks the qdisc state, thoroughly with full. */
+static void fuzz_check(struct fuzz_state *state, int full)
+{
+	struct Qdisc *sch = state->sch;
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct pfab_stat_data stats;
+	u32 departed = 0;
+	int i;
+
+	if (PFAB_MODE_HEAP == pfab_data->mode) {
+		fuzz_check_heap(sch);
+	}
+	else {
+		fuzz_check_bands(sch, full);
+	}
+
+	FUZZ_CHECK(sch->q.qlen <= pfab_data->limit);
+	FUZZ_CHECK(0 == pfab_data->limit_bytes ||
+			   sch->qstats.backlog <= pfab_data->limit_bytes);
+
+	/* The qdisc is alone on its device, so it has all the shared buffer */
+	FUZZ_CHECK(0 == pfab_data->shared_limit ||
+			   sch->q.qlen <= pfab_data->shared_limit);
+
+	pfab_stats_read(pfab_data, &stats);
+	FUZZ_CHECK(stats.packets - stats.evictions - state->departed ==
+			   sch->q.qlen);
+
+	state->parent_qlen -= pfab_user_tree_decrease;
+	pfab_user_tree_decrease = 0;
+	FUZZ_CHECK(state->parent_qlen == sch->q.qlen);
+	FUZZ_CHECK(stats.marks <= stats.packets);
+
+	/* Every dequeued packet has its sojourn time counted */
+	for (i = 0; i < TC_PFABRIC_SOJOURN_BUCKETS; i++) {
+		departed += stats.sojourn[i];
+	}
+	FUZZ_CHECK(departed == state->departed);
+
+	/* Pending events are sent by the timer */
+	if (pfab_data->events.rate) {
+		FUZZ_CHECK(stats.drops + stats.evictions - state->events_base ==
+				   fuzz_events + pfab_data->events.count +
+				   pfab_data->events.lost);
+		FUZZ_CHECK(timer_pending(&pfab_data->events.timer) ||
+				   (0 == pfab_data->events.count &&
+					0 == pfab_data->events.lost));
+	}
+}
+
+/* Key of a packet in the heap */
+static u32 fuzz_heap_key(pfab_sched_data_t *pfab_data, struct sk_buff *skb)
+{
+	u32 i;
+
+	for (i = 0; i < pfab_data->heap.size; i++) {
+		if (pfab_data->heap.entries[i].skb == skb) {
+			return pfab_data->heap.entries[i].key;
+		}
+	}
+
+	FUZZ_CHECK(!"packet not in the heap");
+	return 0;
+}
+
+static void fuzz_enqueue(struct fuzz_state *state, struct fuzz_input *in)
+{
+	struct Qdisc *sch = state->sch;
+	u16 prio = fuzz_u16(in);
+	u8 size = fuzz_u8(in);
+	u8 flow = fuzz_u8(in);
+	struct sk_buff *skb = NULL;
+	int retval;
+
+	skb = pfab_user_alloc_skb(size * 6, prio & 0xff, htonl(0x0a000000 | flow),
+							  htonl(0x0a000100), htons(flow >> 4), htons(5001));
+	FUZZ_CHECK(skb);
+
+	/* Short packets are not IP and take the highest priority */
+	if (size & 1) {
+		skb->len = 20;
+	}
+
+	skb->priority = prio;
+	skb->mark = prio << (size & 7);
+
+	/* Half of the flows are tagged, for the pcp source */
+	if (flow & 1) {
+		skb->vlan_tci = VLAN_TAG_PRESENT | (prio & VLAN_PRIO_MASK);
+	}
+	qdisc_skb_cb(skb)->pkt_len = skb->len;
+
+	retval = pfab_qdisc_ops.enqueue(skb, sch);
+	FUZZ_CHECK(NET_XMIT_SUCCESS == retval || NET_XMIT_CN == retval ||
+			   NET_XMIT_DROP == retval);
+	if (NET_XMIT_SUCCESS == retval) {
+		state->parent_qlen++;
+	}
+}
+
+/* The dequeued packet must be the one peek returned and have the
+   highest priority in the buffer. Flow ordering may send an earlier
+   packet of the flow instead, which is then the head of its flow. */
+static void fuzz_dequeue(struct fuzz_state *state)
+{
+	struct Qdisc *sch = state->sch;
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct sk_buff *peeked = pfab_qdisc_ops.peek(sch);
+	struct sk_buff *skb = NULL;
+	int first = -1;
+	u32 key = 0;
+	u32 i;
+
+	if (PFAB_MODE_HEAP == pfab_data->mode) {
+		if (peeked) {
+			key = fuzz_heap_key(pfab_data, peeked);
+		}
+	}
+	else {
+		first = pfab_bitmap_first(&pfab_data->bitmap);
+		if (pfab_data->flows && peeked) {
+			FUZZ_CHECK(pfab_flow_first(&pfab_data->flow_table,
+				pfab_flow_at(&pfab_data->flow_table,
+							 pfab_skb_cb(peeked)->flow)) == peeked);
+		}
+	}
+
+	skb = pfab_qdisc_ops.dequeue(sch);
+	if (pfab_data->disable_dequeue) {
+		FUZZ_CHECK(NULL == skb);
+		return;
+	}
+
+	/* A shaped qdisc keeps the packets until their departure time, when
+	   the watchdog has it dequeued again. Peek keeps them too, and the
+	   departure time may come between peek and dequeue. */
+	if (NULL == peeked && pfab_data->rate && (skb || sch->q.qlen)) {
+		if (NULL == skb) {
+			FUZZ_CHECK(pfab_data->watchdog.expires >= pfab_data->t_next &&
+					   pfab_data->watchdog.expires <
+					   pfab_data->t_next + PSCHED_TICKS2NS(1));
+			return;
+		}
+		peeked = skb;
+	}
+
+	FUZZ_CHECK(skb == peeked);
+	if (NULL == skb) {
+		FUZZ_CHECK(0 == sch->q.qlen);
+		return;
+	}
+
+	if (PFAB_MODE_HEAP == pfab_data->mode) {
+		for (i = 0; i < pfab_data->heap.size; i++) {
+			FUZZ_CHECK(key <= pfab_data->heap.entries[i].key);
+		}
+	}
+	else if (0 == pfab_data->flows) {
+		FUZZ_CHECK(pfab_skb_cb(skb)->band == first);
+	}
+	else {
+		FUZZ_CHECK(pfab_skb_cb(skb)->band >= first);
+	}
+
+	state->departed++;
+	state->parent_qlen--;
+	kfree_skb(skb);
+}
+
+static void fuzz_change(struct fuzz_state *state, struct fuzz_input *in)
+{
+	struct Qdisc *sch = state->sch;
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	tc_pfabric_qopt_t qopt = {
+		.limit = fuzz_u8(in),
+		.limit_bytes = fuzz_u8(in) * 64,
+		.bands = pfab_data->bands,
+		.mode = pfab_data->mode,
+		.flows = pfab_data->flows,
+		.shared_limit = pfab_data->shared_limit,
+	};
+	u8 flags = fuzz_u8(in);
+	u8 bands = fuzz_u8(in);
+	u8 mark = fuzz_u8(in);
+	u8 rate = fuzz_u8(in);
+	u8 source = fuzz_u8(in);
+	u32 bands_before = pfab_data->bands;
+	u32 qlen = sch->q.qlen;
+	u32 evictions_before;
+	struct pfab_stat_data stats;
+
+	pfab_stats_read(pfab_data, &stats);
+	evictions_before = stats.evictions;
+
+	qopt.disable_dequeue = flags & 1;
+	qopt.prio_source = ((flags >> 1) & 3) | ((source & 1) << 2);
+	qopt.prio_shift = flags >> 3;
+	if (qopt.prio_source >= __PFAB_PRIO_MAX) {
+		FUZZ_CHECK(pfab_user_change(sch, &qopt) < 0);
+		return;
+	}
+
+	/* The mode is fixed at creation */
+	if (0xc0 == (flags & 0xc0)) {
+		qopt.mode = PFAB_MODE_BANDS == qopt.mode ?
+			PFAB_MODE_HEAP : PFAB_MODE_BANDS;
+		FUZZ_CHECK(pfab_user_change(sch, &qopt) < 0);
+		return;
+	}
+
+	/* The number of bands can change on the fly, 0 keeps it */
+	if (flags & 0x80) {
+		qopt.bands = bands;
+	}
+
+	/* Marking by priority needs bands */
+	qopt.mark_threshold = mark & 0x40 ? 0 : mark & 0x3f;
+	qopt.mark_threshold_bytes = mark & 0x40 ? (mark & 0x3f) * 64 : 0;
+	qopt.mark_by = mark >> 7 ? PFAB_MARK_PRIO : PFAB_MARK_TOTAL;
+	if (PFAB_MARK_PRIO == qopt.mark_by && PFAB_MODE_HEAP == qopt.mode) {
+		FUZZ_CHECK(pfab_user_change(sch, &qopt) < 0);
+		return;
+	}
+
+	/* Up to 64 MB/s, so that dequeue is sometimes throttled */
+	qopt.rate = rate & 0x80 ? ((rate & 0x3f) + 1) * 1000000 : 0;
+	qopt.burst = rate & 0x40 ? 3000 : 0;
+
+	/* Few events per second, so that some are lost */
+	qopt.events = source & 2 ? (source & 4 ? 4 : 1 << 20) : 0;
+	if (qopt.events && 0 == pfab_data->events.rate) {
+		fuzz_events_rebase(state);
+	}
+
+	FUZZ_CHECK(0 == pfab_user_change(sch, &qopt));
+	FUZZ_CHECK(pfab_data->limit == qopt.limit);
+	FUZZ_CHECK(pfab_data->rate == qopt.rate);
+	FUZZ_CHECK(pfab_data->bands == (qopt.bands ? qopt.bands : bands_before));
+
+	/* Packets beyond the new limits are evicted, the others are kept */
+	pfab_stats_read(pfab_data, &stats);
+	FUZZ_CHECK(qlen - sch->q.qlen == stats.evictions - evictions_before);
+}
+
+static void fuzz_reset(struct fuzz_state *state)
+{
+	struct Qdisc *sch = state->sch;
+
+	/* Reset also clears the statistics */
+	pfab_qdisc_ops.reset(sch);
+	state->departed = 0;
+	state->parent_qlen = 0;
+	fuzz_events_rebase(state);
+	FUZZ_CHECK(0 == sch->q.qlen);
+	FUZZ_CHECK(0 == sch->qstats.backlog);
+}
+
+/* The band entries of the statistics add up to the totals */
+static void fuzz_dump_stats(struct fuzz_state *state)
+{
+	struct Qdisc *sch = state->sch;
+	pfab_sched_data_t *pfab_data = qdisc_priv(sch);
+	struct tc_pfabric_xstats st;
+	struct gnet_dump d = { .buf = &st, .size = sizeof(st) };
+	u32 enqueues = 0, drops = 0, evictions = 0, backlog = 0;
+	u32 sojourn[TC_PFABRIC_SOJOURN_BUCKETS] = { 0 };
+	u32 i, j;
+
+	memset(&st, 0, sizeof(st));
+	FUZZ_CHECK(0 == pfab_qdisc_ops.dump_stats(sch, &d));
+	FUZZ_CHECK(st.entries <= TC_PFABRIC_XSTATS_BANDS);
+	FUZZ_CHECK(d.len == offsetof(struct tc_pfabric_xstats, band) +
+			   st.entries * sizeof(st.band[0]));
+
+	if (PFAB_MODE_HEAP == pfab_data->mode) {
+		FUZZ_CHECK(0 == st.entries);
+		FUZZ_CHECK(0 == st.sojourn_groups);
+		return;
+	}
+
+	for (i = 0; i < st.entries; i++) {
+		enqueues += st.band[i].enqueues;
+		drops += st.band[i].drops;
+		evictions += st.band[i].evictions;
+		backlog += st.band[i].backlog;
+	}
+
+	FUZZ_CHECK(enqueues == st.enqueues);
+	FUZZ_CHECK(drops == st.drops);
+	FUZZ_CHECK(evictions == st.evictions);
+	FUZZ_CHECK(backlog == sch->qstats.backlog);
+
+	FUZZ_CHECK(st.sojourn_groups <= TC_PFABRIC_SOJOURN_GROUPS);
+	FUZZ_CHECK((st.sojourn_groups - 1) << st.sojourn_shift <
+			   pfab_data->bands);
+	for (i = 0; i < st.sojourn_groups; i++) {
+		for (j = 0; j < TC_PFABRIC_SOJOURN_BUCKETS; j++) {
+			sojourn[j] += st.band_sojourn[i][j];
+		}
+	}
+	FUZZ_CHECK(0 == memcmp(sojourn, st.sojourn, sizeof(sojourn)));
+}
+
+/* Input layout: mode and flags, bands (2 bytes), limit, limit_bytes
+   (2 bytes), flows, shared_limit, then the operations. */
+int LLVMFuzzerTestOneInput(const u8 *data, size_t size)
+{
+	struct fuzz_input in = { data, size };
+	struct fuzz_state state = { .departed = 0 };
+	tc_pfabric_qopt_t qopt;
+	u8 flags, flows, shared;
+	int full = 0;
+
+	if (size > FUZZ_MAX_INPUT) {
+		return 0;
+	}
+
+	pfab_user_genl_rcv = fuzz_genl_rcv;
+	pfab_user_tree_decrease = 0;
+	memset(&qopt, 0, sizeof(qopt));
+	flags = fuzz_u8(&in);
+	qopt.mode = flags & 1 ? PFAB_MODE_HEAP : PFAB_MODE_BANDS;
+	qopt.prio_source = (flags >> 1) & 3;
+	qopt.prio_shift = flags >> 3;
+	qopt.bands = fuzz_u16(&in) & 0x1fff;
+	qopt.limit = fuzz_u8(&in);
+	qopt.limit_bytes = fuzz_u16(&in);
+	flows = fuzz_u8(&in);
+	qopt.flows = flows & 0x80 ? 1U << (flows & 0x1f) : 0;
+	shared = fuzz_u8(&in);
+	qopt.shared_limit = shared & 0x80 ? shared & 0x7f : 0;
+
+	state.sch = pfab_user_create("fuzz0", &qopt);
+	if (NULL == state.sch) {
+		/* Rejected options */
+		FUZZ_CHECK(qopt.bands > MAX_BANDS || qopt.flows > MAX_FLOWS ||
+				   (qopt.flows && PFAB_MODE_HEAP == qopt.mode));
+		return 0;
+	}
+
+	fuzz_check(&state, 1);
+	while (in.size) {
+		switch (fuzz_u8(&in) & 7) {
+		case 0:
+		case 1:
+		case 2:
+			fuzz_enqueue(&state, &in);
+			break;
+		case 3:
+		case 4:
+			fuzz_dequeue(&state);
+			break;
+		case 5:
+			fuzz_change(&state, &in);
+			break;
+		case 6:
+			fuzz_dump_stats(&state);
+			fuzz_events_timer(&state);
+			full = 1;
+			break;
+		case 7:
+			fuzz_reset(&state);
+			break;
+		}
+
+		fuzz_check(&state, full);
+		full = 0;
+	}
+
+	pfab_user_destroy(state.sch);
+	return 0;
+}
+
+#ifdef PFAB_FUZZ_STANDALONE
+/* Without libFuzzer: replays the given inputs, or runs random ones. */
+
+static int fuzz_file(const char *path)
+{
+	static u8 buf[FUZZ_MAX_INPUT];
+	FILE *file = fopen(path, "rb");
+	size_t len;
+
+	if (NULL == file) {
+		perror(path);
+		return -1;
+	}
+
+	len = fread(buf, 1, sizeof(buf), file);
+	fclose(file);
+	LLVMFuzzerTestOneInput(buf, len);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static u8 buf[FUZZ_MAX_INPUT];
+	long runs = 10000;
+	int files = 0;
+	long run;
+	size_t len, i;
+	int arg;
+
+	for (arg = 1; arg < argc; arg++) {
+		if (0 == strncmp(argv[arg], "-runs=", 6)) {
+			runs = atol(argv[arg] + 6);
+		}
+		else {
+			if (fuzz_file(argv[arg]) < 0) {
+				return 1;
+			}
+			files++;
+		}
+	}
+
+	if (files) {
+		printf("Replayed %d inputs\n", files);
+		return 0;
+	}
+
+	for (run = 0; run < runs; run++) {
+		len = net_random() % sizeof(buf);
+		for (i = 0; i < len; i++) {
+			buf[i] = net_random();
+		}
+
+		/* Small limits and few bands make for a busy buffer */
+		if (run & 1) {
+			buf[1] %= 70;
+			buf[2] = 0;
+			buf[3] %= 16;
+		}
+
+		LLVMFuzzerTestOneInput(buf, len);
+	}
+
+	printf("Ran %ld random inputs\n", runs);
+	return 0;
+}
+#endif
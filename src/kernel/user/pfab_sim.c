@@ -0,0 +1,1336 @@
+/*
+ * Trace driven simulator of a pFabric network.
+ *
+ * Replays flows over a leaf-spine fabric in which every egress port is
+ * scheduled by the pFabric qdisc itself (libpfabric.a), and reports the
+ * flow completion time (FCT) of every flow. Flows are read from a CSV or
+ * pcap trace, or drawn from the web search or data mining flow size
+ * distributions with Poisson arrivals at a given load.
+ *
+ * The transport is the minimal pFabric transport: a flow starts sending
+ * at line rate with a window of about one BDP, every packet carries the
+ * remaining flow size as its priority (in skb->mark) and every packet is
+ * ACKed. Packets which are not ACKed within the retransmission timeout
+ * are sent again, and the window drops to one packet and grows by one
+ * per ACK back to its initial size, so that starved flows do not flood
+ * the fabric with packets that will be dropped. ACKs are not queued, they
+ * return after the propagation and serialization delays of the path.
+ *
+ * Hosts hang off leaves, and every leaf connects to every spine. A flow
+ * between two leaves goes through the host port, a leaf uplink chosen
+ * by flow hash (ECMP), a spine port and the leaf port of the receiver.
+ *
+ * usage: pfab_sim [options], see pfab_sim --help
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include "pfab_user.h"
+#include "stats.h"
+
+#define SIM_MTU (1500)
+#define SIM_HEADERS (42)	/* Ethernet, IPv4 and UDP, see pfab_user_alloc_skb */
+#define SIM_MSS (SIM_MTU - SIM_HEADERS)
+#define SIM_MIN_FRAME (64)
+#define SIM_ACK_LEN (SIM_MIN_FRAME)
+#define SIM_MAX_HOPS (4)
+
+/* Transmission state of a packet of a flow */
+#define SIM_PKT_UNSENT (0)	/* Never sent, or lost */
+#define SIM_PKT_INFLIGHT (1)
+#define SIM_PKT_ACKED (2)
+#define SIM_PKT_STATE (3)
+#define SIM_PKT_DELIVERED (4)	/* Reached the receiver at least once */
+
+enum {
+	SIM_EV_FLOW_START,
+	SIM_EV_TX_DONE,		/* A port can send its next packet */
+	SIM_EV_ARRIVE,		/* A packet reaches the next node */
+	SIM_EV_ACK,
+	SIM_EV_TIMER,		/* Retransmission timeout of a flow */
+};
+
+struct sim_event {
+	double time;
+	u64 order;		//Breaks ties in insertion order.
+	u32 type;
+	u32 id;			//Flow or port index.
+	u32 seq;
+	struct sk_buff *skb;
+};
+
+/* Binary min heap of events */
+struct sim_events {
+	struct sim_event *entries;
+	u32 count;
+	u32 capacity;
+	u64 next_order;
+};
+
+struct sim_port {
+	struct Qdisc *sch;
+	double rate;		//Bytes per second.
+	double delay;		//Propagation delay to the next node.
+	double busy_until;	//End of the packet being sent.
+	int tx_pending;		//A TX_DONE event is scheduled.
+};
+
+struct sim_sent {
+	double time;
+	u32 seq;
+};
+
+/* Sender state, only kept while the flow is active */
+struct sim_flow_state {
+	u8 *packet;		//SIM_PKT_* of every packet.
+	struct sim_sent *sent;	//Ring of sent packets in send order.
+	u32 head;
+	u32 count;
+	u32 capacity;
+};
+
+struct sim_flow {
+	u32 src;
+	u32 dst;
+	u64 size;		//Bytes.
+	double start;
+	double finish;		//Arrival of the last packet at the receiver.
+	u32 packets;
+	u32 next_seq;		//First packet never sent.
+	u32 lost_seq;		//No lost packet before it.
+	u32 inflight;
+	u32 window;		//Packets, up to the configured window.
+	u32 delivered;
+	u32 acked;
+	u64 acked_bytes;
+	u32 route[SIM_MAX_HOPS];	//Port indices.
+	u8 hops;
+	u8 timer_armed;
+	struct sim_flow_state *state;
+};
+
+/* Header of the simulator, in the packet payload */
+struct sim_hdr {
+	u32 flow;
+	u32 seq;
+	u32 hop;
+};
+
+struct sim_cdf {
+	const char *name;
+	u32 points;
+	const double *size;	//Packets of SIM_MSS bytes.
+	const double *prob;
+};
+
+/* Flow size distributions used by the pFabric paper: web search from
+   the DCTCP paper and data mining from the VL2 paper. */
+static const double websearch_size[] = {
+	1, 6, 13, 19, 33, 53, 133, 667, 1333, 3333, 6667, 20000
+};
+static const double websearch_prob[] = {
+	0, 0.15, 0.2, 0.3, 0.4, 0.53, 0.6, 0.7, 0.8, 0.9, 0.97, 1
+};
+static const double datamining_size[] = {
+	1, 1, 2, 3, 7, 267, 2107, 66667, 666667
+};
+static const double datamining_prob[] = {
+	0, 0.5, 0.6, 0.7, 0.8, 0.9, 0.95, 0.99, 1
+};
+
+static const struct sim_cdf sim_cdfs[] = {
+	{ "websearch", ARRAY_SIZE(websearch_size), websearch_size, websearch_prob },
+	{ "datamining", ARRAY_SIZE(datamining_size), datamining_size,
+	  datamining_prob },
+};
+
+struct sim_config {
+	u32 leaves;
+	u32 spines;
+	u32 hosts_per_leaf;
+	double edge_rate;	//Bytes per second.
+	double core_rate;
+	double link_delay;	//Seconds.
+	u32 window;		//Packets.
+	double rto;		//Seconds.
+	tc_pfabric_qopt_t qopt;
+	const struct sim_cdf *cdf;
+	double load;
+	u32 flows;
+	u64 seed;
+	const char *trace;
+	const char *pcap;
+	const char *output;
+};
+
+struct sim {
+	struct sim_config config;
+	u32 hosts;
+	struct sim_port *ports;
+	u32 nports;
+	struct sim_flow *flows;
+	u32 nflows;
+	u32 next_flow;		//Next flow to start.
+	u32 completed;
+	struct sim_events events;
+	double now;
+	u64 packets_sent;
+	u64 timeouts;
+	u64 rng;
+};
+
+static struct sim sim;
+
+static void sim_fatal(const char *msg)
+{
+	fprintf(stderr, "pfab_sim: %s\n", msg);
+	exit(1);
+}
+
+static void *sim_alloc(size_t size)
+{
+	void *p = calloc(1, size ? size : 1);
+
+	if (NULL == p) {
+		sim_fatal("out of memory");
+	}
+
+	return p;
+}
+
+/* xorshift64*, so that runs can be reproduced from the seed */
+static u64 sim_rand(void)
+{
+	sim.rng ^= sim.rng >> 12;
+	sim.rng ^= sim.rng << 25;
+	sim.rng ^= sim.rng >> 27;
+	return sim.rng * 2685821657736338717ULL;
+}
+
+/* Uniform in [0, 1) */
+static double sim_uniform(void)
+{
+	return (sim_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Events */
+
+static int sim_event_before(const struct sim_event *a,
+							const struct sim_event *b)
+{
+	return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+static void sim_push(double time, u32 type, u32 id, u32 seq,
+					 struct sk_buff *skb)
+{
+	struct sim_events *events = &sim.events;
+	struct sim_event ev = {
+		.time = time, .order = events->next_order++, .type = type,
+		.id = id, .seq = seq, .skb = skb,
+	};
+	u32 i, parent;
+
+	if (events->count == events->capacity) {
+		events->capacity = events->capacity ? events->capacity * 2 : 1024;
+		events->entries = realloc(events->entries,
+								  events->capacity * sizeof(ev));
+		if (NULL == events->entries) {
+			sim_fatal("out of memory");
+		}
+	}
+
+	for (i = events->count++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!sim_event_before(&ev, &events->entries[parent])) {
+			break;
+		}
+		events->entries[i] = events->entries[parent];
+	}
+
+	events->entries[i] = ev;
+}
+
+static void sim_pop(struct sim_event *ev)
+{
+	struct sim_events *events = &sim.events;
+	struct sim_event last = events->entries[--events->count];
+	u32 i = 0, child;
+
+	*ev = events->entries[0];
+	while ((child = 2 * i + 1) < events->count) {
+		if (child + 1 < events->count &&
+			sim_event_before(&events->entries[child + 1],
+							 &events->entries[child])) {
+			child++;
+		}
+
+		if (!sim_event_before(&events->entries[child], &last)) {
+			break;
+		}
+
+		events->entries[i] = events->entries[child];
+		i = child;
+	}
+
+	events->entries[i] = last;
+}
+
+/* Topology. Ports are numbered: host ports, then for each leaf its
+   host ports and its uplinks, then for each spine its leaf ports. */
+
+static u32 sim_host_port(u32 host)
+{
+	return host;
+}
+
+static u32 sim_leaf_down_port(u32 host)
+{
+	u32 leaf = host / sim.config.hosts_per_leaf;
+
+	return sim.hosts + leaf * (sim.config.hosts_per_leaf + sim.config.spines) +
+		host % sim.config.hosts_per_leaf;
+}
+
+static u32 sim_leaf_up_port(u32 leaf, u32 spine)
+{
+	return sim.hosts + leaf * (sim.config.hosts_per_leaf + sim.config.spines) +
+		sim.config.hosts_per_leaf + spine;
+}
+
+static u32 sim_spine_port(u32 spine, u32 leaf)
+{
+	return sim.hosts + sim.config.leaves *
+		(sim.config.hosts_per_leaf + sim.config.spines) +
+		spine * sim.config.leaves + leaf;
+}
+
+static void sim_add_port(u32 index, const char *fmt, u32 a, u32 b,
+						 double rate)
+{
+	struct sim_port *port = &sim.ports[index];
+	char name[IFNAMSIZ];
+
+	snprintf(name, sizeof(name), fmt, a, b);
+	port->rate = rate;
+	port->delay = sim.config.link_delay;
+	port->sch = pfab_user_create(name, &sim.config.qopt);
+	if (NULL == port->sch) {
+		sim_fatal("the qdisc options were rejected");
+	}
+}
+
+static void sim_build_topology(void)
+{
+	struct sim_config *config = &sim.config;
+	u32 host, leaf, spine, i;
+
+	sim.hosts = config->leaves * config->hosts_per_leaf;
+	sim.nports = sim.hosts +
+		config->leaves * (config->hosts_per_leaf + config->spines) +
+		config->spines * config->leaves;
+	sim.ports = sim_alloc(sim.nports * sizeof(*sim.ports));
+
+	for (host = 0; host < sim.hosts; host++) {
+		sim_add_port(sim_host_port(host), "h%u%.0u", host, 0,
+					 config->edge_rate);
+		sim_add_port(sim_leaf_down_port(host), "l%u-h%u",
+					 host / config->hosts_per_leaf, host, config->edge_rate);
+	}
+
+	for (leaf = 0; leaf < config->leaves; leaf++) {
+		for (spine = 0; spine < config->spines; spine++) {
+			sim_add_port(sim_leaf_up_port(leaf, spine), "l%u-s%u", leaf, spine,
+						 config->core_rate);
+			sim_add_port(sim_spine_port(spine, leaf), "s%u-l%u", spine, leaf,
+						 config->core_rate);
+		}
+	}
+
+	for (i = 0; i < sim.nports; i++) {
+		BUG_ON(NULL == sim.ports[i].sch);
+	}
+}
+
+static void sim_route(struct sim_flow *flow, u32 id)
+{
+	u32 src_leaf = flow->src / sim.config.hosts_per_leaf;
+	u32 dst_leaf = flow->dst / sim.config.hosts_per_leaf;
+	u32 spine;
+
+	flow->hops = 0;
+	flow->route[flow->hops++] = sim_host_port(flow->src);
+	if (src_leaf != dst_leaf) {
+		spine = jhash_3words(flow->src, flow->dst, id, 0) % sim.config.spines;
+		flow->route[flow->hops++] = sim_leaf_up_port(src_leaf, spine);
+		flow->route[flow->hops++] = sim_spine_port(spine, dst_leaf);
+	}
+	flow->route[flow->hops++] = sim_leaf_down_port(flow->dst);
+}
+
+/* Packets */
+
+static u32 sim_payload(struct sim_flow *flow, u32 seq)
+{
+	return seq + 1 < flow->packets ?
+		SIM_MSS : flow->size - (u64) seq * SIM_MSS;
+}
+
+static u32 sim_frame_len(u32 payload)
+{
+	return max_t(u32, SIM_HEADERS + payload, SIM_MIN_FRAME);
+}
+
+static inline struct sim_hdr *sim_hdr(struct sk_buff *skb)
+{
+	return (struct sim_hdr *) (skb->data + SIM_HEADERS);
+}
+
+/* Time for the packets of a flow to reach the receiver on an idle
+   network: store and forward of the first frame, then the rest at the
+   slowest link of the path. */
+static double sim_ideal_fct(struct sim_flow *flow)
+{
+	u32 first = sim_frame_len(sim_payload(flow, 0));
+	double rest = (flow->packets - 1) * (double) SIM_MTU;
+	double slowest = sim.ports[flow->route[0]].rate;
+	double fct = 0;
+	int hop;
+
+	for (hop = 0; hop < flow->hops; hop++) {
+		struct sim_port *port = &sim.ports[flow->route[hop]];
+
+		fct += port->delay + first / port->rate;
+		slowest = min(slowest, port->rate);
+	}
+
+	if (flow->packets > 1) {
+		rest += (double) sim_frame_len(sim_payload(flow, flow->packets - 1)) -
+			SIM_MTU;
+	}
+
+	return fct + rest / slowest;
+}
+
+static double sim_ack_delay(struct sim_flow *flow)
+{
+	double delay = 0;
+	int hop;
+
+	for (hop = 0; hop < flow->hops; hop++) {
+		struct sim_port *port = &sim.ports[flow->route[hop]];
+
+		delay += port->delay + SIM_ACK_LEN / port->rate;
+	}
+
+	return delay;
+}
+
+/* Starts sending a packet. Its arrival at the next node is known right
+   away, a TX_DONE event is only needed to send the one after. */
+static void sim_port_send(u32 index, struct sk_buff *skb)
+{
+	struct sim_port *port = &sim.ports[index];
+
+	port->busy_until = sim.now + qdisc_pkt_len(skb) / port->rate;
+	sim_hdr(skb)->hop++;
+	sim_push(port->busy_until + port->delay, SIM_EV_ARRIVE, 0, 0, skb);
+	if (port->sch->q.qlen) {
+		port->tx_pending = 1;
+		sim_push(port->busy_until, SIM_EV_TX_DONE, index, 0, NULL);
+	}
+}
+
+static void sim_port_transmit(u32 index)
+{
+	struct sk_buff *skb = pfab_qdisc_ops.dequeue(sim.ports[index].sch);
+
+	if (skb) {
+		sim_port_send(index, skb);
+	}
+}
+
+/* Tells whether the qdisc would hand the packet back on the dequeue
+   that follows its enqueue: the port is idle, its qdisc is empty and
+   has room for the packet. */
+static int sim_port_idle(struct sim_port *port, struct sk_buff *skb)
+{
+	pfab_sched_data_t *pfab_data = qdisc_priv(port->sch);
+
+	return !port->tx_pending && port->busy_until <= sim.now &&
+		0 == port->sch->q.qlen && pfab_data->limit &&
+		(0 == pfab_data->limit_bytes ||
+		 qdisc_pkt_len(skb) <= pfab_data->limit_bytes);
+}
+
+/* Packets refused or evicted by the qdisc are freed by it, the sender
+   finds out through its retransmission timeout. Packets that reach an
+   idle port are sent without going through the qdisc, about half of
+   them at the defaults. */
+static void sim_port_enqueue(u32 index, struct sk_buff *skb)
+{
+	struct sim_port *port = &sim.ports[index];
+
+	if (sim_port_idle(port, skb)) {
+		sim_port_send(index, skb);
+		return;
+	}
+
+	pfab_qdisc_ops.enqueue(skb, port->sch);
+	if (port->tx_pending) {
+		return;
+	}
+
+	if (port->busy_until <= sim.now) {
+		sim_port_transmit(index);
+	}
+	else {
+		port->tx_pending = 1;
+		sim_push(port->busy_until, SIM_EV_TX_DONE, index, 0, NULL);
+	}
+}
+
+static void sim_tx_done(u32 index)
+{
+	sim.ports[index].tx_pending = 0;
+	sim_port_transmit(index);
+}
+
+/* Sender */
+
+static void sim_flow_arm(u32 id)
+{
+	struct sim_flow *flow = &sim.flows[id];
+	struct sim_flow_state *state = flow->state;
+
+	if (flow->timer_armed || 0 == state->count) {
+		return;
+	}
+
+	flow->timer_armed = 1;
+	sim_push(state->sent[state->head].time + sim.config.rto, SIM_EV_TIMER,
+			 id, 0, NULL);
+}
+
+static void sim_flow_sent(struct sim_flow_state *state, u32 seq)
+{
+	u32 i;
+
+	if (state->count == state->capacity) {
+		struct sim_sent *sent = sim_alloc(2 * state->capacity * sizeof(*sent));
+
+		for (i = 0; i < state->count; i++) {
+			sent[i] = state->sent[(state->head + i) % state->capacity];
+		}
+
+		free(state->sent);
+		state->sent = sent;
+		state->head = 0;
+		state->capacity *= 2;
+	}
+
+	i = (state->head + state->count++) % state->capacity;
+	state->sent[i].time = sim.now;
+	state->sent[i].seq = seq;
+}
+
+static void sim_send_packet(u32 id, u32 seq)
+{
+	struct sim_flow *flow = &sim.flows[id];
+	struct sim_flow_state *state = flow->state;
+	u32 len = sim_frame_len(sim_payload(flow, seq));
+	u64 remaining = flow->size - flow->acked_bytes;
+	struct sk_buff *skb = NULL;
+	struct sim_hdr *hdr = NULL;
+
+	skb = pfab_user_alloc_skb(len, 0, htonl(0x0a000000 | flow->src),
+							  htonl(0x0a000000 | flow->dst), htons(id),
+							  htons(5001));
+	if (NULL == skb) {
+		sim_fatal("out of memory");
+	}
+
+	/* pFabric priority: the remaining flow size */
+	skb->mark = min_t(u64, remaining, 0xffffffffU);
+	hdr = sim_hdr(skb);
+	hdr->flow = id;
+	hdr->seq = seq;
+	hdr->hop = 0;
+
+	state->packet[seq] = (state->packet[seq] & ~SIM_PKT_STATE) |
+		SIM_PKT_INFLIGHT;
+	flow->inflight++;
+	sim_flow_sent(state, seq);
+	sim.packets_sent++;
+
+	sim_port_enqueue(flow->route[0], skb);
+}
+
+/* Sends lost packets first, then new ones, as the window allows. */
+static void sim_flow_send(u32 id)
+{
+	struct sim_flow *flow = &sim.flows[id];
+	struct sim_flow_state *state = flow->state;
+	u32 seq;
+
+	while (flow->inflight < flow->window) {
+		while (flow->lost_seq < flow->next_seq &&
+			   (state->packet[flow->lost_seq] & SIM_PKT_STATE) !=
+			   SIM_PKT_UNSENT) {
+			flow->lost_seq++;
+		}
+
+		if (flow->lost_seq < flow->next_seq) {
+			seq = flow->lost_seq;
+		}
+		else if (flow->next_seq < flow->packets) {
+			seq = flow->next_seq++;
+			flow->lost_seq = flow->next_seq;
+		}
+		else {
+			break;
+		}
+
+		sim_send_packet(id, seq);
+	}
+
+	sim_flow_arm(id);
+}
+
+static void sim_flow_start(u32 id)
+{
+	struct sim_flow *flow = &sim.flows[id];
+	struct sim_flow_state *state = sim_alloc(sizeof(*state));
+
+	state->packet = sim_alloc(flow->packets);
+	state->capacity = 2 * sim.config.window;
+	state->sent = sim_alloc(state->capacity * sizeof(*state->sent));
+	flow->state = state;
+	flow->window = sim.config.window;
+	sim_flow_send(id);
+}
+
+static void sim_flow_free(struct sim_flow *flow)
+{
+	free(flow->state->packet);
+	free(flow->state->sent);
+	free(flow->state);
+	flow->state = NULL;
+}
+
+/* Packets sent more than one timeout ago and still not ACKed are lost */
+static void sim_flow_timer(u32 id)
+{
+	struct sim_flow *flow = &sim.flows[id];
+	struct sim_flow_state *state = flow->state;
+	struct sim_sent *sent = NULL;
+	u8 *packet = NULL;
+
+	flow->timer_armed = 0;
+	if (NULL == state) {
+		return;
+	}
+
+	while (state->count) {
+		sent = &state->sent[state->head];
+		packet = &state->packet[sent->seq];
+		if ((*packet & SIM_PKT_STATE) == SIM_PKT_INFLIGHT) {
+			if (sent->time + sim.config.rto > sim.now) {
+				break;
+			}
+
+			*packet = (*packet & ~SIM_PKT_STATE) | SIM_PKT_UNSENT;
+			flow->inflight--;
+			flow->lost_seq = min(flow->lost_seq, sent->seq);
+			flow->window = 1;
+			sim.timeouts++;
+		}
+
+		state->head = (state->head + 1) % state->capacity;
+		state->count--;
+	}
+
+	sim_flow_send(id);
+}
+
+static void sim_ack(u32 id, u32 seq)
+{
+	struct sim_flow *flow = &sim.flows[id];
+	struct sim_flow_state *state = flow->state;
+	u8 *packet = NULL;
+
+	if (NULL == state) {
+		return;
+	}
+
+	packet = &state->packet[seq];
+	switch (*packet & SIM_PKT_STATE) {
+	case SIM_PKT_ACKED:
+		return;
+	case SIM_PKT_INFLIGHT:
+		flow->inflight--;
+		break;
+	}
+
+	*packet = (*packet & ~SIM_PKT_STATE) | SIM_PKT_ACKED;
+	flow->acked_bytes += sim_payload(flow, seq);
+	if (flow->window < sim.config.window) {
+		flow->window++;
+	}
+
+	if (++flow->acked == flow->packets) {
+		sim_flow_free(flow);
+		return;
+	}
+
+	sim_flow_send(id);
+}
+
+/* Receiver */
+
+static void sim_deliver(struct sk_buff *skb)
+{
+	struct sim_hdr *hdr = sim_hdr(skb);
+	struct sim_flow *flow = &sim.flows[hdr->flow];
+	u8 *packet = NULL;
+
+	if (flow->state) {
+		packet = &flow->state->packet[hdr->seq];
+		if (!(*packet & SIM_PKT_DELIVERED)) {
+			*packet |= SIM_PKT_DELIVERED;
+			if (++flow->delivered == flow->packets) {
+				flow->finish = sim.now;
+				sim.completed++;
+			}
+		}
+
+		sim_push(sim.now + sim_ack_delay(flow), SIM_EV_ACK, hdr->flow,
+				 hdr->seq, NULL);
+	}
+
+	kfree_skb(skb);
+}
+
+static void sim_arrive(struct sk_buff *skb)
+{
+	struct sim_hdr *hdr = sim_hdr(skb);
+	struct sim_flow *flow = &sim.flows[hdr->flow];
+
+	if (hdr->hop < flow->hops) {
+		sim_port_enqueue(flow->route[hdr->hop], skb);
+	}
+	else {
+		sim_deliver(skb);
+	}
+}
+
+/* Flow sources */
+
+static void sim_add_flow(double start, u32 src, u32 dst, u64 size)
+{
+	static u32 capacity = 0;
+	struct sim_flow *flow = NULL;
+
+	if (sim.nflows == capacity) {
+		capacity = capacity ? capacity * 2 : 1024;
+		sim.flows = realloc(sim.flows, capacity * sizeof(*sim.flows));
+		if (NULL == sim.flows) {
+			sim_fatal("out of memory");
+		}
+	}
+
+	flow = &sim.flows[sim.nflows++];
+	memset(flow, 0, sizeof(*flow));
+	flow->start = start;
+	flow->src = src;
+	flow->dst = dst;
+	flow->size = size ? size : 1;
+	flow->packets = (flow->size + SIM_MSS - 1) / SIM_MSS;
+}
+
+static double sim_cdf_mean(const struct sim_cdf *cdf)
+{
+	double mean = 0;
+	u32 i;
+
+	for (i = 1; i < cdf->points; i++) {
+		mean += (cdf->prob[i] - cdf->prob[i - 1]) *
+			(cdf->size[i] + cdf->size[i - 1]) / 2;
+	}
+
+	return mean * SIM_MSS;
+}
+
+/* Flow size in bytes, interpolated between the points of the CDF */
+static u64 sim_cdf_sample(const struct sim_cdf *cdf)
+{
+	double u = sim_uniform();
+	double size;
+	u32 i = 1;
+
+	while (i < cdf->points - 1 && cdf->prob[i] <= u) {
+		i++;
+	}
+
+	size = cdf->size[i - 1];
+	if (cdf->prob[i] > cdf->prob[i - 1]) {
+		size += (u - cdf->prob[i - 1]) / (cdf->prob[i] - cdf->prob[i - 1]) *
+			(cdf->size[i] - cdf->size[i - 1]);
+	}
+
+	return (u64) (size * SIM_MSS);
+}
+
+/* Poisson arrivals between random hosts, at the given fraction of the
+   capacity of the host links */
+static void sim_generate(void)
+{
+	struct sim_config *config = &sim.config;
+	double rate = config->load * sim.hosts * config->edge_rate /
+		sim_cdf_mean(config->cdf);
+	double time = 0;
+	u32 i, src, dst;
+
+	for (i = 0; i < config->flows; i++) {
+		time += -log(1.0 - sim_uniform()) / rate;
+		src = sim_rand() % sim.hosts;
+		dst = sim_rand() % (sim.hosts - 1);
+		if (dst >= src) {
+			dst++;
+		}
+
+		sim_add_flow(time, src, dst, sim_cdf_sample(config->cdf));
+	}
+}
+
+/* CSV trace: start time in seconds, source host, destination host and
+   size in bytes per line. Lines starting with # and a header line are
+   skipped. */
+static void sim_read_csv(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	char line[256];
+	double start;
+	unsigned long long size;
+	u32 src, dst;
+	u32 lineno = 0;
+
+	if (NULL == file) {
+		perror(path);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		lineno++;
+		if ('#' == line[0] || '\n' == line[0]) {
+			continue;
+		}
+
+		if (4 != sscanf(line, "%lf,%u,%u,%llu", &start, &src, &dst, &size)) {
+			if (1 == lineno) {
+				continue;
+			}
+			fprintf(stderr, "%s:%u: expected start,src,dst,size\n", path, lineno);
+			exit(1);
+		}
+
+		if (src >= sim.hosts || dst >= sim.hosts || src == dst || start < 0) {
+			fprintf(stderr, "%s:%u: invalid flow for %u hosts\n", path, lineno,
+					sim.hosts);
+			exit(1);
+		}
+
+		sim_add_flow(start, src, dst, size);
+	}
+
+	fclose(file);
+}
+
+/* pcap trace: every IPv4 5-tuple is one flow which starts with its first
+   packet and carries the IP bytes of all its packets. Addresses are
+   hashed to hosts. */
+
+#define PCAP_MAGIC (0xa1b2c3d4)
+#define PCAP_MAGIC_NS (0xa1b23c4d)
+#define PCAP_LINKTYPE_ETHERNET (1)
+#define PCAP_LINKTYPE_RAW (101)
+#define PCAP_LINKTYPE_LINUX_SLL (113)
+#define PCAP_MAX_PACKET (262144)
+
+struct pcap_flow_key {
+	__be32 saddr;
+	__be32 daddr;
+	__be16 sport;
+	__be16 dport;
+	u8 protocol;
+};
+
+struct pcap_flows {
+	struct pcap_flow_key *keys;
+	u32 *index;		//Open addressing, flow index + 1.
+	u32 size;		//Power of 2.
+};
+
+static u32 pcap_u32(const u8 *p, int swap)
+{
+	u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+static u32 pcap_host(__be32 addr)
+{
+	return jhash_3words(addr, 0, 0, 0) % sim.hosts;
+}
+
+static u32 pcap_hash(const struct pcap_flow_key *key)
+{
+	return jhash_3words(key->saddr, key->daddr,
+						(key->sport << 16 | key->dport) ^ key->protocol, 0);
+}
+
+static void pcap_flows_grow(struct pcap_flows *flows)
+{
+	u32 size = flows->size ? flows->size * 2 : 1024;
+	u32 *index = sim_alloc(size * sizeof(*index));
+	u32 i, slot;
+
+	for (i = 0; i < sim.nflows; i++) {
+		slot = pcap_hash(&flows->keys[i]) & (size - 1);
+		while (index[slot]) {
+			slot = (slot + 1) & (size - 1);
+		}
+		index[slot] = i + 1;
+	}
+
+	free(flows->index);
+	flows->index = index;
+	flows->size = size;
+	flows->keys = realloc(flows->keys, size * sizeof(*flows->keys));
+	if (NULL == flows->keys) {
+		sim_fatal("out of memory");
+	}
+}
+
+static void pcap_packet(struct pcap_flows *flows, const u8 *ip, u32 len,
+						double time)
+{
+	struct pcap_flow_key key;
+	u32 ihl, slot, src, dst;
+
+	if (len < 20 || 4 != (ip[0] >> 4)) {
+		return;
+	}
+
+	memset(&key, 0, sizeof(key));
+	ihl = (ip[0] & 0xf) * 4;
+	key.protocol = ip[9];
+	memcpy(&key.saddr, ip + 12, 4);
+	memcpy(&key.daddr, ip + 16, 4);
+	if ((IPPROTO_TCP == key.protocol || IPPROTO_UDP == key.protocol) &&
+		len >= ihl + 4) {
+		memcpy(&key.sport, ip + ihl, 2);
+		memcpy(&key.dport, ip + ihl + 2, 2);
+	}
+
+	/* Keep the table at most half full */
+	if (2 * (sim.nflows + 1) > flows->size) {
+		pcap_flows_grow(flows);
+	}
+
+	slot = pcap_hash(&key) & (flows->size - 1);
+	while (flows->index[slot]) {
+		if (0 == memcmp(&flows->keys[flows->index[slot] - 1], &key,
+						sizeof(key))) {
+			sim.flows[flows->index[slot] - 1].size += (ip[2] << 8) | ip[3];
+			return;
+		}
+		slot = (slot + 1) & (flows->size - 1);
+	}
+
+	src = pcap_host(key.saddr);
+	dst = pcap_host(key.daddr);
+	if (src == dst) {
+		dst = (dst + 1) % sim.hosts;
+	}
+
+	flows->keys[sim.nflows] = key;
+	flows->index[slot] = sim.nflows + 1;
+	sim_add_flow(time, src, dst, (ip[2] << 8) | ip[3]);
+}
+
+static void sim_read_pcap(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	struct pcap_flows flows = { NULL, NULL, 0 };
+	u8 header[24];
+	u8 *packet = sim_alloc(PCAP_MAX_PACKET);
+	u32 magic, linktype, len, offset;
+	double frac_unit, time, first = -1;
+	int swap;
+
+	if (NULL == file) {
+		perror(path);
+		exit(1);
+	}
+
+	if (1 != fread(header, sizeof(header), 1, file)) {
+		sim_fatal("truncated pcap header");
+	}
+
+	magic = pcap_u32(header, 0);
+	swap = (__builtin_bswap32(magic) == PCAP_MAGIC ||
+			__builtin_bswap32(magic) == PCAP_MAGIC_NS);
+	magic = pcap_u32(header, swap);
+	if (PCAP_MAGIC != magic && PCAP_MAGIC_NS != magic) {
+		sim_fatal("not a pcap file");
+	}
+
+	frac_unit = PCAP_MAGIC == magic ? 1e-6 : 1e-9;
+	linktype = pcap_u32(header + 20, swap) & 0xffff;
+	switch (linktype) {
+	case PCAP_LINKTYPE_ETHERNET:
+		offset = 14;
+		break;
+	case PCAP_LINKTYPE_RAW:
+		offset = 0;
+		break;
+	case PCAP_LINKTYPE_LINUX_SLL:
+		offset = 16;
+		break;
+	default:
+		sim_fatal("unsupported pcap link type");
+	}
+
+	while (1 == fread(header, 16, 1, file)) {
+		len = pcap_u32(header + 8, swap);
+		if (len > PCAP_MAX_PACKET || 1 != fread(packet, len, 1, file)) {
+			sim_fatal("truncated or corrupt pcap file");
+		}
+
+		time = pcap_u32(header, swap) + pcap_u32(header + 4, swap) * frac_unit;
+		if (first < 0) {
+			first = time;
+		}
+
+		/* 802.1Q tagged Ethernet frames */
+		if (PCAP_LINKTYPE_ETHERNET == linktype && len >= 18 &&
+			0x81 == packet[12] && 0x00 == packet[13]) {
+			if (len > 18) {
+				pcap_packet(&flows, packet + 18, len - 18, time - first);
+			}
+		}
+		else if (len > offset) {
+			pcap_packet(&flows, packet + offset, len - offset, time - first);
+		}
+	}
+
+	fclose(file);
+	free(packet);
+	free(flows.keys);
+	free(flows.index);
+}
+
+static int sim_flow_cmp(const void *a, const void *b)
+{
+	const struct sim_flow *fa = a, *fb = b;
+
+	return fa->start < fb->start ? -1 : fa->start > fb->start;
+}
+
+/* Main loop */
+
+static void sim_next_flow(void)
+{
+	if (sim.next_flow < sim.nflows) {
+		sim_push(sim.flows[sim.next_flow].start, SIM_EV_FLOW_START,
+				 sim.next_flow, 0, NULL);
+		sim.next_flow++;
+	}
+}
+
+static void sim_run(void)
+{
+	struct sim_event ev;
+	u32 i;
+
+	for (i = 0; i < sim.nflows; i++) {
+		sim_route(&sim.flows[i], i);
+	}
+
+	sim_next_flow();
+	while (sim.events.count) {
+		sim_pop(&ev);
+		sim.now = ev.time;
+
+		switch (ev.type) {
+		case SIM_EV_FLOW_START:
+			sim_flow_start(ev.id);
+			sim_next_flow();
+			break;
+		case SIM_EV_TX_DONE:
+			sim_tx_done(ev.id);
+			break;
+		case SIM_EV_ARRIVE:
+			sim_arrive(ev.skb);
+			break;
+		case SIM_EV_ACK:
+			sim_ack(ev.id, ev.seq);
+			break;
+		case SIM_EV_TIMER:
+			sim_flow_timer(ev.id);
+			break;
+		}
+	}
+}
+
+static void sim_report(double wall)
+{
+	struct pfab_stat_data stats;
+	FILE *out = stdout;
+	u64 drops = 0, evictions = 0;
+	double fct, ideal, total_slowdown = 0;
+	u32 i;
+
+	if (sim.config.output && NULL == (out = fopen(sim.config.output, "w"))) {
+		perror(sim.config.output);
+		exit(1);
+	}
+
+	fprintf(out, "flow,src,dst,size,start_us,fct_us,ideal_fct_us,slowdown\n");
+	for (i = 0; i < sim.nflows; i++) {
+		struct sim_flow *flow = &sim.flows[i];
+
+		fct = flow->finish - flow->start;
+		ideal = sim_ideal_fct(flow);
+		total_slowdown += fct / ideal;
+		fprintf(out, "%u,%u,%u,%llu,%.3f,%.3f,%.3f,%.3f\n", i, flow->src,
+				flow->dst, (unsigned long long) flow->size, flow->start * 1e6,
+				fct * 1e6, ideal * 1e6, fct / ideal);
+	}
+
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	for (i = 0; i < sim.nports; i++) {
+		pfab_stats_read(qdisc_priv(sim.ports[i].sch), &stats);
+		drops += stats.drops;
+		evictions += stats.evictions;
+	}
+
+	fprintf(stderr, "%u flows completed, mean slowdown %.3f\n",
+			sim.completed, sim.nflows ? total_slowdown / sim.nflows : 0);
+	fprintf(stderr, "%llu packets sent, %llu dropped, %llu evicted, "
+			"%llu timeouts\n", (unsigned long long) sim.packets_sent,
+			(unsigned long long) drops, (unsigned long long) evictions,
+			(unsigned long long) sim.timeouts);
+	fprintf(stderr, "simulated %.6f s in %.3f s (%.3gx real time, "
+			"%.2f M packets sent per second)\n", sim.now, wall,
+			wall > 0 ? sim.now / wall : 0,
+			wall > 0 ? sim.packets_sent / wall / 1e6 : 0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+"usage: %s [options]\n"
+"Topology:\n"
+"  --leaves N          number of leaf switches (9)\n"
+"  --spines N          number of spine switches (4)\n"
+"  --hosts N           hosts per leaf (16)\n"
+"  --edge-gbps R       host link rate (10)\n"
+"  --core-gbps R       leaf-spine link rate (40)\n"
+"  --delay-us D        propagation delay of each link (1)\n"
+"Transport:\n"
+"  --window N          packets in flight per flow (12)\n"
+"  --rto-us T          retransmission timeout (45)\n"
+"pFabric qdisc of every port:\n"
+"  --limit N           buffer size in packets (24)\n"
+"  --limit-bytes N     buffer size in bytes (0 = none)\n"
+"  --bands N           number of bands (the maximum, %d)\n"
+"  --prio-shift N      band granularity, 2^N bytes of remaining size (10)\n"
+"  --mode bands|heap   scheduling mode (bands)\n"
+"  --flow-buckets N    flow ordered dequeue buckets, so that a flow's\n"
+"                      newer packets do not starve its older ones\n"
+"                      (1024, 0 = disabled, always 0 in heap mode)\n"
+"Workload, generated:\n"
+"  --workload websearch|datamining  flow size distribution (websearch)\n"
+"  --load L            load of the host links (0.6)\n"
+"  --flows N           number of flows (2000)\n"
+"  --seed N            random seed (1)\n"
+"or replayed:\n"
+"  --trace FILE        CSV of start_seconds,src_host,dst_host,size_bytes\n"
+"  --pcap FILE         pcap capture, one flow per IPv4 5-tuple\n"
+"Output:\n"
+"  --output FILE       per flow FCT CSV (stdout)\n", prog, (int) MAX_BANDS);
+	exit(1);
+}
+
+static double parse_double(const char *arg, const char *prog)
+{
+	char *end = NULL;
+	double v = strtod(arg, &end);
+
+	if (end == arg || *end || v < 0) {
+		usage(prog);
+	}
+
+	return v;
+}
+
+static u32 parse_u32(const char *arg, const char *prog)
+{
+	char *end = NULL;
+	unsigned long v = strtoul(arg, &end, 0);
+
+	if (end == arg || *end || v > 0xffffffffUL) {
+		usage(prog);
+	}
+
+	return v;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "leaves", required_argument, NULL, 'L' },
+		{ "spines", required_argument, NULL, 'S' },
+		{ "hosts", required_argument, NULL, 'H' },
+		{ "edge-gbps", required_argument, NULL, 'e' },
+		{ "core-gbps", required_argument, NULL, 'c' },
+		{ "delay-us", required_argument, NULL, 'd' },
+		{ "window", required_argument, NULL, 'w' },
+		{ "rto-us", required_argument, NULL, 'r' },
+		{ "limit", required_argument, NULL, 'l' },
+		{ "limit-bytes", required_argument, NULL, 'B' },
+		{ "bands", required_argument, NULL, 'b' },
+		{ "prio-shift", required_argument, NULL, 's' },
+		{ "mode", required_argument, NULL, 'm' },
+		{ "flow-buckets", required_argument, NULL, 'F' },
+		{ "workload", required_argument, NULL, 'W' },
+		{ "load", required_argument, NULL, 'a' },
+		{ "flows", required_argument, NULL, 'n' },
+		{ "seed", required_argument, NULL, 'x' },
+		{ "trace", required_argument, NULL, 't' },
+		{ "pcap", required_argument, NULL, 'p' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct sim_config *config = &sim.config;
+	struct timespec begin, end;
+	int opt;
+	u32 i;
+
+	config->leaves = 9;
+	config->spines = 4;
+	config->hosts_per_leaf = 16;
+	config->edge_rate = 10e9 / 8;
+	config->core_rate = 40e9 / 8;
+	config->link_delay = 1e-6;
+	config->window = 12;
+	config->rto = 45e-6;
+	config->qopt.limit = 24;
+	config->qopt.bands = MAX_BANDS;
+	config->qopt.prio_shift = 10;
+	config->qopt.mode = PFAB_MODE_BANDS;
+	config->qopt.flows = 1024;
+	config->cdf = &sim_cdfs[0];
+	config->load = 0.6;
+	config->flows = 2000;
+	config->seed = 1;
+
+	while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+		switch (opt) {
+		case 'L': config->leaves = parse_u32(optarg, argv[0]); break;
+		case 'S': config->spines = parse_u32(optarg, argv[0]); break;
+		case 'H': config->hosts_per_leaf = parse_u32(optarg, argv[0]); break;
+		case 'e': config->edge_rate = parse_double(optarg, argv[0]) * 1e9 / 8; break;
+		case 'c': config->core_rate = parse_double(optarg, argv[0]) * 1e9 / 8; break;
+		case 'd': config->link_delay = parse_double(optarg, argv[0]) * 1e-6; break;
+		case 'w': config->window = parse_u32(optarg, argv[0]); break;
+		case 'r': config->rto = parse_double(optarg, argv[0]) * 1e-6; break;
+		case 'l': config->qopt.limit = parse_u32(optarg, argv[0]); break;
+		case 'B': config->qopt.limit_bytes = parse_u32(optarg, argv[0]); break;
+		case 'b': config->qopt.bands = parse_u32(optarg, argv[0]); break;
+		case 's': config->qopt.prio_shift = parse_u32(optarg, argv[0]); break;
+		case 'F': config->qopt.flows = parse_u32(optarg, argv[0]); break;
+		case 'a': config->load = parse_double(optarg, argv[0]); break;
+		case 'n': config->flows = parse_u32(optarg, argv[0]); break;
+		case 'x': config->seed = parse_u32(optarg, argv[0]); break;
+		case 't': config->trace = optarg; break;
+		case 'p': config->pcap = optarg; break;
+		case 'o': config->output = optarg; break;
+		case 'm':
+			if (0 == strcmp(optarg, "bands")) {
+				config->qopt.mode = PFAB_MODE_BANDS;
+			}
+			else if (0 == strcmp(optarg, "heap")) {
+				config->qopt.mode = PFAB_MODE_HEAP;
+			}
+			else {
+				usage(argv[0]);
+			}
+			break;
+		case 'W':
+			config->cdf = NULL;
+			for (i = 0; i < ARRAY_SIZE(sim_cdfs); i++) {
+				if (0 == strcmp(optarg, sim_cdfs[i].name)) {
+					config->cdf = &sim_cdfs[i];
+				}
+			}
+			if (NULL == config->cdf) {
+				usage(argv[0]);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind < argc || 0 == config->leaves || 0 == config->spines ||
+		0 == config->hosts_per_leaf || 0 == config->window ||
+		config->edge_rate <= 0 || config->core_rate <= 0 ||
+		(config->trace && config->pcap) ||
+		config->leaves * config->hosts_per_leaf < 2) {
+		usage(argv[0]);
+	}
+
+	/* The priority is the remaining flow size */
+	config->qopt.prio_source = PFAB_PRIO_MARK;
+	if (PFAB_MODE_HEAP == config->qopt.mode) {
+		config->qopt.flows = 0;
+	}
+	sim.rng = config->seed ? config->seed : 1;
+	sim_build_topology();
+
+	if (config->trace) {
+		sim_read_csv(config->trace);
+	}
+	else if (config->pcap) {
+		sim_read_pcap(config->pcap);
+	}
+	else {
+		sim_generate();
+	}
+
+	qsort(sim.flows, sim.nflows, sizeof(*sim.flows), sim_flow_cmp);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	sim_run();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	sim_report((end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) * 1e-9);
+
+	for (i = 0; i < sim.nports; i++) {
+		pfab_user_destroy(sim.ports[i].sch);
+	}
+
+	free(sim.ports);
+	free(sim.flows);
+	free(sim.events.entries);
+	return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Userspace build of the pFabric scheduler: mock devices and packets.
+ */
+
+#include "pfab_user.h"
+
+#define ETH_HEADER_LEN (14)
+#define IP_HEADER_LEN (20)
+#define UDP_HEADER_LEN (8)
+
+struct pfab_user_dev {
+	struct net_device dev;
+	struct netdev_queue queue;
+};
+
+/* Gives every qdisc its own handle, and so its own stats name */
+static u32 next_handle = 1;
+
+static int pfab_user_opt(struct Qdisc *sch, const tc_pfabric_qopt_t *qopt,
+						 int (*fn)(struct Qdisc *, struct nlattr *))
+{
+	struct {
+		struct nlattr nla;
+		tc_pfabric_qopt_t qopt;
+	} opt;
+
+	opt.nla.nla_len = nla_attr_size(sizeof(*qopt));
+	opt.nla.nla_type = TCA_OPTIONS;
+	opt.qopt = *qopt;
+
+	/* Callers that fill the whole structure set all the options */
+	if (0 == opt.qopt.present) {
+		opt.qopt.present = TC_PFABRIC_OPT_ALL;
+	}
+	return fn(sch, &opt.nla);
+}
+
+struct Qdisc *pfab_user_create(const char *dev_name,
+							   const tc_pfabric_qopt_t *qopt)
+{
+	struct pfab_user_dev *dev = NULL;
+	struct Qdisc *sch = NULL;
+
+	dev = calloc(1, sizeof(*dev));
+	sch = __alloc_percpu(sizeof(*sch) + pfab_qdisc_ops.priv_size,
+						 __alignof__(struct Qdisc));
+	if (NULL == dev || NULL == sch) {
+		goto create_failed;
+	}
+
+	snprintf(dev->dev.name, IFNAMSIZ, "%s", dev_name);
+	dev->queue.dev = &dev->dev;
+
+	sch->ops = &pfab_qdisc_ops;
+	sch->handle = next_handle++ << 16;
+	sch->dev_queue = &dev->queue;
+	__skb_queue_head_init(&sch->q);
+
+	if (pfab_user_opt(sch, qopt, pfab_qdisc_ops.init) < 0) {
+		goto create_failed;
+	}
+
+	return sch;
+
+create_failed:
+	free(sch);
+	free(dev);
+	return NULL;
+}
+
+int pfab_user_change(struct Qdisc *sch, const tc_pfabric_qopt_t *qopt)
+{
+	return pfab_user_opt(sch, qopt, pfab_qdisc_ops.change);
+}
+
+void pfab_user_destroy(struct Qdisc *sch)
+{
+	struct pfab_user_dev *dev = container_of(sch->dev_queue,
+											 struct pfab_user_dev, queue);
+
+	pfab_qdisc_ops.reset(sch);
+	pfab_qdisc_ops.destroy(sch);
+	free(sch);
+	free(dev);
+}
+
+struct sk_buff *pfab_user_alloc_skb(unsigned int len, __u8 tos,
+									__be32 saddr, __be32 daddr,
+									__be16 sport, __be16 dport)
+{
+	const unsigned int headers = ETH_HEADER_LEN + IP_HEADER_LEN +
+		UDP_HEADER_LEN;
+	struct sk_buff *skb = NULL;
+	struct iphdr *iph = NULL;
+	__be16 *ports = NULL;
+
+	if (len < headers) {
+		len = headers;
+	}
+
+	skb = alloc_skb(NET_IP_ALIGN + len, GFP_KERNEL);
+	if (NULL == skb) {
+		return NULL;
+	}
+
+	/* Aligns the IP header, as drivers do */
+	skb_reserve(skb, NET_IP_ALIGN);
+
+	skb_reset_mac_header(skb);
+	memset(skb_put(skb, ETH_HEADER_LEN), 0, ETH_HEADER_LEN);
+
+	skb_set_network_header(skb, ETH_HEADER_LEN);
+	skb->protocol = htons(ETH_P_IP);
+	iph = (struct iphdr *) skb_put(skb, IP_HEADER_LEN);
+	memset(iph, 0, IP_HEADER_LEN);
+	iph->version = 4;
+	iph->ihl = IP_HEADER_LEN / 4;
+	iph->tos = tos;
+	iph->tot_len = htons(len - ETH_HEADER_LEN);
+	iph->protocol = IPPROTO_UDP;
+	iph->saddr = saddr;
+	iph->daddr = daddr;
+
+	ports = (__be16 *) skb_put(skb, UDP_HEADER_LEN);
+	memset(ports, 0, UDP_HEADER_LEN);
+	ports[0] = sport;
+	ports[1] = dport;
+
+	/* The payload is left uninitialized, only its length matters */
+	skb_put(skb, len - headers);
+	qdisc_skb_cb(skb)->pkt_len = len;
+	return skb;
+}
@@ -0,0 +1,30 @@
+/*
+ * Userspace build of the pFabric scheduler.
+ *
+ * Creates pFabric qdiscs on mock devices and builds mock packets. The
+ * qdisc itself is driven through pfab_qdisc_ops, exactly as the kernel
+ * would, e.g. pfab_qdisc_ops.enqueue(skb, sch).
+ */
+
+#ifndef __PFAB_USER_H__
+#define __PFAB_USER_H__
+
+#include "sch_pfab.h"
+
+/* Creates a qdisc with the given options, on a device of its own.
+   Returns NULL if the options are rejected. */
+struct Qdisc *pfab_user_create(const char *dev_name,
+							   const tc_pfabric_qopt_t *qopt);
+
+/* Same as tc qdisc change. Returns 0 or a negative error. */
+int pfab_user_change(struct Qdisc *sch, const tc_pfabric_qopt_t *qopt);
+
+void pfab_user_destroy(struct Qdisc *sch);
+
+/* Builds an IPv4 UDP packet of len bytes (at least the headers) with
+   the given TOS and addresses. pkt_len is set as the stack would. */
+struct sk_buff *pfab_user_alloc_skb(unsigned int len, __u8 tos,
+									__be32 saddr, __be32 daddr,
+									__be16 sport, __be16 dport);
+
+#endif
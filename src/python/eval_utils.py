@@ -1,27 +1,55 @@
 #!/usr/bin/env python
 import sys
 import os
+import re
+import csv
+import json
+import argparse
+import multiprocessing
 import numpy
 import matplotlib
 matplotlib.use('Agg')
 import pylab
 import plot_defaults
 
+# Bytes read from the end of an iperf output file, enough for its last line
+TAIL_LEN = 4096
+
 def get_fct_from_file(filename):
-    print 'Reading file', filename
-    lines = open(filename, 'r').readlines()
-    fct = float(lines[-1].split('-')[1].split('sec')[0].strip())
-    return fct
+	f = open(filename, 'rb')
+	try:
+		f.seek(0, os.SEEK_END)
+		f.seek(max(0, f.tell() - TAIL_LEN))
+		lines = f.read().decode('ascii', 'replace').splitlines()
+	finally:
+		f.close()
+	fct = float(lines[-1].split('-')[1].split('sec')[0].strip())
+	return fct
 
 def nan_mean(a, axis):
-    ma = numpy.ma.masked_array(a, numpy.isnan(a))
-    return numpy.mean(ma, axis = axis)
+	ma = numpy.ma.masked_array(a, numpy.isnan(a))
+	return numpy.mean(ma, axis = axis)
+
+# Flow sizes of the buckets, as in pfabric.py
+SEARCH_FLOW_SIZE_BUCKETS = \
+	[10**6.5, 10**6.6, 10**6.7, 10**6.8, 10**6.9, 10**7, 10**7.1, 10**7.2]
 
-NUM_BUCKETS = 8
+NUM_BUCKETS = len(SEARCH_FLOW_SIZE_BUCKETS)
 
 def normalize_fcts(fcts, baseline):
-    normalized_fcts = [fcts[i]/baseline[i%NUM_BUCKETS] for i in xrange(len(fcts))]
-    return numpy.array(normalized_fcts)
+	fcts = numpy.asarray(fcts, dtype = float).ravel()
+	baseline = numpy.asarray(baseline, dtype = float)
+	return fcts / baseline[numpy.arange(len(fcts)) % NUM_BUCKETS]
+
+def normalized_fct(baselines, host_fcts):
+	"""
+	Mean normalized FCT of a run, given the baseline FCT of every bucket and
+	a hosts x flows matrix of FCTs, missing flows being NaN.
+	"""
+	average_per_flow = nan_mean(numpy.asarray(host_fcts, dtype = float), 0)
+	average_per_flow = numpy.ma.filled(average_per_flow, numpy.nan)
+	normalized_fct_per_flow = normalize_fcts(average_per_flow, baselines)
+	return float(numpy.ma.filled(nan_mean(normalized_fct_per_flow, 0), numpy.nan))
 
 def get_avg_normalized_fct(num_hosts, flows_per_host, baseline_template, search_template):
 	"""
@@ -29,87 +57,363 @@ def get_avg_normalized_fct(num_hosts, flows_per_host, baseline_template, search_
 	the hosts for the current setup.
 	"""
 	# Extract baselines
-	baselines = [get_fct_from_file(f) for f in [baseline_template % (flow %
-	    NUM_BUCKETS) for flow in xrange(flows_per_host)]]
-	print 'Baseline:', baselines
-
-	host_fcts = [[get_fct_from_file(host_files) for host_files in \
-		[search_template % (host, flow % NUM_BUCKETS, flow) for \
-			flow in xrange(flows_per_host)]] for host in xrange(num_hosts)]
-	print 'Host FCT matrix:', host_fcts
-	average_per_flow = numpy.matrix(host_fcts).mean(0)
-	print 'Average FCT per host:', average_per_flow
-	normalized_fct_per_flow = normalize_fcts(average_per_flow, baselines)
-	print 'Normalized FCT per flow', normalized_fct_per_flow
-	mean_fct = normalized_fct_per_flow.mean()
-	print 'Mean FCT:', mean_fct
-	return mean_fct
+	baselines = [get_fct_from_file(baseline_template % bucket) for bucket in \
+		range(min(flows_per_host, NUM_BUCKETS))]
+	host_fcts = [[get_fct_from_file(search_template % (host, flow % NUM_BUCKETS, flow)) \
+		for flow in range(flows_per_host)] for host in range(num_hosts)]
+	return normalized_fct(baselines, host_fcts)
 
-TEMPLATE = os.path.join('%s', '%s', 'f%d-r%d', '%s')
+# Experiment results
+#
+# Every run of a scheme is a <base_dir>/<scheme>/f<load>-r<run> directory
+# of iperf outputs. The FCTs of all of them are scanned by a process pool
+# into one table, cached in <base_dir>/fct_cache.npz: one row per flow,
+# with the baseline flows of a run in the 'baseline' scheme at host -1.
+# A run directory is scanned again only if its stamp changed, see
+# run_dir_stamp().
+
+CACHE_FILE = 'fct_cache.npz'
+RUN_DIR_RE = re.compile(r'^f(\d+)-r(\d+)$')
+SEARCH_FILE_RE = re.compile(r'^iperf_search_h(\d+)_p(\d+)_f(\d+)\.txt$')
+BASELINE_FILE_RE = re.compile(r'^iperf_baseline_(\d+)\.txt$')
+FLOWGEN_FILE_RE = re.compile(r'^flowgen_(h(\d+)|baseline)\.bin$')
+
+# Records of flowgen logs, after their 8 byte header (see src/flowgen/flowgen.h)
+FLOWGEN_LOG_MAGIC = b'PFGL'
+FLOWGEN_HEADER_LEN = 8
+FLOWGEN_RECORD = numpy.dtype([('flow', '<u4'), ('flags', '<u4'), ('size', '<u8'),
+							  ('start_ns', '<u8'), ('finish_ns', '<u8')])
+FLOWGEN_COMPLETED = 1
+
+COLUMNS = ['host', 'bucket', 'flow', 'fct']
+
+def read_flowgen_log(filename):
+	"""Returns the (flow, FCT) of every flow of a flowgen log, with a NaN
+	   FCT for the flows which failed."""
+	f = open(filename, 'rb')
+	try:
+		data = f.read()
+	finally:
+		f.close()
+	if data[:4] != FLOWGEN_LOG_MAGIC:
+		return []
+	n = (len(data) - FLOWGEN_HEADER_LEN) // FLOWGEN_RECORD.itemsize
+	records = numpy.frombuffer(data, FLOWGEN_RECORD, n, FLOWGEN_HEADER_LEN)
+	fcts = (records['finish_ns'] - records['start_ns']) / 1e9
+	fcts[(records['flags'] & FLOWGEN_COMPLETED) == 0] = numpy.nan
+	return zip(records['flow'].tolist(), fcts.tolist())
+
+def scan_run_dir(path):
+	"""Returns the host, bucket, flow and FCT columns of a run directory,
+	   with a NaN FCT for the flows whose output cannot be parsed."""
+	rows = []
+	for name in os.listdir(path):
+		m = FLOWGEN_FILE_RE.match(name)
+		if m is not None:
+			# Flow i of a host has the size of bucket i, as with iperf
+			host = int(m.group(2)) if m.group(2) is not None else -1
+			try:
+				flows = read_flowgen_log(os.path.join(path, name))
+			except IOError:
+				flows = []
+			for flow, fct in flows:
+				rows.append((host, flow % NUM_BUCKETS, flow, fct))
+			continue
+
+		m = SEARCH_FILE_RE.match(name)
+		if m is not None:
+			host, bucket, flow = [int(x) for x in m.groups()]
+		else:
+			m = BASELINE_FILE_RE.match(name)
+			if m is None:
+				continue
+			host, bucket = -1, int(m.group(1))
+			flow = bucket
+		try:
+			fct = get_fct_from_file(os.path.join(path, name))
+		except (IOError, IndexError, ValueError):
+			fct = numpy.nan
+		rows.append((host, bucket, flow, fct))
+	rows.sort()
+	if not rows:
+		return [numpy.zeros(0, dtype = int)] * 3 + [numpy.zeros(0)]
+	host, bucket, flow, fct = zip(*rows)
+	return [numpy.array(host), numpy.array(bucket), numpy.array(flow),
+		numpy.array(fct, dtype = float)]
+
+def list_run_dirs(base_dir):
+	"""Returns the <scheme>/f<load>-r<run> directories of base_dir."""
+	run_dirs = []
+	for scheme in sorted(os.listdir(base_dir)):
+		scheme_dir = os.path.join(base_dir, scheme)
+		if not os.path.isdir(scheme_dir):
+			continue
+		for run_dir in sorted(os.listdir(scheme_dir)):
+			if RUN_DIR_RE.match(run_dir) and \
+					os.path.isdir(os.path.join(scheme_dir, run_dir)):
+				run_dirs.append(os.path.join(scheme, run_dir))
+	return run_dirs
+
+def run_dir_stamp(path):
+	"""
+	Returns the latest mtime, the total size and the number of the files
+	of a run directory. The mtime of the directory itself only changes
+	when files are added, removed or renamed, not when one is rewritten.
+	"""
+	names = os.listdir(path)
+	mtime = os.stat(path).st_mtime
+	size = 0
+	for name in names:
+		st = os.stat(os.path.join(path, name))
+		mtime = max(mtime, st.st_mtime)
+		size += st.st_size
+	return (mtime, size, len(names))
+
+def load_cache(cache_path):
+	"""Returns the columns of every run directory in the cache, by name."""
+	try:
+		cache = numpy.load(cache_path)
+		try:
+			dirs = [str(d) for d in cache['dirs']]
+			stamps = cache['stamps']
+			bounds = cache['bounds']
+			columns = [cache[c] for c in COLUMNS]
+		finally:
+			cache.close()
+	except (IOError, OSError, KeyError, ValueError):
+		return {}
+	runs = {}
+	for i in range(len(dirs)):
+		runs[dirs[i]] = (tuple(stamps[i]),
+			[c[bounds[i]:bounds[i + 1]] for c in columns])
+	return runs
+
+def save_cache(cache_path, run_dirs, runs):
+	sizes = [len(runs[d][1][0]) for d in run_dirs]
+	arrays = {
+		'dirs': numpy.array(run_dirs, dtype = str),
+		'stamps': numpy.array([runs[d][0] for d in run_dirs],
+			dtype = float).reshape(-1, 3),
+		'bounds': numpy.concatenate([[0], numpy.cumsum(sizes)]).astype(int),
+	}
+	for i, column in enumerate(COLUMNS):
+		arrays[column] = numpy.concatenate([runs[d][1][i] for d in run_dirs] +
+			[numpy.zeros(0)]).astype(float if column == 'fct' else int)
+	# Written aside and renamed, so that a reader never sees half a cache
+	tmp_path = cache_path + '.tmp'
+	f = open(tmp_path, 'wb')
+	try:
+		numpy.savez(f, **arrays)
+	finally:
+		f.close()
+	os.rename(tmp_path, cache_path)
+
+def load_results(base_dir, processes = None, use_cache = True):
+	"""
+	Returns the FCT of every flow of every run in base_dir, as a dict of
+	'scheme', 'load', 'run', 'host', 'bucket', 'flow' and 'fct' columns.
+	"""
+	cache_path = os.path.join(base_dir, CACHE_FILE)
+	runs = load_cache(cache_path) if use_cache else {}
+	run_dirs = list_run_dirs(base_dir)
+	# Taken before scanning, so that files written meanwhile are scanned
+	# again next time
+	stamps = [run_dir_stamp(os.path.join(base_dir, d)) for d in run_dirs]
+	stale = [i for i in range(len(run_dirs)) if run_dirs[i] not in runs or \
+		runs[run_dirs[i]][0] != stamps[i]]
+
+	if stale:
+		print('Scanning %d of %d run directories' % (len(stale), len(run_dirs)))
+		paths = [os.path.join(base_dir, run_dirs[i]) for i in stale]
+		if len(paths) > 1 and processes != 1:
+			pool = multiprocessing.Pool(processes)
+			try:
+				scanned = pool.map(scan_run_dir, paths)
+			finally:
+				pool.close()
+				pool.join()
+		else:
+			scanned = [scan_run_dir(p) for p in paths]
+		for i, columns in zip(stale, scanned):
+			runs[run_dirs[i]] = (stamps[i], columns)
+		save_cache(cache_path, run_dirs, runs)
+
+	results = dict((c, []) for c in ['scheme', 'load', 'run'] + COLUMNS)
+	for d in run_dirs:
+		scheme, run_dir = os.path.split(d)
+		load, run = [int(x) for x in RUN_DIR_RE.match(run_dir).groups()]
+		columns = runs[d][1]
+		n = len(columns[0])
+		results['scheme'].append(numpy.repeat(scheme, n))
+		results['load'].append(numpy.repeat(load, n))
+		results['run'].append(numpy.repeat(run, n))
+		for i, column in enumerate(COLUMNS):
+			results[column].append(columns[i])
+	for c in results:
+		results[c] = numpy.concatenate(results[c] + [numpy.zeros(0, dtype = \
+			str if c == 'scheme' else float if c == 'fct' else int)])
+	return results
+
+def select(results, **values):
+	"""Returns the mask of the rows of results with the given column values."""
+	mask = numpy.ones(len(results['fct']), dtype = bool)
+	for column, value in values.items():
+		mask &= results[column] == value
+	return mask
+
+def run_normalized_fct(results, scheme, load, run, num_hosts):
+	"""Mean normalized FCT of one run of a scheme, against the baseline run."""
+	baselines = numpy.ones(NUM_BUCKETS) * numpy.nan
+	rows = select(results, scheme = 'baseline', load = load, run = run)
+	baselines[results['bucket'][rows]] = results['fct'][rows]
+
+	host_fcts = numpy.ones((num_hosts, load)) * numpy.nan
+	rows = select(results, scheme = scheme, load = load, run = run) & \
+		(results['host'] < num_hosts) & (results['flow'] < load)
+	host_fcts[results['host'][rows], results['flow'][rows]] = results['fct'][rows]
+	return normalized_fct(baselines, host_fcts)
+
+def get_loads_list(base_dir, results = None):
+	if results is None:
+		results = load_results(base_dir)
+	return sorted(set(results['load'][results['scheme'] == 'baseline'].tolist()))
+
+def evaluate_scheme(base_dir, scheme, num_iter, num_hosts, loads, results = None):
+	print('Evaluating scheme: %s' % scheme)
+	if results is None:
+		results = load_results(base_dir)
+	fcts_all_iter = [[run_normalized_fct(results, scheme, load, i, num_hosts) \
+		for load in loads] for i in range(num_iter)]
+	print('Scheme data: %s' % fcts_all_iter)
+	return numpy.ma.filled(nan_mean(numpy.array(fcts_all_iter, dtype = float), 0),
+		numpy.nan).tolist()
+
+PERCENTILES = [50, 99, 99.9]
+
+def percentile_name(prefix, q):
+	return '%s_p%s' % (prefix, ('%g' % q).replace('.', ''))
+
+def fct_percentiles(results, schemes, loads, num_iter, num_hosts):
+	"""
+	Returns the PERCENTILES of the FCTs and normalized FCTs of the flows of
+	every flow size bucket, of every scheme and load, over the first num_iter
+	runs, as a list of dicts. Flows without an FCT are left out, and so are
+	the buckets without flows.
+	"""
+	# Baseline of the bucket of every flow, from the baseline run
+	baselines = {}
+	rows = select(results, scheme = 'baseline')
+	for load, run, bucket, fct in zip(results['load'][rows], results['run'][rows],
+									  results['bucket'][rows], results['fct'][rows]):
+		baselines[(load, run, bucket)] = fct
+	baseline = numpy.array([baselines.get(key, numpy.nan) for key in \
+		zip(results['load'], results['run'], results['bucket'])], dtype = float)
+	normalized = results['fct'] / baseline
+
+	stats = []
+	valid = ~numpy.isnan(results['fct']) & (results['run'] < num_iter) & \
+		(results['host'] >= 0) & (results['host'] < num_hosts) & \
+		(results['flow'] < results['load'])
+	for scheme in schemes:
+		for load in loads:
+			for bucket in range(NUM_BUCKETS):
+				rows = valid & select(results, scheme = scheme, load = load,
+									  bucket = bucket)
+				if not rows.any():
+					continue
+				row = {'scheme': scheme, 'load': load, 'bucket': bucket,
+					   'flow_size': int(SEARCH_FLOW_SIZE_BUCKETS[bucket]),
+					   'flows': int(rows.sum())}
+				fcts = results['fct'][rows]
+				normalized_fcts = normalized[rows]
+				normalized_fcts = normalized_fcts[~numpy.isnan(normalized_fcts)]
+				for q in PERCENTILES:
+					row[percentile_name('fct', q)] = float(numpy.percentile(fcts, q))
+					row[percentile_name('normalized_fct', q)] = \
+						float(numpy.percentile(normalized_fcts, q)) \
+						if len(normalized_fcts) else None
+				stats.append(row)
+	return stats
+
+def write_fct_percentiles(stats, filename):
+	"""Writes fct_percentiles() as JSON to a .json file, else as CSV."""
+	fields = ['scheme', 'load', 'bucket', 'flow_size', 'flows'] + \
+		[percentile_name('fct', q) for q in PERCENTILES] + \
+		[percentile_name('normalized_fct', q) for q in PERCENTILES]
+	f = open(filename, 'w')
+	try:
+		if filename.endswith('.json'):
+			json.dump(stats, f, indent = 1, sort_keys = True)
+		else:
+			writer = csv.DictWriter(f, fields, lineterminator = '\n')
+			writer.writerow(dict(zip(fields, fields)))
+			writer.writerows(stats)
+	finally:
+		f.close()
 
-def get_loads_list(base_dir):
-	print base_dir
-	d = [x for x in os.listdir(os.path.join(base_dir, 'baseline')) if \
-		os.path.isdir(os.path.join(base_dir, 'baseline', x)) and
-		x.startswith('f')]
-	print d
-	d = [int(x.split('f')[1].split('-r')[0]) for x in d]
-	return list(set(d))
-
-def evaluate_scheme(base_dir, scheme, num_iter, num_hosts, loads):
-	print 'Evaluatingi scheme:', scheme
-	fcts_all_iter = []
-	for i in xrange(num_iter):
-	    fcts = []
-	    for load in loads:
-		baseline_template = TEMPLATE % (base_dir, 'baseline', load, i, 
-						'iperf_baseline_%d.txt')
-		search_template = TEMPLATE % (base_dir, scheme, load, i, 
-					      'iperf_search_h%d_p%d_f%d.txt')
-		print baseline_template, search_template
-		fcts.append( get_avg_normalized_fct(num_hosts, load, baseline_template, search_template) )
-		fcts_all_iter.append(fcts)
-	print 'Scheme data:', fcts_all_iter
-	return numpy.matrix(fcts_all_iter).mean(0).tolist()[0]
-
-def evaluate_all(base_dir, num_hosts, num_iter, schemes, plot_output):
+def evaluate_all(base_dir, num_hosts, num_iter, schemes, plot_output,
+				 processes = None, use_cache = True, stats_output = None):
+	results = load_results(base_dir, processes, use_cache)
 	matplotlib.rc('figure', figsize=(16, 16))
 	fig = pylab.figure()
 	p = fig.add_subplot(111)
-	loads = get_loads_list(base_dir)
-	loads.sort()
+	loads = get_loads_list(base_dir, results)
+	schemes = [s for s in schemes if select(results, scheme = s).any()]
+
+	# Tail FCTs by flow size, next to the plot unless asked elsewhere
+	if stats_output is None and plot_output is not None:
+		stats_output = [os.path.splitext(plot_output)[0] + ext for ext in
+						['_fct.csv', '_fct.json']]
+	if stats_output:
+		stats = fct_percentiles(results, schemes, loads, num_iter, num_hosts)
+		for filename in stats_output:
+			print('Saving FCT percentiles to %s' % filename)
+			write_fct_percentiles(stats, filename)
+
 	for scheme in schemes:
-		fcts = evaluate_scheme(base_dir, scheme, num_iter, num_hosts, loads)
-		print 'Loads:', loads, 'FCTS:', fcts
+		fcts = evaluate_scheme(base_dir, scheme, num_iter, num_hosts, loads, results)
+		print('Loads: %s FCTS: %s' % (loads, fcts))
 		p.plot(loads, fcts, label = scheme, lw=2)
 
 	handles, labels = p.get_legend_handles_labels()
 	p.legend(handles, labels)
-	
+
 	matplotlib.pyplot.xlabel('Number of flows per host')
 	matplotlib.pyplot.ylabel('Average Normalized FCT')
 	matplotlib.pyplot.grid(True)
 	if plot_output is None:
-	    print 'No output file specified, showing figure...'
-	    matplotlib.pyplot.show()
+		print('No output file specified, showing figure...')
+		matplotlib.pyplot.show()
 	else:
-	    print 'Saving output to %s' % plot_output
-	    matplotlib.pyplot.savefig(plot_output)
+		print('Saving output to %s' % plot_output)
+		matplotlib.pyplot.savefig(plot_output)
+
+
+TEMPLATE = os.path.join('%s', '%s', 'f%d-r%d', '%s')
 
-	
-SCHEMES = ['tcp-droptail', 'pfabric']
+SCHEMES = ['tcp-droptail', 'dctcp', 'pfabric', 'pfabric-ecn']
 
 def main():
 	"""
 	Evaluates several setups with different schemes and loads.
 	"""
-	base_dir = sys.argv[1]
-	num_hosts = int(sys.argv[2])
-	num_iter = int(sys.argv[3])
-	plot_output = None
-	if len(sys.argv) > 4:
-		plot_output = sys.argv[4]
-	fcts_vector = evaluate_all(base_dir, num_hosts, num_iter, SCHEMES, plot_output)
+	parser = argparse.ArgumentParser(description = 'Evaluates pFabric tests')
+	parser.add_argument('base_dir')
+	parser.add_argument('num_hosts', type = int)
+	parser.add_argument('num_iter', type = int)
+	parser.add_argument('plot_output', nargs = '?', default = None)
+	parser.add_argument('--processes', '-j', dest = 'processes', type = int,
+						default = None,
+						help = 'Processes scanning the results (default: all CPUs)')
+	parser.add_argument('--no-cache', dest = 'use_cache', action = 'store_false',
+						help = 'Scan every result file again')
+	parser.add_argument('--stats', dest = 'stats_output', action = 'append',
+						help = 'FCT percentiles output, .csv or .json, may be repeated '
+						'(default: next to the plot)')
+	args = parser.parse_args()
+	evaluate_all(args.base_dir, args.num_hosts, args.num_iter, SCHEMES,
+				 args.plot_output, args.processes, args.use_cache,
+				 args.stats_output)
 
 if __name__ == '__main__':
 	main()
@@ -1,14 +1,27 @@
 #!/usr/bin/env python
 
 # An "Ideal" flow scheduler.
-# Schedules flows in a non-decreasing manner according to size
+# Schedules flows in a non-decreasing manner according to remaining size
+# (SRPT), one packet at a time on each link.
+#
+# usage: ideal.py size [size ...]
+#        ideal.py [--rate Mbps] [--mtu bytes] [--csv] -f flows.txt
+#
+# The flows file ('-' for stdin) is read as a stream, one flow per line:
+#   size | start size | start size link
+# with start times in seconds, in non-decreasing order. Links are scheduled
+# independently. Blank lines and lines starting with '#' are skipped.
 
 import sys
 import os
+import math
+import heapq
+import argparse
 import numpy
 
 ETHER_FRAME_LEN = 1500.0	# standard MTU
 LINK_CAPACITY = 100e6 / 8.0	# 100Mb/s
+FRAME_OVERHEAD = 34	# Ethernet + IP header
 
 class Flow:
 	def __init__(self, size, start_time = 0):
@@ -27,11 +40,10 @@ class Flow:
 		return self.remaining_size <= 0
 
 	def packet_sent(self, time):
-		frame_overhead = 34 # Ethernet + IP header
-		self.remaining_size -= min(ETHER_FRAME_LEN - frame_overhead, self.remaining_size)
+		self.remaining_size -= min(ETHER_FRAME_LEN - FRAME_OVERHEAD, self.remaining_size)
 		if self.is_done():
 			self.completion_time = time - self.start_time
-		
+
 def get_file_size(filename):
 	statinfo = os.stat(filename)
 	return statinfo.st_size
@@ -40,28 +52,168 @@ def get_min_index(values):
 	return numpy.array(values).argmin()
 
 DELTA_T = float(ETHER_FRAME_LEN) / float(LINK_CAPACITY)
+BOUNDARY_EPSILON = 1e-6	# In packets
+
+def packets_needed(size, payload):
+	"""Packets to send a flow, a flow with nothing left still takes one."""
+	return max(1, -(-size // payload))
+
+class Link:
+	"""
+	SRPT on one link. Packets are sent back to back while the link is busy,
+	so a flow arriving mid packet is only considered at the next packet
+	boundary. Instead of picking a flow for every packet, the link jumps
+	from one event (a completion or an arrival) to the next.
+	"""
+
+	def __init__(self, delta_t, payload):
+		self.delta_t = delta_t
+		self.payload = payload
+		self.heap = []	# (remaining size, arrival order, flow id, start time)
+		self.busy_start = 0.0
+		self.sent = 0	# Packets sent since busy_start
+
+	def now(self):
+		return self.busy_start + self.sent * self.delta_t
+
+	def advance(self, until, completed):
+		"""Sends the packets that start before until, appending the
+		   (flow id, completion time) of the finished flows to completed."""
+		heap = self.heap
+		delta_t = self.delta_t
+		while heap:
+			# Packet slots left before until, all of them for the smallest
+			# flow. Arrivals rounded onto a packet boundary count as on it.
+			slots = (until - self.busy_start) / delta_t - self.sent - BOUNDARY_EPSILON
+			if slots <= 0:
+				return
+			slots = int(math.ceil(slots)) if slots != float('inf') else None
+			remaining, order, flow_id, start = heap[0]
+			needed = packets_needed(remaining, self.payload)
+			if slots is None or needed <= slots:
+				heapq.heappop(heap)
+				self.sent += needed
+				completed.append((flow_id, self.now() - start))
+			else:
+				self.sent += slots
+				heapq.heapreplace(heap, (remaining - slots * self.payload,
+										 order, flow_id, start))
+				return
+
+	def add_flow(self, flow_id, order, start, size, completed):
+		self.advance(start, completed)
+		if not self.heap:
+			# An idle link starts sending as soon as the flow arrives
+			self.busy_start = max(start, self.now())
+			self.sent = 0
+		heapq.heappush(self.heap, (size, order, flow_id, start))
+
+def schedule_stream(flows, link_capacity = LINK_CAPACITY, frame_len = ETHER_FRAME_LEN):
+	"""
+	Generates the (flow id, completion time) of (start, size, link) flows,
+	given in non-decreasing start order, as the flows complete. Flow ids are
+	the positions of the flows in the input.
+	"""
+	delta_t = float(frame_len) / float(link_capacity)
+	payload = int(frame_len) - FRAME_OVERHEAD
+	links = {}
+	completed = []
+	last_start = 0.0
+	for flow_id, (start, size, link) in enumerate(flows):
+		if start < last_start:
+			raise ValueError('Flow %d starts before the previous flow' % flow_id)
+		last_start = start
+		if link not in links:
+			links[link] = Link(delta_t, payload)
+		links[link].add_flow(flow_id, flow_id, start, size, completed)
+		for c in completed:
+			yield c
+		del completed[:]
+
+	for link in links.values():
+		link.advance(float('inf'), completed)
+	for c in completed:
+		yield c
+
+def ideal_fcts(flow_sizes, link_capacity = LINK_CAPACITY, frame_len = ETHER_FRAME_LEN):
+	"""Completion times of flows all starting at time 0 on one link, in
+	   input order. With no arrivals SRPT sends the flows one after the
+	   other by size, so no event loop is needed."""
+	delta_t = float(frame_len) / float(link_capacity)
+	payload = int(frame_len) - FRAME_OVERHEAD
+	sizes = numpy.asarray(flow_sizes, dtype = numpy.int64)
+	packets = numpy.maximum(1, -(-sizes // payload))
+	order = numpy.argsort(sizes, kind = 'mergesort')
+	fcts = numpy.empty(len(sizes))
+	fcts[order] = numpy.cumsum(packets[order]) * delta_t
+	return fcts
 
 def schedule_flows(flow_sizes):
-	flows = [Flow(flow_size) for flow_size in flow_sizes]
-	flows_to_schedule = []
-	flows_to_schedule.extend(flows)
-	time = 0.0
-	print 'Time quantum: %f' % DELTA_T
-	
-	while len(flows_to_schedule) > 0:
-		time += DELTA_T
-		remaining_sizes = [f.get_remaining_size() for f in flows_to_schedule]
-		min_rs_flow = get_min_index(remaining_sizes)
-		flows_to_schedule[min_rs_flow].packet_sent(time)
-		flows_to_schedule = [f for f in flows_to_schedule if not f.is_done()]
-	
-	print 'All flows completed'
-	for i in xrange(len(flows)):
-		print 'Flow %d completion time: %f' % (i, flows[i].get_completion_time())
+	fcts = ideal_fcts(flow_sizes)
+	print('Time quantum: %f' % DELTA_T)
+	print('All flows completed')
+	for i in range(len(fcts)):
+		print('Flow %d completion time: %f' % (i, fcts[i]))
+
+def read_flows(f):
+	"""Parses a flows file lazily into (start, size, link) tuples."""
+	for line_number, line in enumerate(f, 1):
+		fields = line.replace(',', ' ').split()
+		if not fields or fields[0].startswith('#'):
+			continue
+		try:
+			if len(fields) == 1:
+				yield (0.0, int(fields[0]), 0)
+			elif len(fields) == 2:
+				yield (float(fields[0]), int(fields[1]), 0)
+			else:
+				yield (float(fields[0]), int(fields[1]), fields[2])
+		except ValueError:
+			raise ValueError('Line %d: bad flow "%s"' % (line_number, line.strip()))
+
+def parse_args():
+	parser = argparse.ArgumentParser(description = 'Ideal (SRPT) flow completion times')
+	parser.add_argument('sizes', type = int, nargs = '*',
+						help = 'Sizes of flows starting at time 0')
+	parser.add_argument('-f', '--file', dest = 'file',
+						help = "Flows file, '-' for stdin")
+	parser.add_argument('--rate', dest = 'rate', type = float,
+						default = LINK_CAPACITY * 8 / 1e6,
+						help = 'Link rate in Mb/s')
+	parser.add_argument('--mtu', dest = 'mtu', type = int,
+						default = int(ETHER_FRAME_LEN),
+						help = 'Frame length in bytes')
+	parser.add_argument('--csv', dest = 'csv', action = 'store_true',
+						help = 'Print flow,fct lines as flows complete')
+	args = parser.parse_args()
+	if (args.file is None) == (not args.sizes):
+		parser.error('Give either flow sizes or a flows file')
+	if args.mtu <= FRAME_OVERHEAD or args.rate <= 0:
+		parser.error('Bad link rate or MTU')
+	return args
 
 def main():
-	flow_sizes = [int(s) for s in sys.argv[1:]]
-	schedule_flows(flow_sizes)
+	args = parse_args()
+	link_capacity = args.rate * 1e6 / 8.0
+	if args.file is None and not args.csv and \
+			link_capacity == LINK_CAPACITY and args.mtu == ETHER_FRAME_LEN:
+		schedule_flows(args.sizes)
+		return
+
+	if args.file is None:
+		flows = ((0.0, size, 0) for size in args.sizes)
+	elif args.file == '-':
+		flows = read_flows(sys.stdin)
+	else:
+		flows = read_flows(open(args.file, 'r'))
+
+	if args.csv:
+		sys.stdout.write('flow,fct\n')
+		line_format = '%d,%.9f\n'
+	else:
+		line_format = 'Flow %d completion time: %f\n'
+	sys.stdout.writelines(line_format % c for c in
+						  schedule_stream(flows, link_capacity, args.mtu))
 
 if __name__ == '__main__':
 	main()
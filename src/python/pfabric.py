@@ -1,6 +1,6 @@
 #!/usr/bin/env python
 from mininet.topo import Topo
-from mininet.node import CPULimitedHost
+from mininet.node import CPULimitedHost, OVSSwitch
 from mininet.link import TCLink
 from mininet.net import Mininet
 from mininet.log import lg
@@ -12,6 +12,7 @@ import sys
 import os
 from argparse import ArgumentParser
 from time import sleep
+from functools import partial
 
 import pdb
 
@@ -22,23 +23,50 @@ PROC_FILE_PATH = '/proc/pfabric_stats'
 IPERF_PORT = 5001
 IPERF_SEARCH_OUTPUT = 'iperf_search_h%d_p%d_f%d.txt'
 IPERF_BASELINE_OUTPUT = 'iperf_baseline_%d.txt'
-IPERF_CLIENT_COMMAND = '%s -c %s -p %d -n %d -S %d > %s &'
-IPERF_SERVER_COMMAND = '%s -s -p %d > %s/iperf_server.txt &'
+IPERF_CLIENT_COMMAND = '%s -c %s -p %d -n %d -S %d%s > %s &'
+IPERF_REMAINING_PRIO_OPTION = ' -Y %s'
+# TOS of a flow from its remaining bytes (patched iperf -Y): band 0 below
+# 32KB, 7 from 2MB, within the default 32 pFabric bands. Not the default,
+# an iperf built without patches/iperf-2.0.5-remaining-size-priority.patch
+# rejects -Y.
+IPERF_REMAINING_PRIO = '15,8'
+IPERF_SERVER_COMMAND = '%s -s -p %d > %s/iperf_server_f%d.txt &'
+
+FLOWGEN_SEARCH_OUTPUT = 'flowgen_h%d.bin'
+FLOWGEN_BASELINE_OUTPUT = 'flowgen_baseline.bin'
+FLOWGEN_CLIENT_COMMAND = '%s --client %s --port %d --flows %d --sizes %s ' \
+                         '--concurrency %d --prio-shift %d --bands %d%s --output %s &'
+FLOWGEN_PFABRIC_OPTIONS = ' --transport pfabric --window %d --rto-us %d'
+FLOWGEN_SERVER_COMMAND = '%s --server --port %d > %s/flowgen_server_f%d.txt 2>&1 &'
+# Remaining size priority of flowgen flows: band 0 below 32KB, 7 from 2MB,
+# so that the TOS (band << 2) stays within the default 32 pFabric bands
+FLOWGEN_PRIO_SHIFT = 15
+FLOWGEN_BANDS = 8
+# pfabric transport window and timeout: a full packet is stored and
+# forwarded by the host and switch links, so the BDP is about a packet per
+# link, and the timeout is 3 RTTs, at least FLOWGEN_MIN_RTO_US to cover the
+# scheduling delays of the hosts
+FLOWGEN_PACKET_BITS = 1500 * 8
+FLOWGEN_PATH_LINKS = 2
+FLOWGEN_MIN_RTO_US = 1000
 
 DELETE_QDISC = 'sudo %s qdisc del dev %s root'
 HTB_ADD = 'sudo %s qdisc add dev %s root handle 1: htb'
 HTB_CLASS_ADD = 'sudo %s class add dev %s parent 1: classid 1:1 htb rate %dmbit'
-PFABRIC_ADD = 'sudo %s qdisc add dev %s parent 1:1 handle 10: pfabric limit %d'
+PFABRIC_ADD = 'sudo %s qdisc add dev %s root handle 10: pfabric limit %d rate %dmbit'
+PFABRIC_MARK = ' mark_threshold %d mark_by prio'
 PFIFO_ADD = 'sudo %s qdisc add dev %s parent 1:1 handle 10: pfifo limit %d'
 DCTCP_SET = 'sysctl -w net.ipv4.tcp_dctcp_enable=%d'
 ECN_SET = 'sysctl -w net.ipv4.tcp_ecn=%d'
 
 MAX_QUEUE_DEFAULT = 150
 MAX_QUEUE_PFAB_DEFAULT = 15
+MARK_THRESHOLD_DEFAULT = 5
 N_HOSTS_DEFAULT = 3
 BW_DEFAULT = 10
 DIR_DEFAULT = "results"
 RUNS_DEFAULT = 5
+TESTS_DEFAULT = 'baseline,tcp-droptail,dctcp,pfabric'
 
 SEARCH_FLOW_SIZE_BUCKETS = \
 	[10**6.5, 10**6.6, 10**6.7, 10**6.8, 10**6.9, 10**7, 10**7.1, 10**7.2]
@@ -81,11 +109,42 @@ parser.add_argument('--maxq_pfab',
                     help="Max buffer size of pfabric network interface in packets",
                     default=MAX_QUEUE_PFAB_DEFAULT)
 
+parser.add_argument('--mark-threshold',
+                    dest="mark_threshold",
+                    action="store",
+                    type=int,
+                    help="Packets of higher or equal priority in the pfabric "
+                         "buffer above which the pfabric-ecn test CE marks",
+                    default=MARK_THRESHOLD_DEFAULT)
+
 parser.add_argument('--iperf',
                     dest="iperf",
                     help="Path to custom iperf",
                     default=CUSTOM_IPERF_PATH)
 
+parser.add_argument('--remaining-prio',
+                    dest="remaining_prio",
+                    help="iperf -Y shift[,bands] option, setting the TOS of a "
+                         "flow from its remaining bytes as it is sent; "
+                         "'none' for the static TOS of its size bucket "
+                         "(default, e.g. %s with a patched iperf)" %
+                         IPERF_REMAINING_PRIO,
+                    default='none')
+
+parser.add_argument('--flowgen',
+                    dest="flowgen",
+                    help="Path to flowgen (src/flowgen), to generate the flows "
+                         "of each host from one process instead of one iperf "
+                         "per flow",
+                    default=None)
+
+parser.add_argument('--transport',
+                    dest="transport",
+                    choices=['tcp', 'pfabric'],
+                    help="Transport of the flowgen flows: TCP, or the minimal "
+                         "pFabric rate control over UDP",
+                    default='tcp')
+
 parser.add_argument('--tc',
                     dest="tc",
                     help="Path to custom tc",
@@ -105,12 +164,45 @@ parser.add_argument('--nruns',
                     help="Number of runs of the experiment",
                     default=RUNS_DEFAULT)
 
+parser.add_argument('--tests',
+                    dest="tests",
+                    help="Comma separated tests to run, in order",
+                    default=TESTS_DEFAULT)
+
+parser.add_argument('--id',
+                    dest="id",
+                    type=int,
+                    help="Experiment number, for experiments run concurrently "
+                         "(see run_parallel.py): prefixes the node names and "
+                         "uses a standalone switch instead of a controller",
+                    default=None)
+
+parser.add_argument('--cores',
+                    dest="cores",
+                    help="CPU cores the hosts are confined to, e.g. 0-3",
+                    default=None)
+
 """Experiment paramenters"""
 args = parser.parse_args()
+if args.transport != 'tcp' and not args.flowgen:
+    parser.error('--transport %s needs --flowgen' % args.transport)
+
+def make_dirs(path):
+    """Creates a directory, which a concurrent experiment may be creating too."""
+    try:
+        os.makedirs(path)
+    except OSError:
+        if not os.path.isdir(path):
+            raise
+
+def node_name(name):
+    """Name of a node of this experiment, unique among concurrent ones."""
+    if args.id is None:
+        return name
+    return 'x%d%s' % (args.id, name)
 
 """Create output directory"""
-if not os.path.exists(args.dir):
-    os.makedirs(args.dir)
+make_dirs(args.dir)
 
 lg.setLogLevel('info')
 
@@ -132,19 +224,24 @@ class BaseTest():
         self.nruns = r
         self.n = n
         self.iperf = iperf
-        self.server = 'h%d' % (self.n - 1)
+        self.flowgen = args.flowgen
+        self.server = node_name('h%d' % (self.n - 1))
+        self.switch = node_name('s0')
         self.output_dir = '%s/%s' % (args.dir, self.name)
         self.interfaces = []
         for i in range(1, self.n + 1):
-             self.interfaces.append('s0-eth%d' % (i))
+             self.interfaces.append('%s-eth%d' % (self.switch, i))
+        self.server_pid = None
 
-        if not os.path.exists(self.output_dir):
-                os.makedirs(self.output_dir)
+        make_dirs(self.output_dir)
 
     def tear_down(self):
         """Removes qdiscs, kill iperf processes."""
         print "Tear down %s..." % self.name
-        os.system('killall -2 ' + self.iperf)
+        # Only this experiment's server, others may be running
+        if self.server_pid is not None:
+            self.server_node.cmd('kill -2 %d' % self.server_pid)
+            self.server_pid = None
 
     def set_up(self):
         """Removes qdiscs, 
@@ -162,7 +259,7 @@ class BaseTest():
             print cmd
             os.system(cmd)
         
-        cmd = PFIFO_ADD % (self.tc, 's0-eth%d' % self.n, self.limit)
+        cmd = PFIFO_ADD % (self.tc, self.interfaces[-1], self.limit)
         print cmd
         os.system(cmd)
 
@@ -179,14 +276,18 @@ class BaseTest():
         """Creates the iperf client command string given server ip, 
            n_bytes, priority, and output_path."""
 
+        options = ''
         if self.name == 'tcp-droptail':
             priority = 0
+        elif args.remaining_prio != 'none':
+            options = IPERF_REMAINING_PRIO_OPTION % args.remaining_prio
         
         iperf_args = (self.iperf, 
                       server_ip, 
                       IPERF_PORT, 
                       n_bytes,
                       priority, 
+                      options,
                       output_path)
 
         cmd = IPERF_CLIENT_COMMAND % iperf_args
@@ -194,13 +295,41 @@ class BaseTest():
         print cmd
         return cmd
 
+    def flowgen_client_cmd(self, server_ip, nflows, concurrency, output_path):
+        """Creates the flowgen client command string of nflows flows,
+           taking the bucket sizes in turn."""
+        bands = FLOWGEN_BANDS
+        if self.name == 'tcp-droptail':
+            bands = 1
+
+        options = ''
+        if args.transport == 'pfabric':
+            rtt_us = FLOWGEN_PATH_LINKS * FLOWGEN_PACKET_BITS / self.bw
+            options = FLOWGEN_PFABRIC_OPTIONS % (FLOWGEN_PATH_LINKS,
+                                                 max(3 * rtt_us, FLOWGEN_MIN_RTO_US))
+
+        sizes = ','.join('%d' % size for size in SEARCH_FLOW_SIZE_BUCKETS)
+        cmd = FLOWGEN_CLIENT_COMMAND % (self.flowgen, server_ip, IPERF_PORT,
+                                        nflows, sizes, concurrency,
+                                        FLOWGEN_PRIO_SHIFT, bands, options,
+                                        output_path)
+        print cmd
+        return cmd
+
     def start_receiver(self, net):
-        """Start iperf server."""
+        """Start iperf or flowgen server."""
         print "Starting iperf server..."
         server = net.getNodeByName(self.server)
-        cmd = IPERF_SERVER_COMMAND % (self.iperf, IPERF_PORT, self.output_dir)
+        if self.flowgen:
+            cmd = FLOWGEN_SERVER_COMMAND % (self.flowgen, IPERF_PORT,
+                                            self.output_dir, self.nflows)
+        else:
+            cmd = IPERF_SERVER_COMMAND % (self.iperf, IPERF_PORT,
+                                          self.output_dir, self.nflows)
         print cmd
         server.cmd(cmd)
+        self.server_node = server
+        self.server_pid = int(server.cmd('echo $!'))
         
     def start_senders(self, net):
         """Start iperf clients."""
@@ -209,13 +338,21 @@ class BaseTest():
         clients = {}
         for r in range(self.nruns):
             output_dir = '%s/f%s-r%d' % (self.output_dir, self.nflows, r)
-            if not os.path.exists(output_dir):
-                os.makedirs(output_dir)
+            make_dirs(output_dir)
 
             for i in range(self.n - 1):
-    	        client = net.getNodeByName('h%d' % i)
+                client = net.getNodeByName(node_name('h%d' % i))
+                if self.flowgen:
+                    # All the flows of the host from one process
+                    output_path = '%s/%s' % (output_dir, FLOWGEN_SEARCH_OUTPUT % i)
+                    cmd = self.flowgen_client_cmd(server.IP(), self.nflows, 0,
+                                                  output_path)
+                    client.cmd(cmd)
+                    clients[client] = [int(client.cmd('echo $!'))]
+                    continue
+
                 pids = []
-	        for j in range(self.nflows):
+                for j in range(self.nflows):
                     bucket = j % NUM_FLOW_SIZE_BUCKETS
                     n_bytes = SEARCH_FLOW_SIZE_BUCKETS[bucket]
                     output_file = IPERF_SEARCH_OUTPUT % (i, bucket, j)
@@ -242,11 +379,18 @@ class BaselineTest(BaseTest):
         print "Starting baseline traffic..."
         for r in range(self.nruns):
             output_dir = '%s/f%s-r%d' % (self.output_dir, self.nflows, r)
-            if not os.path.exists(output_dir):
-                os.makedirs(output_dir)
+            make_dirs(output_dir)
         
             server = net.getNodeByName(self.server)
-            client = net.getNodeByName('h0')
+            client = net.getNodeByName(node_name('h0'))
+            if self.flowgen:
+                output_path = '%s/%s' % (output_dir, FLOWGEN_BASELINE_OUTPUT)
+                cmd = self.flowgen_client_cmd(server.IP(), NUM_FLOW_SIZE_BUCKETS,
+                                              1, output_path)
+                client.cmd(cmd)
+                client.cmd('wait', int(client.cmd('echo $!')))
+                continue
+
             for i in range(NUM_FLOW_SIZE_BUCKETS):
                 output_file = IPERF_BASELINE_OUTPUT % i
                 output_path = '%s/%s' % (output_dir, output_file)
@@ -260,16 +404,23 @@ class BaselineTest(BaseTest):
 class pFabricTest(BaseTest):
     """pFabric test class"""
 
-    def __init__(self):
-        BaseTest.__init__(self, 'pfabric')
+    def __init__(self, name='pfabric'):
+        BaseTest.__init__(self, name)
+
+    def pfabric_add(self):
+        return PFABRIC_ADD % (self.tc, self.interfaces[-1], self.limit_pfab,
+                              self.bw)
 
     def set_up(self):
-        """Set to HTB with pFabric qdisc."""
+        """Set to HTB, and to a pFabric qdisc shaping at the bottleneck
+           rate by itself on the bottleneck interface."""
         print "Set up pFabric..."
         for iface in self.interfaces:
             cmd = DELETE_QDISC % (self.tc, iface)
 	    print cmd
             os.system(cmd)
+            if iface == self.interfaces[-1]:
+                continue
             cmd = HTB_ADD % (self.tc, iface)
 	    print cmd
             os.system(cmd)
@@ -277,7 +428,7 @@ class pFabricTest(BaseTest):
             print cmd
             os.system(cmd)
         
-        cmd = PFABRIC_ADD % (self.tc, 's0-eth%d' % self.n, self.limit_pfab)
+        cmd = self.pfabric_add()
         print cmd
         os.system(cmd)
 
@@ -287,9 +438,34 @@ class pFabricTest(BaseTest):
         f = open(PROC_FILE_PATH, 'r')
         print f.read()
 
-	def tear_down(self):
-		os.system('cat /proc/pfabric_stats_s0-eth%d' % self.n)
-		BaseTest.tear_down(self)
+    def tear_down(self):
+        os.system('cat /proc/pfabric_stats_%s' % self.interfaces[-1])
+        BaseTest.tear_down(self)
+
+class pFabricECNTest(pFabricTest):
+    """pFabric with DCTCP senders, the qdisc CE marking ECT packets once
+       the backlog of their priority or higher exceeds the mark threshold,
+       and evicting only when the buffer is full."""
+
+    def __init__(self):
+        pFabricTest.__init__(self, 'pfabric-ecn')
+
+    def pfabric_add(self):
+        return pFabricTest.pfabric_add(self) + PFABRIC_MARK % args.mark_threshold
+
+    def set_up(self):
+        """Enable DCTCP, as DCTCPTest does, and add the marking qdisc."""
+        pFabricTest.set_up(self)
+        if args.id is None:
+            os.system(DCTCP_SET % 1)
+            os.system(ECN_SET % 1)
+
+    def tear_down(self):
+        """Disable DCTCP."""
+        pFabricTest.tear_down(self)
+        if args.id is None:
+            os.system(DCTCP_SET % 0)
+            os.system(ECN_SET % 0)
 
 class TCPDropTailTest(BaseTest):
     """TCPDropTail test class"""
@@ -304,58 +480,81 @@ class DCTCPTest(BaseTest):
         BaseTest.__init__(self, 'dctcp')
 
     def set_up(self):
-        """Enable DCTCP."""
+        """Enable DCTCP, unless run_parallel.py does it for every
+           concurrent experiment, the setting being global."""
         BaseTest.set_up(self)
-        os.system(DCTCP_SET % 1)
-        os.system(ECN_SET % 1)
+        if args.id is None:
+            os.system(DCTCP_SET % 1)
+            os.system(ECN_SET % 1)
 
     def tear_down(self):
         """Disable DCTCP."""
         BaseTest.tear_down(self)
-        os.system(DCTCP_SET % 0)
-        os.system(ECN_SET % 0)        
+        if args.id is None:
+            os.system(DCTCP_SET % 0)
+            os.system(ECN_SET % 0)
 
 class StarTopo(Topo):
     """Star topology for Buffer Sizing experiment"""
 
-    def __init__(self, n=3, bw=None, maxq=None):
+    def __init__(self, n=3, bw=None, maxq=None, cores=None):
         super(StarTopo, self ).__init__()
         self.n = n
         self.bw = bw
         self.maxq = maxq
+        self.cores = cores
         self.create_topology()
 
     def create_topology(self):
         """Create star topology"""
         hosts = []
+        hostopts = dict()
+        if self.cores is not None:
+            hostopts['cores'] = self.cores
         for i in range(self.n):
-            host = self.addHost('h%d' % i)
+            host = self.addHost(node_name('h%d' % i), **hostopts)
             hosts.append(host)
 
-        switch = self.addSwitch('s0')
+        switch = self.addSwitch(node_name('s0'), dpid='%x' % ((args.id or 0) + 1))
         linkopts = dict()
-	linkopts['bw'] = self.bw
+        linkopts['bw'] = self.bw
         linkopts['max_queue_size'] = self.maxq
         for i in range(self.n):
-        	self.addLink(hosts[i], switch, **linkopts)
+            self.addLink(hosts[i], switch, **linkopts)
+
+TESTS = {
+    'baseline': BaselineTest,
+    'tcp-droptail': TCPDropTailTest,
+    'dctcp': DCTCPTest,
+    'pfabric': pFabricTest,
+    'pfabric-ecn': pFabricECNTest,
+}
 
 def main():
     """Create network and run pFabric experiment"""
-    topo = StarTopo(n=args.n, bw=args.bw, maxq=args.maxq)
-    net = Mininet(topo=topo, host=CPULimitedHost, link=TCLink)
+    tests = args.tests.split(',')
+    for name in tests:
+        if name not in TESTS:
+            parser.error('Unknown test %s' % name)
+
+    topo = StarTopo(n=args.n, bw=args.bw, maxq=args.maxq, cores=args.cores)
+    if args.id is None:
+        net = Mininet(topo=topo, host=CPULimitedHost, link=TCLink)
+    else:
+        # Concurrent experiments would share the controller port
+        net = Mininet(topo=topo, host=CPULimitedHost, link=TCLink,
+                      switch=partial(OVSSwitch, failMode='standalone'),
+                      controller=None)
     net.start()
-    dumpNodeConnections(net.hosts)
-    net.pingAll()
-    baseline = BaselineTest()
-    baseline.test(net)
-    droptail_tcp = TCPDropTailTest()
-    droptail_tcp.test(net)
-    dctcp = DCTCPTest()
-    dctcp.test(net)
-    pfabric = pFabricTest()
-    pfabric.test(net)
-    net.stop()
-    Popen("killall -9 top bwm-ng tcpdump cat mnexec", shell=True).wait()
+    try:
+        dumpNodeConnections(net.hosts)
+        net.pingAll()
+        for name in tests:
+            TESTS[name]().test(net)
+    finally:
+        net.stop()
+    if args.id is None:
+        Popen("killall -9 top bwm-ng tcpdump cat mnexec", shell=True).wait()
 
 if __name__ == '__main__':
     try:
@@ -366,5 +565,7 @@ if __name__ == '__main__':
         print "-"*80
         import traceback
         traceback.print_exc()
-        os.system("killall -9 top bwm-ng tcpdump cat mnexec iperf; mn -c")
+        if args.id is None:
+            os.system("killall -9 top bwm-ng tcpdump cat mnexec iperf; mn -c")
+        sys.exit(1)
 
@@ -0,0 +1,132 @@
+#!/usr/bin/env python
+"""
+Runs the pfabric.py experiments of several loads and tests concurrently.
+
+Every (test, number of flows) pair is one pfabric.py process with its own
+star topology, so its own switch and pFabric qdisc, confined to its own
+CPU cores. As many run at a time as the CPU budget allows, and their
+results land in the same directory layout as consecutive runs.
+
+The DCTCP sysctls are global, so the dctcp and pfabric-ecn experiments run
+after all the others, each test together, with DCTCP enabled.
+
+usage: run_parallel.py --nflows 1 2 4 8 [--cpus N] [--cores-per-run K]
+                       [--tests baseline,...] [pfabric.py options]
+"""
+
+import sys
+import os
+import subprocess
+import multiprocessing
+from argparse import ArgumentParser
+from time import sleep
+
+PFABRIC_SCRIPT = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'pfabric.py')
+TESTS_DEFAULT = 'baseline,tcp-droptail,dctcp,pfabric'
+DIR_DEFAULT = 'results'
+CORES_PER_RUN_DEFAULT = 2
+POLL_INTERVAL = 1.0	# Seconds
+
+# Tests changing global settings, run in a phase of their own
+DCTCP_SYSCTLS = (['sysctl -w net.ipv4.tcp_dctcp_enable=1', 'sysctl -w net.ipv4.tcp_ecn=1'],
+                 ['sysctl -w net.ipv4.tcp_dctcp_enable=0', 'sysctl -w net.ipv4.tcp_ecn=0'])
+GLOBAL_TESTS = {
+    'dctcp': DCTCP_SYSCTLS,
+    'pfabric-ecn': DCTCP_SYSCTLS,
+}
+
+def parse_args():
+    parser = ArgumentParser(description="Runs pFabric tests concurrently",
+                            epilog="Other options are passed to pfabric.py")
+    parser.add_argument('--nflows', dest="nflows", type=int, nargs='+',
+                        help="Numbers of flows per host to run", required=True)
+    parser.add_argument('--tests', dest="tests", default=TESTS_DEFAULT,
+                        help="Comma separated tests to run")
+    parser.add_argument('--cpus', dest="cpus", type=int,
+                        default=multiprocessing.cpu_count(),
+                        help="CPU cores shared by the experiments")
+    parser.add_argument('--cores-per-run', dest="cores_per_run", type=int,
+                        default=CORES_PER_RUN_DEFAULT,
+                        help="CPU cores of each experiment")
+    parser.add_argument('--dir', '-d', dest="dir", default=DIR_DEFAULT,
+                        help="Directory to store outputs")
+    args, pfabric_args = parser.parse_known_args()
+    if args.cores_per_run <= 0 or args.cpus < args.cores_per_run:
+        parser.error('The CPU budget is smaller than one experiment')
+    return args, pfabric_args
+
+def experiment_phases(tests, nflows):
+    """Returns the (test, nflows) experiments, in phases that cannot overlap."""
+    phases = []
+    local = [(test, n) for n in nflows for test in tests if test not in GLOBAL_TESTS]
+    if local:
+        phases.append((None, local))
+    for test in tests:
+        if test in GLOBAL_TESTS:
+            phases.append((test, [(test, n) for n in nflows]))
+    return phases
+
+def run_phase(experiments, args, pfabric_args, first_id, failed):
+    """Runs experiments on args.cpus cores, each on its own set of cores."""
+    slots = args.cpus // args.cores_per_run
+    free = list(range(slots))
+    running = []
+    pending = list(experiments)
+    next_id = first_id
+    while pending or running:
+        while pending and free:
+            test, nflows = pending.pop(0)
+            slot = free.pop(0)
+            cores = '%d-%d' % (slot * args.cores_per_run,
+                               (slot + 1) * args.cores_per_run - 1)
+            log_path = os.path.join(args.dir, 'logs', '%s-f%d.txt' % (test, nflows))
+            cmd = [sys.executable, PFABRIC_SCRIPT, '--dir', args.dir,
+                   '--nflows', str(nflows), '--tests', test,
+                   '--id', str(next_id), '--cores', cores] + pfabric_args
+            print('Starting %s with %d flows on cores %s' % (test, nflows, cores))
+            log = open(log_path, 'w')
+            proc = subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT)
+            log.close()
+            running.append((proc, slot, test, nflows))
+            next_id += 1
+
+        sleep(POLL_INTERVAL)
+        for experiment in list(running):
+            proc, slot, test, nflows = experiment
+            if proc.poll() is None:
+                continue
+            running.remove(experiment)
+            free.append(slot)
+            if proc.returncode != 0:
+                print('%s with %d flows failed, see its log' % (test, nflows))
+                failed.append((test, nflows))
+            else:
+                print('%s with %d flows done' % (test, nflows))
+    return next_id
+
+def main():
+    args, pfabric_args = parse_args()
+    tests = args.tests.split(',')
+    log_dir = os.path.join(args.dir, 'logs')
+    if not os.path.isdir(log_dir):
+        os.makedirs(log_dir)
+
+    failed = []
+    next_id = 0
+    for test, experiments in experiment_phases(tests, args.nflows):
+        set_up, tear_down = GLOBAL_TESTS.get(test, ([], []))
+        sys.stdout.flush()
+        for cmd in set_up:
+            os.system(cmd)
+        try:
+            next_id = run_phase(experiments, args, pfabric_args, next_id, failed)
+        finally:
+            for cmd in tear_down:
+                os.system(cmd)
+
+    if failed:
+        print('Failed: %s' % ', '.join('%s/f%d' % f for f in failed))
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()